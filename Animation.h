@@ -0,0 +1,55 @@
+#ifndef Animation_DEFINED
+#define Animation_DEFINED
+
+#include <vector>
+#include <algorithm>
+#include "include/vec.h"
+
+/// @brief Pose at a point in time. Which fields are used depends on what the track animates:
+/// objects use pos/euler/scale, lights use pos, cameras use pos/target/up.
+struct Keyframe {
+    float time = 0.f;
+    vec3 pos{};
+    vec3 euler{};
+    vec3 scale{1.f, 1.f, 1.f};
+    vec3 target{};
+    vec3 up{0.f, 1.f, 0.f};
+};
+
+/// @brief Keyframed transform of one scene element, linearly interpolated between keys
+struct AnimationTrack {
+    enum class Kind { Object, Light, Camera };
+
+    Kind kind = Kind::Object;
+    int index = 0;   // object or light index, unused for camera
+    int marker = -1; // object visualizing a light, moved along with it
+    std::vector<Keyframe> keys; // sorted by time
+
+    float duration() const { return keys.empty() ? 0.f : keys.back().time; }
+
+    /// @brief Interpolated pose at time, clamped to the first and last keys
+    Keyframe sample(float time) const {
+        if(keys.size() == 1 || time <= keys.front().time) return keys.front();
+        if(time >= keys.back().time) return keys.back();
+
+        auto next = std::upper_bound(keys.begin(), keys.end(), time,
+                                     [](float t, const Keyframe& k) { return t < k.time; });
+        const Keyframe& b = *next;
+        const Keyframe& a = *(next - 1);
+        float s = (time - a.time) / (b.time - a.time);
+
+        Keyframe out;
+        out.time = time;
+        out.pos = lerp(a.pos, b.pos, s);
+        out.euler = lerp(a.euler, b.euler, s);
+        out.scale = lerp(a.scale, b.scale, s);
+        out.target = lerp(a.target, b.target, s);
+        out.up = lerp(a.up, b.up, s);
+        return out;
+    }
+
+private:
+    static vec3 lerp(const vec3& a, const vec3& b, float s) { return a + (b - a) * s; }
+};
+
+#endif
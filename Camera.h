@@ -3,6 +3,7 @@
 
 #include "./include/vec.h"
 #include "./include/matrix.h"
+#include "./include/Bounds.h"
 
 #define DEG2RAD 0.01745329f
 
@@ -15,7 +16,7 @@ public:
            const float fov = 90.f,
            const float aspectRatio = 1.f,
            const float near = 0.1f,
-           const float far = 100.f) : position(pos), fov_rad(fov), nearClip(near), farClip(far) {
+           const float far = 100.f) : position(pos), fov_rad(fov), aspectRatio(aspectRatio), nearClip(near), farClip(far) {
         orient_mat = mat4();
         inv_pos = mat4::Translate(-pos);
 
@@ -30,15 +31,7 @@ public:
         p_right.setValsTo(vec3::normalize(vec3::cross(up, p_dir)));
         p_up.setValsTo(vec3::cross(p_dir, p_right));
 
-        // Calculate projection matrix
-        float right = tanf(fov * 0.5f * DEG2RAD) * near;
-        float top = right / aspectRatio;
-        projection = mat4{
-            near / right, 0.f, 0.f, 0.f,
-            0.f, near / top,   0.f, 0.f,
-            0.f, 0.f, -(far + near) / (far - near), -1.f,
-            0.f, 0.f, -2.f * far * near / (far - near), 0.f
-        };
+        projection = Projection(fov, aspectRatio, near, far);
     }
 
     vec3 forward() const { return -p_dir; }
@@ -49,6 +42,12 @@ public:
     vec3 left() const { return -p_right; }
     const float near() const { return nearClip; }
     const float far() const { return farClip; }
+    /// @brief Width over height of the view, pixels are square when it matches the image's
+    const float aspect() const { return aspectRatio; }
+    void setAspect(float aspect) {
+        aspectRatio = aspect;
+        projection = Projection(fov_rad, aspect, nearClip, farClip);
+    }
 
     // void applyTransform(mat4 m) {};
     void Translate(float x, float y, float z) {
@@ -59,6 +58,26 @@ public:
         inv_pos[{2, 3}] -= z;
     };
     void Translate(vec3 v) { Translate(v.x(), v.y(), v.z()); };
+    /// @brief Move and re-aim camera, keeping its projection
+    void setView(const vec3 pos, const vec3 target, const vec3 up) {
+        position = pos;
+        inv_pos = mat4::Translate(-pos);
+
+        vec3 dir = vec3::normalize(pos - target);
+        vec3 right = vec3::normalize(vec3::cross(up, dir));
+        vec3 newUp = vec3::cross(dir, right);
+
+        // Write the matrix directly, the proxy vectors only share its memory in the original (non-copied) camera
+        orient_mat = mat4();
+        for(size_t i = 0; i < 3; ++i) {
+            orient_mat[{0, i}] = right[i];
+            orient_mat[{1, i}] = newUp[i];
+            orient_mat[{2, i}] = dir[i];
+        }
+        p_right.setValsTo(right);
+        p_up.setValsTo(newUp);
+        p_dir.setValsTo(dir);
+    }
     void Rotate(vec3 axis, float angle) {
         orient_mat *= mat4::Rotate(axis, angle);
     };
@@ -67,6 +86,7 @@ public:
         return orient_mat * inv_pos;
     }
     mat4 getProjectionMatrix() const { return projection; }
+    Frustum getFrustum() const { return Frustum(getViewMatrix(), projection, nearClip, farClip); }
 
     const vec3 getPos() const { return position; }
 
@@ -75,6 +95,7 @@ private:
 
     bool orthographic = false;
     float fov_rad; // FOV in radians
+    float aspectRatio;
     float nearClip;
     float farClip;
 
@@ -83,6 +104,17 @@ private:
     mat4 orient_mat;
     mat4 inv_pos;
 
+    static mat4 Projection(float fov, float aspectRatio, float near, float far) {
+        float right = tanf(fov * 0.5f * DEG2RAD) * near;
+        float top = right / aspectRatio;
+        return mat4{
+            near / right, 0.f, 0.f, 0.f,
+            0.f, near / top,   0.f, 0.f,
+            0.f, 0.f, -(far + near) / (far - near), -1.f,
+            0.f, 0.f, -2.f * far * near / (far - near), 0.f
+        };
+    }
+
     // "proxy" vectors, share memory with orient_mat
     vec3 p_dir; // faces OPPOSITE of target, i.e. points out of camera's ass
     vec3 p_up;
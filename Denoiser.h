@@ -0,0 +1,232 @@
+#ifndef Denoiser_DEFINED
+#define Denoiser_DEFINED
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "GBuffer.h"
+#include "include/SIMD.h"
+#include "include/FastMath.h"
+#include "include/Parallel.h"
+
+/*
+    Edge aware denoiser for noisy path traced images, after the spatial filter of SVGF (Schied et al.,
+    "Spatiotemporal Variance-Guided Filtering", 2017).
+
+    Color is divided by the G-buffer's albedo first, so texture and edges between materials survive and
+    only lighting is smoothed, then filtered by several passes of an a-trous wavelet: a 5x5 B3 spline
+    kernel whose taps spread twice as far apart each pass. Each tap is weighted down by how much its
+    normal, depth and luminance differ from the center's. Luminance differences are measured against the
+    center's standard error, which is filtered along with the color, so noisy pixels are smoothed a lot
+    and converged ones hardly at all. The first pass blurs that error over a pixel's neighbors, as a few
+    samples don't estimate it reliably. Background and emitters are left as they are.
+
+    Planes are padded left and right by the widest pass' reach, so every tap loads 8 neighbors straight,
+    and each pass is spread over threads in tiles.
+*/
+class Denoiser {
+public:
+    /// @brief A noisy image to filter, planes indexed y * width + x
+    struct Image {
+        GISize dim{0, 0};
+        std::vector<float> color[3];
+        std::vector<float> variance; // of each pixel's mean luminance
+
+        void resize(GISize size) {
+            dim = size;
+            size_t n = (size_t) size.width * size.height;
+            for(std::vector<float>& plane : color) plane.assign(n, 0.f);
+            variance.assign(n, 0.f);
+        }
+    };
+
+    /// @brief Filter image in place, guided by the surfaces in guide, which must be the same size
+    void filter(Image& image, const GBuffer& guide, int threads) {
+        TRACE_SCOPE("Denoiser::filter");
+        Load(image, guide);
+        for(int pass = 0; pass < Passes; ++pass) {
+            int step = 1 << pass;
+            int tilesX = (_width + TileSize - 1) / TileSize, tilesY = (_height + TileSize - 1) / TileSize;
+            ParallelFor(0, tilesX * tilesY, 1, threads, [&](int begin, int end) {
+                TRACE_SCOPE("denoise tiles");
+                for(int t = begin; t < end; ++t) FilterTile((t % tilesX) * TileSize, (t / tilesX) * TileSize, step);
+            });
+            std::swap(_in, _out);
+        }
+        Store(image);
+    }
+
+private:
+    static constexpr int Passes = 5;
+    static constexpr int Pad = 2 << (Passes - 1); // widest tap offset, two taps of the last pass' step
+    static constexpr int TileSize = 64;
+    static constexpr float SigmaLuminance = 6.f;
+    static constexpr float SigmaDepth = 2.f;
+    static constexpr int NormalPower = 128; // normal weight is max(0, n . n')^NormalPower, a power of 2
+    static constexpr float MinAlbedo = 1e-3f;
+
+    /// @brief Illumination being filtered, ping-ponged between passes
+    struct Planes {
+        std::vector<float> r, g, b;
+        std::vector<float> variance;
+    };
+
+    float* at(std::vector<float>& plane, int x, int y) { return plane.data() + (size_t) y * _stride + Pad + x; }
+    const float* at(const std::vector<float>& plane, int x, int y) const { return plane.data() + (size_t) y * _stride + Pad + x; }
+
+    /// @brief Copy image into padded planes, dividing out albedo, and set up the guides
+    void Load(const Image& image, const GBuffer& guide) {
+        _width = image.dim.width;
+        _height = image.dim.height;
+        _stride = ((_width + 7) & ~7) + 2 * Pad; // room for a group of 8 starting at the last pixel
+        size_t n = (size_t) _stride * _height;
+        for(Planes* planes : {&_in, &_out}) {
+            for(std::vector<float>* plane : {&planes->r, &planes->g, &planes->b, &planes->variance}) plane->assign(n, 0.f);
+        }
+        for(std::vector<float>* plane : {&_albedo[0], &_albedo[1], &_albedo[2], &_nx, &_ny, &_nz, &_depth, &_gradient, &_valid}) {
+            plane->assign(n, 0.f);
+        }
+
+        for(int y = 0; y < _height; ++y) {
+            GBufferRow row = guide.getRow(y);
+            const float* albedo[3] = {row.r, row.g, row.b};
+            float* illum[3] = {at(_in.r, 0, y), at(_in.g, 0, y), at(_in.b, 0, y)};
+            for(int x = 0; x < _width; ++x) {
+                size_t i = (size_t) y * _width + x;
+                bool surface = row.depth[x] != FLT_MAX && row.specular[x] >= 0.f;
+                at(_valid, x, y)[0] = surface ? 1.f : 0.f;
+                at(_nx, x, y)[0] = row.nx[x];
+                at(_ny, x, y)[0] = row.ny[x];
+                at(_nz, x, y)[0] = row.nz[x];
+                at(_depth, x, y)[0] = surface ? row.depth[x] : 0.f;
+
+                float albedoLuminance = 0.f;
+                for(int c = 0; c < 3; ++c) {
+                    float a = surface ? albedo[c][x] : 0.f;
+                    at(_albedo[c], x, y)[0] = a;
+                    illum[c][x] = a > MinAlbedo ? image.color[c][i] / a : image.color[c][i];
+                    albedoLuminance += Luminance[c] * (a > MinAlbedo ? a : 1.f);
+                }
+                at(_in.variance, x, y)[0] = image.variance[i] / (albedoLuminance * albedoLuminance);
+            }
+        }
+
+        // Depth gradient from the flatter side along each axis, so it stays small at silhouettes
+        for(int y = 0; y < _height; ++y) {
+            for(int x = 0; x < _width; ++x) {
+                if(at(_valid, x, y)[0] == 0.f) continue;
+                float z = at(_depth, x, y)[0];
+                auto side = [&](int qx, int qy) {
+                    if(qx < 0 || qy < 0 || qx >= _width || qy >= _height || at(_valid, qx, qy)[0] == 0.f) return FLT_MAX;
+                    return std::abs(at(_depth, qx, qy)[0] - z);
+                };
+                float gx = std::min(side(x - 1, y), side(x + 1, y));
+                float gy = std::min(side(x, y - 1), side(x, y + 1));
+                float g = std::max(gx == FLT_MAX ? 0.f : gx, gy == FLT_MAX ? 0.f : gy);
+                at(_gradient, x, y)[0] = g;
+            }
+        }
+    }
+
+    /// @brief One a-trous pass over the TileSize square at (x0, y0), from _in to _out
+    void FilterTile(int x0, int y0, int step) {
+        static const float Kernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+        int x1 = std::min(x0 + TileSize, _width), y1 = std::min(y0 + TileSize, _height);
+
+        for(int y = y0; y < y1; ++y) {
+            // Lanes past the right edge land in the padding, and are kept as they were
+            for(int x = x0; x < x1; x += 8) {
+                f8 valid = f8::Load(at(_valid, x, y)) > f8(0.f);
+                f8 cr = f8::Load(at(_in.r, x, y)), cg = f8::Load(at(_in.g, x, y)), cb = f8::Load(at(_in.b, x, y));
+                f8 cv = f8::Load(at(_in.variance, x, y));
+                if(!Any(valid)) {
+                    cr.store(at(_out.r, x, y)); cg.store(at(_out.g, x, y)); cb.store(at(_out.b, x, y));
+                    cv.store(at(_out.variance, x, y));
+                    continue;
+                }
+                f8 nx = f8::Load(at(_nx, x, y)), ny = f8::Load(at(_ny, x, y)), nz = f8::Load(at(_nz, x, y));
+                f8 z = f8::Load(at(_depth, x, y));
+                f8 lum = Luminance8(cr, cg, cb);
+
+                // Per unit of tap distance, and per unit of luminance
+                f8 depthScale = f8(-1.f) / (f8(SigmaDepth * step) * f8::Load(at(_gradient, x, y)) + f8(1e-4f));
+                f8 lumScale = f8(-1.f) / (f8(SigmaLuminance) * Sqrt(Max(step == 1 ? BlurredVariance(x, y) : cv, 0.f)) + f8(1e-4f));
+
+                f8 sum = 0.f;
+                f8 r = 0.f, g = 0.f, b = 0.f, v = 0.f;
+                for(int j = -2; j <= 2; ++j) {
+                    int qy = y + j * step;
+                    if(qy < 0 || qy >= _height) continue;
+                    for(int i = -2; i <= 2; ++i) {
+                        int qx = x + i * step;
+                        f8 qr = f8::Load(at(_in.r, qx, qy)), qg = f8::Load(at(_in.g, qx, qy)), qb = f8::Load(at(_in.b, qx, qy));
+
+                        f8 wn = Max(nx * f8::Load(at(_nx, qx, qy)) + ny * f8::Load(at(_ny, qx, qy)) + nz * f8::Load(at(_nz, qx, qy)), 0.f);
+                        for(int p = 1; p < NormalPower; p *= 2) wn = wn * wn;
+                        f8 e = Abs(z - f8::Load(at(_depth, qx, qy))) * depthScale * f8((float) (std::abs(i) + std::abs(j)))
+                             + Abs(lum - Luminance8(qr, qg, qb)) * lumScale;
+                        f8 w = f8(Kernel[i + 2] * Kernel[j + 2]) * f8::Load(at(_valid, qx, qy)) * wn * FastMath::exp(e);
+
+                        sum = sum + w;
+                        r = r + w * qr;
+                        g = g + w * qg;
+                        b = b + w * qb;
+                        v = v + w * w * f8::Load(at(_in.variance, qx, qy));
+                    }
+                }
+
+                // The center always weighs in for valid lanes, so only invalid ones can divide by 0
+                f8 inv = f8(1.f) / sum;
+                Select(valid, r * inv, cr).store(at(_out.r, x, y));
+                Select(valid, g * inv, cg).store(at(_out.g, x, y));
+                Select(valid, b * inv, cb).store(at(_out.b, x, y));
+                Select(valid, v * inv * inv, cv).store(at(_out.variance, x, y));
+            }
+        }
+    }
+
+    /// @brief Variance of 8 pixels starting at (x, y) averaged with their valid neighbors' by a 3x3 Gaussian,
+    /// steadier than a single pixel's when it has few samples
+    f8 BlurredVariance(int x, int y) const {
+        static const float Kernel[3] = {1.f / 4, 1.f / 2, 1.f / 4};
+        f8 sum = 0.f, weight = 0.f;
+        for(int j = -1; j <= 1; ++j) {
+            int qy = y + j;
+            if(qy < 0 || qy >= _height) continue;
+            for(int i = -1; i <= 1; ++i) {
+                f8 w = f8(Kernel[i + 1] * Kernel[j + 1]) * f8::Load(at(_valid, x + i, qy));
+                sum = sum + w * f8::Load(at(_in.variance, x + i, qy));
+                weight = weight + w;
+            }
+        }
+        return sum / Max(weight, 1e-6f);
+    }
+
+    /// @brief Multiply albedo back in and copy the result into image
+    void Store(Image& image) const {
+        const std::vector<float>* illum[3] = {&_in.r, &_in.g, &_in.b};
+        for(int y = 0; y < _height; ++y) {
+            for(int x = 0; x < _width; ++x) {
+                size_t i = (size_t) y * _width + x;
+                for(int c = 0; c < 3; ++c) {
+                    float a = at(_albedo[c], x, y)[0];
+                    float value = at(*illum[c], x, y)[0];
+                    image.color[c][i] = a > MinAlbedo ? value * a : value;
+                }
+                image.variance[i] = at(_in.variance, x, y)[0];
+            }
+        }
+    }
+
+    static constexpr float Luminance[3] = {.2126f, .7152f, .0722f};
+    static f8 Luminance8(f8 r, f8 g, f8 b) { return f8(Luminance[0]) * r + f8(Luminance[1]) * g + f8(Luminance[2]) * b; }
+
+    int _width = 0, _height = 0, _stride = 0;
+    Planes _in, _out;
+    std::vector<float> _albedo[3];
+    std::vector<float> _nx, _ny, _nz;
+    std::vector<float> _depth, _gradient;
+    std::vector<float> _valid; // 1 for surfaces, 0 for background, emitters and padding
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef FramePipeline_DEFINED
+#define FramePipeline_DEFINED
+
+#include <functional>
+#include <thread>
+#include <exception>
+#include <memory>
+#include "Projector.h"
+#include "include/BoundedQueue.h"
+
+struct PipelineStatistic {
+    int numFrames = 0;
+    double secondsTaken = 0.0; // wall clock time for the whole sequence
+    double framesPerSecond = 0.0;
+};
+
+/// @brief Renders a sequence of frames with the geometry, lighting and output stages running concurrently.
+/// While frame N is lit and written out, frame N + 1 is already being rasterized into another G-buffer.
+/// G-buffers and bitmaps are allocated once and recycled through bounded queues, depth of each.
+class FramePipeline {
+public:
+    /// @brief Called on the geometry stage to pose the scene for a frame. Return false to end the sequence early.
+    using FrameUpdate = std::function<bool(int frame, Scene& scene)>;
+    /// @brief Called on the output stage with each finished frame, in order
+    using FrameOutput = std::function<void(int frame, const GBitmap& bitmap, const RenderStatistic& stats)>;
+
+    FramePipeline(GISize dim, const RenderSettings& settings = {}, int depth = 2)
+        : _dim(dim), _projector(nullptr, dim, nullptr) {
+        _projector.setSettings(settings);
+        depth = std::max(depth, 1);
+        for(int i = 0; i < depth; ++i) {
+            _frames.push_back(std::make_unique<Frame>(dim));
+            _bitmaps.emplace_back();
+            _bitmaps.back().alloc(dim.width, dim.height);
+        }
+    }
+
+    ~FramePipeline() {
+        for(GBitmap& b : _bitmaps) free(b.pixels());
+    }
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    /// @brief Render frames [0, frameCount) of scene. update is called once per frame before rasterizing,
+    /// and may freely modify scene since lighting works from its own snapshot of the camera and lights.
+    PipelineStatistic Run(Scene& scene, int frameCount, FrameUpdate update, FrameOutput output) {
+        Stopwatch total;
+
+        int depth = _frames.size();
+        BoundedQueue<int> freeFrames(depth), litQueue(depth);
+        BoundedQueue<int> freeBitmaps(depth);
+        BoundedQueue<OutputItem> outQueue(depth);
+        for(int i = 0; i < depth; ++i) {
+            freeFrames.push(i);
+            freeBitmaps.push(i);
+        }
+
+        std::exception_ptr error = nullptr;
+        std::mutex errorLock;
+        auto fail = [&](std::exception_ptr e) {
+            {
+                std::lock_guard<std::mutex> lock(errorLock);
+                if(!error) error = e;
+            }
+            freeFrames.close(); litQueue.close(); freeBitmaps.close(); outQueue.close();
+        };
+
+        // Lighting stage
+        std::thread lighting([&]() {
+            Trace::SetThreadName("lighting");
+            try {
+                int f, b;
+                while(litQueue.pop(f)) {
+                    Frame& frame = *_frames[f];
+                    if(!freeBitmaps.pop(b)) break;
+
+                    TRACE_SCOPE("light frame");
+                    Stopwatch watch;
+                    _projector.ShadeBuffer(frame.cam, frame.lights, frame.buffer, _bitmaps[b], frame.stats, nullptr, &frame.shadows);
+                    frame.stats.secondsTaken += watch.elapsed();
+
+                    OutputItem item{frame.index, b, frame.stats};
+                    freeFrames.push(f);
+                    if(!outQueue.push(item)) break;
+                }
+            }
+            catch(...) { fail(std::current_exception()); }
+            outQueue.close();
+        });
+
+        // Output stage
+        int numFrames = 0;
+        std::thread writer([&]() {
+            Trace::SetThreadName("writer");
+            try {
+                OutputItem item;
+                while(outQueue.pop(item)) {
+                    TRACE_SCOPE("write frame");
+                    output(item.frame, _bitmaps[item.bitmap], item.stats);
+                    ++numFrames;
+                    freeBitmaps.push(item.bitmap);
+                }
+            }
+            catch(...) { fail(std::current_exception()); }
+        });
+
+        // Geometry stage, on the calling thread
+        try {
+            int f;
+            for(int i = 0; i < frameCount; ++i) {
+                if(!update(i, scene)) break;
+                if(!freeFrames.pop(f)) break;
+                Frame& frame = *_frames[f];
+
+                TRACE_SCOPE("rasterize frame");
+                Stopwatch watch;
+                frame.index = i;
+                frame.stats = RenderStatistic{};
+                frame.buffer.reset(_dim);
+                _projector.RasterizeScene(scene, frame.buffer, frame.stats);
+                _projector.UpdateShadows(scene, frame.shadows, frame.stats);
+                watch.lap();
+                frame.cam = scene.cam;
+                frame.lights = scene.lights;
+                frame.stats.phases.sceneCopy += watch.lap();
+                frame.stats.secondsTaken = watch.elapsed();
+
+                if(!litQueue.push(f)) break;
+            }
+        }
+        catch(...) { fail(std::current_exception()); }
+        litQueue.close();
+
+        lighting.join();
+        writer.join();
+        if(error) std::rethrow_exception(error);
+
+        PipelineStatistic stats;
+        stats.numFrames = numFrames;
+        stats.secondsTaken = total.elapsed();
+        stats.framesPerSecond = stats.secondsTaken > 0.0 ? numFrames / stats.secondsTaken : 0.0;
+        return stats;
+    }
+
+private:
+    struct Frame {
+        int index = 0;
+        GBuffer buffer;
+        // Snapshot of the posed scene, lighting must not read the live scene since it's already on the next frame
+        Camera cam;
+        std::vector<Light> lights;
+        // Per frame so the next frame's can be updated while this one is lit. Each slot caches its own,
+        // so a change gets redrawn once into every slot.
+        ShadowCasters shadows;
+        RenderStatistic stats;
+
+        Frame(GISize dim) : buffer(dim) {}
+    };
+
+    struct OutputItem {
+        int frame = 0;
+        int bitmap = 0;
+        RenderStatistic stats;
+    };
+
+    GISize _dim;
+    Projector _projector;
+    std::vector<std::unique_ptr<Frame>> _frames;
+    std::vector<GBitmap> _bitmaps;
+};
+
+#endif
@@ -16,20 +16,96 @@ struct PixelData {
     float specular;
 };
 
+/// @brief One row of every G-buffer plane, for shading pixels in runs
+struct GBufferRow {
+    const float* depth;
+    const float *px, *py, *pz; // position
+    const float *nx, *ny, *nz; // normal
+    const float *r, *g, *b;    // albedo
+    const float* specular;
+};
+
+/// @brief Pixels touched by a drawTri call
+struct RasterCounts {
+    int tested = 0;      // pixel centers checked against the triangle's edges
+    int covered = 0;     // pixel centers inside the triangle
+    int depthPassed = 0; // of those, pixels closer than what was already there
+};
+
+/// @brief Which windings GBuffer::DrawDepthTri draws
+enum class DepthCull {
+    None, // either winding, for shadow maps, which see occluders from both sides
+    Back  // only the winding drawTri covers, for Projector::RenderDepth
+};
+
 class GBuffer {
 public:
     GBuffer(const GISize dim) : _dim(dim) {
-        B_depth = vector<vector<float>>(dim.height, vector<float>(dim.width, FLT_MAX));
-        B_invdepth = vector<vector<float>>(dim.height, vector<float>(dim.width, 0.f));
-
-        B_position = vector<vector<vec3>>(dim.height, vector<vec3>(dim.width));
-        B_normal   = vector<vector<vec3>>(dim.height, vector<vec3>(dim.width));
-        B_albedo   = vector<vector<vec3>>(dim.height, vector<vec3>(dim.width));
-        B_specular = vector<vector<float>>(dim.height, vector<float>(dim.width));
+        size_t n = (size_t) dim.width * dim.height;
+        B_depth = vector<float>(n, FLT_MAX);
+        for(int p = 0; p < NumPlanes; ++p) B_planes[p] = vector<float>(n, 0.f);
     };
 
-    void drawTri(int indices[3], const vector<vec2> &proj_verts, vec3 verts[3],
-                 vec3 norms[3], const vector<GColor> &cols, float specular) {
+    /// @brief Prepare buffer for a new frame, reusing its memory if dimensions are unchanged
+    void reset(const GISize dim) {
+        if(dim.width != _dim.width || dim.height != _dim.height) {
+            bool counting = _counting;
+            *this = GBuffer(dim);
+            setCounting(counting);
+        }
+        else clear();
+    }
+
+    /// @brief Enable per pixel cost counters (raster tests, overdraw, lights), which slow down rendering.
+    /// Counters are zeroed along with the rest of the buffer.
+    void setCounting(bool counting) {
+        if(counting == _counting) return;
+        _counting = counting;
+        if(counting) {
+            B_rasterTests = vector<vector<int>>(_dim.height, vector<int>(_dim.width, 0));
+            B_overdraw    = vector<vector<int>>(_dim.height, vector<int>(_dim.width, 0));
+            B_lightCount  = vector<vector<int>>(_dim.height, vector<int>(_dim.width, 0));
+        }
+        else {
+            B_rasterTests.clear();
+            B_overdraw.clear();
+            B_lightCount.clear();
+        }
+    }
+    bool isCounting() const { return _counting; }
+
+    /// @brief Reset every pixel to its initial (empty) state
+    void clear() {
+        std::fill(B_depth.begin(), B_depth.end(), FLT_MAX);
+        for(vector<float>& plane : B_planes) std::fill(plane.begin(), plane.end(), 0.f);
+        for(int y = 0; y < _dim.height; ++y) {
+            if(_counting) {
+                std::fill(B_rasterTests[y].begin(), B_rasterTests[y].end(), 0);
+                std::fill(B_overdraw[y].begin(), B_overdraw[y].end(), 0);
+                std::fill(B_lightCount[y].begin(), B_lightCount[y].end(), 0);
+            }
+        }
+    }
+
+    /// @brief Reset the pixels inside rect, which must lie within the buffer
+    void clear(const GIRect& rect) {
+        for(int y = rect.top; y < rect.bottom; ++y) {
+            size_t row = (size_t) y * _dim.width;
+            std::fill(B_depth.begin() + row + rect.left, B_depth.begin() + row + rect.right, FLT_MAX);
+            for(vector<float>& plane : B_planes) {
+                std::fill(plane.begin() + row + rect.left, plane.begin() + row + rect.right, 0.f);
+            }
+            if(_counting) {
+                std::fill(B_rasterTests[y].begin() + rect.left, B_rasterTests[y].begin() + rect.right, 0);
+                std::fill(B_overdraw[y].begin() + rect.left, B_overdraw[y].begin() + rect.right, 0);
+                std::fill(B_lightCount[y].begin() + rect.left, B_lightCount[y].begin() + rect.right, 0);
+            }
+        }
+    }
+
+    /// @param clip if given, only pixels inside this rect are written
+    RasterCounts drawTri(int indices[3], const vector<vec2> &proj_verts, vec3 verts[3],
+                 vec3 norms[3], const GColor cols[3], float specular, const GIRect* clip = nullptr) {
         // Use Pineda's method or similar to rasterize triangle
         // Perform barycentric interpolation (see z-depth interpolation in scratch-a-pixel) to interpolate 
             // Note that this must be in camera space vertices, so we pass in 2d projection for rasterizing and 3d camera view for interpolating
@@ -51,6 +127,12 @@ public:
         maxX = min(_dim.width, maxX);
         minY = max(0, minY);
         maxY = min(_dim.height, maxY);
+        if(clip) {
+            minX = max(clip->left, minX);
+            maxX = min(clip->right, maxX);
+            minY = max(clip->top, minY);
+            maxY = min(clip->bottom, maxY);
+        }
 
         // Loop over pixels and perform edge checks for pixels using DDA for updates
         vec2 p = {minX + 0.5f, minY + 0.5f};
@@ -62,25 +144,31 @@ public:
 
         // Since negative z is inwards, all z values relative to camera should be negative, so flip
         float inv_zs[3] = {-1.f / verts[0].z(), -1.f / verts[1].z(), -1.f / verts[2].z()};
-        // GColor correctedCols[3] = {cols[indices[0]] * inv_zs[0],
-        //                            cols[indices[1]] * inv_zs[1],
-        //                            cols[indices[2]] * inv_zs[2]};
-        GColor correctedCols[3] = {cols[indices[0]],
-                                   cols[indices[1]],
-                                   cols[indices[2]]};
+        // GColor correctedCols[3] = {cols[0] * inv_zs[0],
+        //                            cols[1] * inv_zs[1],
+        //                            cols[2] * inv_zs[2]};
+        GColor correctedCols[3] = {cols[0],
+                                   cols[1],
+                                   cols[2]};
         // vec3 correctedNorms[3] = {norms[0] * inv_zs[0],
         //                           norms[1] * inv_zs[1],
         //                           norms[2] * inv_zs[2]};
 
+        RasterCounts counts;
+        counts.tested = max(0, maxX - minX) * max(0, maxY - minY);
         for(int y = minY; y < maxY; ++y) {
             for(int x = minX; x < maxX; ++x) {
                 // Naive, TODO: DDA
-                p = {x + 0.5f, y + 0.5f};
+                // Set in place, a braced vec2 would allocate per pixel
+                p[0] = x + 0.5f;
+                p[1] = y + 0.5f;
                 e0 = edgeFunction(proj_tri[1], proj_tri[2], p);
                 e1 = edgeFunction(proj_tri[2], proj_tri[0], p);
                 e2 = edgeFunction(proj_tri[0], proj_tri[1], p);
+                if(_counting) ++B_rasterTests[y][x];
 
                 if(e0 >= 0 && e1 >= 0 && e2 >= 0) {
+                    ++counts.covered;
                     // Draw pixel using baricentric interp
                     float w0 = e0 * inv_area;
                     float w1 = e1 * inv_area;
@@ -90,21 +178,25 @@ public:
                                 + w1 * inv_zs[1]
                                 + w2 * inv_zs[2];
 
-                    if(inv_z > B_invdepth[y][x]) {
+                    size_t i = (size_t) y * _dim.width + x;
+                    if(inv_z > B_planes[InvDepth][i]) {
                         // Render if closer to camera
-                        B_invdepth[y][x] = inv_z;
-                        B_depth[y][x] = 1.f / inv_z;
-
-
-                        B_position[y][x] = triInterp(verts[0], verts[1], verts[2], w0, w1, w2);
-                        //B_normal[y][x] = triInterp(correctedNorms[0], correctedNorms[1], correctedNorms[2], w0, w1, w2);
-                        B_normal[y][x] = triInterp(norms[0], norms[1], norms[2], w0, w1, w2);
-                        //TODO perspective correct norms
-                        GColor c = triInterp(correctedCols[0], correctedCols[1], correctedCols[2], w0, w1, w2);
-                        B_albedo[y][x] = {c.r, c.g, c.b};
+                        ++counts.depthPassed;
+                        if(_counting) ++B_overdraw[y][x];
+                        B_planes[InvDepth][i] = inv_z;
+                        B_depth[i] = 1.f / inv_z;
+
+                        for(int c = 0; c < 3; ++c) {
+                            B_planes[PosX + c][i] = triInterp(verts[0][c], verts[1][c], verts[2][c], w0, w1, w2);
+                            //TODO perspective correct norms
+                            B_planes[NormX + c][i] = triInterp(norms[0][c], norms[1][c], norms[2][c], w0, w1, w2);
+                        }
+                        B_planes[AlbedoR][i] = triInterp(correctedCols[0].r, correctedCols[1].r, correctedCols[2].r, w0, w1, w2);
+                        B_planes[AlbedoG][i] = triInterp(correctedCols[0].g, correctedCols[1].g, correctedCols[2].g, w0, w1, w2);
+                        B_planes[AlbedoB][i] = triInterp(correctedCols[0].b, correctedCols[1].b, correctedCols[2].b, w0, w1, w2);
 
                         //TODO specular rendering
-                        B_specular[y][x] = specular;
+                        B_planes[Specular][i] = specular;
                     }
                 }
             }
@@ -113,24 +205,107 @@ public:
 
 
         // TODO: adapt scanrow method from MyCanvas
+        return counts;
+    }
+
+    /// @brief Depth only drawTri for shadow maps and Projector::RenderDepth, taking screen coordinates as plain
+    /// floats. Covers the same pixels and computes the same 1 / z as drawTri, keeping the largest per pixel of
+    /// invDepth, a row major dim.width x dim.height plane cleared to 0. With DepthCull::None, clockwise
+    /// triangles are drawn too and degenerate ones skipped.
+    template<DepthCull Cull>
+    static RasterCounts DrawDepthTri(const float x[3], const float y[3], const float inv_zs[3],
+                                     float* invDepth, GISize dim) {
+        int minX = max(0, (int) round(min(x[0], min(x[1], x[2]))));
+        int maxX = min(dim.width, (int) round(max(x[0], max(x[1], x[2]))));
+        int minY = max(0, (int) round(min(y[0], min(y[1], y[2]))));
+        int maxY = min(dim.height, (int) round(max(y[0], max(y[1], y[2]))));
+
+        // edgeFunction spelled out, in the same order so coverage matches drawTri's exactly
+        float area = (x[2] - x[0]) * (y[1] - y[0]) - (y[2] - y[0]) * (x[1] - x[0]);
+        float inv_area = 1.f / area;
+        // Flipping the sign of the edge functions makes clockwise triangles pass the same >= 0 test
+        float sign = 1.f;
+        RasterCounts counts;
+        if constexpr(Cull == DepthCull::None) {
+            if(area == 0.f) return counts;
+            if(area < 0.f) sign = -1.f;
+        }
+
+        counts.tested = max(0, maxX - minX) * max(0, maxY - minY);
+        for(int py = minY; py < maxY; ++py) {
+            float cy = py + 0.5f;
+            float r0 = (cy - y[1]) * (x[2] - x[1]);
+            float r1 = (cy - y[2]) * (x[0] - x[2]);
+            float r2 = (cy - y[0]) * (x[1] - x[0]);
+            float* row = invDepth + (size_t) py * dim.width;
+            for(int px = minX; px < maxX; ++px) {
+                float cx = px + 0.5f;
+                float e0 = (cx - x[1]) * (y[2] - y[1]) - r0;
+                float e1 = (cx - x[2]) * (y[0] - y[2]) - r1;
+                float e2 = (cx - x[0]) * (y[1] - y[0]) - r2;
+                if(!(sign * e0 >= 0 && sign * e1 >= 0 && sign * e2 >= 0)) continue;
+
+                ++counts.covered;
+                float inv_z = e0 * inv_area * inv_zs[0] + e1 * inv_area * inv_zs[1] + e2 * inv_area * inv_zs[2];
+                if(inv_z > row[px]) {
+                    ++counts.depthPassed;
+                    row[px] = inv_z;
+                }
+            }
+        }
+        return counts;
     }
 
-    const PixelData getPixel(int x, int y) {
+    const PixelData getPixel(int x, int y) const {
+        size_t i = (size_t) y * _dim.width + x;
         return PixelData{
-            B_depth[y][x],
-            B_position[y][x],
-            B_normal[y][x],
-            B_albedo[y][x],
-            B_specular[y][x]
+            B_depth[i],
+            {B_planes[PosX][i], B_planes[PosY][i], B_planes[PosZ][i]},
+            {B_planes[NormX][i], B_planes[NormY][i], B_planes[NormZ][i]},
+            {B_planes[AlbedoR][i], B_planes[AlbedoG][i], B_planes[AlbedoB][i]},
+            B_planes[Specular][i]
         };
     }
 
-    const vector<vector<float>> getDepthBuffer() const { return B_depth; }
-    const vector<vector<float>> getInvDepthBuffer() const { return B_invdepth; }
-    const vector<vector<vec3>> getPositionBuffer() const { return B_position; }
-    const vector<vector<vec3>> getAlbedoBuffer() const { return B_albedo; }
-    const vector<vector<vec3>> getNormalBuffer() const { return B_normal; }
-    const vector<vector<float>> getSpecularBuffer() const { return B_specular; }
+    /// @brief Write a surface directly, for renderers that find it some other way than drawTri (e.g. ray tracing)
+    void setPixel(int x, int y, float depth, const float position[3], const float normal[3],
+                  const float albedo[3], float specular) {
+        size_t i = (size_t) y * _dim.width + x;
+        B_depth[i] = depth;
+        B_planes[InvDepth][i] = 1.f / depth;
+        for(int c = 0; c < 3; ++c) {
+            B_planes[PosX + c][i] = position[c];
+            B_planes[NormX + c][i] = normal[c];
+            B_planes[AlbedoR + c][i] = albedo[c];
+        }
+        B_planes[Specular][i] = specular;
+    }
+
+    GBufferRow getRow(int y) const {
+        size_t i = (size_t) y * _dim.width;
+        return GBufferRow{
+            B_depth.data() + i,
+            B_planes[PosX].data() + i, B_planes[PosY].data() + i, B_planes[PosZ].data() + i,
+            B_planes[NormX].data() + i, B_planes[NormY].data() + i, B_planes[NormZ].data() + i,
+            B_planes[AlbedoR].data() + i, B_planes[AlbedoG].data() + i, B_planes[AlbedoB].data() + i,
+            B_planes[Specular].data() + i
+        };
+    }
+
+    // Copies of single planes, for debug views
+    const vector<vector<float>> getDepthBuffer() const { return toRows(B_depth); }
+    const vector<vector<float>> getInvDepthBuffer() const { return toRows(B_planes[InvDepth]); }
+    const vector<vector<vec3>> getPositionBuffer() const { return toRows(PosX); }
+    const vector<vector<vec3>> getAlbedoBuffer() const { return toRows(AlbedoR); }
+    const vector<vector<vec3>> getNormalBuffer() const { return toRows(NormX); }
+    const vector<vector<float>> getSpecularBuffer() const { return toRows(B_planes[Specular]); }
+
+    // Cost counters, empty unless counting
+    const vector<vector<int>>& getRasterTestBuffer() const { return B_rasterTests; }
+    const vector<vector<int>>& getOverdrawBuffer() const { return B_overdraw; }
+    const vector<vector<int>>& getLightCountBuffer() const { return B_lightCount; }
+    /// @brief Record how many lights were in range of a pixel, written by the lighting pass
+    void setLightCount(int x, int y, int count) { B_lightCount[y][x] = count; }
 
     const int width() const { return _dim.width; }
     const int height() const { return _dim.height; }
@@ -138,17 +313,18 @@ public:
 private:
     GISize _dim;
 
-    // Buffers
-    vector<vector<float>> B_depth;
-    vector<vector<float>> B_invdepth;
+    // Buffers, planar and row major so the lighting pass can load runs of pixels per channel
+    enum Plane { InvDepth, PosX, PosY, PosZ, NormX, NormY, NormZ, AlbedoR, AlbedoG, AlbedoB, Specular, NumPlanes };
+    vector<float> B_depth;
+    vector<float> B_planes[NumPlanes];
 
-    vector<vector<vec3>> B_position;
-    vector<vector<vec3>> B_normal;
-    vector<vector<vec3>> B_albedo;
-    vector<vector<float>> B_specular;
+    bool _counting = false;
+    vector<vector<int>> B_rasterTests; // edge tests per pixel
+    vector<vector<int>> B_overdraw;    // depth test passes per pixel
+    vector<vector<int>> B_lightCount;  // lights in range per pixel
 
 
-    float edgeFunction(const vec2 &a, const vec2 &b, const vec2 &c) {
+    static float edgeFunction(const vec2 &a, const vec2 &b, const vec2 &c) {
         return (c[0] - a[0]) * (b[1] - a[1]) - (c[1] - a[1]) * (b[0] - a[0]);
     }
 
@@ -156,6 +332,26 @@ private:
     T triInterp(T v0, T v1, T v2, float w0, float w1, float w2) {
         return w0 * v0 + w1 * v1 + w2 * v2;
     }
+
+    vector<vector<float>> toRows(const vector<float>& plane) const {
+        vector<vector<float>> rows(_dim.height);
+        for(int y = 0; y < _dim.height; ++y) {
+            rows[y].assign(plane.begin() + (size_t) y * _dim.width, plane.begin() + (size_t) (y + 1) * _dim.width);
+        }
+        return rows;
+    }
+
+    /// @brief Rows of vec3s from the three planes starting at first
+    vector<vector<vec3>> toRows(Plane first) const {
+        vector<vector<vec3>> rows(_dim.height, vector<vec3>(_dim.width));
+        for(int y = 0; y < _dim.height; ++y) {
+            for(int x = 0; x < _dim.width; ++x) {
+                size_t i = (size_t) y * _dim.width + x;
+                rows[y][x] = {B_planes[first][i], B_planes[first + 1][i], B_planes[first + 2][i]};
+            }
+        }
+        return rows;
+    }
 };
 
 
@@ -5,42 +5,78 @@
 
 using namespace std;
 
-struct Light { // Generic point light
-    vec3 v{};
+enum class LightType { Point, Directional, Ambient };
+
+struct Light { // Point light unless built through Directional or Ambient
+    vec3 v{}; // position of point lights, direction the light travels for directional lights
     vec3 col{1.f, 1.f, 1.f};
     float ambientStrength =  .1f;
-    float specularStrength = 2.f;
 
     float effectiveDistance = 7.f;
     float K_c = 1.f;
     float K_l = .7f;
     float K_q = 1.8f;
 
-    vec3 calcLight(const vec3& p, const vec3& camPos, const vec3& norm, const vec3& albedo, const float shininess){
-        vec3 lightDir = (v - p);
-        float d = lightDir.length();
-        if(d > effectiveDistance) return {0.f, 0.f, 0.f};
-        float attenuation = attenuate(d);
-        lightDir /= d;
+    LightType type = LightType::Point;
+    bool dirty = true; // changed since the last incremental render
+
+    /// @brief Light arriving from direction dir everywhere in the scene, without falloff
+    static Light Directional(const vec3& dir, const vec3& col, float ambientStrength = 0.f) {
+        Light l;
+        l.v = vec3::normalize(dir);
+        l.col = col;
+        l.ambientStrength = ambientStrength;
+        l.type = LightType::Directional;
+        return l;
+    }
+
+    /// @brief Constant light added to every surface regardless of position or normal
+    static Light Ambient(const vec3& col, float strength) {
+        Light l;
+        l.col = col;
+        l.ambientStrength = strength;
+        l.type = LightType::Ambient;
+        return l;
+    }
+
+    /// @brief Reference shading for a single light. Projector::ShadeBuffer uses the kernels in
+    /// LightingKernels.h instead, which must agree with this. Shininess 0 turns off the specular term.
+    vec3 calcLight(const vec3& p, const vec3& camPos, const vec3& norm, const vec3& albedo, const float shininess) const {
+        if(type == LightType::Ambient) return ambientStrength * col * albedo;
+
+        vec3 lightDir;
+        float attenuation = 1.f;
+        if(type == LightType::Directional) {
+            lightDir = -v;
+        }
+        else {
+            lightDir = (v - p);
+            float d = lightDir.length();
+            if(d > effectiveDistance) return {0.f, 0.f, 0.f};
+            attenuation = attenuate(d);
+            lightDir /= d;
+        }
 
         float diff = max(vec3::dot(norm, lightDir), 0.f);
 
-        vec3 viewDir = vec3::normalize(camPos - p);
-        vec3 halfVec = vec3::normalize(lightDir + viewDir);
-        //vec3 reflectDir = vec3::reflect(-lightDir, norm);
-        //float spec = powf(max(vec3::dot(viewDir, reflectDir), 0.f), shininess);
-        float spec = powf(max(vec3::dot(norm, halfVec), 0.f), shininess);
+        float spec = 0.f;
+        if(shininess > 0.f) {
+            vec3 viewDir = vec3::normalize(camPos - p);
+            vec3 halfVec = vec3::normalize(lightDir + viewDir);
+            spec = powf(max(vec3::dot(norm, halfVec), 0.f), shininess);
+        }
 
         return (ambientStrength + diff + spec) * attenuation * col * albedo;
     }
 
-    float attenuate(float d) {
-        return 1.f / (K_c + K_l * d + K_q * d * d);
+    /// @brief Whether p is close enough for calcLight to do any work. Only point lights fall off.
+    bool inRange(const vec3& p) const {
+        return type != LightType::Point || (v - p).length() <= effectiveDistance;
     }
-};
-
-struct DirLight : Light {
 
+    float attenuate(float d) const {
+        return 1.f / (K_c + K_l * d + K_q * d * d);
+    }
 };
 
 #endif
\ No newline at end of file
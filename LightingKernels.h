@@ -0,0 +1,225 @@
+#ifndef LightingKernels_DEFINED
+#define LightingKernels_DEFINED
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "Light.h"
+#include "GBuffer.h"
+#include "include/GPixel.h"
+#include "include/SIMD.h"
+#include "include/FastMath.h"
+
+/*
+    Blinn-Phong shading split by light kind and material. The scene's lights are compiled once per
+    frame into per-kind structure-of-arrays form. Pixels are shaded 8 at a time straight from the
+    G-buffer's planes, by kernels instantiated for the kind of light and whether any of the 8 has a
+    specular term; out of range lights, matte lanes and emitters are masked rather than branched on.
+    Lights, normals and the camera are in world space, so callers pass the pixels' positions in
+    world space too rather than the G-buffer's camera space ones.
+    With MathMode::Exact results match Light::calcLight up to float rounding, MathMode::Approx trades
+    the square roots, divisions and powf for FastMath's approximations.
+
+    Shadows come in as a visibility in [0, 1] per point and directional light, which scales that light's
+    diffuse and specular term but not its ambient one.
+*/
+
+/// @brief Scene lights sorted by kind into structure-of-arrays form
+struct LightArrays {
+    struct PointLights {
+        std::vector<float> x, y, z;
+        std::vector<float> r, g, b;
+        std::vector<float> ambient;
+        std::vector<float> range; // effectiveDistance
+        std::vector<float> kc, kl, kq;
+        int count() const { return (int) x.size(); }
+    } point;
+
+    struct DirectionalLights {
+        std::vector<float> x, y, z; // unit vector towards the light
+        std::vector<float> r, g, b;
+        std::vector<float> ambient;
+        int count() const { return (int) x.size(); }
+    } directional;
+
+    float ambient[3] = {0.f, 0.f, 0.f}; // every ambient light's strength * color, summed
+
+    LightArrays() {}
+    explicit LightArrays(const std::vector<Light>& lights) { build(lights); }
+
+    void build(const std::vector<Light>& lights) {
+        *this = LightArrays();
+        for(const Light& l : lights) {
+            switch(l.type) {
+                case LightType::Point:
+                    point.x.push_back(l.v[0]);
+                    point.y.push_back(l.v[1]);
+                    point.z.push_back(l.v[2]);
+                    point.r.push_back(l.col[0]);
+                    point.g.push_back(l.col[1]);
+                    point.b.push_back(l.col[2]);
+                    point.ambient.push_back(l.ambientStrength);
+                    point.range.push_back(l.effectiveDistance);
+                    point.kc.push_back(l.K_c);
+                    point.kl.push_back(l.K_l);
+                    point.kq.push_back(l.K_q);
+                    break;
+                case LightType::Directional:
+                    directional.x.push_back(-l.v[0]);
+                    directional.y.push_back(-l.v[1]);
+                    directional.z.push_back(-l.v[2]);
+                    directional.r.push_back(l.col[0]);
+                    directional.g.push_back(l.col[1]);
+                    directional.b.push_back(l.col[2]);
+                    directional.ambient.push_back(l.ambientStrength);
+                    break;
+                case LightType::Ambient:
+                    ambient[0] += l.ambientStrength * l.col[0];
+                    ambient[1] += l.ambientStrength * l.col[1];
+                    ambient[2] += l.ambientStrength * l.col[2];
+                    break;
+            }
+        }
+    }
+};
+
+/// @brief Inputs shared by every light for 8 consecutive pixels, computed once before the light loops
+struct SurfacePoints {
+    f8 px, py, pz;   // world space position
+    f8 nx, ny, nz;   // normal
+    f8 vx, vy, vz;   // unit vector towards the camera
+    f8 shininess;    // negative for emitters
+    f8 specular;     // mask of lanes with a specular term
+
+    /// @brief Load n <= 8 pixels starting at x, zero filling the remaining lanes
+    SurfacePoints(const GBufferRow& row, int x, int n, const f8 position[3], const vec3& camPos, MathMode mode) {
+        px = position[0];
+        py = position[1];
+        pz = position[2];
+        nx = f8::LoadPartial(row.nx + x, n);
+        ny = f8::LoadPartial(row.ny + x, n);
+        nz = f8::LoadPartial(row.nz + x, n);
+        shininess = f8::LoadPartial(row.specular + x, n);
+        specular = shininess > f8(0.f);
+
+        vx = f8(camPos[0]) - px;
+        vy = f8(camPos[1]) - py;
+        vz = f8(camPos[2]) - pz;
+        if(mode == MathMode::Approx) FastMath::normalize(vx, vy, vz);
+        else {
+            f8 s = f8(1.f) / Sqrt(vx * vx + vy * vy + vz * vz);
+            vx = vx * s; vy = vy * s; vz = vz * s;
+        }
+    }
+};
+
+/// @brief Shading kernels instantiated per light kind and material
+class LightingKernels {
+public:
+    /// @brief Diffuse plus specular for unit light direction l
+    template<bool Specular, MathMode Mode>
+    static f8 DiffuseSpecular(const SurfacePoints& s, f8 lx, f8 ly, f8 lz) {
+        f8 diff = Max(s.nx * lx + s.ny * ly + s.nz * lz, 0.f);
+        if constexpr(!Specular) return diff;
+
+        f8 hx = lx + s.vx, hy = ly + s.vy, hz = lz + s.vz;
+        f8 nh = s.nx * hx + s.ny * hy + s.nz * hz;
+        if constexpr(Mode == MathMode::Approx) nh = nh * FastMath::rsqrt(hx * hx + hy * hy + hz * hz);
+        else nh = nh / Sqrt(hx * hx + hy * hy + hz * hz);
+        f8 spec = FastMath::Pow<Mode>(Max(nh, 0.f), s.shininess);
+        return diff + Select(s.specular, spec, 0.f);
+    }
+
+    /// @brief Add the light of every Kind light reaching s into sum, before multiplying by albedo
+    /// @param visibility if given, per light fraction of it reaching each lane, point lights then directional
+    template<LightType Kind, bool Specular, MathMode Mode>
+    static void Accumulate(const LightArrays& lights, const SurfacePoints& s, f8 sum[3], const f8* visibility = nullptr) {
+        if constexpr(Kind == LightType::Point) {
+            const LightArrays::PointLights& L = lights.point;
+            for(int i = 0, n = L.count(); i < n; ++i) {
+                f8 lx = f8(L.x[i]) - s.px, ly = f8(L.y[i]) - s.py, lz = f8(L.z[i]) - s.pz;
+                f8 d, inv;
+                if constexpr(Mode == MathMode::Approx) {
+                    f8 d2 = lx * lx + ly * ly + lz * lz;
+                    inv = FastMath::rsqrt(d2);
+                    d = d2 * inv;
+                }
+                else {
+                    d = Sqrt(lx * lx + ly * ly + lz * lz);
+                    inv = f8(1.f) / d;
+                }
+                // Out of range lights are masked to zero rather than skipped
+                f8 attenuation = Select(d <= f8(L.range[i]),
+                                        f8(1.f) / (f8(L.kc[i]) + f8(L.kl[i]) * d + f8(L.kq[i]) * d * d), 0.f);
+                f8 direct = DiffuseSpecular<Specular, Mode>(s, lx * inv, ly * inv, lz * inv);
+                if(visibility) direct = direct * visibility[i];
+                f8 k = (f8(L.ambient[i]) + direct) * attenuation;
+                sum[0] = sum[0] + k * f8(L.r[i]);
+                sum[1] = sum[1] + k * f8(L.g[i]);
+                sum[2] = sum[2] + k * f8(L.b[i]);
+            }
+        }
+        else if constexpr(Kind == LightType::Directional) {
+            const LightArrays::DirectionalLights& L = lights.directional;
+            for(int i = 0, n = L.count(); i < n; ++i) {
+                f8 direct = DiffuseSpecular<Specular, Mode>(s, L.x[i], L.y[i], L.z[i]);
+                if(visibility) direct = direct * visibility[lights.point.count() + i];
+                f8 k = f8(L.ambient[i]) + direct;
+                sum[0] = sum[0] + k * f8(L.r[i]);
+                sum[1] = sum[1] + k * f8(L.g[i]);
+                sum[2] = sum[2] + k * f8(L.b[i]);
+            }
+        }
+        else {
+            sum[0] = sum[0] + f8(lights.ambient[0]);
+            sum[1] = sum[1] + f8(lights.ambient[1]);
+            sum[2] = sum[2] + f8(lights.ambient[2]);
+        }
+    }
+
+    /// @brief Light n <= 8 pixels of a G-buffer row starting at x, writing premultiplied pixels to dst.
+    /// Emitters (negative shininess) keep their albedo, everything else is clamped to [0, 1].
+    /// @param position the pixels' world space positions
+    /// @param visibility optional shadowing, see Accumulate
+    template<MathMode Mode>
+    static void Shade(const LightArrays& lights, const GBufferRow& row, int x, int n, const f8 position[3],
+                      const vec3& camPos, GPixel* dst, const f8* visibility = nullptr) {
+        f8 albedo[3] = {f8::LoadPartial(row.r + x, n), f8::LoadPartial(row.g + x, n), f8::LoadPartial(row.b + x, n)};
+        f8 out[3] = {albedo[0], albedo[1], albedo[2]};
+
+        SurfacePoints s(row, x, n, position, camPos, Mode);
+        f8 emitter = s.shininess < f8(0.f);
+        if(!All(emitter)) {
+            f8 sum[3] = {0.f, 0.f, 0.f};
+            if(Any(s.specular)) AccumulateAll<true, Mode>(lights, s, sum, visibility);
+            else AccumulateAll<false, Mode>(lights, s, sum, visibility);
+            for(int c = 0; c < 3; ++c) {
+                out[c] = Select(emitter, albedo[c], Min(Max(sum[c] * albedo[c], 0.f), 1.f));
+            }
+        }
+
+        // Same rounding as toPremul with alpha 1
+        i8 pixels = i8(255).shl<GPIXEL_SHIFT_A>()
+                  | (out[0] * f8(255.f) + f8(.5f)).toInt().shl<GPIXEL_SHIFT_R>()
+                  | (out[1] * f8(255.f) + f8(.5f)).toInt().shl<GPIXEL_SHIFT_G>()
+                  | (out[2] * f8(255.f) + f8(.5f)).toInt().shl<GPIXEL_SHIFT_B>();
+        if(n >= 8) pixels.store((int32_t*) dst);
+        else {
+            int32_t tmp[8];
+            pixels.store(tmp);
+            std::memcpy(dst, tmp, n * sizeof(GPixel));
+        }
+    }
+
+private:
+    /// @brief Every kind of light, in the order Light::calcLight callers would sum them
+    template<bool Specular, MathMode Mode>
+    static void AccumulateAll(const LightArrays& lights, const SurfacePoints& s, f8 sum[3], const f8* visibility) {
+        Accumulate<LightType::Ambient, Specular, Mode>(lights, s, sum);
+        Accumulate<LightType::Point, Specular, Mode>(lights, s, sum, visibility);
+        Accumulate<LightType::Directional, Specular, Mode>(lights, s, sum, visibility);
+    }
+};
+
+#endif
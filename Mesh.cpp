@@ -0,0 +1,201 @@
+#include "Mesh.h"
+#include <unordered_map>
+#include <array>
+#include <mutex>
+#include "include/CustomException.h"
+
+void Mesh::computeDerived() {
+    bounds = AABB{};
+    for(const vec3& v : vertices) bounds.grow(v);
+
+    faceNormals.clear();
+    faceNormals.reserve(triCount());
+    for(int tri = 0; tri < indexCount(); tri += 3) {
+        const vec3& a = vertices[indices[tri]];
+        const vec3& b = vertices[indices[tri + 1]];
+        const vec3& c = vertices[indices[tri + 2]];
+        faceNormals.push_back(vec3::normalize(vec3::cross(c - a, b - a)));
+    }
+}
+
+MeshHandle Mesh::Create(Mesh&& mesh) {
+    if(!mesh.verifyData()) throw CustomException("Invalid mesh data.");
+    mesh.computeDerived();
+    return std::make_shared<const Mesh>(std::move(mesh));
+}
+
+MeshHandle Mesh::Create(const std::vector<vec3>& vertices,
+                        const std::vector<int>& indices,
+                        const std::vector<vec3>& normals) {
+    Mesh mesh;
+    mesh.vertices = vertices;
+    mesh.indices = indices;
+    mesh.normals = normals;
+    return Create(std::move(mesh));
+}
+
+#pragma region Primitives template data
+MeshHandle Mesh::Cube() {
+    static const MeshHandle cube = Create(
+        {
+            {-0.5f, 0.5f, -0.5f}, {0.5f, 0.5f, -0.5f}, {0.5f, 0.5f, 0.5f}, {-0.5f, 0.5f, 0.5f},
+            {-0.5f, -0.5f, -0.5f}, {0.5f, -0.5f, -0.5f}, {0.5f, -0.5f, 0.5f}, {-0.5f, -0.5f, 0.5f},
+
+            /*
+                   0--------1
+                  /|       /|
+                 / |      / |
+                3--------2  |
+                |  4-----|--5
+                | /      | /
+                |/       |/
+                7--------6
+
+            */
+        },
+
+        {0,1,3, 1,2,3, // top
+         3,2,7, 2,6,7, // front
+         2,1,6, 1,5,6, // right
+         1,0,4, 1,4,5, // back
+         0,3,4, 3,7,4, // left
+         7,6,4, 6,5,4  // bottom
+        }
+    );
+    return cube;
+}
+
+
+#define ICO_X .525731112119133606f
+#define ICO_Z .850650808352039932f
+#define ICO_N 0.f
+static const std::vector<vec3>& icosahedronVertices() {
+    static const std::vector<vec3> verts = {
+        // 0                       1                    2                    3
+        {-ICO_X,ICO_N,ICO_Z}, {ICO_X,ICO_N,ICO_Z}, {-ICO_X,ICO_N,-ICO_Z}, {ICO_X,ICO_N,-ICO_Z},
+        // 4                        5                   6                   7
+        {ICO_N,ICO_Z,ICO_X}, {ICO_N,ICO_Z,-ICO_X}, {ICO_N,-ICO_Z,ICO_X}, {ICO_N,-ICO_Z,-ICO_X},
+        // 8                        9                       10                  11
+        {ICO_Z,ICO_X,ICO_N}, {-ICO_Z,ICO_X, ICO_N}, {ICO_Z,-ICO_X,ICO_N}, {-ICO_Z,-ICO_X, ICO_N}
+    };
+    return verts;
+}
+static const std::vector<int>& icosahedronTris() {
+    static const std::vector<int> tris = {
+        0,4,1,  0,9,4,  9,5,4,  4,5,8,  4,8,1,
+        8,10,1, 8,3,10, 5,3,8,  5,2,3,  2,7,3,
+        7,10,3, 7,6,10, 7,11,6, 11,0,6, 0,1,6,
+        6,1,10, 9,0,11, 9,11,2, 9,2,5,  7,2,11
+    };
+    return tris;
+}
+
+MeshHandle Mesh::Icosahedron() {
+    static const MeshHandle ico = Create(icosahedronVertices(), icosahedronTris());
+    return ico;
+}
+
+MeshHandle Mesh::Plane() {
+    static const MeshHandle plane = Create(
+        {
+            {-0.5f, 0.f, -0.5f},
+            { 0.5f, 0.f, -0.5f},
+            { 0.5f, 0.f,  0.5f},
+            {-0.5f, 0.f,  0.5f}
+        },
+
+        {
+            0, 1, 3,    1, 2, 3,
+            0, 3, 1,    1, 3, 2
+        }
+    );
+    return plane;
+}
+
+#pragma endregion
+
+class Edge {
+public:
+    int a, b;
+
+    Edge(int _a, int _b) : a(_a), b(_b) {
+        if(b < a) std::swap(a, b);
+    }
+
+    bool operator==(const Edge &other) const {
+        return a == other.a && b == other.b;
+    }
+};
+template<>
+struct std::hash<Edge>
+{
+    std::size_t operator()(const Edge& e) const {
+        return e.a << 16 + e.b;
+    }
+};
+
+static Mesh buildIcosphere(int subdivisions) {
+    Mesh mesh;
+    mesh.vertices = icosahedronVertices();
+    mesh.indices = icosahedronTris();
+
+    // Add normals
+    for(int i = 0; i < mesh.vertexCount(); ++i) {
+        mesh.normals.push_back(mesh.vertices[i]);
+    }
+
+    std::unordered_map<Edge, int> edge_mid{};
+    Edge e{0, 0};
+    int mids[3];
+
+    for(int i = 0; i < subdivisions; ++i) {
+        std::vector<int> new_tris{};
+        new_tris.reserve(mesh.indexCount() * 4);
+        for(int n = 0; n < mesh.indexCount(); n += 3) {
+            for(int i = 0; i < 3; ++i) {
+                e.a = mesh.indices[n + i];
+                e.b = mesh.indices[n + (i + 1)%3];
+
+                if(edge_mid.find(e) == edge_mid.end()){
+                    edge_mid.insert({e, mesh.vertexCount()});
+                    vec3 newPoint = vec3::normalize(mesh.vertices[e.a] + mesh.vertices[e.b]);
+                    mesh.vertices.push_back(newPoint);
+                    mesh.normals.push_back(newPoint);
+                }
+                mids[i] = edge_mid[e];
+            }
+
+            new_tris.insert(new_tris.end(), {
+                mesh.indices[n    ], mids[0], mids[2],
+                mesh.indices[n + 1], mids[1], mids[0],
+                mesh.indices[n + 2], mids[2], mids[1],
+                mids[0], mids[1], mids[2]
+            });
+        }
+        mesh.indices = std::move(new_tris);
+        edge_mid.clear();
+    }
+
+    return mesh;
+}
+
+MeshHandle Mesh::Icosphere(int subdivisions) {
+    subdivisions = std::max(subdivisions, 0);
+    if(subdivisions > 5) throw CustomException("Icosphere resolution exceeds hashing limit.");
+
+    static std::array<MeshHandle, 6> cache{};
+    static std::mutex cacheLock;
+
+    std::lock_guard<std::mutex> lock(cacheLock);
+    if(!cache[subdivisions]) cache[subdivisions] = Create(buildIcosphere(subdivisions));
+    return cache[subdivisions];
+}
+
+MeshLODHandle MeshLOD::Icosphere() {
+    static const MeshLODHandle lod = [] {
+        MeshLOD chain;
+        for(int i = 0; i <= 5; ++i) chain.levels.push_back(Mesh::Icosphere(i));
+        return std::make_shared<const MeshLOD>(std::move(chain));
+    }();
+    return lod;
+}
@@ -0,0 +1,87 @@
+#ifndef Mesh_DEFINED
+#define Mesh_DEFINED
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include "include/vec.h"
+#include "include/GColor.h"
+#include "include/GPoint.h"
+#include "include/Bounds.h"
+
+struct Mesh;
+/// @brief Shared, immutable mesh. Objects hold one of these instead of their own copy of the geometry.
+using MeshHandle = std::shared_ptr<const Mesh>;
+
+struct MeshLOD;
+using MeshLODHandle = std::shared_ptr<const MeshLOD>;
+
+/// @brief Geometry in object space. Once created through Mesh::Create a mesh is never modified,
+/// so the same mesh can be safely shared by any number of objects.
+struct Mesh {
+    std::vector<vec3> vertices;
+    std::vector<int> indices;
+    std::vector<vec3> normals;     // per vertex, empty for flat shaded meshes
+    std::vector<vec3> faceNormals; // per tri, unit length, used for flat shading
+
+    // optional per vertex data
+    std::optional<std::vector<GColor>> colors;
+    std::optional<std::vector<GPoint>> uvs;
+
+    AABB bounds;
+
+    int triCount() const { return indices.size() / 3; }
+    int indexCount() const { return indices.size(); }
+    int vertexCount() const { return vertices.size(); }
+    bool hasNormals() const { return !normals.empty(); }
+
+    bool verifyData() const {
+        if(indices.size() % 3 != 0) return false;
+        if(!normals.empty() && normals.size() != vertices.size()) return false;
+        if(colors.has_value() && colors.value().size() != vertices.size()) return false;
+        if(uvs.has_value() && uvs.value().size() != vertices.size()) return false;
+
+        return true;
+    }
+
+    /// @brief Compute derived data (bounds, face normals) and freeze mesh
+    static MeshHandle Create(Mesh&& mesh);
+    static MeshHandle Create(const std::vector<vec3>& vertices,
+                             const std::vector<int>& indices,
+                             const std::vector<vec3>& normals = {});
+
+    // Primitives, generated once and shared
+
+    static MeshHandle Cube();
+    static MeshHandle Plane();
+    static MeshHandle Icosahedron();
+    /// @brief Unit icosphere with smooth normals
+    /// @param subdivisions number of times to subdivide tris, in [0, 5]
+    static MeshHandle Icosphere(int subdivisions);
+
+private:
+    void computeDerived();
+};
+
+/// @brief Chain of progressively finer versions of the same shape. Level 0 is the coarsest,
+/// and every level fits inside the bounds of the levels after it.
+struct MeshLOD {
+    std::vector<MeshHandle> levels;
+
+    int levelCount() const { return levels.size(); }
+    const MeshHandle& level(int i) const { return levels[i]; }
+
+    /// @brief Finest level at or below maxLevel with no more than maxTris triangles, or level 0 if none fit
+    int select(float maxTris, int maxLevel) const {
+        maxLevel = std::min(maxLevel, levelCount() - 1);
+        for(int i = maxLevel; i > 0; --i) {
+            if(levels[i]->triCount() <= maxTris) return i;
+        }
+        return 0;
+    }
+
+    /// @brief Icosphere subdivisions 0 to 5, generated once and shared
+    static MeshLODHandle Icosphere();
+};
+
+#endif
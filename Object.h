@@ -3,68 +3,69 @@
 
 #include <vector>
 #include <optional>
+#include "Mesh.h"
 #include "include/vec.h"
 #include "include/matrix.h"
 #include "include/GColor.h"
 #include "include/GPoint.h"
+#include "include/Bounds.h"
 
 struct Object {
     vec3 pos{};
     vec3 euler{};
     vec3 scale{1.f, 1.f, 1.f};
 
-    std::vector<vec3> vertices;
-    std::vector<int> indices;
-    std::vector<vec3> normals;
-    
-    // optional parameters
-    std::optional<std::vector<GColor>> colors;
-    std::optional<std::vector<GPoint>> uvs;
+    // Shared geometry, never modified through an Object
+    MeshHandle mesh;
+
+    // Optional level of detail chain. mesh is the authored level (lodLevel) and the finest that will be drawn.
+    MeshLODHandle lod;
+    int lodLevel = 0;
 
     // Material properties
+    GColor color{1.f, 1.f, 1.f, 1.f}; // multiplied with mesh vertex colors, if any
     float shininess; // If shininess < 0, object is emitter
     const bool isEmitter() const { return shininess < 0.f; }
 
     // Rendering options
     bool smooth;
+    // mesh approximates the unit sphere around the origin, which ray tracing may intersect exactly instead
+    bool sphere = false;
+
+    // Set whenever the object changes so incremental renders redraw it, see Projector::RenderIncremental
+    bool dirty = true;
 
-    Object() : vertices(), indices() {}
+    Object() : mesh(nullptr), shininess(64.f), smooth(false) {}
     Object(const vec3& _pos, const vec3& _scale, const vec3& _euler, const GColor& _col,
-           const std::vector<vec3> &_vertices,
-           const std::vector<int> &_indices,
-           const std::vector<vec3> &_norms,
+           MeshHandle _mesh,
            float specular,
            bool _smooth) :
            pos(_pos), euler(_euler), scale(_scale),
-           vertices(_vertices), indices(_indices), normals(_norms), 
-           colors{std::vector<GColor>(_vertices.size(), _col)},
+           mesh(std::move(_mesh)), color(_col),
            shininess(specular), smooth(_smooth) {};
 
-    int triCount() const { return indices.size() / 3; }
-    int indexCount() const { return indices.size(); }
-    int vertexCount() const { return vertices.size(); }
+    int triCount() const { return mesh ? mesh->triCount() : 0; }
+    int indexCount() const { return mesh ? mesh->indexCount() : 0; }
+    int vertexCount() const { return mesh ? mesh->vertexCount() : 0; }
 
     const mat4 getTransform() const {
         return mat4::Translate(pos) * mat4::RotateEuler(euler) * mat4::Scale(scale);
     };
 
-    const GColor* getColorArr() const {
-        if(!colors.has_value()) return nullptr;
-        return colors.value().data();
-    }
-    const GPoint* getUVsArr() const {
-        if(!uvs.has_value()) return nullptr;
-        return uvs.value().data();
-    }
-
-    bool verifyData() const {
-        if(indices.size() % 3 != 0) return false;
-        if(colors.has_value() && colors.value().size() != vertices.size()) return false;
-        if(uvs.has_value() && uvs.value().size() != vertices.size()) return false;
+    /// @brief Bounds of vertices in object space
+    AABB getLocalBounds() const { return mesh ? mesh->bounds : AABB{}; }
+    /// @brief Bounds of vertices after object transform
+    AABB getWorldBounds() const { return getLocalBounds().transformed(getTransform()); }
 
-        return true;
+    /// @brief Color of a vertex, combining mesh vertex colors with the object's color
+    GColor vertexColor(int i) const {
+        if(!mesh->colors.has_value()) return color;
+        return mesh->colors.value()[i] * color;
     }
 
+    bool verifyData() const { return mesh && mesh->verifyData(); }
+
+    /// @brief Append a tri. Since meshes are shared, this gives the object its own copy of the mesh first.
     void addTri(const vec3(&v)[3], const vec4* cols = nullptr, const vec2* uv = nullptr);
 
     void addTriFan() {};
@@ -82,7 +83,7 @@ struct Object {
                              vec3 euler  = {0.f, 0.f, 0.f},
                              GColor col  = {1.f, 1.f, 1.f, 1.f},
                              float shininess = 64.f) {
-        return _Cube.GetPrimitive(pos, scale, euler, col, shininess);
+        return Object(pos, scale, euler, col, Mesh::Cube(), shininess, false);
     }
 
     /// @brief Return an icosahedron Object
@@ -96,7 +97,7 @@ struct Object {
                                     vec3 euler  = {0.f, 0.f, 0.f},
                                     GColor col  = {1.f, 1.f, 1.f, 1.f},
                                     float shininess = 64.f) {
-        return _Icosahedron.GetPrimitive(pos, scale, euler, col, shininess);
+        return Object(pos, scale, euler, col, Mesh::Icosahedron(), shininess, false);
     }
 
     /// @brief Return an icosphere Object
@@ -111,7 +112,13 @@ struct Object {
                                   vec3 euler  = {0.f, 0.f, 0.f},
                                   GColor col  = {1.f, 1.f, 1.f, 1.f},
                                   float shininess = 64.f,
-                                  int subdivisions = 1);
+                                  int subdivisions = 1) {
+        Object obj(pos, scale, euler, col, Mesh::Icosphere(subdivisions), shininess, true);
+        obj.lod = MeshLOD::Icosphere();
+        obj.lodLevel = std::clamp(subdivisions, 0, obj.lod->levelCount() - 1);
+        obj.sphere = true;
+        return obj;
+    }
 
     /// @brief Return a plane Object
     /// @param pos float or vec3
@@ -124,32 +131,9 @@ struct Object {
                               vec3 euler  = {0.f, 0.f, 0.f},
                               GColor col  = {1.f, 1.f, 1.f, 1.f},
                               float shininess = 64.f) {
-        return _Plane.GetPrimitive(pos, scale, euler, col, shininess);
+        return Object(pos, scale, euler, col, Mesh::Plane(), shininess, false);
     }
 
-
-private:
-    /// @brief Template data for primitives. By default, primitives are shaded flat unless they contain normal info.
-    struct PrimitiveTemplate {
-        std::vector<vec3> vertices;
-        std::vector<vec3> normals;
-        std::vector<int> tris;
-
-        /// @brief Create an object from primitive template. If primitive has normals, will use smooth shading. Otherwise, uses flat shading.
-        /// @return 
-        Object GetPrimitive(vec3 pos    = {0.f, 0.f, 0.f},
-                            vec3 scale  = {1.f, 1.f, 1.f},
-                            vec3 euler  = {0.f, 0.f, 0.f},
-                            GColor col  = {1.f, 1.f, 1.f, 1.f},
-                            float specular = 64) const {
-            return Object(pos, scale, euler, col, vertices, tris, normals, specular, !normals.empty());
-        }
-    };
-    
-    const static PrimitiveTemplate _Cube;
-    const static PrimitiveTemplate _Plane;
-
-    const static PrimitiveTemplate _Icosahedron;
 };
 
 
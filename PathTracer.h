@@ -0,0 +1,430 @@
+#ifndef PathTracer_DEFINED
+#define PathTracer_DEFINED
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include "RayTracer.h"
+#include "Denoiser.h"
+#include "include/GRandom.h"
+
+/*
+    Progressive Monte Carlo path tracer over the same scene and lights as the rasterizer.
+
+    Each path starts at a random point of its pixel. At every surface it hits, point and directional lights
+    are sampled directly, with a shadow ray each, and the path continues in a cosine weighted direction
+    off the surface's diffuse term. Paths end when they leave the scene or hit an emitter, and Russian
+    roulette ends them early once they have bounced a few times. Emitters only show their albedo to camera
+    rays and don't cast shadows, as the lights they mark are sampled directly. Ambient light is added at
+    the first hit only, as bounced light takes its place further along.
+
+    Samples accumulate pass after pass into a float buffer, with each pixel's luminance variance. A pixel
+    stops being sampled once the relative standard error of its mean drops below
+    RenderSettings::noiseThreshold, and the noisier a pixel still is the more samples it gets per pass.
+    What camera rays first hit is averaged per pixel too, into the G-buffer that guides Denoiser when
+    RenderSettings::denoise is set.
+*/
+class PathTracer {
+public:
+    PathTracer() {}
+
+    void setSettings(const RenderSettings& settings) { _settings = settings; }
+    const RenderSettings& getSettings() const { return _settings; }
+
+    /// @brief Sample pass after pass into out until every pixel converged or has RenderSettings::maxSamples.
+    /// onPass(pass, out, stats) is called after every pass with the image so far.
+    template<typename OnPass>
+    RenderStatistic RenderSceneTo(const Scene& scene, GBitmap& out, OnPass&& onPass) {
+        TRACE_SCOPE("PathTracer::RenderSceneTo");
+        Stopwatch watch;
+        RenderStatistic stats{};
+        GISize dim{out.width(), out.height()};
+
+        BuildScene(scene, stats);
+        Reset(dim);
+        while(_active > 0) {
+            Pass(scene, stats);
+            // Only the final image is denoised
+            Resolve(out, _settings.denoise && _active == 0, stats);
+
+            stats.secondsTaken = watch.elapsed();
+            onPass(stats.numPasses, (const GBitmap&) out, (const RenderStatistic&) stats);
+        }
+
+        stats.numPixelsDamaged = dim.width * dim.height;
+        stats.fullRender = true;
+        stats.secondsTaken = watch.elapsed();
+        return stats;
+    }
+
+    RenderStatistic RenderSceneTo(const Scene& scene, GBitmap& out) {
+        return RenderSceneTo(scene, out, [](int, const GBitmap&, const RenderStatistic&) {});
+    }
+
+    /// @brief Bring the acceleration structure paths and shadow rays are traced against up to date with the scene
+    void BuildScene(const Scene& scene, RenderStatistic& stats) {
+        TRACE_SCOPE("PathTracer::BuildScene");
+        Stopwatch watch;
+
+        _bvh.update(scene, _settings.threads, _settings.analyticSpheres);
+
+        stats.numObjects = scene.objects.size();
+        stats.numTrisTotal = _bvh.instancedTriCount();
+        stats.numLights = scene.lights.size();
+        stats.phases.accelBuild += watch.elapsed();
+    }
+
+    const TwoLevelBVH& getBVH() const { return _bvh; }
+
+private:
+    static constexpr int MinSamples = 8;      // before a pixel's variance is trusted
+    static constexpr int MaxPassSamples = 8;  // per pixel per pass
+    static constexpr int RouletteBounce = 2;  // bounces before Russian roulette may end a path
+    static constexpr int MaxBounces = 8;
+    static constexpr float ErrorFloor = .05f; // luminance below which errors are measured in absolute terms
+    static constexpr float Bias = 1e-3f;      // offset of rays leaving a surface, so they can't hit it
+
+    /// @brief What a camera ray hit first
+    struct Primary {
+        float t = 0.f; // along the ray, whose camera space direction has z = -1, 0 if nothing was hit
+        float normal[3], albedo[3];
+        float shininess;
+    };
+
+    /// @brief Running sums of Primary over a pixel's samples
+    struct Guide {
+        float depth = 0.f, position[3] = {0.f, 0.f, 0.f}; // camera space, over hits
+        float normal[3] = {0.f, 0.f, 0.f};
+        float albedo[3] = {0.f, 0.f, 0.f};                // over samples, misses counting as black
+        float shininess = 0.f;                            // of the last hit
+        int hits = 0, emitterHits = 0;
+    };
+
+    /// @brief Per pixel running sums, indexed y * width + x
+    struct Accumulation {
+        std::vector<float> r, g, b;
+        std::vector<float> lum, lumSq; // luminance of each sample clamped to [0, 1], and its square
+        std::vector<int> samples;
+        std::vector<uint8_t> converged;
+        std::vector<Guide> guides;
+    };
+
+    void Reset(GISize dim) {
+        size_t n = (size_t) dim.width * dim.height;
+        _dim = dim;
+        for(std::vector<float>* sum : {&_acc.r, &_acc.g, &_acc.b, &_acc.lum, &_acc.lumSq}) sum->assign(n, 0.f);
+        _acc.samples.assign(n, 0);
+        _acc.converged.assign(n, 0);
+        _acc.guides.assign(n, Guide());
+        _active = (int) n;
+    }
+
+    /// @brief Relative standard error of pixel i's mean luminance
+    float RelativeError(size_t i) const {
+        int n = _acc.samples[i];
+        if(n < 2) return FLT_MAX;
+        float mean = _acc.lum[i] / n;
+        float variance = std::max(0.f, (_acc.lumSq[i] - mean * _acc.lum[i]) / (n - 1));
+        return std::sqrt(variance / n) / std::max(mean, ErrorFloor);
+    }
+
+    /// @brief Samples pixel i gets this pass: MinSamples to start with, then more the noisier it is
+    int PassSamples(size_t i) const {
+        int n = _acc.samples[i];
+        int wanted = n < MinSamples ? MinSamples - n
+                                    : std::min(MaxPassSamples, (int) std::ceil(RelativeError(i) / _settings.noiseThreshold));
+        return std::max(1, std::min(wanted, _settings.maxSamples - n));
+    }
+
+    /// @brief Sample every pixel that hasn't converged yet, then retire those that now have
+    void Pass(const Scene& scene, RenderStatistic& stats) {
+        TRACE_SCOPE("PathTracer::Pass");
+        Stopwatch watch;
+        CameraRays camera(scene.cam, _dim);
+        LightArrays lights(scene.lights);
+        int pass = stats.numPasses++;
+
+        std::mutex statsLock;
+        int64_t samples = 0, rays = 0;
+        int retired = 0, converged = 0;
+        ParallelFor(0, _dim.height, 1, _settings.threads, [&](int y0, int y1) {
+            TRACE_SCOPE("path rows");
+            int64_t rowSamples = 0, rowRays = 0;
+            int rowRetired = 0, rowConverged = 0;
+            for(int y = y0; y < y1; ++y) {
+                // A stream per row and pass, so images don't depend on which thread took which row
+                GRandom rng(Hash((uint32_t) pass * _dim.height + y));
+                for(int x = 0; x < _dim.width; ++x) {
+                    size_t i = (size_t) y * _dim.width + x;
+                    if(_acc.converged[i]) continue;
+
+                    for(int s = PassSamples(i); s > 0; --s) {
+                        float cx, cy, dir[3];
+                        camera.ray(x + Uniform(rng), y + Uniform(rng), cx, cy, dir);
+                        float c[3];
+                        Primary first;
+                        rowRays += TracePath(lights, camera.origin, dir, rng, c, first);
+                        AddGuide(_acc.guides[i], first, cx, cy);
+                        _acc.r[i] += c[0];
+                        _acc.g[i] += c[1];
+                        _acc.b[i] += c[2];
+                        float lum = std::min(1.f, .2126f * c[0] + .7152f * c[1] + .0722f * c[2]);
+                        _acc.lum[i] += lum;
+                        _acc.lumSq[i] += lum * lum;
+                        ++_acc.samples[i];
+                        ++rowSamples;
+                    }
+
+                    if(_acc.samples[i] >= MinSamples && RelativeError(i) < _settings.noiseThreshold) {
+                        _acc.converged[i] = 1;
+                        ++rowConverged;
+                        ++rowRetired;
+                    }
+                    else if(_acc.samples[i] >= _settings.maxSamples) {
+                        _acc.converged[i] = 1;
+                        ++rowRetired;
+                    }
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(statsLock);
+            samples += rowSamples;
+            rays += rowRays;
+            retired += rowRetired;
+            converged += rowConverged;
+        });
+
+        _active -= retired;
+        stats.numSamples += samples;
+        stats.numRays += rays;
+        stats.numPixelsConverged += converged;
+        stats.phases.trace += watch.elapsed();
+    }
+
+    static void AddGuide(Guide& guide, const Primary& first, float cx, float cy) {
+        for(int a = 0; a < 3; ++a) guide.albedo[a] += first.albedo[a];
+        if(first.t == 0.f) return;
+        guide.depth += first.t;
+        guide.position[0] += cx * first.t;
+        guide.position[1] += cy * first.t;
+        guide.position[2] -= first.t;
+        for(int a = 0; a < 3; ++a) guide.normal[a] += first.normal[a];
+        guide.shininess = first.shininess;
+        ++guide.hits;
+        guide.emitterHits += first.shininess < 0.f;
+    }
+
+    /// @brief Follow one path from o along d, writing the light it carries back to c and what it hit first to first
+    /// @return rays traced
+    int TracePath(const LightArrays& lights, const float o[3], const float d[3], GRandom& rng, float c[3], Primary& first) const {
+        for(int a = 0; a < 3; ++a) first.albedo[a] = 0.f;
+        c[0] = c[1] = c[2] = 0.f;
+        float throughput[3] = {1.f, 1.f, 1.f};
+        float origin[3] = {o[0], o[1], o[2]};
+        float dir[3] = {d[0], d[1], d[2]};
+        int rays = 0;
+
+        for(int bounce = 0; ; ++bounce) {
+            RayHit hit;
+            ++rays;
+            if(!_bvh.intersect(origin, dir, FLT_MAX, hit)) break;
+
+            const TwoLevelBVH::Instance& inst = _bvh.instance(hit);
+            float p[3], n[3], albedo[3];
+            for(int a = 0; a < 3; ++a) p[a] = origin[a] + hit.t * dir[a];
+            _bvh.surface(hit, origin, dir, n, albedo);
+            Normalize(n);
+            // Interpolated normals can lean away from the ray at silhouettes
+            if(Dot(n, dir) > 0.f) for(int a = 0; a < 3; ++a) n[a] = -n[a];
+            if(bounce == 0) {
+                first.t = hit.t;
+                std::copy(n, n + 3, first.normal);
+                std::copy(albedo, albedo + 3, first.albedo);
+                first.shininess = inst.shininess;
+            }
+            if(inst.shininess < 0.f) {
+                if(bounce == 0) for(int a = 0; a < 3; ++a) c[a] = albedo[a];
+                break;
+            }
+
+            float view[3] = {-dir[0], -dir[1], -dir[2]};
+            Normalize(view);
+            float direct[3];
+            rays += DirectLight(lights, p, n, view, inst.shininess, bounce == 0, direct);
+            for(int a = 0; a < 3; ++a) c[a] += throughput[a] * direct[a] * albedo[a];
+
+            // Continue off the diffuse term, whose cosine weighted sampling leaves albedo as the weight
+            if(bounce + 1 >= MaxBounces) break;
+            for(int a = 0; a < 3; ++a) throughput[a] *= albedo[a];
+            if(bounce >= RouletteBounce) {
+                float survive = std::min(.95f, std::max(throughput[0], std::max(throughput[1], throughput[2])));
+                if(Uniform(rng) >= survive) break;
+                for(int a = 0; a < 3; ++a) throughput[a] /= survive;
+            }
+            CosineDirection(n, rng, dir);
+            for(int a = 0; a < 3; ++a) origin[a] = p[a] + n[a] * Bias;
+        }
+        return rays;
+    }
+
+    /// @brief Light from every point and directional light reaching p, before multiplying by albedo.
+    /// Point lights' ambient term and ambient lights are only added if ambient is set.
+    /// @return shadow rays traced
+    int DirectLight(const LightArrays& lights, const float p[3], const float n[3], const float view[3],
+                    float shininess, bool ambient, float sum[3]) const {
+        int rays = 0;
+        sum[0] = sum[1] = sum[2] = 0.f;
+        if(ambient) for(int a = 0; a < 3; ++a) sum[a] = lights.ambient[a];
+        float surface[3] = {p[0] + n[0] * Bias, p[1] + n[1] * Bias, p[2] + n[2] * Bias};
+
+        const LightArrays::PointLights& P = lights.point;
+        for(int i = 0; i < P.count(); ++i) {
+            float l[3] = {P.x[i] - p[0], P.y[i] - p[1], P.z[i] - p[2]};
+            float dist = std::sqrt(Dot(l, l));
+            if(dist > P.range[i]) continue;
+            float attenuation = 1.f / (P.kc[i] + P.kl[i] * dist + P.kq[i] * dist * dist);
+            for(int a = 0; a < 3; ++a) l[a] /= dist;
+
+            float k = ambient ? P.ambient[i] : 0.f;
+            float direct = DiffuseSpecular(n, l, view, shininess);
+            if(direct > 0.f) {
+                // From the light towards the surface, like the lighting pass' shadow rays
+                float from[3] = {P.x[i], P.y[i], P.z[i]};
+                float to[3] = {surface[0] - from[0], surface[1] - from[1], surface[2] - from[2]};
+                ++rays;
+                if(!_bvh.occluded(from, to, 1.f)) k += direct;
+            }
+            k *= attenuation;
+            sum[0] += k * P.r[i];
+            sum[1] += k * P.g[i];
+            sum[2] += k * P.b[i];
+        }
+
+        const LightArrays::DirectionalLights& D = lights.directional;
+        for(int i = 0; i < D.count(); ++i) {
+            float l[3] = {D.x[i], D.y[i], D.z[i]};
+            float k = ambient ? D.ambient[i] : 0.f;
+            float direct = DiffuseSpecular(n, l, view, shininess);
+            if(direct > 0.f) {
+                ++rays;
+                if(!_bvh.occluded(surface, l, FLT_MAX)) k += direct;
+            }
+            sum[0] += k * D.r[i];
+            sum[1] += k * D.g[i];
+            sum[2] += k * D.b[i];
+        }
+        return rays;
+    }
+
+    /// @brief Blinn-Phong diffuse plus specular for unit light direction l, as in Light::calcLight
+    static float DiffuseSpecular(const float n[3], const float l[3], const float view[3], float shininess) {
+        float diff = std::max(Dot(n, l), 0.f);
+        if(shininess <= 0.f) return diff;
+        float h[3] = {l[0] + view[0], l[1] + view[1], l[2] + view[2]};
+        Normalize(h);
+        return diff + powf(std::max(Dot(n, h), 0.f), shininess);
+    }
+
+    /// @brief Write into dir a random direction around unit normal n, with density proportional to its cosine
+    static void CosineDirection(const float n[3], GRandom& rng, float dir[3]) {
+        float r = std::sqrt(Uniform(rng));
+        float phi = 6.28318531f * Uniform(rng);
+        float u = r * std::cos(phi), v = r * std::sin(phi), w = std::sqrt(std::max(0.f, 1.f - r * r));
+
+        // Orthonormal basis around n (Duff et al., "Building an Orthonormal Basis, Revisited")
+        float sign = std::copysign(1.f, n[2]);
+        float a = -1.f / (sign + n[2]);
+        float b = n[0] * n[1] * a;
+        float t[3] = {1.f + sign * n[0] * n[0] * a, sign * b, -sign * n[0]};
+        float s[3] = {b, sign + n[1] * n[1] * a, -n[1]};
+        for(int k = 0; k < 3; ++k) dir[k] = u * t[k] + v * s[k] + w * n[k];
+    }
+
+    /// @brief Write each pixel's mean so far to out, clamped like the lighting pass, denoising it first if asked
+    void Resolve(GBitmap& out, bool denoise, RenderStatistic& stats) {
+        Stopwatch watch;
+        _image.resize(_dim);
+        for(size_t i = 0, n = _acc.samples.size(); i < n; ++i) {
+            int samples = _acc.samples[i];
+            float inv = samples > 0 ? 1.f / samples : 0.f;
+            _image.color[0][i] = _acc.r[i] * inv;
+            _image.color[1][i] = _acc.g[i] * inv;
+            _image.color[2][i] = _acc.b[i] * inv;
+            // Of the mean, taking the noise to be as large as the signal while there is no estimate
+            float mean = _acc.lum[i] * inv;
+            _image.variance[i] = samples >= 2 ? std::max(0.f, (_acc.lumSq[i] - mean * _acc.lum[i]) / (samples - 1)) / samples
+                                              : mean * mean;
+        }
+        if(denoise) {
+            stats.phases.outputConversion += watch.lap();
+            FillGuide();
+            _denoiser.filter(_image, _guide, _settings.threads);
+            stats.phases.denoise += watch.lap();
+        }
+
+        ParallelFor(0, _dim.height, 16, _settings.threads, [&](int y0, int y1) {
+            for(int y = y0; y < y1; ++y) {
+                GPixel* dst = out.getAddr(0, y);
+                for(int x = 0; x < _dim.width; ++x) {
+                    size_t i = (size_t) y * _dim.width + x;
+                    unsigned bytes[3];
+                    for(int a = 0; a < 3; ++a) bytes[a] = (unsigned) (std::min(std::max(_image.color[a][i], 0.f), 1.f) * 255.f + .5f);
+                    dst[x] = GPixel_PackARGB(255, bytes[0], bytes[1], bytes[2]);
+                }
+            }
+        });
+        stats.phases.outputConversion += watch.lap();
+    }
+
+    /// @brief Average each pixel's primary hits into _guide, in the rasterizer's G-buffer conventions
+    void FillGuide() {
+        _guide.reset(_dim);
+        for(int y = 0; y < _dim.height; ++y) {
+            for(int x = 0; x < _dim.width; ++x) {
+                size_t i = (size_t) y * _dim.width + x;
+                const Guide& g = _acc.guides[i];
+                if(g.hits == 0) continue;
+                float position[3], normal[3] = {g.normal[0], g.normal[1], g.normal[2]}, albedo[3];
+                for(int a = 0; a < 3; ++a) {
+                    position[a] = g.position[a] / g.hits;
+                    albedo[a] = g.albedo[a] / _acc.samples[i];
+                }
+                if(Dot(normal, normal) > 0.f) Normalize(normal);
+                float shininess = 2 * g.emitterHits > g.hits ? -1.f : std::max(g.shininess, 0.f);
+                _guide.setPixel(x, y, g.depth / g.hits, position, normal, albedo, shininess);
+            }
+        }
+    }
+
+    /// @brief Uniform float in [0, 1), from the generator's high bits as its low ones repeat quickly
+    static float Uniform(GRandom& rng) { return (rng.nextU() >> 8) * (1.f / (1 << 24)); }
+
+    /// @brief Spread consecutive seeds apart (Wang's integer hash)
+    static uint32_t Hash(uint32_t x) {
+        x = (x ^ 61) ^ (x >> 16);
+        x *= 9;
+        x ^= x >> 4;
+        x *= 0x27d4eb2d;
+        x ^= x >> 15;
+        return x;
+    }
+
+    static float Dot(const float a[3], const float b[3]) { return a[0] * b[0] + a[1] * b[1] + a[2] * b[2]; }
+    static void Normalize(float v[3]) {
+        float s = 1.f / std::sqrt(Dot(v, v));
+        v[0] *= s; v[1] *= s; v[2] *= s;
+    }
+
+    RenderSettings _settings;
+    GISize _dim{0, 0};
+    Accumulation _acc;
+    int _active = 0; // pixels still being sampled
+
+    Denoiser _denoiser;
+    Denoiser::Image _image; // mean of every pixel, and its variance
+    GBuffer _guide{GISize{0, 0}};
+
+    TwoLevelBVH _bvh; // for paths, and shadow rays, which pass through emitters
+};
+
+#endif
@@ -12,33 +12,499 @@
 #include "include/GPaint.h"
 #include "SceneBuilder.h"
 #include "GBuffer.h"
+#include "LightingKernels.h"
+#include "SceneTriangles.h"
+#include "TwoLevelBVH.h"
+#include "ShadowMap.h"
+#include "include/Parallel.h"
+#include "include/Stopwatch.h"
+#include "include/FastMath.h"
+#include "include/Trace.h"
+#include "include/PerfCounters.h"
+#include "include/AllocTracker.h"
+#include <memory>
+#include <functional>
+#include <thread>
+#include <exception>
+#include <mutex>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+
+/// @brief How lights are occluded, see RenderSettings::shadows
+enum class ShadowMode {
+    None,      // every light reaches everything in its range
+    RayTraced, // one shadow ray per lit pixel per point and directional light, against a BVH of the scene
+    Maps       // cube shadow maps for point lights, kept until something in their range moves
+};
+
+/// @brief Options controlling how the Projector renders
+struct RenderSettings {
+    // Level of detail: objects with a LOD chain are drawn at the coarsest level that still keeps
+    // triangles around lodPixelsPerTri pixels large on screen, never finer than their authored level
+    bool lod = true;
+    float lodPixelsPerTri = 4.f;
+
+    // Worker threads for the lighting pass, 0 for one per hardware thread
+    int threads = 0;
+
+    // Per pixel cost counters, needed for the Overdraw, RasterTests and LightCount buffer views. Slows rendering.
+    bool counters = false;
+
+    // Hardware performance counters per phase, for RenderSceneTo and RenderIncremental
+    bool perfCounters = false;
+
+    // Precision of lighting and normal math, Approx uses FastMath's rsqrt and fast_pow
+    MathMode math = MathMode::Exact;
+
+    // Ray tracing mode traces 4x2 pixel tiles as SIMD ray packets rather than one ray at a time
+    bool rayPackets = true;
+
+    // Shadows in the lighting pass. Emitters don't cast them, as they mark where lights are.
+    ShadowMode shadows = ShadowMode::None;
+    int shadowMapSize = 256; // texels along each cube face edge, for ShadowMode::Maps
+
+    // Ray tracing intersects icospheres (Object::sphere) exactly rather than their triangles,
+    // for ray traced shadows too. Leave it off when rasterizing, where facets would shadow themselves.
+    bool analyticSpheres = false;
+
+    // Progressive path tracing (PathTracer) samples a pixel until its estimate's relative standard error
+    // drops below noiseThreshold, or it has maxSamples
+    int maxSamples = 256;
+    float noiseThreshold = 0.02f;
+    bool denoise = false; // filter the final image with Denoiser, guided by what camera rays hit
+};
+
+/// @brief Wall clock seconds spent in each phase of a frame
+struct PhaseTimings {
+    double sceneCopy = 0.0;        // filled in by whoever copies the scene
+    double cull = 0.0;             // frustum culling, LOD selection and batching
+    double vertexTransform = 0.0;
+    double triSetup = 0.0;         // backface culling, normals and camera space vertices
+    double raster = 0.0;
+    double lighting = 0.0;
+    double outputConversion = 0.0; // lit colors to premultiplied pixels, when not fused into lighting
+    double pngEncode = 0.0;        // filled in by whoever writes the image
+
+    double shadowMaps = 0.0;       // redrawing invalidated shadow maps, with ShadowMode::Maps
+
+    // Ray tracing (RayTracer) and ray traced shadows, the raster phases above stay 0 when ray tracing
+    double accelBuild = 0.0;       // world space triangles and their BVH
+    double trace = 0.0;            // primary rays into the G-buffer, or every path traced
+    double denoise = 0.0;          // path tracing only
+};
+
+/// @brief Hardware counters per phase, see RenderSettings::perfCounters
+struct PhaseCounters {
+    bool available = false;
+    std::string unavailableReason;
+
+    PerfValues cull;
+    PerfValues vertexTransform;
+    PerfValues triSetup;
+    PerfValues raster;
+    PerfValues lighting; // includes output conversion
+};
+
+/// @brief Heap activity through operator new during a render, only tracked in builds with
+/// CPPR_TRACK_ALLOCS (make TRACK_ALLOCS=1). Filled by RenderSceneTo and RenderIncremental.
+struct AllocStatistic {
+    bool tracked = false;
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t bytes = 0;
+    uint64_t peakHeapBytes = 0;      // most bytes live at once during the render
+    uint64_t peakResidentBytes = 0;  // process peak RSS so far, reported even when not tracking
+    std::vector<AllocSite> topSites; // by allocation count
+};
 
 struct RenderStatistic {
     int numObjects = 0;
+    int numObjectsCulled = 0;
+    int numMeshBatches = 0;
+    int numObjectsLODReduced = 0; // objects drawn coarser than their authored level
     int numTrisTotal = 0;
     int numTrisDrawn = 0;
     int numLights = 0;
 
-    double ticksTaken = 0.0;
-    double secondsTaken = 0.0;
+    bool fullRender = true;    // false if only a damaged region was redrawn, see RenderIncremental
+    int numPixelsDamaged = 0;  // pixels relit this frame
+
+    int64_t numVerticesTransformed = 0;
+    int64_t numPixelsRasterized = 0; // pixels covered by drawn triangles, counting overlaps
+    int64_t numDepthPasses = 0;      // of those, pixels that passed the depth test
+    int64_t numLightEvals = 0;
+    int64_t numRasterTests = 0;      // pixel centers tested against triangle edges
+    int64_t numRays = 0;             // rays traced, by ray and path tracing and ray traced shadows only
+    int numShadowMapsDrawn = 0;      // point light shadow maps redrawn rather than reused
+
+    // Progressive path tracing only
+    int numPasses = 0;
+    int64_t numSamples = 0;          // paths traced, over every pass
+    int numPixelsConverged = 0;      // pixels that stopped below RenderSettings::noiseThreshold
+
+    // Only gathered with RenderSettings::counters
+    int64_t numLightsInRange = 0; // light evaluations that did the full lighting model
+    int maxRasterTests = 0;       // per pixel maxima
+    int maxOverdraw = 0;
+    int maxLightsPerPixel = 0;
+
+    PhaseTimings phases;
+    PhaseCounters perf;
+    AllocStatistic allocs;
+    double secondsTaken = 0.0; // wall clock, for the render call only
+};
+
+/// @brief What the lighting pass tests shadows against, see RenderSettings::shadows. Kept from frame to frame
+/// by Projector::UpdateShadows, which only rebuilds what moving objects or lights invalidated.
+struct ShadowCasters {
+    ShadowMode mode = ShadowMode::None; // what the contents were built for
+    bool spheres = false;               // occluders were built with RenderSettings::analyticSpheres
+    TwoLevelBVH occluders;              // ShadowMode::RayTraced
+    std::vector<ShadowMap> maps;        // ShadowMode::Maps, indexed like the scene's lights, only valid for point lights
+
+    // Every object as it was when the above was built
+    struct Caster {
+        mat4 transform;
+        const Mesh* mesh = nullptr;
+        bool emitter = true;
+        AABB bounds;
+    };
+    std::vector<Caster> casters;
+    SceneTriangles triangles; // scratch for drawing shadow maps
 };
 
 class Projector {
 public:
 
     Projector(GCanvas* canv, GISize dim, GBitmap* bmap)
-        : _dim(dim), _buffer(GBuffer(dim)), _rendered(false), canvas(canv), bitmap(bmap) {}
+        : _dim(dim), _buffer(GBuffer({0, 0})), _rendered(false), _incrementalValid(false), canvas(canv), bitmap(bmap) {}
+
+    RenderStatistic RenderSceneTo(const Scene& scene, GCanvas& canvas, GISize dim) {
+        TRACE_SCOPE("Projector::RenderSceneTo");
+        _rendered = true;
+        _incrementalValid = false;
+        BeginAllocs();
+        Stopwatch watch;
+
+        _buffer.setCounting(_settings.counters);
+        _buffer.reset(dim);
+        RenderStatistic stats{};
+        BeginPerf(stats);
+
+        RasterizeScene(scene, _buffer, stats);
+        UpdateShadows(scene, stats);
+        PerfMark();
+        ShadeBuffer(scene.cam, scene.lights, _buffer, *bitmap, stats);
+        PerfLap(stats.perf.lighting);
+        EndPerf();
+        stats.numPixelsDamaged = dim.width * dim.height;
+        if(_buffer.isCounting()) CollectCounterMaxima(_buffer, stats);
+
+        stats.secondsTaken = watch.elapsed();
+        EndAllocs(stats);
+        return stats;
+    }
 
-    RenderStatistic RenderSceneTo(Scene scene, GCanvas& canvas, GISize dim) {
+    /// @brief Rows [top, top + buffer height) of an image imageHeight tall, see RasterizeScene
+    struct Band {
+        int top;
+        int imageHeight;
+    };
+    /// @brief Receives a rendered band, rows' first row being the image's row top
+    using BandOutput = std::function<void(int top, const GBitmap& rows)>;
+
+    /// @brief Render scene bandRows rows at a time, for images too large to hold a G-buffer (or bitmap) of
+    /// whole. Each band is rasterized from the objects overlapping it, lit, and handed to output, top to
+    /// bottom, so memory grows with dim.width * bandRows rather than the image. output runs on a thread of
+    /// its own while the next band renders, one call at a time, and the time waited on it isn't counted.
+    /// Work counters add up over bands, counting a triangle once per band it's drawn into. If output throws,
+    /// no further bands are rendered and the exception is rethrown here once the writer thread is joined.
+    /// The projector's G-buffer only holds the last band afterwards, so buffer views aren't available.
+    RenderStatistic RenderBands(const Scene& scene, GISize dim, int bandRows, const BandOutput& output) {
+        TRACE_SCOPE("Projector::RenderBands");
         _rendered = true;
-        clock_t now = std::clock();
+        _incrementalValid = false;
+        BeginAllocs();
+        Stopwatch watch;
+        RenderStatistic stats{};
+        BeginPerf(stats);
+
+        _buffer.setCounting(_settings.counters);
+        UpdateShadows(scene, stats);
+
+        // Two bitmaps, one being written out while the other is lit
+        int rows = std::max(1, std::min(bandRows, dim.height));
+        GBitmap bitmaps[2];
+        for(GBitmap& b : bitmaps) b.alloc(dim.width, rows);
+        std::thread writer;
+        std::exception_ptr error = nullptr; // thrown by output, only touched by the writer until it's joined
+        double waited = 0.0;
+        auto waitForWriter = [&]() {
+            if(!writer.joinable()) return;
+            Stopwatch wait;
+            writer.join();
+            waited += wait.elapsed();
+        };
+
+        try {
+            for(int top = 0, b = 0; top < dim.height; top += rows, b ^= 1) {
+                int height = std::min(rows, dim.height - top);
+                GBitmap out(dim.width, height, bitmaps[b].rowBytes(), bitmaps[b].pixels(), false);
+                _buffer.reset({dim.width, height});
+                Band band{top, dim.height};
+                RasterizeScene(scene, _buffer, stats, nullptr, nullptr, &band);
+                PerfMark();
+                ShadeBuffer(scene.cam, scene.lights, _buffer, out, stats);
+                PerfLap(stats.perf.lighting);
+                if(_buffer.isCounting()) CollectCounterMaxima(_buffer, stats);
+
+                waitForWriter();
+                if(error) break;
+                writer = std::thread([&output, &error, top, out]() {
+                    try { output(top, out); }
+                    catch(...) { error = std::current_exception(); }
+                });
+            }
+        }
+        catch(...) {
+            // A joinable thread can't be destroyed, so let the band being written finish first
+            waitForWriter();
+            for(GBitmap& b : bitmaps) free(b.pixels());
+            EndPerf();
+            throw;
+        }
+        waitForWriter();
+        for(GBitmap& b : bitmaps) free(b.pixels());
+        EndPerf();
+        if(error) std::rethrow_exception(error);
+        stats.numPixelsDamaged = dim.width * dim.height;
+
+        stats.secondsTaken = watch.elapsed() - waited;
+        EndAllocs(stats);
+        return stats;
+    }
+
+    /// @brief Render only the inverse depth of scene, 1 / distance in front of the camera, into invDepth, a row
+    /// major dim.width x dim.height plane with 0 where nothing was drawn. Values match the G-buffer's inverse
+    /// depth after RenderSceneTo, but only vertex positions are transformed, and nothing else is interpolated,
+    /// shadowed or lit, so it runs several times faster. The projector's G-buffer is left untouched.
+    RenderStatistic RenderDepth(const Scene& scene, GISize dim, std::vector<float>& invDepth) {
+        TRACE_SCOPE("Projector::RenderDepth");
+        BeginAllocs();
+        Stopwatch watch;
+        RenderStatistic stats{};
+        BeginPerf(stats);
+        invDepth.assign((size_t) dim.width * dim.height, 0.f);
+
+        mat4 view = scene.cam.getViewMatrix();
+        mat4 proj = scene.cam.getProjectionMatrix();
+        BuildDrawList(scene, view, proj, dim, stats, nullptr, nullptr, nullptr);
+        stats.phases.cull += watch.lap();
+        PerfLap(stats.perf.cull);
+
+        mat4 project_view = proj * view;
+        const Mesh* batchMesh = nullptr;
+        for(const DrawItem& item : _drawList) {
+            const Object& obj = scene.objects[item.obj];
+            const Mesh& mesh = *item.mesh;
+            int n = mesh.vertexCount();
+            if(&mesh != batchMesh) {
+                batchMesh = &mesh;
+                ++stats.numMeshBatches;
+                if(_depthVerts.size() < 3 * (size_t) n) _depthVerts.resize(3 * (size_t) n);
+            }
+
+            mat4 obj_transform = obj.getTransform();
+            mat4 obj_project = project_view * obj_transform;
+            mat4 localToCam = view * obj_transform;
+
+            // Screen position and 1 / z per vertex, in plain floats as vec3 allocates. Only the rows of
+            // localToCam that give z are needed.
+            float* xs = _depthVerts.data();
+            float* ys = xs + n;
+            float* inv_zs = ys + n;
+            float fw = (float) dim.width, fh = (float) dim.height;
+            for(int i = 0; i < n; ++i) {
+                const vec3& v = mesh.vertices[i];
+                float s = 1.f / std::abs(RowDot(obj_project, 3, v));
+                xs[i] = (RowDot(obj_project, 0, v) * s + 0.5f) * fw;
+                ys[i] = (RowDot(obj_project, 1, v) * s + 0.5f) * fh;
+                float z = RowDot(localToCam, 2, v) * (1.f / std::abs(RowDot(localToCam, 3, v)));
+                inv_zs[i] = -1.f / z;
+            }
+            stats.numVerticesTransformed += n;
+            stats.phases.vertexTransform += watch.lap();
+            PerfLap(stats.perf.vertexTransform);
+
+            // Backface cull as RasterizeScene does, drawing each triangle as soon as it's kept
+            for(int tri = 0; tri < mesh.indexCount(); tri += 3) {
+                int a = mesh.indices[tri], b = mesh.indices[tri + 1], c = mesh.indices[tri + 2];
+                float wind = (xs[b] - xs[a]) * (ys[c] - ys[a]) - (xs[c] - xs[a]) * (ys[b] - ys[a]);
+                if(!signbit(wind)) continue;
+
+                float tx[3] = {xs[a], xs[b], xs[c]};
+                float ty[3] = {ys[a], ys[b], ys[c]};
+                float tz[3] = {inv_zs[a], inv_zs[b], inv_zs[c]};
+                RasterCounts counts = GBuffer::DrawDepthTri<DepthCull::Back>(tx, ty, tz, invDepth.data(), dim);
+                stats.numRasterTests += counts.tested;
+                stats.numPixelsRasterized += counts.covered;
+                stats.numDepthPasses += counts.depthPassed;
+                ++stats.numTrisDrawn;
+            }
+            stats.numTrisTotal += mesh.indexCount() / 3;
+            stats.phases.raster += watch.lap();
+            PerfLap(stats.perf.raster);
+        }
+        EndPerf();
+        stats.numPixelsDamaged = dim.width * dim.height;
+
+        stats.secondsTaken = watch.elapsed();
+        EndAllocs(stats);
+        return stats;
+    }
 
-        _buffer = GBuffer(dim);
+    /// @brief Render scene, redrawing only what changed since the previous RenderIncremental call.
+    /// Objects flagged dirty are re-rasterized over both their old and new screen bounds, and only objects
+    /// overlapping that region are drawn again. Dirty lights only relight the pixels they could reach.
+    /// Falls back to a full render when the camera, output size, or number of objects or lights changed.
+    /// With shadows, lights whose shadows may have changed are relit wherever they reach.
+    /// Refits the scene BVH for dirty objects and clears all dirty flags.
+    RenderStatistic RenderIncremental(Scene& scene, GISize dim) {
+        TRACE_SCOPE("Projector::RenderIncremental");
+        _rendered = true;
+        BeginAllocs();
+        Stopwatch watch;
         RenderStatistic stats{};
+        BeginPerf(stats);
+
+        mat4 view = scene.cam.getViewMatrix();
+        mat4 proj = scene.cam.getProjectionMatrix();
+        int numObjects = scene.objects.size();
+        int numLights = scene.lights.size();
+
+        _dirty.clear();
+        for(int i = 0; i < numObjects; ++i) {
+            if(scene.objects[i].dirty) _dirty.push_back(i);
+        }
+        if(!_dirty.empty()) scene.bvh.refit(scene.objects, _dirty);
+
+        bool full = !_incrementalValid
+                 || dim.width != _buffer.width() || dim.height != _buffer.height()
+                 || !(view == _lastView) || !(proj == _lastProj)
+                 || _buffer.isCounting() != _settings.counters
+                 || (int) scene.screenBounds.size() != numObjects
+                 || (int) scene.lightScreenBounds.size() != numLights;
+
+        std::vector<int> reshadowed = UpdateShadows(scene, stats);
+
+        if(full) {
+            _buffer.setCounting(_settings.counters);
+            _buffer.reset(dim);
+            RasterizeScene(scene, _buffer, stats, nullptr, &scene.screenBounds);
+            PerfMark();
+            ShadeBuffer(scene.cam, scene.lights, _buffer, *bitmap, stats);
+            PerfLap(stats.perf.lighting);
+
+            scene.lightScreenBounds.resize(numLights);
+            for(int i = 0; i < numLights; ++i) scene.lightScreenBounds[i] = LightScreenBounds(scene.lights[i], view, proj, dim);
+            stats.numPixelsDamaged = dim.width * dim.height;
+        }
+        else {
+            // Geometry changed wherever a dirty object was or now is
+            GIRect geomDamage{0, 0, 0, 0};
+            for(int i : _dirty) {
+                geomDamage = Union(geomDamage, scene.screenBounds[i]);
+                geomDamage = Union(geomDamage, ProjectBounds(scene.bvh.objectBounds(i).transformed(view), proj, dim));
+            }
+
+            // Lighting changed there too, and wherever a dirty light did or now does reach
+            GIRect shadeDamage = geomDamage;
+            for(int i = 0; i < numLights; ++i) {
+                if(!scene.lights[i].dirty) continue;
+                GIRect bounds = LightScreenBounds(scene.lights[i], view, proj, dim);
+                shadeDamage = Union(shadeDamage, scene.lightScreenBounds[i]);
+                shadeDamage = Union(shadeDamage, bounds);
+                scene.lightScreenBounds[i] = bounds;
+            }
+
+            // So did shadows wherever their light reaches
+            for(int i : reshadowed) {
+                shadeDamage = Union(shadeDamage, scene.lightScreenBounds[i]);
+                shadeDamage = Union(shadeDamage, LightScreenBounds(scene.lights[i], view, proj, dim));
+            }
+
+            stats.numObjects = numObjects;
+            stats.numLights = numLights;
+            if(!geomDamage.isEmpty()) {
+                _buffer.clear(geomDamage);
+                RasterizeScene(scene, _buffer, stats, &geomDamage, &scene.screenBounds);
+            }
+            if(!shadeDamage.isEmpty()) {
+                PerfMark();
+                ShadeBuffer(scene.cam, scene.lights, _buffer, *bitmap, stats, &shadeDamage);
+                PerfLap(stats.perf.lighting);
+                stats.numPixelsDamaged = shadeDamage.width() * shadeDamage.height();
+            }
+            stats.fullRender = false;
+        }
+
+        if(_buffer.isCounting()) CollectCounterMaxima(_buffer, stats);
+        EndPerf();
+
+        for(Object& obj : scene.objects) obj.dirty = false;
+        for(Light& l : scene.lights) l.dirty = false;
+        _lastView = view;
+        _lastProj = proj;
+        _incrementalValid = true;
+
+        stats.secondsTaken = watch.elapsed();
+        EndAllocs(stats);
+        return stats;
+    }
 
-        mat4 project_view = scene.cam.getProjectionMatrix() * scene.cam.getViewMatrix();
-        for(const Object& obj : scene.objects) {
-            ++stats.numObjects;
+    /// @brief Geometry pass, culls, transforms and rasterizes scene objects into buffer.
+    /// Uses the projector's scratch state, so only one RasterizeScene may run at a time per Projector.
+    /// @param clip if given, only objects overlapping it are drawn and only pixels inside it are written
+    /// @param screenBounds if given, filled with every object's screen bounds, empty for culled objects
+    /// @param band if given, buffer holds only these rows of the image, and only objects overlapping them are
+    /// drawn. clip and screenBounds are in the whole image's pixels.
+    void RasterizeScene(const Scene& scene, GBuffer& buffer, RenderStatistic& stats,
+                        const GIRect* clip = nullptr, std::vector<GIRect>* screenBounds = nullptr,
+                        const Band* band = nullptr) {
+        TRACE_SCOPE("Projector::RasterizeScene");
+        GISize dim{buffer.width(), band ? band->imageHeight : buffer.height()};
+        int top = band ? band->top : 0;
+        GIRect rows{0, top, dim.width, top + buffer.height()};
+        GIRect bufferClip = clip ? GIRect::LTRB(clip->left, clip->top - top, clip->right, clip->bottom - top) : rows;
+        Stopwatch watch;
+
+        mat4 view = scene.cam.getViewMatrix();
+        mat4 proj = scene.cam.getProjectionMatrix();
+        BuildDrawList(scene, view, proj, dim, stats, clip, screenBounds, band ? &rows : nullptr);
+        stats.phases.cull += watch.lap();
+        PerfLap(stats.perf.cull);
+
+        mat4 project_view = proj * view;
+        vec2 canv_dim = {(float) dim.width, (float) dim.height};
+        const Mesh* batchMesh = nullptr;
+        bool approxNormals = _settings.math == MathMode::Approx;
+
+        for(const DrawItem& item : _drawList) {
+            const Object& obj = scene.objects[item.obj];
+            const Mesh& mesh = *item.mesh;
+
+            if(&mesh != batchMesh) {
+                // Per mesh setup, scratch buffers only grow so their vectors are reused across instances
+                batchMesh = &mesh;
+                ++stats.numMeshBatches;
+                if((int) _projVerts.size() < mesh.vertexCount()) _projVerts.resize(mesh.vertexCount());
+                if((int) _triIndices.size() < mesh.indexCount()) {
+                    _triIndices.resize(mesh.indexCount());
+                    _triNorms.resize(mesh.indexCount());
+                    _triVerts.resize(mesh.indexCount());
+                }
+            }
 
             mat4 obj_transform = obj.getTransform();
             mat4 obj_project = project_view * obj_transform;
@@ -46,92 +512,81 @@ public:
             //mat3 normal_transform = mat4::upperLeft(obj_transform).invert().transpose();
             mat4 normal_transform = obj_transform.invert().transpose();
             normal_transform[12] = 0.f; normal_transform[13] = 0.f; normal_transform[14] = 0.f; 
-            vec2 canv_dim = {(float) dim.width, (float) dim.height};
 
             // Project all vertices to 2D
-            std::vector<vec2> proj_verts;
-            proj_verts.reserve(obj.vertexCount());
+            std::vector<vec2>& proj_verts = _projVerts;
 
-            for(int i = 0; i < obj.vertexCount(); ++i) {
-                vec3 proj = obj_project * obj.vertices[i];
+            for(int i = 0; i < mesh.vertexCount(); ++i) {
+                vec3 proj = obj_project * mesh.vertices[i];
 
                 // recenter and rescale
-                vec2 proj_centered = {proj.x() + 0.5f, proj.y() + 0.5f};
+                vec2& proj_centered = proj_verts[i];
+                proj_centered[0] = proj.x() + 0.5f;
+                proj_centered[1] = proj.y() + 0.5f;
                 proj_centered *= canv_dim;
-
-                proj_verts.push_back(proj_centered);
+                proj_centered[1] -= (float) top;
             }
+            stats.numVerticesTransformed += mesh.vertexCount();
+            stats.phases.vertexTransform += watch.lap();
+            PerfLap(stats.perf.vertexTransform);
 
             // Backface Culling
             // CCW indicates we are looking at backside of tri, so we do "backface culling"
-            std::vector<int> indices;
-            std::vector<vec3> norms;
-            std::vector<vec3> vertices;
-            indices.reserve(obj.indexCount());
-            norms.reserve(obj.indexCount());
-            vertices.reserve(obj.indexCount());
+            std::vector<int>& indices = _triIndices;
+            std::vector<vec3>& norms = _triNorms;
+            std::vector<vec3>& vertices = _triVerts;
             int count = 0;
 
-            mat4 localToCam = scene.cam.getViewMatrix() * obj_transform;
+            mat4 localToCam = view * obj_transform;
             
-            if(obj.smooth){
-                for(int tri = 0; tri < obj.indexCount(); tri += 3) {
-                    int a = obj.indices[tri];
-                    int b = obj.indices[tri + 1];
-                    int c = obj.indices[tri + 2];
-                    vec2 ab = proj_verts[b] - proj_verts[a];
-                    vec2 ac = proj_verts[c] - proj_verts[a];
-                    float wind = ab.x() * ac.y() - ac.x() * ab.y();
-
-                    if(signbit(wind)) { // If CW, keep tri
-                        indices.push_back(a);
-                        indices.push_back(b);
-                        indices.push_back(c);
+            for(int tri = 0; tri < mesh.indexCount(); tri += 3) {
+                int a = mesh.indices[tri];
+                int b = mesh.indices[tri + 1];
+                int c = mesh.indices[tri + 2];
+                vec2 ab = proj_verts[b] - proj_verts[a];
+                vec2 ac = proj_verts[c] - proj_verts[a];
+                float wind = ab.x() * ac.y() - ac.x() * ab.y();
 
-                        // TODO: perform this step during projection so that norms aren't double calculated
-                        norms.push_back(vec3::normalize(normal_transform * obj.normals[a]));
-                        norms.push_back(vec3::normalize(normal_transform * obj.normals[b]));
-                        norms.push_back(vec3::normalize(normal_transform * obj.normals[c]));
-
-                        vertices.push_back(localToCam * obj.vertices[a]);
-                        vertices.push_back(localToCam * obj.vertices[b]);
-                        vertices.push_back(localToCam * obj.vertices[c]);
+                if(signbit(wind)) { // If CW, keep tri
+                    int n = count * 3;
+                    indices[n] = a;
+                    indices[n + 1] = b;
+                    indices[n + 2] = c;
 
-                        ++count;
+                    if(obj.smooth) {
+                        // TODO: perform this step during projection so that norms aren't double calculated
+                        if(approxNormals) {
+                            norms[n]     = normal_transform * mesh.normals[a];
+                            norms[n + 1] = normal_transform * mesh.normals[b];
+                            norms[n + 2] = normal_transform * mesh.normals[c];
+                            for(int k = n; k < n + 3; ++k) FastMath::normalize(norms[k]);
+                        }
+                        else {
+                            norms[n]     = vec3::normalize(normal_transform * mesh.normals[a]);
+                            norms[n + 1] = vec3::normalize(normal_transform * mesh.normals[b]);
+                            norms[n + 2] = vec3::normalize(normal_transform * mesh.normals[c]);
+                        }
                     }
-
-                    ++stats.numTrisTotal;
-                }
-            }
-            else { // flat shading, calculate face norms
-                for(int tri = 0; tri < obj.indexCount(); tri += 3) {
-                    int a = obj.indices[tri];
-                    int b = obj.indices[tri + 1];
-                    int c = obj.indices[tri + 2];
-                    vec2 ab = proj_verts[b] - proj_verts[a];
-                    vec2 ac = proj_verts[c] - proj_verts[a];
-                    float wind = ab.x() * ac.y() - ac.x() * ab.y();
-
-                    if(signbit(wind)) { // If CW, keep tri
-                        indices.push_back(a);
-                        indices.push_back(b);
-                        indices.push_back(c);
-                        
-                        vec3 norm = normal_transform * vec3::cross(obj.vertices[c] - obj.vertices[a], obj.vertices[b] - obj.vertices[a]);
-                        norm.normalize();
-                        norms.insert(norms.end(), {norm, norm, norm});
-
-                        vertices.push_back(localToCam * obj.vertices[a]);
-                        vertices.push_back(localToCam * obj.vertices[b]);
-                        vertices.push_back(localToCam * obj.vertices[c]);
-                        
-                        ++count;
+                    else { // flat shading, face norms are precomputed by the mesh
+                        vec3 norm = normal_transform * mesh.faceNormals[tri / 3];
+                        if(approxNormals) FastMath::normalize(norm);
+                        else norm.normalize();
+                        norms[n] = norm; norms[n + 1] = norm; norms[n + 2] = norm;
                     }
 
-                    ++stats.numTrisTotal;
+                    vertices[n]     = localToCam * mesh.vertices[a];
+                    vertices[n + 1] = localToCam * mesh.vertices[b];
+                    vertices[n + 2] = localToCam * mesh.vertices[c];
+
+                    ++count;
                 }
+
+                ++stats.numTrisTotal;
             }
 
+            stats.phases.triSetup += watch.lap();
+            PerfLap(stats.perf.triSetup);
+
             // NOTE: the normals and camera vertices are calculated alongside indices, i.e. a single vertex has format
             // proj_verts[indices[n]] <-> norms[n] <-> vertices[n]
 
@@ -142,11 +597,21 @@ public:
             */
            
             // Rasterize triangle, and then scanrow its pixels, using above principle
+            TRACE_SCOPE("GBuffer::drawTri batch");
             int n = 0;
+            GColor cols[3];
             for(int i = 0; i < count; ++i) {
-                _buffer.drawTri(&indices[n], proj_verts, &vertices[n], &norms[n], obj.colors.value(), obj.shininess);
+                cols[0] = obj.vertexColor(indices[n]);
+                cols[1] = obj.vertexColor(indices[n + 1]);
+                cols[2] = obj.vertexColor(indices[n + 2]);
+                RasterCounts counts = buffer.drawTri(&indices[n], proj_verts, &vertices[n], &norms[n], cols, obj.shininess, clip ? &bufferClip : nullptr);
+                stats.numRasterTests += counts.tested;
+                stats.numPixelsRasterized += counts.covered;
+                stats.numDepthPasses += counts.depthPassed;
                 n += 3;
             }
+            stats.phases.raster += watch.lap();
+            PerfLap(stats.perf.raster);
 
             /*
             Step 1: loop through each triangle
@@ -173,41 +638,205 @@ public:
 
             stats.numTrisDrawn += count;
         }
+    }
 
-        // TODO: deferred rendering to screen
-        stats.numLights = scene.lights.size();
-        vec3 camPos = scene.cam.getPos();
-        for(int y = 0; y < _dim.height; ++y) {
-            for(int x = 0; x < _dim.width; ++x) {
-                
-                vec3 col{0.f, 0.f, 0.f};
-                PixelData data = _buffer.getPixel(x, y);
+    /// @brief Lighting pass, resolves buffer into out. Rows are shaded in parallel.
+    /// Doesn't touch projector state, so it may run alongside RasterizeScene on a different buffer.
+    /// @param region if given, only pixels inside it are shaded, the rest of out is left untouched
+    /// With counting enabled on buffer, also records the lights in range of each pixel.
+    /// @param shadows what to test shadows against, the projector's own (see UpdateShadows) if not given
+    void ShadeBuffer(const Camera& cam, const std::vector<Light>& lights, GBuffer& buffer,
+                     GBitmap& out, RenderStatistic& stats, const GIRect* region = nullptr,
+                     const ShadowCasters* shadows = nullptr) const {
+        if(out.width() != buffer.width() || out.height() != buffer.height())
+            throw CustomException("Buffer and bitmap dimensions don't match.");
+
+        TRACE_SCOPE("Projector::ShadeBuffer");
+        GIRect area = region ? *region : GIRect::WH(buffer.width(), buffer.height());
+        stats.numLights = lights.size();
+        vec3 camPos = cam.getPos();
+        LightArrays lightArrays(lights);
+        mat4 invView = cam.getViewMatrix().invert();
+        int numShadowed = lightArrays.point.count() + lightArrays.directional.count();
+        if(!shadows) shadows = &_shadows;
+        const TwoLevelBVH* occluders = nullptr;
+        if(shadows->mode == ShadowMode::RayTraced && !shadows->occluders.empty()) occluders = &shadows->occluders;
+        std::vector<const ShadowMap*> shadowMaps; // per point light, null where it has none
+        if(shadows->mode == ShadowMode::Maps) {
+            for(size_t i = 0; i < lights.size(); ++i) {
+                if(lights[i].type != LightType::Point) continue;
+                bool has = i < shadows->maps.size() && shadows->maps[i].valid;
+                shadowMaps.push_back(has ? &shadows->maps[i] : nullptr);
+            }
+        }
+        bool shadowing = occluders || !shadowMaps.empty();
+
+        // Pixels are lit and written 8 at a time, so output conversion is part of the lighting phase
+        Stopwatch pass;
+        int64_t lightEvals = 0, lightsInRange = 0, shadowRays = 0;
+        bool counting = buffer.isCounting();
+        bool approx = _settings.math == MathMode::Approx;
+        std::mutex statsLock;
 
-                if(data.specular < 0.f) { // Rendering emitters
-                    *(bitmap->getAddr(x, y)) = toPremul(data.albedo);
-                    continue;
+        ParallelFor(area.top, area.bottom, 8, _settings.threads, [&](int y0, int y1) {
+            TRACE_SCOPE("shade rows");
+            int64_t evals = 0, inRange = 0, rays = 0;
+            std::vector<f8> visible(shadowing ? numShadowed : 0);
+
+            for(int y = y0; y < y1; ++y) {
+                GBufferRow row = buffer.getRow(y);
+                GPixel* dst = out.getAddr(0, y);
+                for(int x = area.left; x < area.right; x += 8) {
+                    int n = std::min(8, area.right - x);
+                    // Shadows and shading both work in world space, like the lights
+                    f8 world[3];
+                    WorldPositions(invView, row, x, n, world);
+                    const f8* visibility = shadowing ? visible.data() : nullptr;
+                    if(occluders) rays += TraceShadows(*occluders, lightArrays, row, x, n, world, visible.data());
+                    else if(shadowing) SampleShadowMaps(shadowMaps, lightArrays, row, x, n, world, visible.data());
+                    if(approx) LightingKernels::Shade<MathMode::Approx>(lightArrays, row, x, n, world, camPos, dst + x, visibility);
+                    else LightingKernels::Shade<MathMode::Exact>(lightArrays, row, x, n, world, camPos, dst + x, visibility);
                 }
 
-                for(Light l : scene.lights) {
-                    col += l.calcLight(data.position, camPos, data.normal, data.albedo, data.specular);
+                for(int x = area.left; x < area.right; ++x) {
+                    if(row.depth[x] == FLT_MAX || row.specular[x] < 0.f) continue; // empty pixels and emitters aren't lit
+                    evals += lights.size();
+
+                    if(counting) {
+                        vec3 p = invView * vec3{row.px[x], row.py[x], row.pz[x]};
+                        int n = 0;
+                        for(const Light& l : lights) n += l.inRange(p);
+                        buffer.setLightCount(x, y, n);
+                        inRange += n;
+                    }
                 }
+            }
+
+            std::lock_guard<std::mutex> lock(statsLock);
+            lightEvals += evals;
+            lightsInRange += inRange;
+            shadowRays += rays;
+        });
 
-                col[0] = std::clamp(col[0], 0.f, 1.f);
-                col[1] = std::clamp(col[1], 0.f, 1.f);
-                col[2] = std::clamp(col[2], 0.f, 1.f);
+        stats.phases.lighting += pass.elapsed();
+        stats.numLightEvals += lightEvals;
+        stats.numLightsInRange += lightsInRange;
+        stats.numRays += shadowRays;
+    }
+
+    /// @brief Bring the projector's own shadow casters up to date with scene, see the overload below.
+    /// RenderSceneTo and RenderIncremental call this themselves.
+    std::vector<int> UpdateShadows(const Scene& scene, RenderStatistic& stats) { return UpdateShadows(scene, _shadows, stats); }
+
+    /// @brief Bring shadows up to date with scene for RenderSettings::shadows. Only lights within range of an
+    /// object that moved, appeared or left since the last update with the same shadows are affected. The
+    /// occluders' top level is refit if objects only moved, a shadow map only redrawn when its light is affected,
+    /// moved, or changed range. Emitters are left out, as they mark where lights are.
+    /// @return indices into scene.lights of the lights whose shadows may have changed
+    std::vector<int> UpdateShadows(const Scene& scene, ShadowCasters& shadows, RenderStatistic& stats) const {
+        TRACE_SCOPE("Projector::UpdateShadows");
+        std::vector<int> affected;
+        if(_settings.shadows == ShadowMode::None) {
+            shadows.mode = ShadowMode::None;
+            return affected;
+        }
+        const std::vector<Light>& lights = scene.lights;
 
-                *(bitmap->getAddr(x, y)) = toPremul(col);
+        // Where objects that changed since the last update were and are now
+        std::vector<AABB> moved;
+        bool spheres = _settings.shadows == ShadowMode::RayTraced && _settings.analyticSpheres;
+        bool allMoved = shadows.mode != _settings.shadows || shadows.spheres != spheres
+                     || scene.objects.size() != shadows.casters.size();
+        shadows.mode = _settings.shadows;
+        shadows.spheres = spheres;
+        shadows.casters.resize(scene.objects.size());
+        for(size_t o = 0; o < scene.objects.size(); ++o) {
+            const Object& obj = scene.objects[o];
+            ShadowCasters::Caster now{obj.getTransform(), obj.mesh.get(), obj.isEmitter(), obj.getWorldBounds()};
+            ShadowCasters::Caster& was = shadows.casters[o];
+            if(allMoved || !(now.transform == was.transform) || now.mesh != was.mesh || now.emitter != was.emitter) {
+                if(!was.emitter) moved.push_back(was.bounds);
+                if(!now.emitter) moved.push_back(now.bounds);
+                was = now;
             }
         }
-        
 
-        stats.ticksTaken = double(clock() - now);
-        stats.secondsTaken = stats.ticksTaken / double(CLOCKS_PER_SEC);
+        for(size_t i = 0; i < lights.size(); ++i) {
+            const Light& l = lights[i];
+            bool changed = allMoved;
+            // Shadow maps only cover point lights
+            if(l.type == LightType::Directional) changed |= _settings.shadows == ShadowMode::RayTraced && !moved.empty();
+            else if(l.type == LightType::Point) {
+                for(size_t m = 0; m < moved.size() && !changed; ++m) changed = moved[m].overlapsSphere(l.v, l.effectiveDistance);
+            }
+            if(changed) affected.push_back(i);
+        }
 
-        return stats;
+        if(_settings.shadows == ShadowMode::RayTraced) {
+            if(allMoved || !moved.empty()) {
+                Stopwatch watch;
+                shadows.occluders.update(scene, _settings.threads, spheres);
+                stats.phases.accelBuild += watch.elapsed();
+            }
+            return affected;
+        }
+
+        // Shadow maps
+        Stopwatch watch;
+        shadows.maps.resize(lights.size());
+        std::vector<int> stale;
+        for(size_t i = 0, a = 0; i < lights.size(); ++i) {
+            const Light& l = lights[i];
+            ShadowMap& map = shadows.maps[i];
+            bool isAffected = a < affected.size() && affected[a] == (int) i;
+            if(isAffected) ++a;
+            if(l.type != LightType::Point) {
+                map.valid = false;
+                continue;
+            }
+            if(isAffected || !map.matches(l.v, l.effectiveDistance, _settings.shadowMapSize)) stale.push_back(i);
+        }
+        if(stale.empty()) return affected;
+
+        // Only triangles that reach into a light's range are drawn into its map
+        shadows.triangles.gather(scene, _settings.threads);
+        const std::vector<RTTriangle>& tris = shadows.triangles.tris;
+        std::vector<std::vector<int>> candidates(stale.size());
+        ParallelFor(0, (int) stale.size(), 1, _settings.threads, [&](int begin, int end) {
+            for(int s = begin; s < end; ++s) {
+                const Light& l = lights[stale[s]];
+                shadows.maps[stale[s]].reset(l.v, l.effectiveDistance, _settings.shadowMapSize);
+                for(int t = 0; t < (int) tris.size(); ++t) {
+                    AABB b;
+                    b.grow(tris[t].v0[0], tris[t].v0[1], tris[t].v0[2]);
+                    b.grow(tris[t].v0[0] + tris[t].e1[0], tris[t].v0[1] + tris[t].e1[1], tris[t].v0[2] + tris[t].e1[2]);
+                    b.grow(tris[t].v0[0] + tris[t].e2[0], tris[t].v0[1] + tris[t].e2[1], tris[t].v0[2] + tris[t].e2[2]);
+                    if(b.overlapsSphere(l.v, l.effectiveDistance)) candidates[s].push_back(t);
+                }
+            }
+        });
+        ParallelFor(0, (int) stale.size() * ShadowMap::NumFaces, 1, _settings.threads, [&](int begin, int end) {
+            TRACE_SCOPE("shadow map faces");
+            for(int j = begin; j < end; ++j) {
+                int s = j / ShadowMap::NumFaces;
+                shadows.maps[stale[s]].renderFace(j % ShadowMap::NumFaces, tris, candidates[s]);
+            }
+        });
+        for(int i : stale) shadows.maps[i].valid = true;
+
+        // A moved light's map changed too
+        std::vector<int> all;
+        std::set_union(affected.begin(), affected.end(), stale.begin(), stale.end(), std::back_inserter(all));
+        stats.numShadowMapsDrawn += stale.size();
+        stats.phases.shadowMaps += watch.elapsed();
+        return all;
     }
 
-    enum BufferType {Depth, Inv_Depth, Position, Albedo, Normal, Specular};
+    void setSettings(const RenderSettings& settings) { _settings = settings; }
+    const RenderSettings& getSettings() const { return _settings; }
+
+    /// @brief Overdraw, RasterTests and LightCount are heatmaps of per pixel cost, see RenderSettings::counters
+    enum BufferType {Depth, Inv_Depth, Position, Albedo, Normal, Specular, Overdraw, RasterTests, LightCount};
 
     void ShowBuffer(BufferType type, GBitmap &bitmap, const Scene &scene) {
         if(!_rendered) throw CustomException("Nothing has been rendered yet.");
@@ -234,6 +863,15 @@ public:
             case BufferType::Position:
                 ShowPositionBuffer(bitmap);
                 break;
+            case BufferType::Overdraw:
+                ShowCountBuffer(bitmap, _buffer.getOverdrawBuffer());
+                break;
+            case BufferType::RasterTests:
+                ShowCountBuffer(bitmap, _buffer.getRasterTestBuffer());
+                break;
+            case BufferType::LightCount:
+                ShowCountBuffer(bitmap, _buffer.getLightCountBuffer());
+                break;
         }
     }
 
@@ -242,15 +880,318 @@ public:
     const std::vector<std::vector<vec3>> getPositionBuffer() { if(!_rendered) throw CustomException("Nothing rendered."); return _buffer.getPositionBuffer(); }
     const std::vector<std::vector<vec3>> getAlbedoBuffer() { if(!_rendered) throw CustomException("Nothing rendered."); return _buffer.getAlbedoBuffer(); }
     const std::vector<std::vector<vec3>> getNormalBuffer() { if(!_rendered) throw CustomException("Nothing rendered."); return _buffer.getNormalBuffer(); }
+    // Cost counters, empty unless rendered with RenderSettings::counters
+    const std::vector<std::vector<int>> getRasterTestBuffer() { if(!_rendered) throw CustomException("Nothing rendered."); return _buffer.getRasterTestBuffer(); }
+    const std::vector<std::vector<int>> getOverdrawBuffer() { if(!_rendered) throw CustomException("Nothing rendered."); return _buffer.getOverdrawBuffer(); }
+    const std::vector<std::vector<int>> getLightCountBuffer() { if(!_rendered) throw CustomException("Nothing rendered."); return _buffer.getLightCountBuffer(); }
 
 private:
     GISize _dim;
     GBuffer _buffer;
     bool _rendered;
+    RenderSettings _settings;
+
+    // State of the last incremental render, _buffer and bitmap hold its result while valid
+    bool _incrementalValid;
+    mat4 _lastView, _lastProj;
+    std::vector<int> _dirty;
+
+    // Hardware counters, opened on first use. Only read while _perfActive, i.e. inside a
+    // RenderSceneTo or RenderIncremental call, since they count the thread that opened them
+    // (and the ParallelFor workers, whoever they're working for).
+    std::unique_ptr<PerfCounters> _perf;
+    bool _perfActive = false;
+    PerfValues _perfLast;
+
+    // Allocation tracking snapshots, reused so taking them doesn't allocate
+    AllocCounts _allocsBefore;
+    std::vector<AllocSite> _allocSitesBefore, _allocSitesAfter;
+
+    SceneBVH _bvh;             // fallback when scene's BVH is stale
+
+    ShadowCasters _shadows;
+    static constexpr float ShadowBias = 1e-3f; // world units shadow rays start off the surface, along its normal
+    std::vector<int> _visible; // objects surviving culling, reused between frames
+
+    struct DrawItem {
+        int obj;
+        const Mesh* mesh; // level of detail chosen for this frame
+    };
+    std::vector<DrawItem> _drawList;
+
+    // Per object scratch, sized for the largest mesh seen so far
+    std::vector<vec2> _projVerts;
+    std::vector<int> _triIndices;
+    std::vector<vec3> _triNorms;
+    std::vector<vec3> _triVerts;
+    std::vector<float> _depthVerts; // RenderDepth's screen x, screen y and 1 / z planes
 
     GCanvas* canvas;
     GBitmap* bitmap;
 
+    static GIRect Union(const GIRect& a, const GIRect& b) {
+        if(a.isEmpty()) return b;
+        if(b.isEmpty()) return a;
+        return {std::min(a.left, b.left), std::min(a.top, b.top), std::max(a.right, b.right), std::max(a.bottom, b.bottom)};
+    }
+
+    static bool Overlaps(const GIRect& a, const GIRect& b) {
+        return a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+    }
+
+    /// @brief Row r of m times (v, 1), summed in the order mat4 * vec3 sums it so results match bit for bit
+    static float RowDot(const mat4& m, size_t r, const vec3& v) {
+        float sum = 0.f;
+        sum += m[{r, 0}] * v[0];
+        sum += m[{r, 1}] * v[1];
+        sum += m[{r, 2}] * v[2];
+        sum += m[{r, 3}];
+        return sum;
+    }
+
+    /// @brief Frustum cull scene and fill _drawList with the objects left, at the mesh level each is drawn at,
+    /// batched by mesh. See RasterizeScene for clip and screenBounds.
+    /// @param rows if given, only objects overlapping these rows of the image are kept
+    void BuildDrawList(const Scene& scene, const mat4& view, const mat4& proj, GISize dim, RenderStatistic& stats,
+                       const GIRect* clip, std::vector<GIRect>* screenBounds, const GIRect* rows) {
+        // Frustum cull through the scene's BVH, building a temporary one if objects were added or removed since
+        // it was built. Moved objects are refit where they're moved, see Scene::markObjectDirty.
+        const SceneBVH* bvh = &scene.bvh;
+        if(scene.bvh.objectCount() != (int) scene.objects.size()) {
+            _bvh.build(scene.objects);
+            bvh = &_bvh;
+        }
+        _visible.clear();
+        bvh->cullFrustum(scene.cam.getFrustum(), scene.cam.getPos(), _visible);
+
+        stats.numObjects = scene.objects.size();
+        stats.numObjectsCulled = stats.numObjects - _visible.size();
+
+        // Pick mesh level per object
+        if(screenBounds) screenBounds->assign(scene.objects.size(), GIRect{0, 0, 0, 0});
+        _drawList.clear();
+        for(int objIdx : _visible) {
+            if(clip || screenBounds || rows) {
+                GIRect bounds = ProjectBounds(bvh->objectBounds(objIdx).transformed(view), proj, dim);
+                if(screenBounds) (*screenBounds)[objIdx] = bounds;
+                if(clip && !Overlaps(bounds, *clip)) continue;
+                if(rows && !Overlaps(bounds, *rows)) continue;
+            }
+            const Object& obj = scene.objects[objIdx];
+            const Mesh* mesh = selectLOD(obj, bvh->objectBounds(objIdx), view, proj, dim);
+            if(mesh != obj.mesh.get()) ++stats.numObjectsLODReduced;
+            _drawList.push_back({objIdx, mesh});
+        }
+
+        // Batch instances of the same mesh together, keeping front-to-back order within a batch
+        std::stable_sort(_drawList.begin(), _drawList.end(), [](const DrawItem& a, const DrawItem& b) {
+            return a.mesh < b.mesh;
+        });
+    }
+
+    /// @brief Conservative pixel bounds of a camera space box, the whole screen if it reaches behind the camera
+    static GIRect ProjectBounds(const AABB& bounds, const mat4& proj, GISize dim) {
+        if(bounds.empty()) return {0, 0, 0, 0};
+        GIRect screen = GIRect::WH(dim.width, dim.height);
+        if(bounds.max[2] >= -1e-4f) return screen;
+
+        // Same mapping as the geometry pass, x * P00 / |P32 * z| recentered and scaled to pixels
+        float sx = proj[{0, 0}] * dim.width, sy = proj[{1, 1}] * dim.height;
+        float h = std::abs(proj[{3, 2}]);
+        float left = FLT_MAX, top = FLT_MAX, right = -FLT_MAX, bottom = -FLT_MAX;
+        for(int i = 0; i < 8; ++i) {
+            float x = (i & 1) ? bounds.max[0] : bounds.min[0];
+            float y = (i & 2) ? bounds.max[1] : bounds.min[1];
+            float z = (i & 4) ? bounds.max[2] : bounds.min[2];
+            float inv = 1.f / (h * -z);
+            float px = x * sx * inv + 0.5f * dim.width;
+            float py = y * sy * inv + 0.5f * dim.height;
+            left = std::min(left, px); right = std::max(right, px);
+            top = std::min(top, py);   bottom = std::max(bottom, py);
+        }
+
+        // Pad a pixel for the rasterizer rounding its bounds
+        return {std::max(screen.left, (int) std::floor(left) - 1), std::max(screen.top, (int) std::floor(top) - 1),
+                std::min(screen.right, (int) std::ceil(right) + 1), std::min(screen.bottom, (int) std::ceil(bottom) + 1)};
+    }
+
+    /// @brief Pixels a light could contribute to, its range projected as a sphere around the light's
+    /// camera space position. Directional and ambient lights reach every pixel.
+    static GIRect LightScreenBounds(const Light& light, const mat4& view, const mat4& proj, GISize dim) {
+        if(light.type != LightType::Point) return GIRect::WH(dim.width, dim.height);
+        AABB range;
+        vec3 c = view * light.v;
+        float r = light.effectiveDistance;
+        range.grow(c.x() - r, c.y() - r, c.z() - r);
+        range.grow(c.x() + r, c.y() + r, c.z() + r);
+        return ProjectBounds(range, proj, dim);
+    }
+
+    void BeginAllocs() {
+        if(!AllocTracker::IsEnabled()) return;
+        AllocTracker::Sites(_allocSitesBefore);
+        AllocTracker::ResetPeak();
+        _allocsBefore = AllocTracker::Counts();
+    }
+
+    void EndAllocs(RenderStatistic& stats) {
+        stats.allocs.peakResidentBytes = AllocTracker::PeakResidentBytes();
+        if(!AllocTracker::IsEnabled()) return;
+
+        AllocCounts after = AllocTracker::Counts();
+        stats.allocs.peakHeapBytes = AllocTracker::PeakBytes();
+        AllocTracker::Sites(_allocSitesAfter);
+
+        stats.allocs.tracked = true;
+        stats.allocs.allocations = after.allocations - _allocsBefore.allocations;
+        stats.allocs.frees = after.frees - _allocsBefore.frees;
+        stats.allocs.bytes = after.bytes - _allocsBefore.bytes;
+        stats.allocs.topSites = AllocTracker::TopSites(_allocSitesBefore, _allocSitesAfter, 10);
+    }
+
+    void BeginPerf(RenderStatistic& stats) {
+        if(!_settings.perfCounters) return;
+        if(!_perf) _perf = std::make_unique<PerfCounters>();
+        stats.perf.available = _perf->available();
+        stats.perf.unavailableReason = _perf->error();
+        _perfActive = _perf->available();
+        PerfMark();
+    }
+
+    void EndPerf() { _perfActive = false; }
+
+    /// @brief Start attributing counts from here
+    void PerfMark() {
+        if(_perfActive) _perfLast = _perf->read();
+    }
+
+    /// @brief Attribute counts since the last mark or lap to phase
+    void PerfLap(PerfValues& phase) {
+        if(!_perfActive) return;
+        PerfValues now = _perf->read();
+        phase += now - _perfLast;
+        _perfLast = now;
+    }
+
+    /// @brief Mask of the first n lanes from x holding a surface that gets lit, not empty or an emitter
+    static int LitSurfaces(const GBufferRow& row, int x, int n) {
+        int surface = 0;
+        for(int i = 0; i < n; ++i) {
+            if(row.depth[x + i] != FLT_MAX && row.specular[x + i] >= 0.f) surface |= 1 << i;
+        }
+        return surface;
+    }
+
+    /// @brief World space positions of n <= 8 pixels of row starting at x. The G-buffer holds camera space ones.
+    static void WorldPositions(const mat4& invView, const GBufferRow& row, int x, int n, f8 p[3]) {
+        f8 cx = f8::LoadPartial(row.px + x, n), cy = f8::LoadPartial(row.py + x, n), cz = f8::LoadPartial(row.pz + x, n);
+        for(size_t a = 0; a < 3; ++a) {
+            p[a] = f8(invView[{a, 0}]) * cx + f8(invView[{a, 1}]) * cy + f8(invView[{a, 2}]) * cz + f8(invView[{a, 3}]);
+        }
+    }
+
+    /// @brief Trace shadow rays for n <= 8 pixels of row starting at x, setting visible[i] to 1 in the lanes
+    /// light i reaches and 0 elsewhere, point lights first, then directional. Lanes without a lit surface or out
+    /// of a point light's range trace nothing and count as lit. Each light's rays go as one packet: point light
+    /// rays are traced from the light towards the pixels so they share an origin, directional ones towards the light.
+    /// @return number of rays traced
+    static int64_t TraceShadows(const TwoLevelBVH& occluders, const LightArrays& lights,
+                                const GBufferRow& row, int x, int n, const f8 world[3], f8* visible) {
+        int numLights = lights.point.count() + lights.directional.count();
+        for(int i = 0; i < numLights; ++i) visible[i] = f8(1.f);
+        int surface = LitSurfaces(row, x, n);
+        if(!surface) return 0;
+
+        // Start rays slightly off the surface so they can't hit it
+        f8 p[3];
+        const float* normal[3] = {row.nx, row.ny, row.nz};
+        for(int a = 0; a < 3; ++a) p[a] = world[a] + f8::LoadPartial(normal[a] + x, n) * f8(ShadowBias);
+
+        int64_t rays = 0;
+        RayPacket packet;
+        const LightArrays::PointLights& P = lights.point;
+        for(int i = 0; i < P.count(); ++i) {
+            packet.ox = f8(P.x[i]); packet.oy = f8(P.y[i]); packet.oz = f8(P.z[i]);
+            packet.dx = p[0] - packet.ox; packet.dy = p[1] - packet.oy; packet.dz = p[2] - packet.oz;
+            packet.tmax = f8(1.f);
+            packet.sharedOrigin = true;
+            f8 d2 = packet.dx * packet.dx + packet.dy * packet.dy + packet.dz * packet.dz;
+            packet.active = MoveMask(d2 <= f8(P.range[i] * P.range[i])) & surface;
+            if(!packet.active) continue;
+            for(int l = 0; l < 8; ++l) rays += packet.active >> l & 1;
+            visible[i] = Select(f8::FromMask(occluders.occluded(packet)), 0.f, 1.f);
+        }
+
+        const LightArrays::DirectionalLights& D = lights.directional;
+        for(int i = 0; i < D.count(); ++i) {
+            packet.ox = p[0]; packet.oy = p[1]; packet.oz = p[2];
+            packet.dx = f8(D.x[i]); packet.dy = f8(D.y[i]); packet.dz = f8(D.z[i]);
+            packet.tmax = f8(FLT_MAX);
+            packet.sharedOrigin = false;
+            packet.active = surface;
+            for(int l = 0; l < 8; ++l) rays += surface >> l & 1;
+            visible[P.count() + i] = Select(f8::FromMask(occluders.occluded(packet)), 0.f, 1.f);
+        }
+        return rays;
+    }
+
+    /// @brief Look up n <= 8 pixels of row starting at x in the point lights' shadow maps, setting visible[i]
+    /// to the fraction of point light i reaching each lane, and 1 for directional lights, which have none
+    static void SampleShadowMaps(const std::vector<const ShadowMap*>& maps, const LightArrays& lights,
+                                 const GBufferRow& row, int x, int n, const f8 world[3], f8* visible) {
+        int numLights = lights.point.count() + lights.directional.count();
+        for(int i = 0; i < numLights; ++i) visible[i] = f8(1.f);
+        int surface = LitSurfaces(row, x, n);
+        if(!surface) return;
+
+        float p[3][8];
+        for(int a = 0; a < 3; ++a) world[a].store(p[a]);
+
+        for(int i = 0; i < lights.point.count(); ++i) {
+            const ShadowMap* map = maps[i];
+            if(!map) continue;
+            float lanes[8];
+            for(int l = 0; l < 8; ++l) {
+                lanes[l] = 1.f;
+                if(!(surface >> l & 1)) continue;
+                // Offset along the normal by about a texel, which grows with distance from the light
+                float d = std::sqrt((p[0][l] - map->pos[0]) * (p[0][l] - map->pos[0]) + (p[1][l] - map->pos[1]) * (p[1][l] - map->pos[1])
+                                  + (p[2][l] - map->pos[2]) * (p[2][l] - map->pos[2]));
+                float offset = 1.5f * map->texelSize(d);
+                float q[3] = {p[0][l] + row.nx[x + l] * offset, p[1][l] + row.ny[x + l] * offset, p[2][l] + row.nz[x + l] * offset};
+                lanes[l] = map->visibility(q);
+            }
+            visible[i] = f8::Load(lanes);
+        }
+    }
+
+    static void CollectCounterMaxima(const GBuffer& buffer, RenderStatistic& stats) {
+        for(int y = 0; y < buffer.height(); ++y) {
+            for(int x = 0; x < buffer.width(); ++x) {
+                stats.maxRasterTests = std::max(stats.maxRasterTests, buffer.getRasterTestBuffer()[y][x]);
+                stats.maxOverdraw = std::max(stats.maxOverdraw, buffer.getOverdrawBuffer()[y][x]);
+                stats.maxLightsPerPixel = std::max(stats.maxLightsPerPixel, buffer.getLightCountBuffer()[y][x]);
+            }
+        }
+    }
+
+    /// @brief Choose the mesh level to draw an object at, from the projected size of its bounding sphere
+    const Mesh* selectLOD(const Object& obj, const AABB& worldBounds, const mat4& view, const mat4& proj, GISize dim) const {
+        if(!_settings.lod || !obj.lod || obj.lodLevel <= 0) return obj.mesh.get();
+
+        // Projector maps camera space x to screen as x * P00 / |P32 * z|, see Frustum
+        float depth = -(view * worldBounds.center()).z();
+        float radius = worldBounds.radius();
+        if(depth <= radius) return obj.mesh.get(); // camera inside or touching the bounding sphere
+
+        float pxPerUnit = std::max(dim.width * proj[{0, 0}], dim.height * proj[{1, 1}]) / std::abs(proj[{3, 2}] * depth);
+        float rPx = radius * pxPerUnit;
+        // Roughly half of a closed mesh faces the camera
+        float maxTris = 2.f * gFloatPI * rPx * rPx / std::max(_settings.lodPixelsPerTri, 1e-3f);
+
+        return obj.lod->level(obj.lod->select(maxTris, obj.lodLevel)).get();
+    }
+
     void ShowDepthBuffer(GBitmap &bitmap, const Scene &scene) {
         const std::vector<std::vector<float>> &buffer = _buffer.getDepthBuffer();
         float val;
@@ -329,6 +1270,34 @@ private:
         }
     }
 
+    /// @brief False color ramp from blue through green to red for t in [0, 1]
+    static GColor HeatColor(float t) {
+        static const float stops[5][3] = {{0.f, 0.f, 1.f}, {0.f, 1.f, 1.f}, {0.f, 1.f, 0.f}, {1.f, 1.f, 0.f}, {1.f, 0.f, 0.f}};
+        t = std::clamp(t, 0.f, 1.f) * 4.f;
+        int i = std::min((int) t, 3);
+        float s = t - i;
+        return {stops[i][0] + (stops[i + 1][0] - stops[i][0]) * s,
+                stops[i][1] + (stops[i + 1][1] - stops[i][1]) * s,
+                stops[i][2] + (stops[i + 1][2] - stops[i][2]) * s, 1.f};
+    }
+
+    /// @brief Heatmap of a counter, scaled to its maximum. Pixels with a count of 0 are black.
+    void ShowCountBuffer(GBitmap &bitmap, const std::vector<std::vector<int>> &buffer) {
+        if(!_buffer.isCounting()) throw CustomException("Cost counters weren't enabled for the last render.");
+
+        int max = 1;
+        for(const std::vector<int>& row : buffer) {
+            for(int v : row) max = std::max(max, v);
+        }
+
+        for(int y = 0; y < bitmap.height(); ++y) {
+            for(int x = 0; x < bitmap.width(); ++x) {
+                int v = buffer[y][x];
+                *(bitmap.getAddr(x, y)) = v == 0 ? toPremul({0.f, 0.f, 0.f, 1.f}) : toPremul(HeatColor(v / (float) max));
+            }
+        }
+    }
+
     void ShowSpecularBuffer(GBitmap &bitmap) {
         const std::vector<std::vector<float>> &buffer = _buffer.getSpecularBuffer();
         float val;
@@ -0,0 +1,169 @@
+#ifndef RayTracer_DEFINED
+#define RayTracer_DEFINED
+
+#include <vector>
+#include "Projector.h"
+#include "TwoLevelBVH.h"
+
+/// @brief Rays from the camera through points of the image, following the rasterizer's projection
+struct CameraRays {
+    float origin[3];  // camera position in world space
+    float axes[3][3]; // camera right, up and backward axes in world space
+    float scaleX, scaleY;
+    GISize dim;
+
+    CameraRays(const Camera& cam, GISize size) : dim(size) {
+        // Screen x = (P00 * x / |P32 * z| + 0.5) * width, likewise for y, so the camera space ray
+        // through a pixel center is (sx * |P32| / P00, sy * |P32| / P11, -1)
+        mat4 view = cam.getViewMatrix();
+        mat4 proj = cam.getProjectionMatrix();
+        scaleX = std::abs(proj[{3, 2}]) / proj[{0, 0}];
+        scaleY = std::abs(proj[{3, 2}]) / proj[{1, 1}];
+        vec3 pos = cam.getPos();
+        // Camera axes in world space are the rows of the view matrix's rotation
+        for(int r = 0; r < 3; ++r) {
+            origin[r] = pos[r];
+            for(int c = 0; c < 3; ++c) axes[r][c] = view[{(size_t) r, (size_t) c}];
+        }
+    }
+
+    /// @brief World space direction through image point (x, y), in pixels, whose camera space
+    /// direction is (cx, cy, -1)
+    void ray(float x, float y, float& cx, float& cy, float dir[3]) const {
+        cx = (x / dim.width - 0.5f) * scaleX;
+        cy = (y / dim.height - 0.5f) * scaleY;
+        for(int a = 0; a < 3; ++a) dir[a] = cx * axes[0][a] + cy * axes[1][a] - axes[2][a];
+    }
+};
+
+/*
+    Ray traced alternative to Projector's rasterizer, rendering the same Scene into the same GBitmap.
+
+    Objects are placed in a TwoLevelBVH over their meshes' BVHs, then one primary ray per pixel center
+    finds the visible surface. Rays follow the rasterizer's projection and back face culling,
+    and hits are written to a G-buffer in the rasterizer's conventions (camera space positions, world
+    space normals), so the deferred lighting pass is shared and images only differ where the rasterizer's
+    screen space interpolation does.
+*/
+class RayTracer {
+public:
+    RayTracer() : _lighting(nullptr, {0, 0}, nullptr), _buffer(GISize{0, 0}) {}
+
+    void setSettings(const RenderSettings& settings) { _settings = settings; _lighting.setSettings(settings); }
+    const RenderSettings& getSettings() const { return _settings; }
+
+    /// @brief Build the acceleration structure and trace and light every pixel of out
+    RenderStatistic RenderSceneTo(const Scene& scene, GBitmap& out) {
+        TRACE_SCOPE("RayTracer::RenderSceneTo");
+        Stopwatch watch;
+        RenderStatistic stats{};
+        GISize dim{out.width(), out.height()};
+        _buffer.reset(dim);
+
+        BuildScene(scene, stats);
+        TraceScene(scene, _buffer, stats);
+        _lighting.ShadeBuffer(scene.cam, scene.lights, _buffer, out, stats);
+
+        stats.numPixelsDamaged = dim.width * dim.height;
+        stats.fullRender = true;
+        stats.secondsTaken = watch.elapsed();
+        return stats;
+    }
+
+    /// @brief Bring the acceleration structure up to date with the scene, only building BVHs for new meshes
+    void BuildScene(const Scene& scene, RenderStatistic& stats) {
+        TRACE_SCOPE("RayTracer::BuildScene");
+        Stopwatch watch;
+
+        _bvh.update(scene, _settings.threads, _settings.analyticSpheres);
+
+        stats.numObjects = scene.objects.size();
+        stats.numTrisTotal = _bvh.instancedTriCount();
+        stats.phases.accelBuild += watch.elapsed();
+
+        // Shadows use their own casters, without the light markers
+        _lighting.UpdateShadows(scene, stats);
+    }
+
+    /// @brief Trace one primary ray per pixel of buffer, recording the closest surface.
+    /// The BVH must have been built from scene by BuildScene.
+    void TraceScene(const Scene& scene, GBuffer& buffer, RenderStatistic& stats) const {
+        TRACE_SCOPE("RayTracer::TraceScene");
+        Stopwatch watch;
+        int width = buffer.width(), height = buffer.height();
+
+        CameraRays camera(scene.cam, {width, height});
+        const float* origin = camera.origin;
+
+        auto writeHit = [&](int x, int y, float cx, float cy, const RayHit& hit) {
+            // t is also the distance along the camera's view axis, as dir has camera space z = -1
+            float position[3] = {cx * hit.t, cy * hit.t, -hit.t};
+            float dir[3], normal[3], albedo[3];
+            for(int a = 0; a < 3; ++a) dir[a] = cx * camera.axes[0][a] + cy * camera.axes[1][a] - camera.axes[2][a];
+            _bvh.surface(hit, origin, dir, normal, albedo);
+            buffer.setPixel(x, y, hit.t, position, normal, albedo, _bvh.instance(hit).shininess);
+        };
+
+        if(_settings.rayPackets) {
+            // 4x2 pixel tiles, lane i covering pixel (x + i % 4, y + i / 4)
+            ParallelFor(0, (height + 1) / 2, 2, _settings.threads, [&](int begin, int end) {
+                TRACE_SCOPE("trace packets");
+                RayPacket packet;
+                packet.ox = f8(origin[0]);
+                packet.oy = f8(origin[1]);
+                packet.oz = f8(origin[2]);
+                packet.sharedOrigin = true;
+                for(int y = 2 * begin; y < 2 * end; y += 2) {
+                    for(int x = 0; x < width; x += 4) {
+                        alignas(32) float dir[3][8], cxs[8], cys[8];
+                        packet.active = 0;
+                        for(int i = 0; i < 8; ++i) {
+                            int px = x + i % 4, py = y + i / 4;
+                            if(px < width && py < height) packet.active |= 1 << i;
+                            else { px = x; py = y; } // keep unused lanes' rays finite
+                            float d[3];
+                            camera.ray(px + 0.5f, py + 0.5f, cxs[i], cys[i], d);
+                            for(int a = 0; a < 3; ++a) dir[a][i] = d[a];
+                        }
+                        packet.dx = f8::Load(dir[0]);
+                        packet.dy = f8::Load(dir[1]);
+                        packet.dz = f8::Load(dir[2]);
+
+                        RayHit hits[8];
+                        int hitMask = _bvh.intersect(packet, hits);
+                        for(int i = 0; i < 8; ++i) {
+                            if(hitMask >> i & 1) writeHit(x + i % 4, y + i / 4, cxs[i], cys[i], hits[i]);
+                        }
+                    }
+                }
+            });
+        }
+        else {
+            ParallelFor(0, height, 4, _settings.threads, [&](int y0, int y1) {
+                TRACE_SCOPE("trace rows");
+                for(int y = y0; y < y1; ++y) {
+                    for(int x = 0; x < width; ++x) {
+                        float cx, cy, dir[3];
+                        camera.ray(x + 0.5f, y + 0.5f, cx, cy, dir);
+
+                        RayHit hit;
+                        if(_bvh.intersect(origin, dir, FLT_MAX, hit)) writeHit(x, y, cx, cy, hit);
+                    }
+                }
+            });
+        }
+
+        stats.numRays += (int64_t) width * height;
+        stats.phases.trace += watch.elapsed();
+    }
+
+    const TwoLevelBVH& getBVH() const { return _bvh; }
+
+private:
+    RenderSettings _settings;
+    Projector _lighting; // only used for its deferred lighting pass
+    GBuffer _buffer;
+    TwoLevelBVH _bvh;
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "SceneBVH.h"
+#include <algorithm>
+
+void SceneBVH::build(const std::vector<Object>& objects) {
+    std::vector<AABB> bounds(objects.size());
+    for(int i = 0; i < (int) objects.size(); ++i) bounds[i] = objects[i].getWorldBounds();
+    build(bounds);
+}
+
+void SceneBVH::build(const std::vector<AABB>& bounds) {
+    _nodes.clear();
+    _indices.resize(bounds.size());
+    _objBounds = bounds;
+    _leafOf.assign(bounds.size(), 0);
+    if(bounds.empty()) return;
+
+    for(int i = 0; i < (int) bounds.size(); ++i) _indices[i] = i;
+
+    // A binary tree with at most one object per leaf has at most 2n - 1 nodes
+    _nodes.reserve(2 * bounds.size());
+    _nodes.push_back({AABB{}, 0, (int) bounds.size()});
+    updateLeaf(0);
+    subdivide(0, 0);
+
+    _parent.assign(_nodes.size(), -1);
+    for(int n = 0; n < (int) _nodes.size(); ++n) {
+        const Node& node = _nodes[n];
+        if(node.isLeaf()) {
+            for(int i = 0; i < node.count; ++i) _leafOf[_indices[node.leftFirst + i]] = n;
+        }
+        else {
+            _parent[node.leftFirst] = n;
+            _parent[node.leftFirst + 1] = n;
+        }
+    }
+}
+
+void SceneBVH::subdivide(int n, int depth) {
+    Node node = _nodes[n];
+    if(node.count <= MaxLeafSize || depth >= MaxDepth) return;
+
+    // Split along longest axis of the centroid bounds, at the median
+    AABB centroids;
+    for(int i = 0; i < node.count; ++i) {
+        const AABB& b = _objBounds[_indices[node.leftFirst + i]];
+        centroids.grow(b.center(0), b.center(1), b.center(2));
+    }
+    int axis = centroids.longestAxis();
+    if(centroids.max[axis] <= centroids.min[axis]) return; // all centroids coincide, keep as leaf
+
+    int first = node.leftFirst;
+    int mid = node.count / 2;
+    std::nth_element(_indices.begin() + first, _indices.begin() + first + mid, _indices.begin() + first + node.count,
+        [&](int a, int b) { return _objBounds[a].center(axis) < _objBounds[b].center(axis); });
+
+    int left = (int) _nodes.size();
+    _nodes.push_back({AABB{}, first, mid});
+    _nodes.push_back({AABB{}, first + mid, node.count - mid});
+    _nodes[n].leftFirst = left;
+    _nodes[n].count = 0;
+
+    updateLeaf(left);
+    updateLeaf(left + 1);
+    subdivide(left, depth + 1);
+    subdivide(left + 1, depth + 1);
+}
+
+void SceneBVH::updateLeaf(int n) {
+    Node& node = _nodes[n];
+    node.bounds = AABB{};
+    for(int i = 0; i < node.count; ++i) {
+        node.bounds.grow(_objBounds[_indices[node.leftFirst + i]]);
+    }
+}
+
+void SceneBVH::updateInternal(int n) {
+    Node& node = _nodes[n];
+    node.bounds = _nodes[node.leftFirst].bounds;
+    node.bounds.grow(_nodes[node.leftFirst + 1].bounds);
+}
+
+void SceneBVH::refit(const std::vector<Object>& objects) {
+    if(objects.size() != _objBounds.size()) {
+        build(objects);
+        return;
+    }
+    for(int i = 0; i < (int) objects.size(); ++i) {
+        _objBounds[i] = objects[i].getWorldBounds();
+    }
+    // Children are always stored after their parent
+    for(int n = (int) _nodes.size() - 1; n >= 0; --n) {
+        if(_nodes[n].isLeaf()) updateLeaf(n);
+        else updateInternal(n);
+    }
+}
+
+void SceneBVH::refit(const std::vector<Object>& objects, const std::vector<int>& moved) {
+    if(objects.size() != _objBounds.size()) {
+        build(objects);
+        return;
+    }
+    for(int i : moved) {
+        _objBounds[i] = objects[i].getWorldBounds();
+        int n = _leafOf[i];
+        updateLeaf(n);
+        for(n = _parent[n]; n >= 0; n = _parent[n]) updateInternal(n);
+    }
+}
+
+void SceneBVH::refit(const std::vector<AABB>& bounds, const std::vector<int>& moved) {
+    if(bounds.size() != _objBounds.size()) {
+        build(bounds);
+        return;
+    }
+    for(int i : moved) {
+        _objBounds[i] = bounds[i];
+        int n = _leafOf[i];
+        updateLeaf(n);
+        for(n = _parent[n]; n >= 0; n = _parent[n]) updateInternal(n);
+    }
+}
+
+#pragma region Queries
+
+void SceneBVH::cullFrustum(const Frustum& frustum, const vec3& eye, std::vector<int>& out) const {
+    if(_nodes.empty()) return;
+
+    struct Entry { int node; int mask; };
+    Entry stack[MaxDepth * 2 + 2];
+    int sp = 0;
+    stack[sp++] = {0, 0x3F};
+
+    while(sp > 0) {
+        Entry e = stack[--sp];
+        const Node& node = _nodes[e.node];
+
+        int mask = e.mask;
+        if(mask && frustum.test(node.bounds, mask) == Frustum::Outside) continue;
+
+        if(node.isLeaf()) {
+            for(int i = 0; i < node.count; ++i) {
+                int obj = _indices[node.leftFirst + i];
+                int objMask = mask;
+                if(objMask && frustum.test(_objBounds[obj], objMask) == Frustum::Outside) continue;
+                out.push_back(obj);
+            }
+            continue;
+        }
+
+        // Push far child first so near child is visited first
+        int l = node.leftFirst, r = node.leftFirst + 1;
+        if(_nodes[l].bounds.distanceSq(eye) > _nodes[r].bounds.distanceSq(eye)) std::swap(l, r);
+        stack[sp++] = {r, mask};
+        stack[sp++] = {l, mask};
+    }
+}
+
+void SceneBVH::traverseFrontToBack(const vec3& eye, std::vector<int>& out) const {
+    if(_nodes.empty()) return;
+
+    int stack[MaxDepth * 2 + 2];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while(sp > 0) {
+        const Node& node = _nodes[stack[--sp]];
+        if(node.isLeaf()) {
+            for(int i = 0; i < node.count; ++i) out.push_back(_indices[node.leftFirst + i]);
+            continue;
+        }
+        int l = node.leftFirst, r = node.leftFirst + 1;
+        if(_nodes[l].bounds.distanceSq(eye) > _nodes[r].bounds.distanceSq(eye)) std::swap(l, r);
+        stack[sp++] = r;
+        stack[sp++] = l;
+    }
+}
+
+void SceneBVH::raycast(const vec3& origin, const vec3& dir, float tmax, std::vector<int>& out) const {
+    if(_nodes.empty()) return;
+
+    float o[3] = {origin.x(), origin.y(), origin.z()};
+    float invDir[3] = {1.f / dir.x(), 1.f / dir.y(), 1.f / dir.z()};
+
+    std::vector<std::pair<float, int>> hits;
+    int stack[MaxDepth * 2 + 2];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    float t;
+    while(sp > 0) {
+        const Node& node = _nodes[stack[--sp]];
+        if(!node.bounds.intersectRay(o, invDir, tmax, t)) continue;
+
+        if(node.isLeaf()) {
+            for(int i = 0; i < node.count; ++i) {
+                int obj = _indices[node.leftFirst + i];
+                if(_objBounds[obj].intersectRay(o, invDir, tmax, t)) hits.push_back({t, obj});
+            }
+            continue;
+        }
+        stack[sp++] = node.leftFirst;
+        stack[sp++] = node.leftFirst + 1;
+    }
+
+    std::sort(hits.begin(), hits.end());
+    for(const auto& hit : hits) out.push_back(hit.second);
+}
+
+void SceneBVH::queryPoint(const vec3& p, std::vector<int>& out) const {
+    querySphere(p, 0.f, out);
+}
+
+void SceneBVH::querySphere(const vec3& center, float radius, std::vector<int>& out) const {
+    if(_nodes.empty()) return;
+
+    int stack[MaxDepth * 2 + 2];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    while(sp > 0) {
+        const Node& node = _nodes[stack[--sp]];
+        if(!node.bounds.overlapsSphere(center, radius)) continue;
+
+        if(node.isLeaf()) {
+            for(int i = 0; i < node.count; ++i) {
+                int obj = _indices[node.leftFirst + i];
+                if(_objBounds[obj].overlapsSphere(center, radius)) out.push_back(obj);
+            }
+            continue;
+        }
+        stack[sp++] = node.leftFirst;
+        stack[sp++] = node.leftFirst + 1;
+    }
+}
+
+#pragma endregion
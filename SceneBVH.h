@@ -0,0 +1,159 @@
+#ifndef SceneBVH_DEFINED
+#define SceneBVH_DEFINED
+
+#include <vector>
+#include "include/vec.h"
+#include "include/Bounds.h"
+#include "include/SIMD.h"
+#include "Object.h"
+
+/// @brief Bounding volume hierarchy over the world space bounds of scene objects.
+/// Used for frustum culling, front-to-back traversal, and ray/point/sphere queries.
+/// Nodes are stored flat, children always come after their parent, so refitting is a single reverse sweep.
+class SceneBVH {
+public:
+    SceneBVH() {}
+
+    /// @brief Build hierarchy from scratch over objects' world bounds
+    void build(const std::vector<Object>& objects);
+    /// @brief Build over one box per object, for users whose objects' extent isn't their mesh's
+    void build(const std::vector<AABB>& bounds);
+
+    /// @brief Recompute bounds of all objects and propagate up the tree, keeping the topology.
+    /// Much cheaper than a rebuild, but quality degrades if objects move far from where they were built.
+    void refit(const std::vector<Object>& objects);
+
+    /// @brief Recompute bounds for only the given objects, then propagate up the tree
+    void refit(const std::vector<Object>& objects, const std::vector<int>& moved);
+    /// @brief Set the boxes of the given objects, then propagate up the tree
+    void refit(const std::vector<AABB>& bounds, const std::vector<int>& moved);
+
+    bool empty() const { return _nodes.empty(); }
+    int objectCount() const { return (int) _objBounds.size(); }
+    int nodeCount() const { return (int) _nodes.size(); }
+    const AABB& objectBounds(int i) const { return _objBounds[i]; }
+    const AABB& bounds() const { return _nodes[0].bounds; }
+
+    /// @brief Collect objects overlapping the frustum, approximately ordered front-to-back from eye
+    void cullFrustum(const Frustum& frustum, const vec3& eye, std::vector<int>& out) const;
+
+    /// @brief Collect all objects, approximately ordered front-to-back from eye
+    void traverseFrontToBack(const vec3& eye, std::vector<int>& out) const;
+
+    /// @brief Collect objects whose bounds are hit by a ray, sorted by entry distance
+    /// @param dir need not be normalized, tmax is in units of dir
+    void raycast(const vec3& origin, const vec3& dir, float tmax, std::vector<int>& out) const;
+
+    /// @brief Visit the objects whose bounds a ray enters before tmax, nearer subtrees first. visit(object)
+    /// may lower tmax, which prunes what is left, and returns true to stop.
+    template<class Visit>
+    void traverseRay(const float o[3], const float invDir[3], float& tmax, Visit&& visit) const {
+        if(_nodes.empty()) return;
+        int stack[MaxDepth * 2 + 2];
+        int sp = 0;
+        stack[sp++] = 0;
+
+        float t;
+        while(sp > 0) {
+            const Node& node = _nodes[stack[--sp]];
+            if(!node.bounds.intersectRay(o, invDir, tmax, t)) continue;
+
+            if(node.isLeaf()) {
+                for(int i = 0; i < node.count; ++i) {
+                    int obj = _indices[node.leftFirst + i];
+                    if(_objBounds[obj].intersectRay(o, invDir, tmax, t) && visit(obj)) return;
+                }
+                continue;
+            }
+            // Nearer child on top of the stack, missed ones not at all
+            int l = node.leftFirst, r = node.leftFirst + 1;
+            float tl, tr;
+            if(!_nodes[l].bounds.intersectRay(o, invDir, tmax, tl)) tl = FLT_MAX;
+            if(!_nodes[r].bounds.intersectRay(o, invDir, tmax, tr)) tr = FLT_MAX;
+            if(tr < tl) {
+                std::swap(l, r);
+                std::swap(tl, tr);
+            }
+            if(tr != FLT_MAX) stack[sp++] = r;
+            if(tl != FLT_MAX) stack[sp++] = l;
+        }
+    }
+
+    /// @brief traverseRay for the active lanes of a packet, each with its own tmax. visit(object, lanes) is
+    /// given the lanes entering the object's box, and may lower tmax or clear active lanes, stopping once none are left.
+    template<class Visit>
+    void traversePacket(const f8 o[3], const f8 invDir[3], f8& tmax, int& active, Visit&& visit) const {
+        if(_nodes.empty() || !active) return;
+        auto enters = [&](const AABB& b) {
+            f8 t0 = 0.f, t1 = tmax;
+            for(int a = 0; a < 3; ++a) {
+                f8 ta = (f8(b.min[a]) - o[a]) * invDir[a], tb = (f8(b.max[a]) - o[a]) * invDir[a];
+                t0 = Max(t0, Min(ta, tb));
+                t1 = Min(t1, Max(ta, tb));
+            }
+            return MoveMask(t0 <= t1) & active;
+        };
+
+        // Children are ordered along the first active lane's direction
+        int lead = 0;
+        while(!(active >> lead & 1)) ++lead;
+        float dir[3];
+        for(int a = 0; a < 3; ++a) {
+            alignas(32) float inv[8];
+            invDir[a].store(inv);
+            dir[a] = 1.f / inv[lead];
+        }
+
+        int stack[MaxDepth * 2 + 2];
+        int sp = 0;
+        stack[sp++] = 0;
+        while(sp > 0 && active) {
+            const Node& node = _nodes[stack[--sp]];
+            if(!enters(node.bounds)) continue;
+
+            if(node.isLeaf()) {
+                for(int i = 0; i < node.count && active; ++i) {
+                    int obj = _indices[node.leftFirst + i];
+                    int lanes = enters(_objBounds[obj]);
+                    if(lanes) visit(obj, lanes);
+                }
+                continue;
+            }
+            int l = node.leftFirst, r = node.leftFirst + 1;
+            float along = 0.f;
+            for(int a = 0; a < 3; ++a) along += (_nodes[l].bounds.center(a) - _nodes[r].bounds.center(a)) * dir[a];
+            if(along > 0.f) std::swap(l, r);
+            stack[sp++] = r;
+            stack[sp++] = l;
+        }
+    }
+
+    /// @brief Collect objects whose bounds contain point p
+    void queryPoint(const vec3& p, std::vector<int>& out) const;
+
+    /// @brief Collect objects whose bounds overlap a sphere, e.g. the effective radius of a light
+    void querySphere(const vec3& center, float radius, std::vector<int>& out) const;
+
+private:
+    struct Node {
+        AABB bounds;
+        int leftFirst; // index of left child if internal (right child is leftFirst + 1), or first object index if leaf
+        int count;     // number of objects, 0 if internal
+        bool isLeaf() const { return count > 0; }
+    };
+
+    static const int MaxLeafSize = 4;
+    static const int MaxDepth = 64;
+
+    std::vector<Node> _nodes;
+    std::vector<int> _indices;    // object indices referenced by leaves
+    std::vector<AABB> _objBounds; // world bounds per object
+    std::vector<int> _parent;     // parent node per node, used for partial refits
+    std::vector<int> _leafOf;     // leaf node per object
+
+    void subdivide(int node, int depth);
+    void updateLeaf(int node);
+    void updateInternal(int node);
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "SceneBuilder.h"
 #include "include/CustomException.h"
+#include "include/Trace.h"
 #include <iostream>
 #include <fstream>
 #include <array>
@@ -112,10 +113,19 @@ Light buildPointLight(json light_data) {
     return Light{jsonToVec<3>(light_data["pos"]),
                  jsonToVec<3>(light_data["color"]),
                  jsonToFloat(light_data["ambient"]),
-                 jsonToFloat(light_data["specular"]),
                  effectiveRadius, atten[0], atten[1], atten[2]};
 }
 
+Light buildDirectionalLight(json light_data) {
+    return Light::Directional(jsonToVec<3>(light_data["dir"]),
+                              jsonToVec<3>(light_data["color"]),
+                              jsonToFloat(light_data["ambient"]));
+}
+
+Light buildAmbientLight(json light_data) {
+    return Light::Ambient(jsonToVec<3>(light_data["color"]), jsonToFloat(light_data["ambient"]));
+}
+
 Object buildPointLightObj(json light_data) {
     return Object::Icosphere(jsonToVec<3>(light_data["pos"]),
                             jsonFloatOrVec3(light_data["d_size"]),
@@ -140,7 +150,9 @@ Object SceneBuilder::buildLightObj(json light_data) {
 
 
 SceneBuilder::LightBuilderMap SceneBuilder::_LightBuilders = {
-    {"point", buildPointLight}
+    {"point", buildPointLight},
+    {"directional", buildDirectionalLight},
+    {"ambient", buildAmbientLight}
 };
 SceneBuilder::ObjBuilderMap SceneBuilder::_LightObjBuilders = {
     {"point", buildPointLightObj}
@@ -150,6 +162,7 @@ SceneBuilder::ObjBuilderMap SceneBuilder::_LightObjBuilders = {
 #pragma endregion
 
 void SceneBuilder::LoadScene(string filename) {
+    TRACE_SCOPE("SceneBuilder::LoadScene");
     ifstream file(filename);
 
     // Check file valid
@@ -166,20 +179,120 @@ void SceneBuilder::LoadScene(string filename) {
     }
 
     // Construct camera
-    scene.cam = buildCamera(sceneData["cam"]);
+    json& cam_data = sceneData["cam"];
+    scene.cam = buildCamera(cam_data);
+    if(cam_data.contains("keyframes")) {
+        Keyframe base;
+        base.pos = jsonToVec<3>(cam_data["pos"]);
+        base.target = jsonToVec<3>(cam_data["target"]);
+        base.up = jsonToVec<3>(cam_data["up"]);
+        scene.animations.push_back(buildTrack(cam_data["keyframes"], AnimationTrack::Kind::Camera, base));
+    }
     
     // Construct Objects
     for(auto& pair : sceneData["objects"].items()){
-        scene.objects.push_back(buildObject(pair.value()));
+        json& obj_data = pair.value();
+        if(obj_data.contains("keyframes")) {
+            Keyframe base;
+            base.pos = jsonToVec<3>(obj_data["pos"]);
+            base.euler = jsonToVec<3>(obj_data["euler"]);
+            base.scale = jsonFloatOrVec3(obj_data["scale"]);
+            scene.animations.push_back(buildTrack(obj_data["keyframes"], AnimationTrack::Kind::Object, base));
+            scene.animations.back().index = scene.objects.size();
+        }
+        scene.objects.push_back(buildObject(obj_data));
     }
 
     // Construct Lights
     for(auto& pair : sceneData["lights"].items()){
-        scene.lights.push_back(buildLight(pair.value()));
-        scene.objects.push_back(buildLightObj(pair.value()));
+        json& light_data = pair.value();
+        bool hasMarker = _LightObjBuilders.find(jsonToString(light_data["type"])) != _LightObjBuilders.end();
+        if(light_data.contains("keyframes")) {
+            if(!light_data.contains("pos")) throw CustomException("Only lights with a position can be animated.");
+            Keyframe base;
+            base.pos = jsonToVec<3>(light_data["pos"]);
+            scene.animations.push_back(buildTrack(light_data["keyframes"], AnimationTrack::Kind::Light, base));
+            scene.animations.back().index = scene.lights.size();
+            if(hasMarker) scene.animations.back().marker = scene.objects.size();
+        }
+        scene.lights.push_back(buildLight(light_data));
+        if(hasMarker) scene.objects.push_back(buildLightObj(light_data));
+    }
+
+    scene.buildBVH();
+}
+
+#pragma region Animation
+
+AnimationTrack SceneBuilder::buildTrack(json keyframes, AnimationTrack::Kind kind, const Keyframe& base) {
+    if(!keyframes.is_array() || keyframes.empty()) throw CustomException("Keyframes must be a non-empty array.");
+
+    AnimationTrack track;
+    track.kind = kind;
+
+    // Properties missing from a keyframe carry over from the previous one, or the element itself for the first
+    Keyframe prev = base;
+    for(auto& pair : keyframes.items()) {
+        json& key = pair.value();
+        if(!key.contains("time")) throw CustomException("Keyframe is missing required property \"time\".");
+
+        Keyframe k = prev;
+        k.time = jsonToFloat(key["time"]);
+        if(key.contains("pos")) k.pos = jsonToVec<3>(key["pos"]);
+        if(key.contains("euler")) k.euler = jsonToVec<3>(key["euler"]);
+        if(key.contains("scale")) k.scale = jsonFloatOrVec3(key["scale"]);
+        if(key.contains("target")) k.target = jsonToVec<3>(key["target"]);
+        if(key.contains("up")) k.up = jsonToVec<3>(key["up"]);
+
+        track.keys.push_back(k);
+        prev = k;
+    }
+    std::stable_sort(track.keys.begin(), track.keys.end(),
+                     [](const Keyframe& a, const Keyframe& b) { return a.time < b.time; });
+
+    return track;
+}
+
+float Scene::animationDuration() const {
+    float duration = 0.f;
+    for(const AnimationTrack& track : animations) duration = max(duration, track.duration());
+    return duration;
+}
+
+void Scene::Animate(float time) {
+    _moved.clear();
+    for(const AnimationTrack& track : animations) {
+        Keyframe k = track.sample(time);
+        switch(track.kind) {
+            case AnimationTrack::Kind::Object: {
+                Object& obj = objects[track.index];
+                obj.pos = k.pos;
+                obj.euler = k.euler;
+                obj.scale = k.scale;
+                obj.dirty = true;
+                _moved.push_back(track.index);
+                break;
+            }
+            case AnimationTrack::Kind::Light:
+                lights[track.index].v = k.pos;
+                lights[track.index].dirty = true;
+                if(track.marker >= 0) {
+                    objects[track.marker].pos = k.pos;
+                    objects[track.marker].dirty = true;
+                    _moved.push_back(track.marker);
+                }
+                break;
+            case AnimationTrack::Kind::Camera:
+                cam.setView(k.pos, k.target, k.up);
+                break;
+        }
     }
+
+    if(!_moved.empty()) bvh.refit(objects, _moved);
 }
 
+#pragma endregion
+
 #pragma region SceneVerifier
 
 
@@ -231,13 +344,30 @@ DataVerify SceneVerifier::_PointLight = {
     {
         {"color", "[1.0, 1.0, 1.0]"_json},
         {"ambient", "0.1"_json},
-        {"specular", "2"_json},
         // attenuation : [K_c, K_l, k_q]
         {"attenuation", "[1.0, 0.7, 1.8]"_json},
         {"d_size", "0.05"_json} // size of sphere representation
     }
 };
 
+DataVerify SceneVerifier::_DirectionalLight = {
+    {"type", "dir"}, // dir : direction the light travels
+
+    {
+        {"color", "[1.0, 1.0, 1.0]"_json},
+        {"ambient", "0.0"_json}
+    }
+};
+
+DataVerify SceneVerifier::_AmbientLight = {
+    {"type"},
+
+    {
+        {"color", "[1.0, 1.0, 1.0]"_json},
+        {"ambient", "0.1"_json} // strength
+    }
+};
+
 SceneVerifier::VerifierMap SceneVerifier::_verifierMap = {
     {"cam", SceneVerifier::_Camera},
     {"object", SceneVerifier::_Object},
@@ -245,7 +375,9 @@ SceneVerifier::VerifierMap SceneVerifier::_verifierMap = {
     {"icosahedron", SceneVerifier::_Object},
     {"icosphere", SceneVerifier::_Icosphere},
     {"plane", SceneVerifier::_Object},
-    {"point", SceneVerifier::_PointLight}
+    {"point", SceneVerifier::_PointLight},
+    {"directional", SceneVerifier::_DirectionalLight},
+    {"ambient", SceneVerifier::_AmbientLight}
 };
 #pragma endregion
 
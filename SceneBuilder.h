@@ -8,6 +8,9 @@
 #include "Object.h"
 #include "Light.h"
 #include "Camera.h"
+#include "SceneBVH.h"
+#include "Animation.h"
+#include "include/GRect.h"
 #include "include/CustomException.h"
 
 #include "src/json.hpp"
@@ -39,6 +42,8 @@ private:
     static DataVerify _Object;
     static DataVerify _Icosphere;
     static DataVerify _PointLight;
+    static DataVerify _DirectionalLight;
+    static DataVerify _AmbientLight;
 };
 
 #pragma endregion
@@ -48,6 +53,39 @@ struct Scene {
     Camera cam;
     vector<Object> objects{};
     vector<Light> lights{};
+
+    /// @brief Spatial index over objects. Rebuild after adding or removing objects. Moving one through
+    /// markObjectDirty or Animate refits it; renders cull through it as is.
+    SceneBVH bvh{};
+
+    /// @brief Keyframed transforms, applied by Animate
+    vector<AnimationTrack> animations{};
+
+    // Change tracking for Projector::RenderIncremental, which maintains these
+    vector<GIRect> screenBounds{};      // per object, pixels it covered in the last incremental render
+    vector<GIRect> lightScreenBounds{}; // per light, pixels it could reach in the last incremental render
+
+    /// @brief Flag an object or light as changed. Animate does this for everything it poses. Marking an
+    /// object also refits the BVH for it, so call this after moving one.
+    void markObjectDirty(int i) {
+        objects[i].dirty = true;
+        _moved.assign(1, i);
+        bvh.refit(objects, _moved);
+    }
+    void markLightDirty(int i) { lights[i].dirty = true; }
+
+    void buildBVH() { bvh.build(objects); }
+    void refitBVH() { bvh.refit(objects); }
+
+    bool isAnimated() const { return !animations.empty(); }
+    /// @brief Time of the last keyframe in the scene
+    float animationDuration() const;
+    /// @brief Pose animated objects, lights, and camera at time (in seconds), marking them dirty,
+    /// and refit the BVH for moved objects
+    void Animate(float time);
+
+private:
+    vector<int> _moved{}; // scratch for Animate and markObjectDirty
 };
 
 
@@ -84,6 +122,8 @@ private:
 
     Light buildLight(json light_data);
     Object buildLightObj(json light_data);
+
+    AnimationTrack buildTrack(json keyframes, AnimationTrack::Kind kind, const Keyframe& base);
 };
 
 
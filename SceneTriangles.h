@@ -0,0 +1,55 @@
+#ifndef SceneTriangles_DEFINED
+#define SceneTriangles_DEFINED
+
+#include <vector>
+#include "SceneBuilder.h"
+#include "TriangleBVH.h"
+#include "include/Parallel.h"
+
+/// @brief Every shadow casting object's triangles in world space, for drawing shadow maps.
+/// Ray tracing places objects' meshes in a TwoLevelBVH instead.
+class SceneTriangles {
+public:
+    std::vector<RTTriangle> tris;
+
+    /// @brief Gather the scene's triangles, in object order, leaving out emitters, which mark the lights
+    void gather(const Scene& scene, int threads) {
+        int numTris = 0;
+        std::vector<int> first(scene.objects.size());
+        for(size_t o = 0; o < scene.objects.size(); ++o) {
+            first[o] = numTris;
+            if(!scene.objects[o].isEmitter()) numTris += scene.objects[o].triCount();
+        }
+        tris.resize(numTris);
+
+        ParallelFor(0, (int) scene.objects.size(), 1, threads, [&](int begin, int end) {
+            for(int o = begin; o < end; ++o) {
+                if(scene.objects[o].isEmitter()) continue;
+                GatherObject(scene.objects[o], first[o]);
+            }
+        });
+    }
+
+private:
+    void GatherObject(const Object& obj, int first) {
+        if(!obj.mesh) return;
+        const Mesh& mesh = *obj.mesh;
+        mat4 transform = obj.getTransform();
+
+        std::vector<vec3> world(mesh.vertexCount());
+        for(int i = 0; i < mesh.vertexCount(); ++i) world[i] = transform * mesh.vertices[i];
+
+        for(int t = 0; t < mesh.triCount(); ++t) {
+            const int* idx = &mesh.indices[3 * t];
+            RTTriangle& tri = tris[first + t];
+            const vec3& v0 = world[idx[0]];
+            for(int a = 0; a < 3; ++a) {
+                tri.v0[a] = v0[a];
+                tri.e1[a] = world[idx[1]][a] - v0[a];
+                tri.e2[a] = world[idx[2]][a] - v0[a];
+            }
+        }
+    }
+};
+
+#endif
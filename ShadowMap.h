@@ -0,0 +1,156 @@
+#ifndef ShadowMap_DEFINED
+#define ShadowMap_DEFINED
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "GBuffer.h"
+#include "TriangleBVH.h"
+#include "include/vec.h"
+
+/*
+    Omnidirectional shadow map of a point light: six 90 degree faces around the light, +x, -x, +y, -y,
+    +z and -z, each holding per texel the closest occluder's inverse depth along the face's axis. Faces
+    are rasterized depth only by GBuffer::DrawDepthTri, either winding, after clipping triangles to a near plane.
+
+    Lookups find the face a point falls in, compare its own depth against a 3x3 texel neighborhood
+    (percentage closer filtering) and return the lit fraction, so shadow edges come out softened over
+    a texel or so.
+*/
+class ShadowMap {
+public:
+    static const int NumFaces = 6;
+
+    vec3 pos;          // light position the map was rendered from
+    float range = 0.f; // light's effectiveDistance, nothing beyond it is drawn
+    int size = 0;      // texels along each face edge
+    bool valid = false;
+
+    /// @brief Clear the map for a light at pos reaching range, size x size texels per face
+    void reset(const vec3& lightPos, float lightRange, int faceSize) {
+        pos = lightPos;
+        range = lightRange;
+        size = faceSize;
+        _faces.assign((size_t) NumFaces * size * size, 0.f);
+        valid = false;
+    }
+
+    /// @brief Whether the map was rendered for this light and size
+    bool matches(const vec3& lightPos, float lightRange, int faceSize) const {
+        return valid && size == faceSize && range == lightRange
+            && pos[0] == lightPos[0] && pos[1] == lightPos[1] && pos[2] == lightPos[2];
+    }
+
+    /// @brief Draw the world space triangles tris[i] for each i in candidates into one face.
+    /// Faces are independent, so they may be drawn on different threads.
+    void renderFace(int face, const std::vector<RTTriangle>& tris, const std::vector<int>& candidates) {
+        float* plane = &_faces[(size_t) face * size * size];
+        const float* basis = Basis[face];
+        float near = range * NearFraction;
+
+        for(int t : candidates) {
+            const RTTriangle& tri = tris[t];
+            // Face space vertices: x right, y up, z along the face's axis
+            float v[3][3];
+            for(int k = 0; k < 3; ++k) {
+                float r[3];
+                for(int a = 0; a < 3; ++a) {
+                    r[a] = tri.v0[a] - pos[a];
+                    if(k == 1) r[a] += tri.e1[a];
+                    else if(k == 2) r[a] += tri.e2[a];
+                }
+                for(int c = 0; c < 3; ++c) v[k][c] = basis[3 * c] * r[0] + basis[3 * c + 1] * r[1] + basis[3 * c + 2] * r[2];
+            }
+
+            // Skip triangles entirely behind the near plane or outside one of the side planes
+            bool culled = (v[0][2] < near && v[1][2] < near && v[2][2] < near);
+            for(int c = 0; c < 2 && !culled; ++c) {
+                culled = (v[0][c] > v[0][2] && v[1][c] > v[1][2] && v[2][c] > v[2][2])
+                      || (v[0][c] < -v[0][2] && v[1][c] < -v[1][2] && v[2][c] < -v[2][2]);
+            }
+            if(culled) continue;
+
+            // Clip to z >= near, leaving a triangle or a quad
+            float poly[4][3];
+            int n = 0;
+            for(int k = 0; k < 3; ++k) {
+                const float* a = v[k];
+                const float* b = v[(k + 1) % 3];
+                if(a[2] >= near) {
+                    std::copy(a, a + 3, poly[n++]);
+                }
+                if((a[2] >= near) != (b[2] >= near)) {
+                    float s = (near - a[2]) / (b[2] - a[2]);
+                    for(int c = 0; c < 3; ++c) poly[n][c] = a[c] + s * (b[c] - a[c]);
+                    poly[n++][2] = near;
+                }
+            }
+
+            float xs[4], ys[4], inv_zs[4];
+            for(int k = 0; k < n; ++k) {
+                inv_zs[k] = 1.f / poly[k][2];
+                xs[k] = (poly[k][0] * inv_zs[k] + 1.f) * 0.5f * size;
+                ys[k] = (poly[k][1] * inv_zs[k] + 1.f) * 0.5f * size;
+            }
+            GISize dim{size, size};
+            GBuffer::DrawDepthTri<DepthCull::None>(xs, ys, inv_zs, plane, dim);
+            if(n == 4) {
+                float secondXs[3] = {xs[0], xs[2], xs[3]};
+                float secondYs[3] = {ys[0], ys[2], ys[3]};
+                float secondZs[3] = {inv_zs[0], inv_zs[2], inv_zs[3]};
+                GBuffer::DrawDepthTri<DepthCull::None>(secondXs, secondYs, secondZs, plane, dim);
+            }
+        }
+    }
+
+    /// @brief Fraction of a 3x3 texel neighborhood around world point p that sees the light, 1 beyond range
+    float visibility(const float p[3]) const {
+        float r[3] = {p[0] - pos[0], p[1] - pos[1], p[2] - pos[2]};
+        int axis = 0;
+        if(std::abs(r[1]) > std::abs(r[axis])) axis = 1;
+        if(std::abs(r[2]) > std::abs(r[axis])) axis = 2;
+        int face = 2 * axis + (r[axis] < 0.f);
+        const float* basis = Basis[face];
+
+        float z = basis[6] * r[0] + basis[7] * r[1] + basis[8] * r[2];
+        if(z <= 0.f || z > range) return 1.f;
+        float sx = (basis[0] * r[0] + basis[1] * r[1] + basis[2] * r[2]) / z;
+        float sy = (basis[3] * r[0] + basis[4] * r[1] + basis[5] * r[2]) / z;
+        int cx = std::min(size - 1, std::max(0, (int) ((sx + 1.f) * 0.5f * size)));
+        int cy = std::min(size - 1, std::max(0, (int) ((sy + 1.f) * 0.5f * size)));
+
+        // Occluders closer than the point by more than the depth bias shadow it
+        float threshold = (1.f + DepthBias) / z;
+        const float* plane = &_faces[(size_t) face * size * size];
+        int lit = 0;
+        for(int y = cy - 1; y <= cy + 1; ++y) {
+            for(int x = cx - 1; x <= cx + 1; ++x) {
+                int tx = std::min(size - 1, std::max(0, x));
+                int ty = std::min(size - 1, std::max(0, y));
+                lit += plane[(size_t) ty * size + tx] <= threshold;
+            }
+        }
+        return lit / 9.f;
+    }
+
+    /// @brief World space size of a texel at distance d from the light, for offsetting lookups off surfaces
+    float texelSize(float d) const { return 2.f * d / size; }
+
+private:
+    static constexpr float NearFraction = 1e-3f; // near plane distance as a fraction of range
+    static constexpr float DepthBias = 1e-2f;    // relative depth difference that still counts as lit
+
+    // Rows are each face's right, up and forward axis
+    static constexpr float Basis[NumFaces][9] = {
+        { 0, 0, -1,   0, 1,  0,    1,  0,  0},
+        { 0, 0,  1,   0, 1,  0,   -1,  0,  0},
+        { 1, 0,  0,   0, 0, -1,    0,  1,  0},
+        { 1, 0,  0,   0, 0,  1,    0, -1,  0},
+        { 1, 0,  0,   0, 1,  0,    0,  0,  1},
+        {-1, 0,  0,   0, 1,  0,    0,  0, -1}
+    };
+
+    std::vector<float> _faces; // inverse depth, face after face, 0 where nothing was drawn
+};
+
+#endif
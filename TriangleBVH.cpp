@@ -0,0 +1,472 @@
+#include "TriangleBVH.h"
+#include "include/Parallel.h"
+#include <algorithm>
+#include <cmath>
+
+void TriangleBVH::build(const std::vector<RTTriangle>& tris, int threads) {
+    int n = (int) tris.size();
+    _tris.clear();
+    _triIds.clear();
+    _nodes.clear();
+    _nodeCount = 0;
+    if(n == 0) return;
+
+    _triBounds.resize(n);
+    _centroids.resize(3 * n);
+    _indices.resize(n);
+    ParallelFor(0, n, 1024, threads, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) {
+            const RTTriangle& t = tris[i];
+            AABB& b = _triBounds[i];
+            b = AABB{};
+            if(t.isSphere()) {
+                float r = t.radius();
+                b.grow(t.v0[0] - r, t.v0[1] - r, t.v0[2] - r);
+                b.grow(t.v0[0] + r, t.v0[1] + r, t.v0[2] + r);
+            }
+            else {
+                b.grow(t.v0[0], t.v0[1], t.v0[2]);
+                b.grow(t.v0[0] + t.e1[0], t.v0[1] + t.e1[1], t.v0[2] + t.e1[2]);
+                b.grow(t.v0[0] + t.e2[0], t.v0[1] + t.e2[1], t.v0[2] + t.e2[2]);
+            }
+            for(int a = 0; a < 3; ++a) _centroids[3 * i + a] = b.center(a);
+            _indices[i] = i;
+        }
+    });
+
+    // A binary tree with at least one triangle per leaf has at most 2n - 1 nodes
+    _nodes.resize(2 * n);
+    _nodes[0].leftFirst = 0;
+    _nodes[0].count = n;
+    _nodesUsed = 1;
+    updateBounds(0);
+
+    int spawnDepth = 0;
+    for(int t = ResolveThreadCount(threads); t > 1; t >>= 1) ++spawnDepth;
+    subdivide(0, 0, spawnDepth);
+
+    _nodeCount = _nodesUsed;
+    _nodes.resize(_nodeCount);
+    _tris.resize(n);
+    _triIds = _indices;
+    ParallelFor(0, n, 4096, threads, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) _tris[i] = tris[_indices[i]];
+    });
+}
+
+void TriangleBVH::updateBounds(int n) {
+    Node& node = _nodes[n];
+    AABB b;
+    for(int i = 0; i < node.count; ++i) b.grow(_triBounds[_indices[node.leftFirst + i]]);
+    for(int a = 0; a < 3; ++a) {
+        node.min[a] = b.min[a];
+        node.max[a] = b.max[a];
+    }
+}
+
+void TriangleBVH::subdivide(int n, int depth, int spawnDepth) {
+    Node& node = _nodes[n];
+    int first = node.leftFirst, count = node.count;
+    if(count <= 2 || depth >= MaxDepth) return;
+
+    AABB centroidBounds;
+    for(int i = first; i < first + count; ++i) {
+        const float* c = &_centroids[3 * _indices[i]];
+        centroidBounds.grow(c[0], c[1], c[2]);
+    }
+
+    // Binned SAH: bin centroids along each axis and sweep the bins for the cheapest split
+    struct Bin { AABB bounds; int count = 0; };
+    float bestCost = FLT_MAX;
+    int bestAxis = -1, bestSplit = 0;
+    for(int axis = 0; axis < 3; ++axis) {
+        float lo = centroidBounds.min[axis], extent = centroidBounds.max[axis] - lo;
+        if(extent <= 0.f) continue;
+        float scale = Bins / extent;
+
+        Bin bins[Bins];
+        for(int i = first; i < first + count; ++i) {
+            int tri = _indices[i];
+            int b = std::min(Bins - 1, (int) ((_centroids[3 * tri + axis] - lo) * scale));
+            bins[b].bounds.grow(_triBounds[tri]);
+            ++bins[b].count;
+        }
+
+        float leftArea[Bins - 1];
+        int leftCount[Bins - 1];
+        AABB box;
+        int sum = 0;
+        for(int b = 0; b < Bins - 1; ++b) {
+            box.grow(bins[b].bounds);
+            sum += bins[b].count;
+            leftArea[b] = box.surfaceArea();
+            leftCount[b] = sum;
+        }
+        box = AABB{};
+        sum = 0;
+        for(int b = Bins - 1; b > 0; --b) {
+            box.grow(bins[b].bounds);
+            sum += bins[b].count;
+            float cost = leftCount[b - 1] * leftArea[b - 1] + sum * box.surfaceArea();
+            if(cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+    if(bestAxis < 0) return; // all centroids coincide
+
+    AABB nodeBounds;
+    for(int a = 0; a < 3; ++a) {
+        nodeBounds.min[a] = node.min[a];
+        nodeBounds.max[a] = node.max[a];
+    }
+    float leafCost = count * nodeBounds.surfaceArea();
+    if(count <= MaxLeafSize && bestCost >= leafCost) return;
+
+    float lo = centroidBounds.min[bestAxis];
+    float scale = Bins / (centroidBounds.max[bestAxis] - lo);
+    int* mid = std::partition(&_indices[first], &_indices[first] + count, [&](int tri) {
+        return std::min(Bins - 1, (int) ((_centroids[3 * tri + bestAxis] - lo) * scale)) < bestSplit;
+    });
+    int leftCount = (int) (mid - &_indices[first]);
+    if(leftCount == 0 || leftCount == count) return;
+
+    int left = _nodesUsed.fetch_add(2);
+    _nodes[left].leftFirst = first;
+    _nodes[left].count = leftCount;
+    _nodes[left + 1].leftFirst = first + leftCount;
+    _nodes[left + 1].count = count - leftCount;
+    node.leftFirst = left;
+    node.count = 0;
+    updateBounds(left);
+    updateBounds(left + 1);
+
+    if(depth < spawnDepth && count >= ParallelMinTris) {
+        ParallelFor(0, 2, 1, 2, [&](int begin, int end) {
+            for(int child = begin; child < end; ++child) subdivide(left + child, depth + 1, spawnDepth);
+        });
+    }
+    else {
+        subdivide(left, depth + 1, spawnDepth);
+        subdivide(left + 1, depth + 1, spawnDepth);
+    }
+}
+
+AABB TriangleBVH::bounds() const {
+    AABB b;
+    if(_nodes.empty()) return b;
+    for(int a = 0; a < 3; ++a) {
+        b.min[a] = _nodes[0].min[a];
+        b.max[a] = _nodes[0].max[a];
+    }
+    return b;
+}
+
+float TriangleBVH::slab(const Node& node, const float o[3], const float invD[3], float tmax) {
+    float tmin = 0.f;
+    for(int a = 0; a < 3; ++a) {
+        float t0 = (node.min[a] - o[a]) * invD[a];
+        float t1 = (node.max[a] - o[a]) * invD[a];
+        tmin = std::max(tmin, std::min(t0, t1));
+        tmax = std::min(tmax, std::max(t0, t1));
+    }
+    return tmin <= tmax ? tmin : FLT_MAX;
+}
+
+bool TriangleBVH::frustumMisses(const Node& node, const PacketFrustum& f, float tmax) {
+    // Interval bounds of each axis's entry and exit distance over all the packet's directions.
+    // Every ray enters no sooner than the latest lower bound and exits no later than the earliest upper one.
+    float enter = 0.f, exit = tmax;
+    for(int a = 0; a < 3; ++a) {
+        float lo = node.min[a] - f.o[a], hi = node.max[a] - f.o[a];
+        if(f.invLo[a] < 0.f) std::swap(lo, hi);
+        enter = std::max(enter, std::min(lo * f.invLo[a], lo * f.invHi[a]));
+        exit = std::min(exit, std::max(hi * f.invLo[a], hi * f.invHi[a]));
+    }
+    return enter > exit;
+}
+
+/// @brief Moller-Trumbore for 8 rays against one triangle, culling back faces
+/// @return mask of lanes hitting it in (0, best), with t, u and v set in those lanes
+static f8 IntersectPacket(const RTTriangle& tri, const RayPacket& r, f8 best, f8& t, f8& u, f8& v) {
+    f8 e1x(tri.e1[0]), e1y(tri.e1[1]), e1z(tri.e1[2]);
+    f8 e2x(tri.e2[0]), e2y(tri.e2[1]), e2z(tri.e2[2]);
+    f8 px = r.dy * e2z - r.dz * e2y;
+    f8 py = r.dz * e2x - r.dx * e2z;
+    f8 pz = r.dx * e2y - r.dy * e2x;
+    f8 det = e1x * px + e1y * py + e1z * pz;
+    f8 hit = det <= f8(-1e-12f);
+    if(!Any(hit)) return hit;
+
+    f8 invDet = f8(1.f) / det;
+    f8 sx = r.ox - f8(tri.v0[0]), sy = r.oy - f8(tri.v0[1]), sz = r.oz - f8(tri.v0[2]);
+    u = (sx * px + sy * py + sz * pz) * invDet;
+    f8 qx = sy * e1z - sz * e1y;
+    f8 qy = sz * e1x - sx * e1z;
+    f8 qz = sx * e1y - sy * e1x;
+    v = (r.dx * qx + r.dy * qy + r.dz * qz) * invDet;
+    t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+    return hit & (f8(0.f) <= u) & (u <= f8(1.f)) & (f8(0.f) <= v) & (u + v <= f8(1.f))
+               & (f8(0.f) < t) & (t < best);
+}
+
+/// @brief Near intersection of 8 rays with a sphere, from outside only like the back face culling of triangles
+/// @return mask of lanes hitting it in (0, best), with t set in those lanes
+static f8 IntersectSpherePacket(const RTTriangle& sphere, const RayPacket& r, f8 best, f8& t) {
+    f8 ox = r.ox - f8(sphere.v0[0]), oy = r.oy - f8(sphere.v0[1]), oz = r.oz - f8(sphere.v0[2]);
+    f8 a = r.dx * r.dx + r.dy * r.dy + r.dz * r.dz;
+    f8 b = ox * r.dx + oy * r.dy + oz * r.dz;
+    f8 c = ox * ox + oy * oy + oz * oz - f8(sphere.radius() * sphere.radius());
+    f8 disc = b * b - a * c;
+    f8 hit = f8(0.f) <= disc;
+    if(!Any(hit)) return hit;
+    t = (f8(0.f) - b - Sqrt(Max(disc, 0.f))) / a;
+    return hit & (f8(0.f) < t) & (t < best);
+}
+
+/// @brief IntersectSpherePacket for one ray
+static bool IntersectSphere(const RTTriangle& sphere, const float o[3], const float d[3], float& t) {
+    float oc[3] = {o[0] - sphere.v0[0], o[1] - sphere.v0[1], o[2] - sphere.v0[2]};
+    float a = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    float b = oc[0] * d[0] + oc[1] * d[1] + oc[2] * d[2];
+    float c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - sphere.radius() * sphere.radius();
+    float disc = b * b - a * c;
+    if(disc < 0.f) return false;
+    t = (-b - std::sqrt(disc)) / a;
+    return true;
+}
+
+template<bool AnyHit>
+void TriangleBVH::traverse(int root, const float o[3], const float d[3], const float invD[3],
+                           float& best, int& bestTri, float& bestU, float& bestV) const {
+    int stack[MaxDepth + 1];
+    int top = 0;
+    stack[top++] = root;
+
+    while(top > 0) {
+        const Node& node = _nodes[stack[--top]];
+        if(node.isLeaf()) {
+            for(int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                const RTTriangle& tri = _tris[i];
+                if(tri.isSphere()) {
+                    float t;
+                    if(IntersectSphere(tri, o, d, t) && t > 0.f && t < best) {
+                        best = t;
+                        bestTri = i;
+                        bestU = bestV = 0.f;
+                        if(AnyHit) return;
+                    }
+                    continue;
+                }
+
+                // Moller-Trumbore, culling back faces
+                float p[3] = {d[1] * tri.e2[2] - d[2] * tri.e2[1],
+                              d[2] * tri.e2[0] - d[0] * tri.e2[2],
+                              d[0] * tri.e2[1] - d[1] * tri.e2[0]};
+                float det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+                if(det > -1e-12f) continue;
+                float invDet = 1.f / det;
+                float s[3] = {o[0] - tri.v0[0], o[1] - tri.v0[1], o[2] - tri.v0[2]};
+                float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+                if(u < 0.f || u > 1.f) continue;
+                float q[3] = {s[1] * tri.e1[2] - s[2] * tri.e1[1],
+                              s[2] * tri.e1[0] - s[0] * tri.e1[2],
+                              s[0] * tri.e1[1] - s[1] * tri.e1[0]};
+                float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+                if(v < 0.f || u + v > 1.f) continue;
+                float t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * invDet;
+                if(t > 0.f && t < best) {
+                    best = t;
+                    bestTri = i;
+                    bestU = u;
+                    bestV = v;
+                    if(AnyHit) return;
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first, skipping children beyond the closest hit so far
+        int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+        float t0 = slab(_nodes[nearChild], o, invD, best);
+        float t1 = slab(_nodes[farChild], o, invD, best);
+        if(t1 < t0) {
+            std::swap(t0, t1);
+            std::swap(nearChild, farChild);
+        }
+        if(t1 != FLT_MAX) stack[top++] = farChild;
+        if(t0 != FLT_MAX) stack[top++] = nearChild;
+    }
+}
+
+template<bool AnyHit>
+int TriangleBVH::traversePacket(const RayPacket& packet, PacketHits& hits) const {
+    alignas(32) float o[3][8], d[3][8], invD[3][8];
+    f8 invX = f8(1.f) / packet.dx, invY = f8(1.f) / packet.dy, invZ = f8(1.f) / packet.dz;
+    packet.ox.store(o[0]); packet.oy.store(o[1]); packet.oz.store(o[2]);
+    packet.dx.store(d[0]); packet.dy.store(d[1]); packet.dz.store(d[2]);
+    invX.store(invD[0]); invY.store(invD[1]); invZ.store(invD[2]);
+    packet.tmax.store(hits.t);
+    for(int i = 0; i < 8; ++i) hits.tri[i] = -1;
+
+    auto traceLane = [&](int root, int i) {
+        float lo[3] = {o[0][i], o[1][i], o[2][i]}, ld[3] = {d[0][i], d[1][i], d[2][i]};
+        float linv[3] = {invD[0][i], invD[1][i], invD[2][i]};
+        traverse<AnyHit>(root, lo, ld, linv, hits.t[i], hits.tri[i], hits.u[i], hits.v[i]);
+    };
+    auto hitLanes = [&]() {
+        int mask = 0;
+        for(int i = 0; i < 8; ++i) mask |= (hits.tri[i] >= 0) << i;
+        return mask;
+    };
+
+    int active = packet.active;
+    int lanes = 0;
+    for(int i = 0; i < 8; ++i) lanes += (active >> i) & 1;
+    if(lanes < PacketMinLanes) {
+        for(int i = 0; i < 8; ++i) {
+            if(!(active >> i & 1)) continue;
+            float linv[3] = {invD[0][i], invD[1][i], invD[2][i]};
+            float lo[3] = {o[0][i], o[1][i], o[2][i]};
+            if(slab(_nodes[0], lo, linv, hits.t[i]) != FLT_MAX) traceLane(0, i);
+        }
+        return hitLanes();
+    }
+
+    // Frustum culling needs one origin and the sign of each direction component shared by all rays
+    int lead = 0;
+    while(!(active >> lead & 1)) ++lead;
+    PacketFrustum frustum;
+    bool useFrustum = packet.sharedOrigin;
+    for(int a = 0; a < 3 && useFrustum; ++a) {
+        frustum.o[a] = o[a][lead];
+        frustum.invLo[a] = frustum.invHi[a] = invD[a][lead];
+        for(int i = 0; i < 8; ++i) {
+            if(!(active >> i & 1)) continue;
+            if(d[a][i] == 0.f || (d[a][i] < 0.f) != (d[a][lead] < 0.f)) useFrustum = false;
+            frustum.invLo[a] = std::min(frustum.invLo[a], invD[a][i]);
+            frustum.invHi[a] = std::max(frustum.invHi[a], invD[a][i]);
+        }
+    }
+    float frustumMax = 0.f; // furthest any active lane still looks
+    for(int i = 0; i < 8; ++i) if(active >> i & 1) frustumMax = std::max(frustumMax, hits.t[i]);
+
+    int stack[MaxDepth + 1];
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0) {
+        int n = stack[--top];
+        const Node& node = _nodes[n];
+        if(useFrustum && frustumMisses(node, frustum, frustumMax)) continue;
+
+        // Slab test of every lane against the node, as in slab
+        f8 best = f8::Load(hits.t);
+        f8 tmin(0.f), tmax = best;
+        f8 t0 = (f8(node.min[0]) - packet.ox) * invX, t1 = (f8(node.max[0]) - packet.ox) * invX;
+        tmin = Max(tmin, Min(t0, t1)); tmax = Min(tmax, Max(t0, t1));
+        t0 = (f8(node.min[1]) - packet.oy) * invY; t1 = (f8(node.max[1]) - packet.oy) * invY;
+        tmin = Max(tmin, Min(t0, t1)); tmax = Min(tmax, Max(t0, t1));
+        t0 = (f8(node.min[2]) - packet.oz) * invZ; t1 = (f8(node.max[2]) - packet.oz) * invZ;
+        tmin = Max(tmin, Min(t0, t1)); tmax = Min(tmax, Max(t0, t1));
+        int mask = MoveMask(tmin <= tmax) & active;
+        if(!mask) continue;
+
+        int count = 0;
+        for(int i = 0; i < 8; ++i) count += (mask >> i) & 1;
+        if(count < PacketMinLanes) {
+            // Too few rays left for the packet to pay off
+            for(int i = 0; i < 8; ++i) {
+                if(mask >> i & 1) traceLane(n, i);
+            }
+        }
+        else if(node.isLeaf()) {
+            f8 u = f8::Load(hits.u), v = f8::Load(hits.v);
+            f8 lanesIn = f8::FromMask(mask);
+            for(int i = node.leftFirst; i < node.leftFirst + node.count; ++i) {
+                f8 t, tu = 0.f, tv = 0.f;
+                f8 hit = (_tris[i].isSphere() ? IntersectSpherePacket(_tris[i], packet, best, t)
+                                              : IntersectPacket(_tris[i], packet, best, t, tu, tv)) & lanesIn;
+                int hitMask = MoveMask(hit);
+                if(!hitMask) continue;
+                for(int l = 0; l < 8; ++l) {
+                    if(hitMask >> l & 1) hits.tri[l] = i;
+                }
+                best = Select(hit, t, best);
+                u = Select(hit, tu, u);
+                v = Select(hit, tv, v);
+            }
+            best.store(hits.t);
+            u.store(hits.u);
+            v.store(hits.v);
+        }
+        else {
+            // Near child first along the leading ray
+            const Node& left = _nodes[node.leftFirst];
+            const Node& right = _nodes[node.leftFirst + 1];
+            float along = 0.f;
+            for(int a = 0; a < 3; ++a) along += (left.min[a] + left.max[a] - right.min[a] - right.max[a]) * d[a][lead];
+            int nearChild = node.leftFirst, farChild = node.leftFirst + 1;
+            if(along > 0.f) std::swap(nearChild, farChild);
+            stack[top++] = farChild;
+            stack[top++] = nearChild;
+            continue;
+        }
+
+        if(AnyHit) {
+            active &= ~hitLanes();
+            if(!active) break;
+        }
+        frustumMax = 0.f;
+        for(int i = 0; i < 8; ++i) if(active >> i & 1) frustumMax = std::max(frustumMax, hits.t[i]);
+    }
+    return hitLanes() & packet.active;
+}
+
+bool TriangleBVH::intersect(const float o[3], const float d[3], float tmax, RayHit& hit) const {
+    if(_nodes.empty()) return false;
+    float invD[3] = {1.f / d[0], 1.f / d[1], 1.f / d[2]};
+    if(slab(_nodes[0], o, invD, tmax) == FLT_MAX) return false;
+
+    float best = tmax, u = 0.f, v = 0.f;
+    int bestTri = -1;
+    traverse<false>(0, o, d, invD, best, bestTri, u, v);
+    if(bestTri < 0) return false;
+    hit.t = best;
+    hit.u = u;
+    hit.v = v;
+    hit.tri = _triIds[bestTri];
+    return true;
+}
+
+bool TriangleBVH::occluded(const float o[3], const float d[3], float tmax) const {
+    if(_nodes.empty()) return false;
+    float invD[3] = {1.f / d[0], 1.f / d[1], 1.f / d[2]};
+    if(slab(_nodes[0], o, invD, tmax) == FLT_MAX) return false;
+
+    float best = tmax, u, v;
+    int bestTri = -1;
+    traverse<true>(0, o, d, invD, best, bestTri, u, v);
+    return bestTri >= 0;
+}
+
+int TriangleBVH::intersect(const RayPacket& packet, RayHit hits[8]) const {
+    if(_nodes.empty() || !packet.active) return 0;
+    PacketHits found;
+    int mask = traversePacket<false>(packet, found);
+    for(int i = 0; i < 8; ++i) {
+        if(!(mask >> i & 1)) continue;
+        hits[i].t = found.t[i];
+        hits[i].u = found.u[i];
+        hits[i].v = found.v[i];
+        hits[i].tri = _triIds[found.tri[i]];
+    }
+    return mask;
+}
+
+int TriangleBVH::occluded(const RayPacket& packet) const {
+    if(_nodes.empty() || !packet.active) return 0;
+    PacketHits found;
+    return traversePacket<true>(packet, found);
+}
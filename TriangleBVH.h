@@ -0,0 +1,135 @@
+#ifndef TriangleBVH_DEFINED
+#define TriangleBVH_DEFINED
+
+#include <vector>
+#include <atomic>
+#include <float.h>
+#include <cmath>
+#include "include/Bounds.h"
+#include "include/SIMD.h"
+
+/// @brief Triangle in the form the ray intersection test wants. A sphere can take a triangle's place,
+/// see Sphere, so both share the BVH's primitive array.
+struct RTTriangle {
+    float v0[3];
+    float e1[3]; // v1 - v0
+    float e2[3]; // v2 - v0
+
+    /// @brief Sphere of radius around center, kept as v0 = center and e1[0] = radius, with e2[0] NaN to mark it
+    static RTTriangle Sphere(const float center[3], float radius) {
+        RTTriangle s{{center[0], center[1], center[2]}, {radius, 0.f, 0.f}, {NAN, 0.f, 0.f}};
+        return s;
+    }
+    bool isSphere() const { return std::isnan(e2[0]); }
+    float radius() const { return e1[0]; }
+};
+
+/// @brief Closest intersection found along a ray
+struct RayHit {
+    float t = FLT_MAX;      // in units of the ray direction
+    float u = 0.f, v = 0.f; // barycentric weights of the triangle's second and third vertex
+    int tri = -1;           // index into the triangles the BVH was built from, -1 if nothing was hit
+    int instance = -1;      // object hit, for two level structures (TwoLevelBVH)
+};
+
+/// @brief Up to 8 rays traced together, lane i of each vector belonging to ray i
+struct RayPacket {
+    f8 ox, oy, oz;
+    f8 dx, dy, dz;
+    f8 tmax = FLT_MAX;
+    int active = 0xFF;         // bit i set if lane i holds a ray
+    bool sharedOrigin = false; // every lane starts at the same point, which allows frustum culling
+};
+
+/// @brief Bounding volume hierarchy over triangles for ray tracing, built with binned SAH.
+/// Nodes are flattened to 32 bytes, two per cache line, with siblings stored next to each other
+/// so a parent only needs the index of its first child. Triangles are copied into leaf order.
+class TriangleBVH {
+public:
+    TriangleBVH() {}
+    TriangleBVH(const TriangleBVH&) = delete;
+    TriangleBVH& operator=(const TriangleBVH&) = delete;
+
+    /// @brief Build from scratch, splitting large subtrees across threads (0 for one per hardware thread)
+    void build(const std::vector<RTTriangle>& tris, int threads = 0);
+
+    /// @brief Closest front facing hit along o + t * d for t in (0, tmax). Triangles wound clockwise
+    /// as seen from the ray origin are back faces, matching the rasterizer's culling, and so is the
+    /// inside of a sphere. Sphere hits leave u and v at 0.
+    /// @return whether anything was hit, hit is only updated if so
+    bool intersect(const float o[3], const float d[3], float tmax, RayHit& hit) const;
+    /// @brief Whether anything intersect would find is hit, stopping at the first triangle found
+    bool occluded(const float o[3], const float d[3], float tmax) const;
+
+    /// @brief intersect for every active lane of a packet. Nodes are tested against all lanes at once,
+    /// and against the packet's bounding frustum first when it shares an origin and direction signs.
+    /// Lanes left alone in a subtree continue through it as single rays.
+    /// @return bit i set if ray i hit something, only those hits are updated
+    int intersect(const RayPacket& packet, RayHit hits[8]) const;
+    /// @brief occluded for every active lane of a packet
+    /// @return bit i set if ray i is occluded
+    int occluded(const RayPacket& packet) const;
+
+    bool empty() const { return _tris.empty(); }
+    int triCount() const { return (int) _tris.size(); }
+    int nodeCount() const { return _nodeCount; }
+    AABB bounds() const;
+
+private:
+    struct Node {
+        float min[3];
+        int leftFirst; // first child if internal (the second follows it), else first triangle
+        float max[3];
+        int count;     // triangles in the leaf, 0 if internal
+        bool isLeaf() const { return count > 0; }
+    };
+    static_assert(sizeof(Node) == 32, "BVH nodes should stay 32 bytes");
+
+    static const int Bins = 16;
+    static const int MaxLeafSize = 8;
+    static const int MaxDepth = 64;
+    static const int ParallelMinTris = 4096; // smaller subtrees are built on the thread that reaches them
+    static const int PacketMinLanes = 3;     // fewer rays reaching a node than this are traced one by one
+
+    std::vector<Node> _nodes;
+    int _nodeCount = 0;
+    std::vector<RTTriangle> _tris; // in leaf order
+    std::vector<int> _triIds;      // original index of each triangle in _tris
+
+    // Build scratch
+    std::atomic<int> _nodesUsed{0};
+    std::vector<AABB> _triBounds;
+    std::vector<float> _centroids; // xyz per triangle
+    std::vector<int> _indices;
+
+    void updateBounds(int node);
+    void subdivide(int node, int depth, int spawnDepth);
+    /// @brief Per lane closest hit state of a packet traversal
+    struct PacketHits {
+        alignas(32) float t[8];
+        alignas(32) float u[8];
+        alignas(32) float v[8];
+        int tri[8];
+    };
+    /// @brief Bounds of a packet's rays sharing an origin, for culling whole nodes
+    struct PacketFrustum {
+        float o[3];
+        float invLo[3], invHi[3]; // range of 1 / direction per axis, all of one sign
+    };
+
+    /// @brief Entry distance of a ray into a node's box, FLT_MAX on a miss or beyond tmax
+    static float slab(const Node& node, const float o[3], const float invD[3], float tmax);
+    /// @brief Whether no ray within frustum can enter the node before tmax
+    static bool frustumMisses(const Node& node, const PacketFrustum& frustum, float tmax);
+
+    /// @brief Single ray traversal of the subtree under root, whose box the ray is known to enter
+    template<bool AnyHit>
+    void traverse(int root, const float o[3], const float d[3], const float invD[3],
+                  float& best, int& bestTri, float& bestU, float& bestV) const;
+    /// @brief Packet traversal of the whole tree. Triangle indices in hits are into _tris.
+    /// @return lanes that hit something
+    template<bool AnyHit>
+    int traversePacket(const RayPacket& packet, PacketHits& hits) const;
+};
+
+#endif
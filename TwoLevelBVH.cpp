@@ -0,0 +1,264 @@
+#include "TwoLevelBVH.h"
+#include <algorithm>
+#include <cmath>
+
+bool TwoLevelBVH::update(const Scene& scene, int threads, bool spheres) {
+    for(auto& entry : _blas) entry.second.used = false;
+
+    int n = (int) scene.objects.size();
+    bool rebuild = n != (int) _instances.size();
+    _instances.resize(n);
+    _bounds.resize(n);
+    std::vector<int> moved;
+    for(int o = 0; o < n; ++o) {
+        const Object& obj = scene.objects[o];
+        bool sphere = spheres && obj.sphere && obj.mesh;
+        Instance inst = Place(obj, sphere);
+        if(obj.mesh) inst.blas = Bottom(obj, sphere, inst.mirrored, threads);
+
+        Instance& was = _instances[o];
+        if(was.blas != inst.blas) rebuild = true;
+        else if(!(was.transform == inst.transform)) moved.push_back(o);
+        was = inst;
+
+        AABB local;
+        if(sphere) {
+            local.grow(-1.f, -1.f, -1.f);
+            local.grow(1.f, 1.f, 1.f);
+        }
+        else if(inst.blas) local = inst.blas->bounds();
+        _bounds[o] = local.transformed(inst.transform);
+    }
+
+    // Meshes no object uses anymore
+    for(auto it = _blas.begin(); it != _blas.end();) {
+        if(it->second.used) ++it;
+        else it = _blas.erase(it);
+    }
+
+    if(rebuild) _top.build(_bounds);
+    else if(!moved.empty()) _top.refit(_bounds, moved);
+    return !rebuild;
+}
+
+const TriangleBVH* TwoLevelBVH::Bottom(const Object& obj, bool sphere, bool mirrored, int threads) {
+    BlasKey key{sphere ? nullptr : obj.mesh.get(), mirrored};
+    Blas& blas = _blas[key];
+    blas.used = true;
+    if(blas.bvh) return blas.bvh.get();
+
+    std::vector<RTTriangle> tris;
+    if(sphere) {
+        float center[3] = {0.f, 0.f, 0.f};
+        tris.push_back(RTTriangle::Sphere(center, 1.f));
+    }
+    else {
+        const Mesh& mesh = *obj.mesh;
+        blas.mesh = obj.mesh;
+        tris.resize(mesh.triCount());
+        for(int t = 0; t < mesh.triCount(); ++t) {
+            const int* idx = &mesh.indices[3 * t];
+            // Swapping two vertices keeps the same side facing the ray once mirrored into world space
+            const vec3& v0 = mesh.vertices[idx[0]];
+            const vec3& v1 = mesh.vertices[idx[mirrored ? 2 : 1]];
+            const vec3& v2 = mesh.vertices[idx[mirrored ? 1 : 2]];
+            for(int a = 0; a < 3; ++a) {
+                tris[t].v0[a] = v0[a];
+                tris[t].e1[a] = v1[a] - v0[a];
+                tris[t].e2[a] = v2[a] - v0[a];
+            }
+        }
+    }
+    blas.bvh = std::make_unique<TriangleBVH>();
+    blas.bvh->build(tris, threads);
+    return blas.bvh.get();
+}
+
+TwoLevelBVH::Instance TwoLevelBVH::Place(const Object& obj, bool sphere) {
+    Instance inst;
+    inst.mesh = sphere ? nullptr : obj.mesh.get();
+    inst.transform = obj.getTransform();
+    mat4 inverse = inst.transform.invert();
+    for(size_t i = 0; i < 3; ++i) {
+        for(size_t j = 0; j < 4; ++j) inst.toObject[i][j] = inverse[{i, j}];
+        for(size_t j = 0; j < 3; ++j) inst.normalToWorld[i][j] = inverse[{j, i}];
+    }
+    const mat4& m = inst.transform;
+    float det = m[{0, 0}] * (m[{1, 1}] * m[{2, 2}] - m[{1, 2}] * m[{2, 1}])
+              - m[{0, 1}] * (m[{1, 0}] * m[{2, 2}] - m[{1, 2}] * m[{2, 0}])
+              + m[{0, 2}] * (m[{1, 0}] * m[{2, 1}] - m[{1, 1}] * m[{2, 0}]);
+    inst.mirrored = !sphere && det < 0.f;
+    inst.color = obj.color;
+    inst.shininess = obj.shininess;
+    inst.smooth = obj.smooth;
+    inst.emitter = obj.isEmitter();
+    return inst;
+}
+
+void TwoLevelBVH::ToObject(const Instance& inst, const float o[3], const float d[3], float lo[3], float ld[3]) {
+    const float (*m)[4] = inst.toObject;
+    for(int i = 0; i < 3; ++i) {
+        lo[i] = m[i][0] * o[0] + m[i][1] * o[1] + m[i][2] * o[2] + m[i][3];
+        ld[i] = m[i][0] * d[0] + m[i][1] * d[1] + m[i][2] * d[2];
+    }
+}
+
+RayPacket TwoLevelBVH::ToObject(const Instance& inst, const RayPacket& packet) {
+    const float (*m)[4] = inst.toObject;
+    f8 o[3], d[3];
+    for(int i = 0; i < 3; ++i) {
+        o[i] = f8(m[i][0]) * packet.ox + f8(m[i][1]) * packet.oy + f8(m[i][2]) * packet.oz + f8(m[i][3]);
+        d[i] = f8(m[i][0]) * packet.dx + f8(m[i][1]) * packet.dy + f8(m[i][2]) * packet.dz;
+    }
+    RayPacket local = packet;
+    local.ox = o[0]; local.oy = o[1]; local.oz = o[2];
+    local.dx = d[0]; local.dy = d[1]; local.dz = d[2];
+    return local;
+}
+
+bool TwoLevelBVH::intersect(const float o[3], const float d[3], float tmax, RayHit& hit) const {
+    float invD[3] = {1.f / d[0], 1.f / d[1], 1.f / d[2]};
+    float best = tmax;
+    bool found = false;
+    _top.traverseRay(o, invD, best, [&](int obj) {
+        const Instance& inst = _instances[obj];
+        if(!inst.blas) return false;
+        float lo[3], ld[3];
+        ToObject(inst, o, d, lo, ld);
+        RayHit local;
+        if(inst.blas->intersect(lo, ld, best, local)) {
+            hit = local;
+            hit.instance = obj;
+            best = local.t;
+            found = true;
+        }
+        return false;
+    });
+    return found;
+}
+
+bool TwoLevelBVH::occluded(const float o[3], const float d[3], float tmax) const {
+    float invD[3] = {1.f / d[0], 1.f / d[1], 1.f / d[2]};
+    bool found = false;
+    _top.traverseRay(o, invD, tmax, [&](int obj) {
+        const Instance& inst = _instances[obj];
+        if(!inst.blas || inst.emitter) return false;
+        float lo[3], ld[3];
+        ToObject(inst, o, d, lo, ld);
+        found = inst.blas->occluded(lo, ld, tmax);
+        return found;
+    });
+    return found;
+}
+
+int TwoLevelBVH::intersect(const RayPacket& packet, RayHit hits[8]) const {
+    if(!packet.active) return 0;
+    f8 o[3] = {packet.ox, packet.oy, packet.oz};
+    f8 invD[3] = {f8(1.f) / packet.dx, f8(1.f) / packet.dy, f8(1.f) / packet.dz};
+    f8 best = packet.tmax;
+    int active = packet.active, found = 0;
+    _top.traversePacket(o, invD, best, active, [&](int obj, int lanes) {
+        const Instance& inst = _instances[obj];
+        if(!inst.blas) return;
+        RayPacket local = ToObject(inst, packet);
+        local.tmax = best;
+        local.active = lanes;
+        RayHit localHits[8];
+        int mask = inst.blas->intersect(local, localHits);
+        if(!mask) return;
+
+        alignas(32) float t[8];
+        best.store(t);
+        for(int l = 0; l < 8; ++l) {
+            if(!(mask >> l & 1)) continue;
+            hits[l] = localHits[l];
+            hits[l].instance = obj;
+            t[l] = localHits[l].t;
+        }
+        best = f8::Load(t);
+        found |= mask;
+    });
+    return found;
+}
+
+int TwoLevelBVH::occluded(const RayPacket& packet) const {
+    if(!packet.active) return 0;
+    f8 o[3] = {packet.ox, packet.oy, packet.oz};
+    f8 invD[3] = {f8(1.f) / packet.dx, f8(1.f) / packet.dy, f8(1.f) / packet.dz};
+    f8 tmax = packet.tmax;
+    int active = packet.active, found = 0;
+    _top.traversePacket(o, invD, tmax, active, [&](int obj, int lanes) {
+        const Instance& inst = _instances[obj];
+        if(!inst.blas || inst.emitter) return;
+        RayPacket local = ToObject(inst, packet);
+        local.active = lanes;
+        int mask = inst.blas->occluded(local);
+        found |= mask;
+        active &= ~mask;
+    });
+    return found;
+}
+
+void TwoLevelBVH::surface(const RayHit& hit, const float o[3], const float d[3], float normal[3], float albedo[3]) const {
+    const Instance& inst = _instances[hit.instance];
+    const float (*m)[3] = inst.normalToWorld;
+    // Plain floats, as vec3 allocates
+    auto toWorld = [&](float x, float y, float z, float n[3]) {
+        for(int a = 0; a < 3; ++a) n[a] = m[a][0] * x + m[a][1] * y + m[a][2] * z;
+        float s = 1.f / std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        for(int a = 0; a < 3; ++a) n[a] *= s;
+    };
+
+    if(!inst.mesh) {
+        // On the unit sphere the object space point is its own normal
+        float lo[3], ld[3];
+        ToObject(inst, o, d, lo, ld);
+        toWorld(lo[0] + hit.t * ld[0], lo[1] + hit.t * ld[1], lo[2] + hit.t * ld[2], normal);
+        albedo[0] = inst.color.r;
+        albedo[1] = inst.color.g;
+        albedo[2] = inst.color.b;
+        return;
+    }
+
+    // A mirrored mesh' BVH has its second and third vertex swapped
+    const Mesh& mesh = *inst.mesh;
+    const int* idx = &mesh.indices[3 * hit.tri];
+    float u = inst.mirrored ? hit.v : hit.u, v = inst.mirrored ? hit.u : hit.v;
+    float w[3] = {1.f - u - v, u, v};
+    float n[3];
+    if(!inst.smooth) {
+        const vec3& f = mesh.faceNormals[hit.tri];
+        toWorld(f[0], f[1], f[2], n);
+    }
+    for(int a = 0; a < 3; ++a) normal[a] = albedo[a] = 0.f;
+    for(int k = 0; k < 3; ++k) {
+        if(inst.smooth) {
+            const vec3& vn = mesh.normals[idx[k]];
+            toWorld(vn[0], vn[1], vn[2], n);
+        }
+        GColor c = mesh.colors.has_value() ? mesh.colors.value()[idx[k]] * inst.color : inst.color;
+        float col[3] = {c.r, c.g, c.b};
+        for(int a = 0; a < 3; ++a) {
+            normal[a] += w[k] * n[a];
+            albedo[a] += w[k] * col[a];
+        }
+    }
+}
+
+int TwoLevelBVH::triCount() const {
+    int n = 0;
+    for(const auto& entry : _blas) n += entry.second.bvh->triCount();
+    return n;
+}
+
+int TwoLevelBVH::instancedTriCount() const {
+    int n = 0;
+    for(const Instance& inst : _instances) n += inst.blas ? inst.blas->triCount() : 0;
+    return n;
+}
+
+int TwoLevelBVH::nodeCount() const {
+    int n = _top.nodeCount();
+    for(const auto& entry : _blas) n += entry.second.bvh->nodeCount();
+    return n;
+}
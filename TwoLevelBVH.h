@@ -0,0 +1,101 @@
+#ifndef TwoLevelBVH_DEFINED
+#define TwoLevelBVH_DEFINED
+
+#include <vector>
+#include <map>
+#include <memory>
+#include "SceneBuilder.h"
+#include "SceneBVH.h"
+#include "TriangleBVH.h"
+
+/*
+    Two level acceleration structure over a Scene's objects, for ray tracing.
+
+    The bottom level is a TriangleBVH per unique mesh, built over its triangles in object space. Objects share
+    meshes (every cube, every icosphere of a subdivision level), so a mesh is built once however many objects
+    use it, and kept across updates for as long as some object still does. The top level is a SceneBVH over the
+    objects' world space boxes. Rays reaching an object are carried into its space and traced through its mesh's
+    BVH; the transform is affine and directions aren't renormalized, so distances along them stay the same.
+
+    When only transforms changed since the last update, the top level is refit for the moved objects rather
+    than rebuilt, and no bottom level BVH is touched.
+*/
+class TwoLevelBVH {
+public:
+    /// @brief An object placed in the scene
+    struct Instance {
+        const TriangleBVH* blas = nullptr; // null for objects without a mesh
+        const Mesh* mesh = nullptr;        // null for analytic spheres
+        mat4 transform;                    // object to world, as it was placed
+        float toObject[3][4];              // world to object space
+        float normalToWorld[3][3];         // inverse transpose of transform's linear part
+        GColor color;
+        float shininess = 0.f;
+        bool smooth = false;
+        bool mirrored = false; // transform flips handedness, so the mesh's BVH is wound the other way
+        bool emitter = false;
+    };
+
+    TwoLevelBVH() {}
+    TwoLevelBVH(const TwoLevelBVH&) = delete;
+    TwoLevelBVH& operator=(const TwoLevelBVH&) = delete;
+
+    /// @brief Bring the structure up to date with scene, building BVHs only for meshes not seen before
+    /// @param threads for building, 0 for one per hardware thread
+    /// @param spheres trace icospheres (Object::sphere) as exact spheres, see RenderSettings::analyticSpheres
+    /// @return true if the top level was only refit, false if it was rebuilt
+    bool update(const Scene& scene, int threads, bool spheres = false);
+
+    /// @brief Closest front facing hit along o + t * d for t in (0, tmax), see TriangleBVH::intersect.
+    /// hit.instance is the object hit, and hit.tri indexes its mesh's triangles.
+    bool intersect(const float o[3], const float d[3], float tmax, RayHit& hit) const;
+    /// @brief Whether any shadow casting object is hit. Emitters mark where lights are, and cast none.
+    bool occluded(const float o[3], const float d[3], float tmax) const;
+    /// @brief intersect for every active lane of a packet
+    /// @return bit i set if ray i hit something, only those hits are updated
+    int intersect(const RayPacket& packet, RayHit hits[8]) const;
+    /// @brief occluded for every active lane of a packet
+    /// @return bit i set if ray i is occluded
+    int occluded(const RayPacket& packet) const;
+
+    /// @brief Normal and albedo where hit, a hit of the ray o + t * d, lands. The normal is exact for
+    /// spheres, and interpolated like the rasterizer's for triangles, so only nearly unit length.
+    void surface(const RayHit& hit, const float o[3], const float d[3], float normal[3], float albedo[3]) const;
+    const Instance& instance(const RayHit& hit) const { return _instances[hit.instance]; }
+
+    bool empty() const { return _instances.empty(); }
+    int instanceCount() const { return (int) _instances.size(); }
+    /// @brief Meshes with a BVH of their own, a mesh used both as is and mirrored counting twice
+    int meshCount() const { return (int) _blas.size(); }
+    /// @brief Triangles the meshes' BVHs hold, each counted once however many objects share it
+    int triCount() const;
+    /// @brief Triangles of every object, as many as a single level BVH would hold
+    int instancedTriCount() const;
+    /// @brief Nodes of the top level and every mesh's BVH
+    int nodeCount() const;
+
+private:
+    /// @brief A mesh's BVH, holding on to the mesh so its address can't be reused by another
+    struct Blas {
+        MeshHandle mesh;
+        std::unique_ptr<TriangleBVH> bvh;
+        bool used = false;
+    };
+    using BlasKey = std::pair<const Mesh*, bool>; // mesh, or null for the unit sphere, and whether mirrored
+
+    std::map<BlasKey, Blas> _blas;
+    std::vector<Instance> _instances; // indexed like the scene's objects
+    std::vector<AABB> _bounds;        // world space box of each instance
+    SceneBVH _top;
+
+    /// @brief BVH of obj's mesh, or of the unit sphere, building it if it's new
+    const TriangleBVH* Bottom(const Object& obj, bool sphere, bool mirrored, int threads);
+    /// @brief Instance for obj, all but its BVH
+    static Instance Place(const Object& obj, bool sphere);
+
+    /// @brief Ray o + t * d carried into an instance's object space
+    static void ToObject(const Instance& inst, const float o[3], const float d[3], float lo[3], float ld[3]);
+    static RayPacket ToObject(const Instance& inst, const RayPacket& packet);
+};
+
+#endif
@@ -5,80 +5,576 @@
 #include <string>
 #include "../Camera.h"
 #include "../Projector.h"
+#include "../FramePipeline.h"
+#include "../RayTracer.h"
+#include "../PathTracer.h"
+#include "../include/PNGStream.h"
 #include <iostream>
+#include <fstream>
+#include <cstdio>
 
 using namespace std;
 
+static void PrintPerfValues(const char* phase, const PerfValues& v) {
+    cout << "  " << phase << "\t" << v.cycles << "\t" << v.instructions << "\t" << v.ipc() << "\t"
+         << v.l1dMisses << "\t" << v.llcMisses << "\t" << v.branchMisses << endl;
+}
+
+static json PerfValuesToJson(const PerfValues& v) {
+    return json{
+        {"cycles", v.cycles},
+        {"instructions", v.instructions},
+        {"l1dMisses", v.l1dMisses},
+        {"llcMisses", v.llcMisses},
+        {"branchMisses", v.branchMisses}
+    };
+}
+
+static json AllocsToJson(const AllocStatistic& allocs) {
+    json sites = json::array();
+    for(const AllocSite& site : allocs.topSites) {
+        sites.push_back({{"symbol", site.symbol}, {"count", site.count}, {"bytes", site.bytes}});
+    }
+    return json{
+        {"tracked", allocs.tracked},
+        {"allocations", allocs.allocations},
+        {"frees", allocs.frees},
+        {"bytes", allocs.bytes},
+        {"peakHeapBytes", allocs.peakHeapBytes},
+        {"peakResidentBytes", allocs.peakResidentBytes},
+        {"topSites", sites}
+    };
+}
+
+static void PrintStats(const RenderStatistic& stats) {
+    const PhaseTimings& p = stats.phases;
+    cout << "Phase times (ms):" << endl;
+    cout << "  scene copy\t\t" << p.sceneCopy * 1000.0 << endl;
+    cout << "  cull\t\t\t" << p.cull * 1000.0 << endl;
+    cout << "  vertex transform\t" << p.vertexTransform * 1000.0 << endl;
+    cout << "  tri setup\t\t" << p.triSetup * 1000.0 << endl;
+    cout << "  raster\t\t" << p.raster * 1000.0 << endl;
+    cout << "  lighting\t\t" << p.lighting * 1000.0 << endl;
+    cout << "  output conversion\t" << p.outputConversion * 1000.0 << endl;
+    cout << "  png encode\t\t" << p.pngEncode * 1000.0 << endl;
+    if(stats.numRays > 0) {
+        cout << "  accel build\t\t" << p.accelBuild * 1000.0 << endl;
+        cout << "  trace\t\t\t" << p.trace * 1000.0 << endl;
+        cout << "# Rays:\t\t\t" << stats.numRays << endl;
+        if(p.trace > 0.0) cout << "Mrays/s:\t\t" << stats.numRays / p.trace / 1e6 << endl;
+        if(p.denoise > 0.0) cout << "  denoise\t\t" << p.denoise * 1000.0 << endl;
+    }
+    if(stats.numShadowMapsDrawn > 0) {
+        cout << "  shadow maps\t\t" << p.shadowMaps * 1000.0 << endl;
+        cout << "# Shadow maps drawn:\t" << stats.numShadowMapsDrawn << endl;
+    }
+    cout << "# Vertices transformed:\t" << stats.numVerticesTransformed << endl;
+    cout << "# Pixels rasterized:\t" << stats.numPixelsRasterized << endl;
+    cout << "# Depth test passes:\t" << stats.numDepthPasses << endl;
+    cout << "# Light evaluations:\t" << stats.numLightEvals << endl;
+    cout << "# Raster tests:\t\t" << stats.numRasterTests << endl;
+    if(stats.maxRasterTests > 0) {
+        cout << "# Lights in range:\t" << stats.numLightsInRange << endl;
+        cout << "Max per pixel:\t\t" << stats.maxRasterTests << " raster tests, " << stats.maxOverdraw << " overdraw, "
+             << stats.maxLightsPerPixel << " lights" << endl;
+    }
+
+    const PhaseCounters& perf = stats.perf;
+    if(perf.available) {
+        cout << "Hardware counters:\tcycles\tinstr\tIPC\tL1D miss\tLLC miss\tbranch miss" << endl;
+        PrintPerfValues("cull\t\t", perf.cull);
+        PrintPerfValues("vertex transform", perf.vertexTransform);
+        PrintPerfValues("tri setup\t", perf.triSetup);
+        PrintPerfValues("raster\t\t", perf.raster);
+        PrintPerfValues("lighting\t", perf.lighting);
+    }
+    else if(!perf.unavailableReason.empty()) {
+        cout << "Hardware counters:\tunavailable (" << perf.unavailableReason << ")" << endl;
+    }
+
+    const AllocStatistic& allocs = stats.allocs;
+    if(allocs.tracked) {
+        cout << "# Allocations:\t\t" << allocs.allocations << " (" << allocs.bytes << " bytes), "
+             << allocs.frees << " frees" << endl;
+        cout << "Peak heap:\t\t" << allocs.peakHeapBytes << " bytes" << endl;
+        cout << "Top allocation sites:" << endl;
+        for(const AllocSite& site : allocs.topSites) {
+            cout << "  " << site.count << "\t" << site.bytes << " bytes\t" << site.symbol << endl;
+        }
+    }
+    cout << "Peak resident:\t\t" << allocs.peakResidentBytes << " bytes" << endl;
+}
+
+static json StatsToJson(const RenderStatistic& stats) {
+    const PhaseTimings& p = stats.phases;
+    return json{
+        {"secondsTaken", stats.secondsTaken},
+        {"phases", {
+            {"sceneCopy", p.sceneCopy},
+            {"cull", p.cull},
+            {"vertexTransform", p.vertexTransform},
+            {"triSetup", p.triSetup},
+            {"raster", p.raster},
+            {"lighting", p.lighting},
+            {"outputConversion", p.outputConversion},
+            {"pngEncode", p.pngEncode},
+            {"shadowMaps", p.shadowMaps},
+            {"accelBuild", p.accelBuild},
+            {"trace", p.trace},
+            {"denoise", p.denoise}
+        }},
+        {"numObjects", stats.numObjects},
+        {"numObjectsCulled", stats.numObjectsCulled},
+        {"numObjectsLODReduced", stats.numObjectsLODReduced},
+        {"numMeshBatches", stats.numMeshBatches},
+        {"numTrisTotal", stats.numTrisTotal},
+        {"numTrisDrawn", stats.numTrisDrawn},
+        {"numLights", stats.numLights},
+        {"fullRender", stats.fullRender},
+        {"numPixelsDamaged", stats.numPixelsDamaged},
+        {"numVerticesTransformed", stats.numVerticesTransformed},
+        {"numPixelsRasterized", stats.numPixelsRasterized},
+        {"numDepthPasses", stats.numDepthPasses},
+        {"numLightEvals", stats.numLightEvals},
+        {"numRasterTests", stats.numRasterTests},
+        {"numRays", stats.numRays},
+        {"mraysPerSecond", p.trace > 0.0 ? stats.numRays / p.trace / 1e6 : 0.0},
+        {"numShadowMapsDrawn", stats.numShadowMapsDrawn},
+        {"numPasses", stats.numPasses},
+        {"numSamples", stats.numSamples},
+        {"numPixelsConverged", stats.numPixelsConverged},
+        {"numLightsInRange", stats.numLightsInRange},
+        {"maxRasterTests", stats.maxRasterTests},
+        {"maxOverdraw", stats.maxOverdraw},
+        {"maxLightsPerPixel", stats.maxLightsPerPixel},
+        {"perf", {
+            {"available", stats.perf.available},
+            {"unavailableReason", stats.perf.unavailableReason},
+            {"cull", PerfValuesToJson(stats.perf.cull)},
+            {"vertexTransform", PerfValuesToJson(stats.perf.vertexTransform)},
+            {"triSetup", PerfValuesToJson(stats.perf.triSetup)},
+            {"raster", PerfValuesToJson(stats.perf.raster)},
+            {"lighting", PerfValuesToJson(stats.perf.lighting)}
+        }},
+        {"allocs", AllocsToJson(stats.allocs)}
+    };
+}
+
+/// @brief Triangle count of a ray traced frame, and how many of them instancing left to build BVHs over
+static void PrintBVH(const RenderStatistic& stats, const TwoLevelBVH& bvh) {
+    cout << "# Triangles:\t" << stats.numTrisTotal << " (" << bvh.triCount() << " in " << bvh.meshCount()
+         << " meshes) in " << bvh.nodeCount() << " BVH nodes" << endl;
+}
+
+static const int MaxImageSize = 16384;             // per side, see -w and -h
+static const int64_t AutoBandPixels = 4096 * 4096; // raster images larger than this render in bands
+static const int DefaultBandRows = 64;
+
+/// @brief Output size from -w and -h, either of which may be 0 to follow the camera's aspect (width over height)
+static GISize ImageSize(int width, int height, float aspect) {
+    if(width == 0 && height == 0) return {256, 256};
+    if(width == 0) width = std::max(1, (int) std::lround(height * aspect));
+    if(height == 0) height = std::max(1, (int) std::lround(width / aspect));
+    if(width > MaxImageSize || height > MaxImageSize)
+        throw CustomException("Image size is limited to 16384 pixels per side.");
+    return {width, height};
+}
+
+/// @brief Inverse depth as a 16 bit grayscale PNG, 1 / near white down to 1 / far and empty pixels black
+static bool WriteDepthPNG(const string& filename, const std::vector<float>& invDepth, GISize dim, const Camera& cam) {
+    PNGStream png;
+    if(!png.open(filename.c_str(), dim.width, dim.height, PNGStream::Format::Gray16)) return false;
+    float lo = 1.f / cam.far(), hi = 1.f / cam.near();
+    std::vector<uint16_t> row(dim.width);
+    for(int y = 0; y < dim.height; ++y) {
+        const float* src = &invDepth[(size_t) y * dim.width];
+        for(int x = 0; x < dim.width; ++x) {
+            float t = std::clamp((src[x] - lo) / (hi - lo), 0.f, 1.f);
+            row[x] = (uint16_t) std::lround(t * 65535.f);
+        }
+        png.write(row.data(), 1);
+    }
+    return png.close();
+}
+
+/// @brief Inverse depth as is, 0 for empty pixels, as a single channel Portable Float Map (rows bottom to top)
+static bool WriteDepthPFM(const string& filename, const std::vector<float>& invDepth, GISize dim) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if(!file) return false;
+    // A negative scale marks little endian floats
+    const uint16_t probe = 1;
+    bool little = *(const uint8_t*) &probe == 1;
+    bool ok = fprintf(file, "Pf\n%d %d\n%s\n", dim.width, dim.height, little ? "-1.0" : "1.0") > 0;
+    for(int y = dim.height - 1; y >= 0 && ok; --y) {
+        ok = fwrite(&invDepth[(size_t) y * dim.width], sizeof(float), dim.width, file) == (size_t) dim.width;
+    }
+    return fclose(file) == 0 && ok;
+}
+
+static void WriteStatsJson(const string& filename, const json& data) {
+    ofstream file(filename);
+    if(!file) throw CustomException("Could not open stats file.");
+    file << data.dump(2) << endl;
+}
+
 int main(int argc, char* argv[]) {
     // Handle command inputs
     if(argc < 2) {
         cout << "Need to specify json scene file to render." << endl;
-        cout << "Command: ./render <json file> [-o filename]" << endl;
+        cout << "Command: ./render <json file> [-o filename] [-w width] [-h height] [--aspect A] [--band rows] [-v] [--no-lod] [--lod-ppt pixels] [--frames N] [--fps F] [--incremental] [--stats-json file] [--trace file] [--heatmaps] [--perf] [--fast-math] [--mode raster|rt|pt] [--single-rays] [--shadows none|rt|map] [--shadow-map-size N] [--spp N] [--noise T] [--save-every N] [--denoise] [--analytic-spheres] [--depth-only] [--depth-format png16|float]" << endl;
         return -1;
     }
 
     string sceneFile(argv[1]);
     string title = "image";
     bool verbose = false;
+    int frames = 0;
+    float fps = 24.f;
+    bool incremental = false;
+    string statsFile = "";
+    string traceFile = "";
+    bool rayTrace = false;
+    bool pathTrace = false;
+    int saveEvery = 0;
+    int width = 0, height = 0;
+    float aspect = 0.f;
+    int bandRows = 0;
+    bool depthOnly = false;
+    bool depthFloat = false;
+    RenderSettings settings{};
     for(int i = 2; i < argc; ++i) {
         if(string(argv[i]) == "-o") {
             if(i + 1 >= argc) throw CustomException("Unspecified output filename.");
             title = string(argv[i+1]);
         }
+        else if(string(argv[i]) == "-w" || string(argv[i]) == "-h") {
+            if(i + 1 >= argc) throw CustomException("Unspecified image size.");
+            int size = stoi(argv[i + 1]);
+            if(size < 1) throw CustomException("Image size must be positive.");
+            (argv[i][1] == 'w' ? width : height) = size;
+            ++i;
+        }
+        else if(string(argv[i]) == "--aspect") {
+            if(i + 1 >= argc) throw CustomException("Unspecified aspect ratio.");
+            aspect = stof(argv[++i]);
+            if(aspect <= 0.f) throw CustomException("Aspect ratio must be positive.");
+        }
+        else if(string(argv[i]) == "--band") {
+            if(i + 1 >= argc) throw CustomException("Unspecified band height.");
+            bandRows = stoi(argv[++i]);
+            if(bandRows < 1) throw CustomException("Band height must be positive.");
+        }
         else if(string(argv[i]) == "-v") verbose = true;
+        else if(string(argv[i]) == "--no-lod") settings.lod = false;
+        else if(string(argv[i]) == "--lod-ppt") {
+            if(i + 1 >= argc) throw CustomException("Unspecified pixels per triangle.");
+            settings.lodPixelsPerTri = stof(argv[++i]);
+        }
+        else if(string(argv[i]) == "--frames") {
+            if(i + 1 >= argc) throw CustomException("Unspecified frame count.");
+            frames = stoi(argv[++i]);
+        }
+        else if(string(argv[i]) == "--fps") {
+            if(i + 1 >= argc) throw CustomException("Unspecified frame rate.");
+            fps = stof(argv[++i]);
+            if(fps <= 0.f) throw CustomException("Frame rate must be positive.");
+        }
+        else if(string(argv[i]) == "--incremental") incremental = true;
+        else if(string(argv[i]) == "--heatmaps") settings.counters = true;
+        else if(string(argv[i]) == "--perf") settings.perfCounters = true;
+        else if(string(argv[i]) == "--fast-math") settings.math = MathMode::Approx;
+        else if(string(argv[i]) == "--single-rays") settings.rayPackets = false;
+        else if(string(argv[i]) == "--denoise") settings.denoise = true;
+        else if(string(argv[i]) == "--analytic-spheres") settings.analyticSpheres = true;
+        else if(string(argv[i]) == "--depth-only") depthOnly = true;
+        else if(string(argv[i]) == "--depth-format") {
+            if(i + 1 >= argc) throw CustomException("Unspecified depth format.");
+            string format = argv[++i];
+            if(format == "float") depthFloat = true;
+            else if(format == "png16") depthFloat = false;
+            else throw CustomException("Depth format must be png16 or float.");
+        }
+        else if(string(argv[i]) == "--stats-json") {
+            if(i + 1 >= argc) throw CustomException("Unspecified stats filename.");
+            statsFile = string(argv[++i]);
+        }
+        else if(string(argv[i]) == "--shadows") {
+            if(i + 1 >= argc) throw CustomException("Unspecified shadow mode.");
+            string mode = argv[++i];
+            if(mode == "rt") settings.shadows = ShadowMode::RayTraced;
+            else if(mode == "map") settings.shadows = ShadowMode::Maps;
+            else if(mode == "none") settings.shadows = ShadowMode::None;
+            else throw CustomException("Shadow mode must be none, rt or map.");
+        }
+        else if(string(argv[i]) == "--shadow-map-size") {
+            if(i + 1 >= argc) throw CustomException("Unspecified shadow map size.");
+            settings.shadowMapSize = stoi(argv[++i]);
+            if(settings.shadowMapSize < 1) throw CustomException("Shadow map size must be positive.");
+        }
+        else if(string(argv[i]) == "--mode") {
+            if(i + 1 >= argc) throw CustomException("Unspecified render mode.");
+            string mode = argv[++i];
+            if(mode == "rt") rayTrace = true;
+            else if(mode == "pt") rayTrace = pathTrace = true;
+            else if(mode != "raster") throw CustomException("Render mode must be raster, rt or pt.");
+        }
+        else if(string(argv[i]) == "--spp") {
+            if(i + 1 >= argc) throw CustomException("Unspecified samples per pixel.");
+            settings.maxSamples = stoi(argv[++i]);
+            if(settings.maxSamples < 1) throw CustomException("Samples per pixel must be positive.");
+        }
+        else if(string(argv[i]) == "--noise") {
+            if(i + 1 >= argc) throw CustomException("Unspecified noise threshold.");
+            settings.noiseThreshold = stof(argv[++i]);
+            if(settings.noiseThreshold <= 0.f) throw CustomException("Noise threshold must be positive.");
+        }
+        else if(string(argv[i]) == "--save-every") {
+            if(i + 1 >= argc) throw CustomException("Unspecified pass interval.");
+            saveEvery = stoi(argv[++i]);
+        }
+        else if(string(argv[i]) == "--trace") {
+            if(i + 1 >= argc) throw CustomException("Unspecified trace filename.");
+            traceFile = string(argv[++i]);
+        }
     }
 
 
+    if(!traceFile.empty()) {
+        Trace::SetEnabled(true);
+        Trace::SetThreadName("main");
+    }
+    auto writeTrace = [&]() {
+        if(traceFile.empty()) return;
+        if(!Trace::WriteJson(traceFile.c_str())) cout << "Failed to write trace " << traceFile << endl;
+    };
+
     // Build scene
     SceneBuilder builder(sceneFile);
+    Stopwatch copyWatch;
+    Scene scene = builder.getScene();
+    double copySeconds = copyWatch.elapsed();
+    json frameStats = json::array();
+
+    if(frames > 0 && rayTrace) throw CustomException("Ray tracing only renders single frames.");
+    if(!rayTrace) settings.analyticSpheres = false; // rasterized spheres keep their facets
+
+    // With only one of width and height given the other follows the camera's aspect, with both the camera keeps its own
+    if(aspect > 0.f) scene.cam.setAspect(aspect);
+    GISize dim = ImageSize(width, height, scene.cam.aspect());
+    if(bandRows > 0 && (frames > 0 || rayTrace)) throw CustomException("Band rendering only renders single rasterized frames.");
+    if(depthOnly && (frames > 0 || rayTrace || bandRows > 0))
+        throw CustomException("Depth only rendering only renders single rasterized frames, without bands.");
+    // Depth only rendering holds 4 bytes per pixel, so it never needs bands
+    bool bands = bandRows > 0 || (frames == 0 && !rayTrace && !depthOnly && (int64_t) dim.width * dim.height > AutoBandPixels);
+    if(bands && bandRows == 0) bandRows = DefaultBandRows;
+
+    if(frames > 0 && incremental) {
+        // Sequence mode redrawing only what moved since the previous frame
+        GBitmap frameBitmap;
+        frameBitmap.alloc(dim.width, dim.height);
+        Projector projector(nullptr, dim, &frameBitmap);
+        projector.setSettings(settings);
+
+        double seconds = 0.0;
+        for(int frame = 0; frame < frames; ++frame) {
+            scene.Animate(frame / fps);
+            RenderStatistic stats = projector.RenderIncremental(scene, dim);
+            seconds += stats.secondsTaken;
+
+            char filename[512];
+            snprintf(filename, sizeof(filename), "%s_%05d.png", title.c_str(), frame);
+            Stopwatch encodeWatch;
+            frameBitmap.writeToFile(filename);
+            stats.phases.pngEncode = encodeWatch.elapsed();
+            if(!statsFile.empty()) frameStats.push_back(StatsToJson(stats));
+            if(verbose) cout << "Rendered " << filename << " in " << stats.secondsTaken * 1000.f << "ms, "
+                             << (stats.fullRender ? "full" : "incremental") << ", "
+                             << stats.numPixelsDamaged << " pixels relit" << endl;
+        }
+
+        cout << "Rendered " << frames << " frames in " << seconds * 1000.f << "ms" << endl;
+        if(!statsFile.empty()) WriteStatsJson(statsFile, json{{"frames", frameStats}});
+        writeTrace();
+        free(frameBitmap.pixels());
+        return 0;
+    }
+    if(frames > 0) {
+        // Sequence mode, the scene is built once and only transforms change between frames
+        FramePipeline pipeline(dim, settings);
+        PipelineStatistic seqStats = pipeline.Run(scene, frames,
+            [&](int frame, Scene& s) {
+                s.Animate(frame / fps);
+                return true;
+            },
+            [&](int frame, const GBitmap& frameBitmap, const RenderStatistic& stats) {
+                char filename[512];
+                snprintf(filename, sizeof(filename), "%s_%05d.png", title.c_str(), frame);
+                Stopwatch encodeWatch;
+                frameBitmap.writeToFile(filename);
+                if(!statsFile.empty()) {
+                    RenderStatistic frameStat = stats;
+                    frameStat.phases.pngEncode = encodeWatch.elapsed();
+                    frameStats.push_back(StatsToJson(frameStat));
+                }
+                if(verbose) cout << "Rendered " << filename << " in " << stats.secondsTaken * 1000.f << "ms" << endl;
+            });
 
+        cout << "Rendered " << seqStats.numFrames << " frames in " << seqStats.secondsTaken * 1000.f << "ms ("
+             << seqStats.framesPerSecond << " fps)" << endl;
+        if(!statsFile.empty()) {
+            WriteStatsJson(statsFile, json{{"frames", frameStats},
+                                           {"secondsTaken", seqStats.secondsTaken},
+                                           {"framesPerSecond", seqStats.framesPerSecond}});
+        }
+        writeTrace();
+        return 0;
+    }
+    if(scene.isAnimated()) scene.Animate(0.f);
+
+    // Band rendering streams rows to the file as they're lit, so the whole image is never held
     GBitmap bitmap;
-    bitmap.alloc(256, 256);
-    auto canvas = GCreateCanvas(bitmap);
-    if(!canvas){
-        cout << "Failed to create bitmap." << endl;
-        return -1;
+    std::unique_ptr<GCanvas> canvas;
+    if(!bands && !depthOnly) {
+        bitmap.alloc(dim.width, dim.height);
+        canvas = GCreateCanvas(bitmap);
+        if(!canvas){
+            cout << "Failed to create bitmap." << endl;
+            return -1;
+        }
     }
 
-    Projector projector(canvas.get(), GISize{bitmap.width(), bitmap.height()}, &bitmap);
+    Projector projector(canvas.get(), dim, &bitmap);
+    projector.setSettings(settings);
+    RayTracer rayTracer;
+    rayTracer.setSettings(settings);
+
+    PathTracer pathTracer;
+    pathTracer.setSettings(settings);
 
-    RenderStatistic stats = projector.RenderSceneTo(builder.getScene(), *canvas,
-                                                     {bitmap.width(), bitmap.height()});
+    RenderStatistic stats;
+    std::vector<float> invDepth;
+    if(pathTrace) {
+        // Progressive, writing the image so far every saveEvery passes
+        stats = pathTracer.RenderSceneTo(scene, bitmap, [&](int pass, const GBitmap& image, const RenderStatistic& passStats) {
+            if(saveEvery > 0 && pass % saveEvery == 0) {
+                char filename[512];
+                snprintf(filename, sizeof(filename), "%s_pass%04d.png", title.c_str(), pass);
+                image.writeToFile(filename);
+            }
+            if(verbose) cout << "Pass " << pass << " at " << passStats.secondsTaken * 1000.f << "ms, "
+                             << passStats.numSamples << " samples, " << passStats.numPixelsConverged << " pixels converged" << endl;
+        });
+    }
+    else if(rayTrace) stats = rayTracer.RenderSceneTo(scene, bitmap);
+    else if(bands) {
+        PNGStream png;
+        if(!png.open((title + ".png").c_str(), dim.width, dim.height)) throw CustomException("Could not open output file.");
+        double encodeSeconds = 0.0;
+        stats = projector.RenderBands(scene, dim, bandRows, [&](int, const GBitmap& rows) {
+            Stopwatch encodeWatch;
+            png.write(rows);
+            encodeSeconds += encodeWatch.elapsed();
+        });
+        Stopwatch encodeWatch;
+        if(!png.close()) cout << "Failed to write " << title << ".png" << endl;
+        stats.phases.pngEncode = encodeSeconds + encodeWatch.elapsed();
+    }
+    else if(depthOnly) stats = projector.RenderDepth(scene, dim, invDepth);
+    else stats = projector.RenderSceneTo(scene, *canvas, dim);
 
-    string filename = title + ".png";
-    bitmap.writeToFile(filename.c_str());
+    stats.phases.sceneCopy = copySeconds;
+
+    string filename = title + (depthOnly && depthFloat ? ".pfm" : ".png");
+    if(depthOnly) {
+        Stopwatch encodeWatch;
+        bool written = depthFloat ? WriteDepthPFM(filename, invDepth, dim) : WriteDepthPNG(filename, invDepth, dim, scene.cam);
+        if(!written) cout << "Failed to write " << filename << endl;
+        stats.phases.pngEncode = encodeWatch.elapsed();
+    }
+    else if(!bands) {
+        Stopwatch encodeWatch;
+        bitmap.writeToFile(filename.c_str());
+        stats.phases.pngEncode = encodeWatch.elapsed();
+    }
 
     cout << "Rendered " << filename << " in " << stats.secondsTaken * 1000.f << "ms (" << 1.f / stats.secondsTaken << " fps)" << endl;
-    cout << "# Objects:\t" << stats.numObjects << endl;
-    cout << "# Triangles:\t" << stats.numTrisDrawn << "/" << stats.numTrisTotal << endl;
+    cout << "# Objects:\t" << stats.numObjects - stats.numObjectsCulled << "/" << stats.numObjects << endl;
+    if(pathTrace) {
+        int pixels = dim.width * dim.height;
+        PrintBVH(stats, pathTracer.getBVH());
+        cout << "# Samples:\t" << stats.numSamples << " (" << (double) stats.numSamples / pixels << " per pixel) in "
+             << stats.numPasses << " passes, " << stats.numPixelsConverged << "/" << pixels << " pixels converged" << endl;
+    }
+    else if(rayTrace) PrintBVH(stats, rayTracer.getBVH());
+    else cout << "# Triangles:\t" << stats.numTrisDrawn << "/" << stats.numTrisTotal << endl;
+    if(verbose) {
+        cout << "# LOD reduced:\t" << stats.numObjectsLODReduced << endl;
+        PrintStats(stats);
+    }
+    if(!statsFile.empty()) WriteStatsJson(statsFile, StatsToJson(stats));
+    writeTrace();
+
+    if(rayTrace) {
+        // Heatmaps and buffer views come from the rasterizer's G-buffer
+        if(settings.counters || verbose) cout << "Heatmaps and buffer views are only available in raster mode." << endl;
+        free(bitmap.pixels());
+        return 0;
+    }
+    if(bands) {
+        if(settings.counters || verbose) cout << "Heatmaps and buffer views aren't available when rendering in bands." << endl;
+        return 0;
+    }
+    if(depthOnly) {
+        if(settings.counters || verbose) cout << "Heatmaps and buffer views aren't available when rendering depth only." << endl;
+        return 0;
+    }
+
+    if(settings.counters) {
+        GBitmap heat_bitmap;
+        heat_bitmap.alloc(bitmap.width(), bitmap.height());
+
+        filename = title + "_overdraw.png";
+        projector.ShowBuffer(Projector::BufferType::Overdraw, heat_bitmap, scene);
+        heat_bitmap.writeToFile(filename.c_str());
+
+        filename = title + "_rastertests.png";
+        projector.ShowBuffer(Projector::BufferType::RasterTests, heat_bitmap, scene);
+        heat_bitmap.writeToFile(filename.c_str());
+
+        filename = title + "_lights.png";
+        projector.ShowBuffer(Projector::BufferType::LightCount, heat_bitmap, scene);
+        heat_bitmap.writeToFile(filename.c_str());
+
+        free(heat_bitmap.pixels());
+    }
 
     // DEBUG: Show buffers
     if(verbose){
         GBitmap buff_bitmap;
-        buff_bitmap.alloc(256, 256);
+        buff_bitmap.alloc(dim.width, dim.height);
 
         filename = title + "_depth.png";
-        projector.ShowBuffer(Projector::BufferType::Depth, buff_bitmap, builder.getScene());
+        projector.ShowBuffer(Projector::BufferType::Depth, buff_bitmap, scene);
         buff_bitmap.writeToFile(filename.c_str());
         
         filename = title + "_invdepth.png";
-        projector.ShowBuffer(Projector::BufferType::Inv_Depth, buff_bitmap, builder.getScene());
+        projector.ShowBuffer(Projector::BufferType::Inv_Depth, buff_bitmap, scene);
         buff_bitmap.writeToFile(filename.c_str());
 
         filename = title + "_normal.png";
-        projector.ShowBuffer(Projector::BufferType::Normal, buff_bitmap, builder.getScene());
+        projector.ShowBuffer(Projector::BufferType::Normal, buff_bitmap, scene);
         buff_bitmap.writeToFile(filename.c_str());
 
         filename = title + "_albedo.png";
-        projector.ShowBuffer(Projector::BufferType::Albedo, buff_bitmap, builder.getScene());
+        projector.ShowBuffer(Projector::BufferType::Albedo, buff_bitmap, scene);
         buff_bitmap.writeToFile(filename.c_str());
 
         filename = title + "_specular.png";
-        projector.ShowBuffer(Projector::BufferType::Specular, buff_bitmap, builder.getScene());
+        projector.ShowBuffer(Projector::BufferType::Specular, buff_bitmap, scene);
         buff_bitmap.writeToFile(filename.c_str());
 
         filename = title + "_position.png";
-        projector.ShowBuffer(Projector::BufferType::Position, buff_bitmap, builder.getScene());
+        projector.ShowBuffer(Projector::BufferType::Position, buff_bitmap, scene);
         buff_bitmap.writeToFile(filename.c_str());
 
         /*
@@ -0,0 +1,1086 @@
+#include "../include/GBitmap.h"
+#include "../Projector.h"
+#include "../FramePipeline.h"
+#include "../RayTracer.h"
+#include "../PathTracer.h"
+#include "../Denoiser.h"
+#include "../include/GRandom.h"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+/*
+    Golden image and frame time regression check, run through make perfcheck.
+
+    Renders every scene in <dir>/scenes and compares against <dir>/reference/<scene>.png and the
+    frame time recorded in <dir>/baseline.local.json. Thresholds come from <dir>/perfcheck.json.
+    Renders and diff images go to <dir>/output. --update rewrites the references and baseline,
+    --baseline only the baseline. Frame times only compare on the machine that recorded them, so the
+    baseline isn't checked in: without one, or for scenes it doesn't have, frame times aren't checked.
+    --no-timing skips the frame time check, for builds that aren't expected to match the baseline's
+    speed, like the scalar (CPPR_NO_SIMD) one make perfcheck also runs against the same references.
+
+    Every scene then goes through the equivalence checks, pairs of ways to render it (or otherwise
+    compute something) that should agree, within pixelTolerance for images. A check that fails
+    writes what it rendered to <dir>/output/<scene>_<check>.png, with a _diff.png beside it.
+*/
+
+struct CheckConfig {
+    int pixelTolerance = 2;          // max per channel difference before a pixel counts as changed
+    double maxChangedFraction = 0.0; // fraction of pixels allowed to change
+    double maxRegressionPercent = 25.0;
+    int runs = 3;                    // frame time is the fastest of this many renders
+    int width = 256;
+    int height = 256;
+};
+
+struct ImageDiff {
+    int changedPixels = 0;
+    int maxChannelDiff = 0;
+};
+
+static json ReadJson(const fs::path& path) {
+    ifstream file(path);
+    if(!file.is_open()) return json::object();
+    return json::parse(file);
+}
+
+static CheckConfig LoadConfig(const fs::path& path) {
+    CheckConfig config;
+    json data = ReadJson(path);
+    config.pixelTolerance = data.value("pixelTolerance", config.pixelTolerance);
+    config.maxChangedFraction = data.value("maxChangedFraction", config.maxChangedFraction);
+    config.maxRegressionPercent = data.value("maxRegressionPercent", config.maxRegressionPercent);
+    config.runs = std::max(1, data.value("runs", config.runs));
+    config.width = data.value("width", config.width);
+    config.height = data.value("height", config.height);
+    return config;
+}
+
+/// @brief Whether every pixel of bitmap is the same, e.g. a scene without lights, which would check nothing
+static bool IsBlank(const GBitmap& bitmap) {
+    GPixel first = *bitmap.getAddr(0, 0);
+    for(int y = 0; y < bitmap.height(); ++y) {
+        for(int x = 0; x < bitmap.width(); ++x) {
+            if(*bitmap.getAddr(x, y) != first) return false;
+        }
+    }
+    return true;
+}
+
+/// @brief Compare two images of the same size, writing changed pixels in red over a faded copy of expected
+static ImageDiff CompareImages(const GBitmap& actual, const GBitmap& expected, int tolerance, GBitmap& diffImage) {
+    ImageDiff diff;
+    for(int y = 0; y < actual.height(); ++y) {
+        for(int x = 0; x < actual.width(); ++x) {
+            GPixel a = *actual.getAddr(x, y);
+            GPixel e = *expected.getAddr(x, y);
+            int d = std::max({std::abs((int) GPixel_GetA(a) - (int) GPixel_GetA(e)),
+                              std::abs((int) GPixel_GetR(a) - (int) GPixel_GetR(e)),
+                              std::abs((int) GPixel_GetG(a) - (int) GPixel_GetG(e)),
+                              std::abs((int) GPixel_GetB(a) - (int) GPixel_GetB(e))});
+            diff.maxChannelDiff = std::max(diff.maxChannelDiff, d);
+
+            if(d > tolerance) {
+                ++diff.changedPixels;
+                *diffImage.getAddr(x, y) = GPixel_PackARGB(255, 255, 0, 0);
+            }
+            else {
+                unsigned gray = (GPixel_GetR(e) + GPixel_GetG(e) + GPixel_GetB(e)) / 12;
+                *diffImage.getAddr(x, y) = GPixel_PackARGB(255, gray, gray, gray);
+            }
+        }
+    }
+    return diff;
+}
+
+/// @brief Bitmap that frees its pixels, scratch for the equivalence checks
+struct OwnedBitmap {
+    GBitmap bitmap;
+    explicit OwnedBitmap(GISize dim) { bitmap.alloc(dim.width, dim.height); }
+    ~OwnedBitmap() { free(bitmap.pixels()); }
+    OwnedBitmap(const OwnedBitmap&) = delete;
+    OwnedBitmap& operator=(const OwnedBitmap&) = delete;
+};
+
+/// @brief What an equivalence check needs besides its scene
+struct CheckContext {
+    const CheckConfig& config;
+    GISize dim;
+    fs::path output; // <dir>/output/<scene>_<check>, for images of a failed check
+};
+
+/// @brief The scene as the golden image check renders it, posed at time 0 if animated
+static Scene LoadScene(const fs::path& path) {
+    SceneBuilder builder(path.string());
+    Scene scene = builder.getScene();
+    if(scene.isAnimated()) scene.Animate(0.f);
+    return scene;
+}
+
+static void RenderTo(const Scene& scene, GBitmap& out, const RenderSettings& settings = {}) {
+    GISize dim{out.width(), out.height()};
+    auto canvas = GCreateCanvas(out);
+    Projector projector(canvas.get(), dim, &out);
+    projector.setSettings(settings);
+    projector.RenderSceneTo(scene, *canvas, dim);
+}
+
+/// @brief Pixels of actual differing from expected by more than the tolerance, writing both out if any do
+static int DiffImages(const GBitmap& actual, const GBitmap& expected, const CheckContext& context) {
+    OwnedBitmap diffImage(context.dim);
+    int changed = CompareImages(actual, expected, context.config.pixelTolerance, diffImage.bitmap).changedPixels;
+    if(changed) {
+        actual.writeToFile((context.output.string() + ".png").c_str());
+        diffImage.bitmap.writeToFile((context.output.string() + "_diff.png").c_str());
+    }
+    return changed;
+}
+
+/// @brief Objects refit far out of view, then moved back one at a time through markObjectDirty, against the
+/// scene as loaded, so culling has to go through the bounds markObjectDirty refit
+static int CheckMovedSceneBVH(const fs::path& path, const CheckContext& context) {
+    Scene moved = LoadScene(path), loaded = LoadScene(path);
+    if(moved.objects.empty()) return -1;
+
+    for(Object& obj : moved.objects) obj.pos[0] += 1000.f;
+    moved.refitBVH();
+    for(int i = 0; i < (int) moved.objects.size(); ++i) {
+        moved.objects[i].pos[0] -= 1000.f;
+        moved.markObjectDirty(i);
+    }
+
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    RenderTo(loaded, expected.bitmap);
+    RenderTo(moved, actual.bitmap);
+    return DiffImages(actual.bitmap, expected.bitmap, context);
+}
+
+/// @brief Time of frame of frames spread over scene's animation, 0 if it has none
+static float FrameTime(const Scene& scene, int frame, int frames) {
+    return frames > 1 ? scene.animationDuration() * frame / (frames - 1) : 0.f;
+}
+
+/// @brief The first object with a LOD chain, alone in front of the camera at distances from where it fills
+/// the view to where it's a speck. Drawn triangles should stay around lodPixelsPerTri pixels large: the level
+/// drawn may not be finer than one with a quarter of that, nor coarser than the next finer level allows.
+/// @return distances where the level drawn is off, finer than authored, or finer than at a nearer distance
+static int CheckLODSize(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    auto lodObject = std::find_if(scene.objects.begin(), scene.objects.end(), [](const Object& obj) { return obj.lod && obj.lodLevel > 0; });
+    if(lodObject == scene.objects.end()) return -1;
+    Object obj = *lodObject;
+    scene.objects = {obj};
+    scene.animations.clear();
+    scene.buildBVH();
+
+    mat4 view = scene.cam.getViewMatrix();
+    vec3 forward{-view[{2, 0}], -view[{2, 1}], -view[{2, 2}]};
+    RenderSettings settings;
+    const float ppt = settings.lodPixelsPerTri;
+
+    OwnedBitmap image(context.dim);
+    auto canvas = GCreateCanvas(image.bitmap);
+    Projector projector(canvas.get(), context.dim, &image.bitmap);
+    projector.setSettings(settings);
+
+    int wrong = 0, previous = obj.lodLevel;
+    for(float distance = 2.f * obj.getWorldBounds().radius(); distance < scene.cam.far(); distance *= 1.25f) {
+        scene.objects[0].pos = scene.cam.getPos() + forward * distance;
+        scene.markObjectDirty(0);
+        RenderStatistic stats = projector.RenderSceneTo(scene, *canvas, context.dim);
+
+        int level = -1;
+        for(int i = 0; i < obj.lod->levelCount(); ++i) {
+            if(obj.lod->level(i)->triCount() == stats.numTrisTotal) level = i;
+        }
+        int covered = 0;
+        for(const std::vector<float>& row : projector.getInvDepthBuffer()) {
+            covered += (int) std::count_if(row.begin(), row.end(), [](float d) { return d > 0.f; });
+        }
+        // Roughly half of the triangles face the camera
+        float pixelsPerTri = 2.f * covered / std::max(stats.numTrisTotal, 1);
+        bool tooFine = level > 0 && pixelsPerTri < ppt / 4.f;
+        bool tooCoarse = level < obj.lodLevel && pixelsPerTri >= 4.f * ppt;
+        if(level < 0 || level > obj.lodLevel || level > previous || tooFine || tooCoarse) ++wrong;
+        previous = level;
+    }
+    return wrong;
+}
+
+static double PhaseSum(const PhaseTimings& p) {
+    return p.sceneCopy + p.cull + p.vertexTransform + p.triSetup + p.raster + p.lighting + p.outputConversion + p.pngEncode
+         + p.shadowMaps + p.accelBuild + p.trace + p.denoise;
+}
+
+/// @brief Phase times of a frame rasterized with every kind of shadows, and ray traced, against the frame's
+/// wall clock time. The phases mustn't add up to more than it, nor leave over a quarter of it unaccounted for.
+/// @return frames whose phases don't add up
+static int CheckPhaseTimes(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    OwnedBitmap image(context.dim);
+    auto canvas = GCreateCanvas(image.bitmap);
+    std::vector<RenderStatistic> frames;
+    for(ShadowMode shadows : {ShadowMode::None, ShadowMode::RayTraced, ShadowMode::Maps}) {
+        RenderSettings settings;
+        settings.shadows = shadows;
+        Projector projector(canvas.get(), context.dim, &image.bitmap);
+        projector.setSettings(settings);
+        frames.push_back(projector.RenderSceneTo(scene, *canvas, context.dim));
+    }
+    RayTracer rayTracer;
+    frames.push_back(rayTracer.RenderSceneTo(scene, image.bitmap));
+
+    int wrong = 0;
+    for(const RenderStatistic& stats : frames) {
+        double sum = PhaseSum(stats.phases);
+        if(sum > stats.secondsTaken * (1.0 + 1e-6) || sum < stats.secondsTaken * 0.75) ++wrong;
+    }
+    return wrong;
+}
+
+/// @brief A scene loaded and rendered on several threads with tracing enabled, written out as trace_event JSON
+/// and parsed back. Every span needs a name, thread and non-negative duration, spans on a thread must nest, and
+/// loading, rendering and chunks of work must all show up. Threads other than the rendering one, the pool's
+/// workers, must be named.
+/// @return problems found, 1 if the file couldn't be written or parsed
+static int CheckTraceJson(const fs::path& path, const CheckContext& context) {
+    const std::string file = context.output.string() + ".json";
+    Trace::Clear();
+    Trace::SetEnabled(true);
+    Scene scene = LoadScene(path);
+    RenderSettings settings;
+    settings.threads = 4;
+    OwnedBitmap image(context.dim);
+    RenderTo(scene, image.bitmap, settings);
+    Trace::SetEnabled(false);
+    bool written = Trace::WriteJson(file.c_str());
+    Trace::Clear();
+    if(!written) return 1;
+
+    json trace;
+    try {
+        std::ifstream in(file);
+        trace = json::parse(in);
+    }
+    catch(const json::exception&) {
+        return 1;
+    }
+
+    int problems = 0;
+    std::map<int, std::vector<std::pair<double, double>>> spans; // start and end per thread
+    std::set<std::string> names;
+    std::set<int> named;
+    int renderThread = -1;
+    for(const json& e : trace.value("traceEvents", json::array())) {
+        std::string ph = e.value("ph", "");
+        if(ph == "M") {
+            if(e.value("name", "") == "thread_name" && e.contains("args") && e["args"].contains("name")) named.insert(e.value("tid", -1));
+            else ++problems;
+        }
+        else if(ph == "X" && e.contains("name") && e["name"].is_string() && e.contains("tid") && e.contains("ts") && e.value("dur", -1.0) >= 0.0) {
+            names.insert(e["name"].get<std::string>());
+            if(e["name"] == "Projector::RenderSceneTo") renderThread = e["tid"];
+            double ts = e["ts"];
+            spans[e["tid"].get<int>()].emplace_back(ts, ts + e["dur"].get<double>());
+        }
+        else ++problems;
+    }
+    for(const char* expected : {"SceneBuilder::LoadScene", "Projector::RenderSceneTo", "ParallelFor worker"}) {
+        problems += !names.count(expected);
+    }
+
+    // Spans on a thread come from nested scopes, so each one either ends before the next starts or contains it
+    for(auto& [tid, thread] : spans) {
+        std::sort(thread.begin(), thread.end(), [](auto& a, auto& b) { return a.first < b.first || (a.first == b.first && a.second > b.second); });
+        std::vector<double> open;
+        for(auto [start, end] : thread) {
+            while(!open.empty() && open.back() <= start) open.pop_back();
+            if(!open.empty() && end > open.back()) ++problems;
+            open.push_back(end);
+        }
+        problems += tid != renderThread && !named.count(tid);
+    }
+    if(!problems) fs::remove(file);
+    return problems;
+}
+
+/// @brief Cost heatmaps of a frame rendered with counters, against the frame's totals and coverage. The buffers
+/// have to add up to numRasterTests, numDepthPasses and numLightsInRange and peak at the reported maxima. Pixels
+/// need a depth pass exactly where something was drawn, no more passes than tests, and lights counted only where
+/// drawn. Counting mustn't change the image either.
+/// @return mismatched totals plus pixels whose counts are off
+static int CheckHeatmaps(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    RenderTo(scene, expected.bitmap);
+
+    RenderSettings settings;
+    settings.counters = true;
+    auto canvas = GCreateCanvas(actual.bitmap);
+    Projector projector(canvas.get(), context.dim, &actual.bitmap);
+    projector.setSettings(settings);
+    RenderStatistic stats = projector.RenderSceneTo(scene, *canvas, context.dim);
+    const std::vector<std::vector<float>> invDepth = projector.getInvDepthBuffer();
+    const std::vector<std::vector<int>> rasterTests = projector.getRasterTestBuffer(), overdraw = projector.getOverdrawBuffer();
+    const std::vector<std::vector<int>> lightCount = projector.getLightCountBuffer();
+
+    int wrong = 0;
+    int64_t tests = 0, passes = 0, lights = 0;
+    int maxTests = 0, maxPasses = 0, maxLights = 0;
+    for(int y = 0; y < context.dim.height; ++y) {
+        for(int x = 0; x < context.dim.width; ++x) {
+            int tested = rasterTests[y][x], passed = overdraw[y][x], inRange = lightCount[y][x];
+            bool drawn = invDepth[y][x] > 0.f;
+            if(drawn != (passed > 0) || passed > tested || (!drawn && inRange) || inRange > (int) scene.lights.size()) ++wrong;
+            tests += tested;
+            passes += passed;
+            lights += inRange;
+            maxTests = std::max(maxTests, tested);
+            maxPasses = std::max(maxPasses, passed);
+            maxLights = std::max(maxLights, inRange);
+        }
+    }
+    wrong += (tests != stats.numRasterTests) + (passes != stats.numDepthPasses) + (lights != stats.numLightsInRange);
+    wrong += (maxTests != stats.maxRasterTests) + (maxPasses != stats.maxOverdraw) + (maxLights != stats.maxLightsPerPixel);
+    return wrong + DiffImages(actual.bitmap, expected.bitmap, context);
+}
+
+/// @brief A few frames through FramePipeline, against rendering each on its own
+static int CheckPipeline(const fs::path& path, const CheckContext& context) {
+    const int frames = 4;
+    Scene scene = LoadScene(path), posed = LoadScene(path);
+    OwnedBitmap expected(context.dim);
+    int differing = 0;
+
+    FramePipeline pipeline(context.dim);
+    pipeline.Run(scene, frames,
+                 [](int frame, Scene& s) {
+                     if(s.isAnimated()) s.Animate(FrameTime(s, frame, frames));
+                     return true;
+                 },
+                 [&](int frame, const GBitmap& bitmap, const RenderStatistic&) {
+                     if(posed.isAnimated()) posed.Animate(FrameTime(posed, frame, frames));
+                     RenderTo(posed, expected.bitmap);
+                     differing += DiffImages(bitmap, expected.bitmap, context);
+                 });
+    return differing;
+}
+
+/// @brief Pose scene for frame of frames: along its animation if it has one, otherwise by nudging an
+/// object and a light, marked dirty, which stand in for an animation
+static void PoseFrame(Scene& scene, int frame, int frames) {
+    if(scene.isAnimated()) {
+        scene.Animate(FrameTime(scene, frame, frames));
+        return;
+    }
+    if(frame == 0) return;
+    if(!scene.objects.empty()) {
+        int i = frame % scene.objects.size();
+        scene.objects[i].pos[1] += 0.1f;
+        scene.markObjectDirty(i);
+    }
+    if(!scene.lights.empty()) {
+        int i = frame % scene.lights.size();
+        scene.lights[i].v[0] += 0.2f;
+        scene.markLightDirty(i);
+    }
+}
+
+/// @brief Frames rendered with RenderIncremental, against each rendered in full, with every kind of shadows
+static int CheckIncremental(const fs::path& path, const CheckContext& context) {
+    const int frames = 4;
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    auto canvas = GCreateCanvas(actual.bitmap);
+    int differing = 0;
+    for(ShadowMode shadows : {ShadowMode::None, ShadowMode::RayTraced, ShadowMode::Maps}) {
+        RenderSettings settings;
+        settings.shadows = shadows;
+        Scene incremental = LoadScene(path), full = LoadScene(path);
+        Projector projector(canvas.get(), context.dim, &actual.bitmap);
+        projector.setSettings(settings);
+        for(int frame = 0; frame < frames; ++frame) {
+            PoseFrame(incremental, frame, frames);
+            PoseFrame(full, frame, frames);
+            projector.RenderIncremental(incremental, context.dim);
+            RenderTo(full, expected.bitmap, settings);
+            differing += DiffImages(actual.bitmap, expected.bitmap, context);
+        }
+    }
+    return differing;
+}
+
+/// @brief Shade one light of kind Kind with the Exact kernel, before albedo
+template<LightType Kind>
+static void AccumulateExact(const LightArrays& lights, const SurfacePoints& s, f8 sum[3]) {
+    LightingKernels::Accumulate<Kind, true, MathMode::Exact>(lights, s, sum);
+}
+
+/// @brief The Exact lighting kernels against Light::calcLight, light by light, for each of the scene's lights and
+/// a point, directional and ambient light of its own. Surface points are random: positions around the light,
+/// in and out of its range, random normals and a mix of matte and shiny lanes. Colors agree to float rounding.
+/// @return lanes where they don't
+static int CheckLightingKernels(const fs::path& path, const CheckContext&) {
+    Scene scene = LoadScene(path);
+    GRandom rng(7);
+    auto random = [&](float lo, float hi) { return lo + (hi - lo) * rng.nextF(); };
+    auto randomVec = [&](float r) { return vec3{random(-r, r), random(-r, r), random(-r, r)}; };
+
+    std::vector<Light> lights = scene.lights;
+    Light point;
+    point.v = randomVec(5.f);
+    point.col = {0.9f, 0.6f, 0.3f};
+    lights.push_back(point);
+    lights.push_back(Light::Directional(randomVec(1.f) + vec3{0.f, -1.5f, 0.f}, {0.5f, 0.7f, 1.f}, 0.05f));
+    lights.push_back(Light::Ambient({0.2f, 0.3f, 0.4f}, 0.5f));
+
+    const vec3 camPos = scene.cam.getPos();
+    int wrong = 0;
+    for(const Light& light : lights) {
+        LightArrays arrays({light});
+        for(int batch = 0; batch < 256; ++batch) {
+            float p[3][8], n[3][8], shininess[8], zero[8] = {};
+            for(int i = 0; i < 8; ++i) {
+                vec3 pos = light.v + randomVec(1.5f * light.effectiveDistance);
+                vec3 normal = vec3::normalize(randomVec(1.f) + vec3{0.f, 0.f, 1e-3f});
+                for(int a = 0; a < 3; ++a) {
+                    p[a][i] = pos[a];
+                    n[a][i] = normal[a];
+                }
+                shininess[i] = rng.nextF() < 0.25f ? 0.f : random(1.f, 128.f);
+            }
+            GBufferRow row{zero, p[0], p[1], p[2], n[0], n[1], n[2], zero, zero, zero, shininess};
+            f8 position[3] = {f8::Load(p[0]), f8::Load(p[1]), f8::Load(p[2])};
+            SurfacePoints s(row, 0, 8, position, camPos, MathMode::Exact);
+
+            f8 sum[3] = {0.f, 0.f, 0.f};
+            switch(light.type) {
+                case LightType::Point: AccumulateExact<LightType::Point>(arrays, s, sum); break;
+                case LightType::Directional: AccumulateExact<LightType::Directional>(arrays, s, sum); break;
+                case LightType::Ambient: AccumulateExact<LightType::Ambient>(arrays, s, sum); break;
+            }
+            float actual[3][8];
+            for(int c = 0; c < 3; ++c) sum[c].store(actual[c]);
+
+            for(int i = 0; i < 8; ++i) {
+                vec3 expected = light.calcLight({p[0][i], p[1][i], p[2][i]}, camPos, {n[0][i], n[1][i], n[2][i]},
+                                                {1.f, 1.f, 1.f}, shininess[i]);
+                bool same = true;
+                for(int c = 0; c < 3; ++c) {
+                    same &= std::abs(actual[c][i] - expected[c]) <= 1e-4f * std::max(1.f, std::abs(expected[c]));
+                }
+                wrong += !same;
+            }
+        }
+    }
+    return wrong;
+}
+
+/// @brief FastMath's rsqrt and fast_pow against sqrt and powf, within the 1e-3 relative error MathMode::Approx
+/// documents. fast_pow takes bases across (0, 1] with the scene's shininess values and exponents up to 4096,
+/// rsqrt takes 0 and values from denormals to 1e30; rsqrt(0) must be finite, normalizing a zero vector gives 0.
+/// @return values out of tolerance
+static int CheckFastMath(const fs::path& path, const CheckContext&) {
+    Scene scene = LoadScene(path);
+    std::vector<float> exponents;
+    for(const Object& obj : scene.objects) {
+        if(!obj.isEmitter()) exponents.push_back(obj.shininess);
+    }
+    for(float e = 1.f; e <= 4096.f; e *= 2.f) exponents.push_back(e);
+    exponents.push_back(0.f);
+
+    auto within = [](float actual, double expected) {
+        return std::isfinite(actual) && std::abs(actual - expected) <= 1e-3 * std::abs(expected) + FLT_MIN;
+    };
+
+    int wrong = 0;
+    for(float e : exponents) {
+        for(float x = 1.f; x > 1e-6f; x *= 0.97f) {
+            wrong += !within(FastMath::fast_pow(x, e), std::pow(double(x), double(e)));
+        }
+    }
+    wrong += FastMath::fast_pow(0.f, 64.f) != 0.f;
+
+    for(float x = 1e-40f; x < 1e30f; x *= 1.7f) {
+        wrong += !within(FastMath::rsqrt(std::max(x, FLT_MIN)), 1.0 / std::sqrt(double(std::max(x, FLT_MIN))));
+    }
+    wrong += !std::isfinite(FastMath::rsqrt(0.f));
+    vec3 zero{0.f, 0.f, 0.f};
+    FastMath::normalize(zero);
+    wrong += !(zero[0] == 0.f && zero[1] == 0.f && zero[2] == 0.f);
+    return wrong;
+}
+
+static bool Near(const vec3& a, const vec3& b) {
+    for(int i = 0; i < 3; ++i) {
+        if(std::abs(a[i] - b[i]) > 1e-4f * std::max(1.f, std::abs(b[i]))) return false;
+    }
+    return true;
+}
+
+/// @brief Whether what track animates is posed as key says
+static bool Posed(const Scene& scene, const AnimationTrack& track, const Keyframe& key) {
+    switch(track.kind) {
+        case AnimationTrack::Kind::Object: {
+            const Object& obj = scene.objects[track.index];
+            return Near(obj.pos, key.pos) && Near(obj.euler, key.euler) && Near(obj.scale, key.scale);
+        }
+        case AnimationTrack::Kind::Light:
+            return Near(scene.lights[track.index].v, key.pos) && (track.marker < 0 || Near(scene.objects[track.marker].pos, key.pos));
+        case AnimationTrack::Kind::Camera:
+            return Near(scene.cam.getPos(), key.pos);
+    }
+    return false;
+}
+
+/// @brief Animated elements posed at each keyframe and halfway between, against the keys and their midpoints
+static int CheckKeyframes(const fs::path& path, const CheckContext&) {
+    Scene scene = LoadScene(path);
+    if(!scene.isAnimated()) return -1;
+
+    int wrong = 0;
+    for(const AnimationTrack& track : scene.animations) {
+        for(size_t k = 0; k < track.keys.size(); ++k) {
+            const Keyframe& key = track.keys[k];
+            scene.Animate(key.time);
+            wrong += !Posed(scene, track, key);
+            if(k + 1 == track.keys.size()) continue;
+
+            const Keyframe& next = track.keys[k + 1];
+            Keyframe mid;
+            mid.time = (key.time + next.time) / 2.f;
+            mid.pos = (key.pos + next.pos) * 0.5f;
+            mid.euler = (key.euler + next.euler) * 0.5f;
+            mid.scale = (key.scale + next.scale) * 0.5f;
+            scene.Animate(mid.time);
+            wrong += !Posed(scene, track, mid);
+        }
+    }
+    return wrong;
+}
+
+/// @brief Frames of a scene scrubbed backwards through its animation, against each pose animated to directly
+static int CheckAnimation(const fs::path& path, const CheckContext& context) {
+    const int frames = 4;
+    Scene scrubbed = LoadScene(path);
+    if(!scrubbed.isAnimated()) return -1;
+
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    int differing = 0;
+    for(int frame = frames - 1; frame >= 0; --frame) {
+        Scene direct = LoadScene(path);
+        direct.Animate(FrameTime(direct, frame, frames));
+        scrubbed.Animate(FrameTime(scrubbed, frame, frames));
+        RenderTo(direct, expected.bitmap);
+        RenderTo(scrubbed, actual.bitmap);
+        differing += DiffImages(actual.bitmap, expected.bitmap, context);
+    }
+    return differing;
+}
+
+/// @brief Closest front facing hit of o + t * d with any of tris, testing every one, as TriangleBVH::intersect
+/// would find it
+static bool IntersectAll(const vector<RTTriangle>& tris, const float o[3], const float d[3], float& best) {
+    best = FLT_MAX;
+    for(const RTTriangle& tri : tris) {
+        // Moller-Trumbore, culling back faces
+        float p[3] = {d[1] * tri.e2[2] - d[2] * tri.e2[1], d[2] * tri.e2[0] - d[0] * tri.e2[2], d[0] * tri.e2[1] - d[1] * tri.e2[0]};
+        float det = tri.e1[0] * p[0] + tri.e1[1] * p[1] + tri.e1[2] * p[2];
+        if(det > -1e-12f) continue;
+        float invDet = 1.f / det;
+        float s[3] = {o[0] - tri.v0[0], o[1] - tri.v0[1], o[2] - tri.v0[2]};
+        float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+        if(u < 0.f || u > 1.f) continue;
+        float q[3] = {s[1] * tri.e1[2] - s[2] * tri.e1[1], s[2] * tri.e1[0] - s[0] * tri.e1[2], s[0] * tri.e1[1] - s[1] * tri.e1[0]};
+        float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * invDet;
+        if(v < 0.f || u + v > 1.f) continue;
+        float t = (tri.e2[0] * q[0] + tri.e2[1] * q[1] + tri.e2[2] * q[2]) * invDet;
+        if(t > 0.f && t < best) best = t;
+    }
+    return best != FLT_MAX;
+}
+
+static bool SameDistance(float a, float b, float tolerance = 1e-5f) {
+    return std::abs(a - b) <= tolerance * std::max(1.f, std::abs(b));
+}
+
+/// @brief Camera rays through every 4th pixel each way, traced through a SAH TriangleBVH over the scene's
+/// world space triangles, against testing every triangle, and through the same BVH built on 4 threads, which must
+/// hit identically. Counts rays where either the closest hit or occluded disagrees.
+static int CheckTriangleBVH(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    SceneTriangles triangles;
+    triangles.gather(scene, 0);
+    if(triangles.tris.empty()) return -1;
+    TriangleBVH bvh, threaded;
+    bvh.build(triangles.tris, 1);
+    threaded.build(triangles.tris, 4);
+
+    CameraRays camera(scene.cam, context.dim);
+    int wrong = 0;
+    for(int y = 0; y < context.dim.height; y += 4) {
+        for(int x = 0; x < context.dim.width; x += 4) {
+            float cx, cy, d[3];
+            camera.ray(x + 0.5f, y + 0.5f, cx, cy, d);
+            float expected;
+            bool expectHit = IntersectAll(triangles.tris, camera.origin, d, expected);
+            RayHit hit;
+            bool found = bvh.intersect(camera.origin, d, FLT_MAX, hit);
+            bool occluded = bvh.occluded(camera.origin, d, FLT_MAX);
+            RayHit threadedHit;
+            bool threadedFound = threaded.intersect(camera.origin, d, FLT_MAX, threadedHit);
+            if(found != expectHit || occluded != expectHit || (found && !SameDistance(hit.t, expected))) ++wrong;
+            else if(threadedFound != found || (found && threadedHit.t != hit.t)) ++wrong;
+        }
+    }
+    return wrong;
+}
+
+/// @brief Camera rays through every pixel, traced through a TwoLevelBVH of the scene's instanced meshes,
+/// against a single level TriangleBVH over its world space triangles. Rays hitting an emitter first are
+/// skipped, as only the two level one holds emitters. Instances are hit in object space, so distances are only
+/// compared to within rounding. Counts rays where the closest hit or occluded disagrees.
+static int CheckTwoLevelBVH(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    SceneTriangles triangles;
+    triangles.gather(scene, 0);
+    if(triangles.tris.empty()) return -1;
+    TriangleBVH flat;
+    flat.build(triangles.tris);
+    TwoLevelBVH twoLevel;
+    twoLevel.update(scene, 0);
+
+    CameraRays camera(scene.cam, context.dim);
+    int wrong = 0;
+    for(int y = 0; y < context.dim.height; ++y) {
+        for(int x = 0; x < context.dim.width; ++x) {
+            float cx, cy, d[3];
+            camera.ray(x + 0.5f, y + 0.5f, cx, cy, d);
+            RayHit hit, expected;
+            bool found = twoLevel.intersect(camera.origin, d, FLT_MAX, hit);
+            if(found && twoLevel.instance(hit).emitter) continue;
+            bool expectHit = flat.intersect(camera.origin, d, FLT_MAX, expected);
+            bool occluded = twoLevel.occluded(camera.origin, d, FLT_MAX);
+            if(found != expectHit || occluded != expectHit || (found && !SameDistance(hit.t, expected.t, 1e-4f))) ++wrong;
+        }
+    }
+    return wrong;
+}
+
+/// @brief Ray traced with 4x2 ray packets, against one ray at a time, for triangles and analytic spheres
+static int CheckRayPackets(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    int differing = 0;
+    for(bool spheres : {false, true}) {
+        RenderSettings settings;
+        settings.analyticSpheres = spheres;
+        settings.shadows = ShadowMode::RayTraced;
+        RayTracer packets, singles;
+        settings.rayPackets = true;
+        packets.setSettings(settings);
+        settings.rayPackets = false;
+        singles.setSettings(settings);
+        singles.RenderSceneTo(scene, expected.bitmap);
+        packets.RenderSceneTo(scene, actual.bitmap);
+        differing += DiffImages(actual.bitmap, expected.bitmap, context);
+    }
+    return differing;
+}
+
+/// @brief Trace what camera rays hit into guide, as the path tracer guides the denoiser, and light it into lit
+static void TraceGuide(const Scene& scene, GBuffer& guide, GBitmap& lit) {
+    RayTracer tracer;
+    RenderStatistic stats{};
+    tracer.BuildScene(scene, stats);
+    tracer.TraceScene(scene, guide, stats);
+    Projector lighting(nullptr, {guide.width(), guide.height()}, nullptr);
+    lighting.ShadeBuffer(scene.cam, scene.lights, guide, lit, stats);
+}
+
+/// @brief A noise free image with zero variance through the denoiser, against the image itself
+static int CheckDenoiserKeepsConverged(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    GBuffer guide(context.dim);
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    TraceGuide(scene, guide, expected.bitmap);
+
+    Denoiser::Image image;
+    image.resize(context.dim);
+    for(int y = 0; y < context.dim.height; ++y) {
+        for(int x = 0; x < context.dim.width; ++x) {
+            GPixel p = *expected.bitmap.getAddr(x, y);
+            size_t i = (size_t) y * context.dim.width + x;
+            image.color[0][i] = GPixel_GetR(p) / 255.f;
+            image.color[1][i] = GPixel_GetG(p) / 255.f;
+            image.color[2][i] = GPixel_GetB(p) / 255.f;
+        }
+    }
+    Denoiser().filter(image, guide, 0);
+
+    for(int y = 0; y < context.dim.height; ++y) {
+        for(int x = 0; x < context.dim.width; ++x) {
+            size_t i = (size_t) y * context.dim.width + x;
+            int c[3];
+            for(int a = 0; a < 3; ++a) c[a] = (int) (std::min(std::max(image.color[a][i], 0.f), 1.f) * 255.f + 0.5f);
+            *actual.bitmap.getAddr(x, y) = GPixel_PackARGB(255, c[0], c[1], c[2]);
+        }
+    }
+    return DiffImages(actual.bitmap, expected.bitmap, context);
+}
+
+/// @brief Surfaces under flat light with noise added, through the denoiser, against the flat light
+/// @return 1 if the denoised image's error isn't at most a quarter of the noisy one's
+static int CheckDenoiserSmoothsNoise(const fs::path& path, const CheckContext& context) {
+    const float Light = 0.5f, Noise = 0.2f; // noise is uniform in [-Noise, Noise]
+    Scene scene = LoadScene(path);
+    GBuffer guide(context.dim);
+    OwnedBitmap lit(context.dim);
+    TraceGuide(scene, guide, lit.bitmap);
+
+    Denoiser::Image image;
+    image.resize(context.dim);
+    GRandom rng(1);
+    for(int y = 0; y < context.dim.height; ++y) {
+        GBufferRow row = guide.getRow(y);
+        const float* albedo[3] = {row.r, row.g, row.b};
+        for(int x = 0; x < context.dim.width; ++x) {
+            size_t i = (size_t) y * context.dim.width + x;
+            float light = Light + (2.f * rng.nextF() - 1.f) * Noise;
+            for(int c = 0; c < 3; ++c) image.color[c][i] = albedo[c][x] * light;
+            float luminance = 0.2126f * albedo[0][x] + 0.7152f * albedo[1][x] + 0.0722f * albedo[2][x];
+            image.variance[i] = Noise * Noise / 3.f * luminance * luminance;
+        }
+    }
+
+    // Only lit surfaces are filtered
+    auto error = [&]() {
+        double sum = 0.0;
+        for(int y = 0; y < context.dim.height; ++y) {
+            GBufferRow row = guide.getRow(y);
+            const float* albedo[3] = {row.r, row.g, row.b};
+            for(int x = 0; x < context.dim.width; ++x) {
+                if(row.depth[x] == FLT_MAX || row.specular[x] < 0.f) continue;
+                size_t i = (size_t) y * context.dim.width + x;
+                for(int c = 0; c < 3; ++c) sum += std::pow(image.color[c][i] - albedo[c][x] * Light, 2.0);
+            }
+        }
+        return std::sqrt(sum);
+    };
+    double noisy = error();
+    Denoiser().filter(image, guide, 0);
+    return error() * 4.0 > noisy ? 1 : 0;
+}
+
+/// @brief The scene's point lights with shadow maps, against the same lights with ray traced shadows. Maps sample
+/// occluders at texel resolution with a depth bias, so pixels along shadow edges and terminators differ. Half the
+/// pixels the ray traced shadows change (against no shadows) differing, plus 0.1% of the image, means the maps
+/// miss or misplace shadows. Directional lights are left out, as shadow maps don't cover them.
+/// @return pixels differing, 0 if within that allowance
+static int CheckShadowMaps(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    auto directional = [](const Light& l) { return l.type == LightType::Directional; };
+    scene.lights.erase(std::remove_if(scene.lights.begin(), scene.lights.end(), directional), scene.lights.end());
+    auto point = [](const Light& l) { return l.type == LightType::Point; };
+    if(std::none_of(scene.lights.begin(), scene.lights.end(), point)) return -1;
+
+    OwnedBitmap unshadowed(context.dim), traced(context.dim), mapped(context.dim), diffImage(context.dim);
+    RenderSettings settings;
+    RenderTo(scene, unshadowed.bitmap, settings);
+    settings.shadows = ShadowMode::RayTraced;
+    RenderTo(scene, traced.bitmap, settings);
+    settings.shadows = ShadowMode::Maps;
+    RenderTo(scene, mapped.bitmap, settings);
+
+    int tolerance = context.config.pixelTolerance;
+    int shadowed = CompareImages(traced.bitmap, unshadowed.bitmap, tolerance, diffImage.bitmap).changedPixels;
+    int changed = CompareImages(mapped.bitmap, traced.bitmap, tolerance, diffImage.bitmap).changedPixels;
+    if(changed <= shadowed / 2 + context.dim.width * context.dim.height / 1000) return 0;
+    mapped.bitmap.writeToFile((context.output.string() + ".png").c_str());
+    diffImage.bitmap.writeToFile((context.output.string() + "_diff.png").c_str());
+    return changed;
+}
+
+/// @brief Root mean square difference of a's color channels from the average of each 2x2 block of b, twice a's size,
+/// in 8-bit steps
+static double RmsDifferenceHalf(const GBitmap& a, const GBitmap& b) {
+    double sum = 0.0;
+    for(int y = 0; y < a.height(); ++y) {
+        for(int x = 0; x < a.width(); ++x) {
+            GPixel p = *a.getAddr(x, y);
+            GPixel q[4] = {*b.getAddr(2 * x, 2 * y), *b.getAddr(2 * x + 1, 2 * y),
+                           *b.getAddr(2 * x, 2 * y + 1), *b.getAddr(2 * x + 1, 2 * y + 1)};
+            double d[3] = {(double) GPixel_GetR(p), (double) GPixel_GetG(p), (double) GPixel_GetB(p)};
+            for(const GPixel& c : q) {
+                d[0] -= GPixel_GetR(c) / 4.0;
+                d[1] -= GPixel_GetG(c) / 4.0;
+                d[2] -= GPixel_GetB(c) / 4.0;
+            }
+            sum += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+        }
+    }
+    return std::sqrt(sum / (3.0 * a.width() * a.height()));
+}
+
+/// @brief Path traced images at half the check's width and height with 4 and 16 samples per pixel, against one
+/// at full size with 32 averaged down, whose samples are independent of theirs. Going from 4 to 16 samples has to
+/// cut the error by at least 30%, where it should nearly halve, unless it's already within half an 8-bit step.
+/// The 16 sample image traced again on 1 and on 4 threads has to be identical, as samples depend only on the pass
+/// and row.
+/// @return sample counts that didn't cut the error enough plus pixels differing between thread counts
+static int CheckPathTracer(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    GISize dim{context.dim.width / 2, context.dim.height / 2};
+    auto trace = [&](int samples, int threads, GBitmap& out) {
+        RenderSettings settings;
+        settings.noiseThreshold = 0.f; // never converged early, every pixel gets samples
+        settings.maxSamples = samples;
+        settings.threads = threads;
+        PathTracer tracer;
+        tracer.setSettings(settings);
+        tracer.RenderSceneTo(scene, out);
+    };
+
+    OwnedBitmap reference(context.dim), coarse(dim), fine(dim), oneThread(dim), diffImage(dim);
+    trace(32, 0, reference.bitmap);
+    trace(4, 0, coarse.bitmap);
+    trace(16, 0, fine.bitmap);
+    double coarseError = RmsDifferenceHalf(coarse.bitmap, reference.bitmap);
+    double fineError = RmsDifferenceHalf(fine.bitmap, reference.bitmap);
+    int wrong = coarseError > .5 && fineError > .7 * coarseError;
+
+    trace(16, 1, oneThread.bitmap);
+    wrong += CompareImages(oneThread.bitmap, fine.bitmap, 0, diffImage.bitmap).changedPixels;
+    trace(16, 4, oneThread.bitmap);
+    wrong += CompareImages(oneThread.bitmap, fine.bitmap, 0, diffImage.bitmap).changedPixels;
+    return wrong;
+}
+
+/// @brief Images rendered in bands of a height not dividing the image's, pieced back together, against each
+/// rendered whole, with every kind of shadows
+static int CheckBands(const fs::path& path, const CheckContext& context) {
+    const int bandRows = 37;
+    Scene scene = LoadScene(path);
+    OwnedBitmap expected(context.dim), actual(context.dim);
+    auto canvas = GCreateCanvas(actual.bitmap);
+    int differing = 0;
+    for(ShadowMode shadows : {ShadowMode::None, ShadowMode::RayTraced, ShadowMode::Maps}) {
+        RenderSettings settings;
+        settings.shadows = shadows;
+        Projector projector(canvas.get(), context.dim, &actual.bitmap);
+        projector.setSettings(settings);
+        projector.RenderBands(scene, context.dim, bandRows, [&](int top, const GBitmap& rows) {
+            for(int y = 0; y < rows.height(); ++y) {
+                memcpy(actual.bitmap.getAddr(0, top + y), rows.getAddr(0, y), rows.width() * sizeof(GPixel));
+            }
+        });
+        RenderTo(scene, expected.bitmap, settings);
+        differing += DiffImages(actual.bitmap, expected.bitmap, context);
+    }
+    return differing;
+}
+
+/// @brief Inverse depth rendered on its own, against the G-buffer's after a full render
+/// @return pixels whose inverse depth isn't exactly the same
+static int CheckDepthOnly(const fs::path& path, const CheckContext& context) {
+    Scene scene = LoadScene(path);
+    OwnedBitmap image(context.dim);
+    auto canvas = GCreateCanvas(image.bitmap);
+    Projector projector(canvas.get(), context.dim, &image.bitmap);
+    std::vector<float> invDepth;
+    projector.RenderDepth(scene, context.dim, invDepth);
+    projector.RenderSceneTo(scene, *canvas, context.dim);
+    const std::vector<std::vector<float>> expected = projector.getInvDepthBuffer();
+
+    int differing = 0;
+    for(int y = 0; y < context.dim.height; ++y) {
+        for(int x = 0; x < context.dim.width; ++x) {
+            if(invDepth[(size_t) y * context.dim.width + x] != expected[y][x]) ++differing;
+        }
+    }
+    return differing;
+}
+
+/// @brief Something about a scene that should hold however it's rendered
+struct Equivalence {
+    const char* name;
+    /// @return how many pixels (or whatever the check compares) disagree, -1 if it doesn't apply to the scene
+    int (*check)(const fs::path& scene, const CheckContext& context);
+};
+
+static const Equivalence Equivalences[] = {
+    {"moved_bvh", CheckMovedSceneBVH},
+    {"lod", CheckLODSize},
+    {"phases", CheckPhaseTimes},
+    {"trace", CheckTraceJson},
+    {"heatmaps", CheckHeatmaps},
+    {"pipeline", CheckPipeline},
+    {"keyframes", CheckKeyframes},
+    {"animation", CheckAnimation},
+    {"incremental", CheckIncremental},
+    {"kernels", CheckLightingKernels},
+    {"fastmath", CheckFastMath},
+    {"bvh", CheckTriangleBVH},
+    {"tlas", CheckTwoLevelBVH},
+    {"packets", CheckRayPackets},
+    {"denoise_keep", CheckDenoiserKeepsConverged},
+    {"denoise_noise", CheckDenoiserSmoothsNoise},
+    {"bands", CheckBands},
+    {"depth", CheckDepthOnly},
+    {"shadow_maps", CheckShadowMaps},
+    {"path_tracer", CheckPathTracer},
+};
+
+/// @brief Run every equivalence check over every scene
+/// @return number of checks that failed
+static int RunEquivalences(const vector<fs::path>& scenes, const CheckConfig& config, const fs::path& outputDir) {
+    int failures = 0, run = 0;
+    cout << endl << "check		scene		differing	result" << endl;
+    for(const Equivalence& equivalence : Equivalences) {
+        string check = equivalence.name;
+        for(const fs::path& scenePath : scenes) {
+            string name = scenePath.stem().string();
+            CheckContext context{config, {config.width, config.height}, outputDir / (name + "_" + check)};
+            int differing = equivalence.check(scenePath, context);
+            if(differing < 0) continue;
+
+            ++run;
+            if(differing) ++failures;
+            cout << check << (check.size() < 8 ? "\t\t" : "\t") << name << (name.size() < 8 ? "\t\t" : "\t")
+                 << differing << "\t\t" << (differing ? "FAIL" : "ok") << endl;
+        }
+    }
+    cout << run - failures << "/" << run << " equivalence checks passed" << endl;
+    return failures;
+}
+
+int main(int argc, char* argv[]) {
+    fs::path dir = "tests";
+    bool update = false, timing = true, recordBaseline = false;
+    for(int i = 1; i < argc; ++i) {
+        if(string(argv[i]) == "--update") update = recordBaseline = true;
+        else if(string(argv[i]) == "--baseline") recordBaseline = true;
+        else if(string(argv[i]) == "--no-timing") timing = false;
+        else dir = argv[i];
+    }
+
+    fs::path sceneDir = dir / "scenes";
+    fs::path referenceDir = dir / "reference";
+    fs::path outputDir = dir / "output";
+    fs::path baselinePath = dir / "baseline.local.json";
+    if(!fs::is_directory(sceneDir)) {
+        cout << "No scene directory " << sceneDir << endl;
+        return 1;
+    }
+    fs::create_directories(outputDir);
+    if(update) fs::create_directories(referenceDir);
+
+    CheckConfig config = LoadConfig(dir / "perfcheck.json");
+    json baseline = ReadJson(baselinePath);
+    if(timing && !recordBaseline && baseline.empty()) {
+        cout << "No frame time baseline for this machine in " << baselinePath << ", frame times aren't checked."
+             << " Record one with make perfcheck-baseline." << endl;
+    }
+    json newBaseline = json::object();
+
+    vector<fs::path> scenes;
+    for(const auto& entry : fs::directory_iterator(sceneDir)) {
+        if(entry.path().extension() == ".json") scenes.push_back(entry.path());
+    }
+    sort(scenes.begin(), scenes.end());
+
+    GBitmap bitmap, reference, diffImage;
+    bitmap.alloc(config.width, config.height);
+    diffImage.alloc(config.width, config.height);
+    GISize dim{config.width, config.height};
+    int numPixels = config.width * config.height;
+    auto canvas = GCreateCanvas(bitmap);
+
+    int failures = 0;
+    cout << "scene\t\tchanged px\tmax diff\ttime ms\tbaseline ms\tchange\tresult" << endl;
+    for(const fs::path& scenePath : scenes) {
+        string name = scenePath.stem().string();
+        vector<string> problems;
+
+        SceneBuilder builder(scenePath.string());
+        Scene scene = builder.getScene();
+        if(scene.isAnimated()) scene.Animate(0.f);
+
+        Projector projector(canvas.get(), dim, &bitmap);
+        double seconds = 0.0;
+        for(int run = 0; run < config.runs; ++run) {
+            RenderStatistic stats = projector.RenderSceneTo(scene, *canvas, dim);
+            seconds = run == 0 ? stats.secondsTaken : std::min(seconds, stats.secondsTaken);
+        }
+
+        string outputPath = (outputDir / (name + ".png")).string();
+        bitmap.writeToFile(outputPath.c_str());
+        string referencePath = (referenceDir / (name + ".png")).string();
+
+        // Image check
+        ImageDiff diff;
+        free(reference.pixels());
+        reference.reset();
+        if(IsBlank(bitmap)) {
+            problems.push_back("render is a single color, the scene checks nothing");
+        }
+        else if(update) {
+            bitmap.writeToFile(referencePath.c_str());
+        }
+        else if(!reference.readFromFile(referencePath.c_str())) {
+            problems.push_back("missing reference image");
+        }
+        else if(reference.width() != bitmap.width() || reference.height() != bitmap.height()) {
+            problems.push_back("reference image size differs");
+        }
+        else {
+            diff = CompareImages(bitmap, reference, config.pixelTolerance, diffImage);
+            if(diff.changedPixels > config.maxChangedFraction * numPixels) {
+                problems.push_back(to_string(diff.changedPixels) + " pixels changed");
+                string diffPath = (outputDir / (name + "_diff.png")).string();
+                diffImage.writeToFile(diffPath.c_str());
+            }
+        }
+
+        // Timing check
+        double baselineSeconds = baseline.contains(name) ? baseline[name].value("seconds", 0.0) : 0.0;
+        double change = baselineSeconds > 0.0 ? (seconds / baselineSeconds - 1.0) * 100.0 : 0.0;
+        if(!recordBaseline && timing && change > config.maxRegressionPercent) problems.push_back("frame time regressed");
+        newBaseline[name] = {{"seconds", seconds}};
+
+        cout << name << (name.size() < 8 ? "\t\t" : "\t") << diff.changedPixels << "\t\t" << diff.maxChannelDiff << "\t\t"
+             << seconds * 1000.0 << "\t" << baselineSeconds * 1000.0 << "\t\t" << change << "%\t"
+             << (update ? "updated" : problems.empty() ? "ok" : "FAIL") << endl;
+        for(const string& p : problems) cout << "  " << p << endl;
+        if(!problems.empty()) ++failures;
+    }
+
+    if(recordBaseline && timing) {
+        ofstream file(baselinePath);
+        file << newBaseline.dump(2) << endl;
+    }
+    if(update) {
+        cout << "Updated references" << (timing ? " and baseline" : "") << " for " << scenes.size() << " scenes" << endl;
+    }
+    else {
+        if(recordBaseline && timing) cout << "Recorded frame times in " << baselinePath << endl;
+        cout << scenes.size() - failures << "/" << scenes.size() << " scenes passed" << endl;
+    }
+
+    failures += RunEquivalences(scenes, config, outputDir);
+
+    free(bitmap.pixels());
+    free(diffImage.pixels());
+    free(reference.pixels());
+    return failures == 0 ? 0 : 1;
+}
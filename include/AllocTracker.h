@@ -0,0 +1,54 @@
+#ifndef AllocTracker_DEFINED
+#define AllocTracker_DEFINED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// @brief Cumulative heap activity through operator new and delete
+struct AllocCounts {
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t bytes = 0; // requested, not including allocator overhead
+};
+
+/// @brief Where operator new was called from, and what was allocated there
+struct AllocSite {
+    static constexpr int StackDepth = 12; // return addresses kept per call stack, innermost first
+
+    uintptr_t stack[StackDepth] = {}; // call stack into operator new, 0 past its end
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    // Filled in by TopSites: the innermost frame of renderer code, skipping operator new, the standard
+    // library, the allocator and Vector, which would otherwise account for nearly every allocation
+    uintptr_t address = 0;
+    std::string symbol;
+};
+
+/// @brief Global operator new/delete tracking. The hooks are only compiled in with CPPR_TRACK_ALLOCS
+/// (make TRACK_ALLOCS=1) on Linux, otherwise every count reads 0 and IsEnabled is false.
+/// Counts are process wide, so they only describe a span if nothing else allocates meanwhile.
+class AllocTracker {
+public:
+    static bool IsEnabled();
+
+    static AllocCounts Counts();
+    /// @brief Bytes currently allocated through operator new, including allocator rounding
+    static uint64_t LiveBytes();
+    /// @brief Highest LiveBytes since the last ResetPeak
+    static uint64_t PeakBytes();
+    static void ResetPeak();
+
+    /// @brief Copy every allocation site seen so far into out. Allocates only if out is smaller than
+    /// the site table, so reusing out keeps the copy itself from showing up as an allocation.
+    static void Sites(std::vector<AllocSite>& out);
+    /// @brief The n sites that allocated most often between two Sites snapshots, with symbol names.
+    /// Call stacks that lead to the same renderer frame are merged.
+    static std::vector<AllocSite> TopSites(const std::vector<AllocSite>& before,
+                                           const std::vector<AllocSite>& after, int n);
+
+    /// @brief Process peak resident set size, available whether or not tracking is compiled in, 0 off Linux
+    static uint64_t PeakResidentBytes();
+};
+
+#endif
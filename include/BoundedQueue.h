@@ -0,0 +1,52 @@
+#ifndef BoundedQueue_DEFINED
+#define BoundedQueue_DEFINED
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/// @brief Blocking FIFO with a fixed capacity, for handing work between pipeline stages.
+/// push blocks while full, pop blocks while empty. After close, push is ignored and pop drains what is left.
+template<typename T>
+class BoundedQueue {
+public:
+    BoundedQueue(size_t capacity) : _capacity(capacity), _closed(false) {}
+
+    /// @return false if the queue was closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _notFull.wait(lock, [&] { return _closed || _items.size() < _capacity; });
+        if(_closed) return false;
+        _items.push_back(std::move(item));
+        _notEmpty.notify_one();
+        return true;
+    }
+
+    /// @return false once the queue is closed and empty
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(_lock);
+        _notEmpty.wait(lock, [&] { return _closed || !_items.empty(); });
+        if(_items.empty()) return false;
+        item = std::move(_items.front());
+        _items.pop_front();
+        _notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(_lock);
+        _closed = true;
+        _notEmpty.notify_all();
+        _notFull.notify_all();
+    }
+
+private:
+    size_t _capacity;
+    bool _closed;
+    std::deque<T> _items;
+    std::mutex _lock;
+    std::condition_variable _notEmpty;
+    std::condition_variable _notFull;
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef Bounds_DEFINED
+#define Bounds_DEFINED
+
+#include "vec.h"
+#include "matrix.h"
+#include <float.h>
+#include <algorithm>
+
+/// @brief Axis aligned bounding box. Stored as raw floats (not vec3) so that large arrays of bounds
+/// stay compact and cheap to copy.
+struct AABB {
+    float min[3] = { FLT_MAX,  FLT_MAX,  FLT_MAX};
+    float max[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+    bool empty() const { return min[0] > max[0] || min[1] > max[1] || min[2] > max[2]; }
+
+    void grow(float x, float y, float z) {
+        min[0] = std::min(min[0], x); max[0] = std::max(max[0], x);
+        min[1] = std::min(min[1], y); max[1] = std::max(max[1], y);
+        min[2] = std::min(min[2], z); max[2] = std::max(max[2], z);
+    }
+    void grow(const vec3& p) { grow(p.x(), p.y(), p.z()); }
+    void grow(const AABB& b) {
+        for(int i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], b.min[i]);
+            max[i] = std::max(max[i], b.max[i]);
+        }
+    }
+
+    vec3 center() const { return {0.5f * (min[0] + max[0]), 0.5f * (min[1] + max[1]), 0.5f * (min[2] + max[2])}; }
+    float center(int axis) const { return 0.5f * (min[axis] + max[axis]); }
+    vec3 extent() const { return {max[0] - min[0], max[1] - min[1], max[2] - min[2]}; }
+
+    /// @brief Radius of the sphere enclosing the box, centered at center()
+    float radius() const {
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        return 0.5f * sqrtf(dx * dx + dy * dy + dz * dz);
+    }
+
+    float surfaceArea() const {
+        if(empty()) return 0.f;
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        return 2.f * (dx * dy + dy * dz + dz * dx);
+    }
+
+    int longestAxis() const {
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        if(dx >= dy && dx >= dz) return 0;
+        return dy >= dz ? 1 : 2;
+    }
+
+    bool contains(const vec3& p) const {
+        return p.x() >= min[0] && p.x() <= max[0] &&
+               p.y() >= min[1] && p.y() <= max[1] &&
+               p.z() >= min[2] && p.z() <= max[2];
+    }
+
+    bool overlaps(const AABB& b) const {
+        return min[0] <= b.max[0] && max[0] >= b.min[0] &&
+               min[1] <= b.max[1] && max[1] >= b.min[1] &&
+               min[2] <= b.max[2] && max[2] >= b.min[2];
+    }
+
+    /// @brief Squared distance from point to box, 0 if inside
+    float distanceSq(const vec3& p) const {
+        float d = 0.f;
+        for(int i = 0; i < 3; ++i) {
+            float v = p[i];
+            if(v < min[i]) d += (min[i] - v) * (min[i] - v);
+            else if(v > max[i]) d += (v - max[i]) * (v - max[i]);
+        }
+        return d;
+    }
+
+    bool overlapsSphere(const vec3& c, float r) const { return distanceSq(c) <= r * r; }
+
+    /// @brief Slab test
+    /// @param o ray origin
+    /// @param invDir component-wise reciprocal of ray direction
+    /// @param tmax maximum ray distance
+    /// @param tnear set to entry distance on hit
+    /// @return true if ray hits box in [0, tmax]
+    bool intersectRay(const float o[3], const float invDir[3], float tmax, float& tnear) const {
+        float t0 = 0.f, t1 = tmax;
+        for(int i = 0; i < 3; ++i) {
+            float ta = (min[i] - o[i]) * invDir[i];
+            float tb = (max[i] - o[i]) * invDir[i];
+            if(ta > tb) std::swap(ta, tb);
+            t0 = std::max(t0, ta);
+            t1 = std::min(t1, tb);
+            if(t0 > t1) return false;
+        }
+        tnear = t0;
+        return true;
+    }
+
+    /// @brief Bounds of this box after an affine transform, computed from the 8 transformed corners
+    AABB transformed(const mat4& m) const {
+        AABB out;
+        if(empty()) return out;
+        for(int c = 0; c < 8; ++c) {
+            vec3 p = m * vec3{(c & 1) ? max[0] : min[0],
+                              (c & 2) ? max[1] : min[1],
+                              (c & 4) ? max[2] : min[2]};
+            out.grow(p);
+        }
+        return out;
+    }
+};
+
+/// @brief View frustum as 6 world space planes. A point p is inside plane (a, b, c, d) if a*x + b*y + c*z + d >= 0.
+struct Frustum {
+    float planes[6][4];
+
+    Frustum() : planes{} {}
+
+    /// @brief Construct frustum from camera matrices. Follows the Projector's screen mapping,
+    /// where a camera space point is visible if |proj.x / |proj.w|| <= 0.5, and near/far clip on camera space z.
+    Frustum(const mat4& view, const mat4& proj, float near, float far) {
+        float sx = proj[{0, 0}];
+        float sy = proj[{1, 1}];
+        float h = 0.5f * std::abs(proj[{3, 2}]);
+
+        // Camera space planes, camera looks down -z
+        const float cam[6][4] = {
+            { sx, 0.f, -h, 0.f},   // left
+            {-sx, 0.f, -h, 0.f},   // right
+            {0.f,  sy, -h, 0.f},   // top
+            {0.f, -sy, -h, 0.f},   // bottom
+            {0.f, 0.f, -1.f, -near}, // near
+            {0.f, 0.f,  1.f,  far}   // far
+        };
+
+        // plane_world = view^T * plane_cam
+        mat4 viewT = view.transpose();
+        for(int i = 0; i < 6; ++i) {
+            vec4 p = viewT * vec4{cam[i][0], cam[i][1], cam[i][2], cam[i][3]};
+            planes[i][0] = p.x(); planes[i][1] = p.y(); planes[i][2] = p.z(); planes[i][3] = p.w();
+        }
+    }
+
+    enum Result { Outside, Intersect, Inside };
+
+    /// @brief Classify box against frustum
+    /// @param b box
+    /// @param mask bitmask of planes that still need testing, cleared for planes the box is fully inside of
+    Result test(const AABB& b, int& mask) const {
+        Result res = Inside;
+        for(int i = 0; i < 6; ++i) {
+            if(!(mask & (1 << i))) continue;
+            const float* p = planes[i];
+            // positive vertex, furthest along plane normal
+            float px = p[0] >= 0.f ? b.max[0] : b.min[0];
+            float py = p[1] >= 0.f ? b.max[1] : b.min[1];
+            float pz = p[2] >= 0.f ? b.max[2] : b.min[2];
+            if(p[0] * px + p[1] * py + p[2] * pz + p[3] < 0.f) return Outside;
+
+            // negative vertex
+            float nx = p[0] >= 0.f ? b.min[0] : b.max[0];
+            float ny = p[1] >= 0.f ? b.min[1] : b.max[1];
+            float nz = p[2] >= 0.f ? b.min[2] : b.max[2];
+            if(p[0] * nx + p[1] * ny + p[2] * nz + p[3] >= 0.f) mask &= ~(1 << i);
+            else res = Intersect;
+        }
+        return res;
+    }
+
+    bool overlaps(const AABB& b) const {
+        int mask = 0x3F;
+        return test(b, mask) != Outside;
+    }
+};
+
+#endif
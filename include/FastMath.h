@@ -0,0 +1,103 @@
+#ifndef FastMath_DEFINED
+#define FastMath_DEFINED
+
+#include <cfloat>
+
+#include "SIMD.h"
+#include "vec.h"
+
+/// @brief How precisely the shading math is evaluated, see RenderSettings::math
+enum class MathMode {
+    Exact,  // sqrt, division and powf, identical to the reference shading
+    Approx  // rsqrt and fast_pow, within 1e-3 relative error, rarely more than a level off in 8-bit output
+};
+
+/*
+    Approximations for the shading paths. rsqrt refines the hardware estimate with a Newton step to about
+    1e-6 relative error. fast_pow is exp2(e * log2(x)): log2 comes from the mantissa through an odd series
+    in (m - 1) / (m + 1), accurate relative to the result near x = 1 where high shininess exponents need it,
+    and exp2 from a degree 6 polynomial scaled by the exponent bits, measuring around 1e-5 relative error
+    for x in (0, 1] and exponents up to 4096.
+
+    The Pow and Rsqrt templates pick the exact or approximate form at compile time, so kernels
+    can be instantiated per MathMode.
+*/
+class FastMath {
+public:
+    /// @brief 1 / sqrt(x), with x clamped to FLT_MIN so 0 gives a large finite value rather than NaN
+    static f8 rsqrt(f8 x) {
+        x = Max(x, f8(FLT_MIN));
+        f8 y = RsqrtEstimate(x);
+        return y * (f8(1.5f) - f8(.5f) * x * y * y);
+    }
+
+    /// @brief x^e for x >= 0, 0 where x is 0
+    static f8 fast_pow(f8 x, f8 e) {
+        // x = 2^k * m with m in [sqrt(1/2), sqrt(2))
+        i8 bits = x.bits();
+        f8 k = (bits.shr<23>() - i8(127)).toFloat();
+        f8 m = f8::FromBits((bits & i8(0x007FFFFF)) | i8(0x3F800000));
+        f8 high = m > f8(1.41421356f);
+        m = Select(high, m * f8(.5f), m);
+        k = Select(high, k + f8(1.f), k);
+
+        // log2(m) = 2 / ln 2 * (t + t^3 / 3 + t^5 / 5 + t^7 / 7), t = (m - 1) / (m + 1)
+        f8 t = (m - f8(1.f)) / (m + f8(1.f));
+        f8 t2 = t * t;
+        f8 log2m = t * (f8(2.88539008f) + t2 * (f8(.961796694f) + t2 * (f8(.577078016f) + t2 * f8(.412198583f))));
+
+        return Select(x > f8(0.f), exp2(e * (k + log2m)), 0.f);
+    }
+
+    /// @brief 2^y, clamped to the normal float range
+    static f8 exp2(f8 y) {
+        y = Min(Max(y, -126.f), 127.f);
+
+        // 2^y = 2^floor(y) * 2^r, r in [0, 1)
+        f8 whole = y.toInt().toFloat();
+        whole = Select(whole > y, whole - f8(1.f), whole);
+        f8 r = y - whole;
+        f8 p = f8(1.f) + r * (f8(.693147181f) + r * (f8(.240226507f) + r * (f8(.0555041087f)
+                       + r * (f8(.00961812911f) + r * (f8(.00133335581f) + r * f8(.000154035304f))))));
+        f8 scale = f8::FromBits((whole.toInt() + i8(127)).shl<23>());
+        return p * scale;
+    }
+
+    /// @brief e^x, through exp2
+    static f8 exp(f8 x) { return exp2(x * f8(1.44269504f)); }
+
+    static float rsqrt(float x) { return Lane0(rsqrt(f8(x))); }
+    static float fast_pow(float x, float e) { return Lane0(fast_pow(f8(x), f8(e))); }
+
+    /// @brief Normalize 8 vectors in place, zero vectors stay zero
+    static void normalize(f8& x, f8& y, f8& z) {
+        f8 s = rsqrt(x * x + y * y + z * z);
+        x = x * s; y = y * s; z = z * s;
+    }
+    static void normalize(vec3& v) {
+        float s = rsqrt(v.lengthsq());
+        v[0] *= s; v[1] *= s; v[2] *= s;
+    }
+
+    /// @brief 1 / sqrt(x)
+    template<MathMode Mode>
+    static f8 Rsqrt(f8 x) {
+        if constexpr(Mode == MathMode::Approx) return rsqrt(x);
+        else return f8(1.f) / Sqrt(x);
+    }
+
+    template<MathMode Mode>
+    static f8 Pow(f8 x, f8 e) {
+        if constexpr(Mode == MathMode::Approx) return fast_pow(x, e);
+        else return PerLane(x, e, [](float b, float p) { return powf(b, p); });
+    }
+
+private:
+    static float Lane0(f8 v) {
+        float lanes[8];
+        v.store(lanes);
+        return lanes[0];
+    }
+};
+
+#endif
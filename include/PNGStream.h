@@ -0,0 +1,61 @@
+#ifndef PNGStream_DEFINED
+#define PNGStream_DEFINED
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include "GBitmap.h"
+
+/// @brief Writes a PNG a few rows at a time, for images too large to hold whole (GBitmap::writeToFile
+/// encodes through lodepng, which needs every row at once). Rows are filtered and deflated as they come
+/// in, and the compressed stream is written out in IDAT chunks, so memory stays a couple of rows plus the
+/// 32KB deflate window however tall the image. Deflate finds matches through short hash chains, like
+/// zlib's fastest levels, and codes them in blocks with Huffman codes of their own.
+class PNGStream {
+public:
+    PNGStream();
+    ~PNGStream();
+    PNGStream(const PNGStream&) = delete;
+    PNGStream& operator=(const PNGStream&) = delete;
+
+    enum class Format {
+        RGBA8,  // 8 bit RGBA, written from GBitmaps
+        Gray16  // 16 bit grayscale, written from rows of samples
+    };
+
+    /// @brief Create (or overwrite) path and write the header of a width x height image
+    bool open(const char path[], int width, int height, Format format = Format::RGBA8);
+
+    /// @brief Append the next rows of an RGBA8 image, top to bottom, as many as rows is tall
+    bool write(const GBitmap& rows);
+
+    /// @brief Append the next count rows of a Gray16 image, top to bottom, each width samples long
+    bool write(const uint16_t samples[], int count);
+
+    /// @brief Finish the image and close the file
+    /// @return true if every row was written and nothing failed along the way
+    bool close();
+
+    /// @brief Premultiplied pixels to the unpremultiplied RGBA bytes PNG stores
+    static void ToRGBA(const GPixel src[], int width, uint8_t dst[]);
+
+private:
+    struct Deflate;
+
+    FILE* _file = nullptr;
+    bool _ok = false;
+    Format _format = Format::RGBA8;
+    int _width = 0, _height = 0, _rowsWritten = 0;
+    std::vector<uint8_t> _row, _prior;    // unfiltered bytes of the current and previous row
+    std::vector<uint8_t> _filtered[5];    // current row under each filter, leading filter type byte included
+    std::unique_ptr<Deflate> _deflate;
+
+    /// @brief Filter and compress the row in _row
+    void writeRow();
+    void writeChunk(const char type[4], const uint8_t data[], size_t size);
+    /// @brief Write out what deflate has compressed so far, if it's a chunk's worth or finishing
+    void flushIDAT(bool finish);
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef Parallel_DEFINED
+#define Parallel_DEFINED
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include "Trace.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/// @brief Number of worker threads to use, 0 means one per hardware thread
+inline int ResolveThreadCount(int requested) {
+    if(requested > 0) return requested;
+    return std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+/// @brief The kernel's id for the calling thread, 0 where there's none
+inline int OSThreadId() {
+#ifdef __linux__
+    return (int) syscall(SYS_gettid);
+#else
+    return 0;
+#endif
+}
+
+/// @brief Worker threads shared by every ParallelFor call. Workers are started the first time a call asks for
+/// more than are running and then kept for the life of the program, so calls don't pay for creating threads
+/// and traces show a fixed set of them. Calls may come from several threads at once, and nest.
+class ThreadPool {
+public:
+    /// @brief One call's chunks, living on the caller's stack. Workers only pick it up while it's queued,
+    /// and the caller waits for every worker that did before returning.
+    struct Job {
+        void (*run)(void* fn, int chunk);
+        void* fn;
+        int chunks;
+        int maxHelpers;            // workers allowed to join the caller
+        std::atomic<int> next{0};  // next chunk to hand out
+        int helpers = 0;           // workers that joined, guarded by the pool's lock like the rest
+        int active = 0;            // workers still running chunks
+        std::exception_ptr error;  // first exception thrown by a chunk
+    };
+
+    static ThreadPool& Shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stopping = true;
+        }
+        _wake.notify_all();
+        for(std::thread& t : _workers) t.join();
+    }
+
+    /// @brief Run job's chunks on the calling thread and up to job.maxHelpers workers, returning once all
+    /// are done. An exception thrown by a chunk stops the rest from starting and is rethrown here.
+    void run(Job& job) {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            while((int) _workers.size() < job.maxHelpers) _workers.emplace_back([this]() { workerLoop(); });
+            _jobs.push_back(&job);
+        }
+        _wake.notify_all();
+        work(job);
+
+        std::unique_lock<std::mutex> lock(_lock);
+        auto queued = std::find(_jobs.begin(), _jobs.end(), &job);
+        if(queued != _jobs.end()) _jobs.erase(queued);
+        _done.wait(lock, [&]() { return job.active == 0; });
+        if(job.error) std::rethrow_exception(job.error);
+    }
+
+    /// @brief Called with a worker's OSThreadId, see addWorkerObserver
+    using WorkerObserver = void (*)(void* context, int threadId);
+
+    /// @brief Call observer(context, id) for every worker until removeWorkerObserver(context): right away for
+    /// those running, and for each one started later on that worker's thread, before it runs any chunks.
+    /// Calls are made holding the pool's lock, so observer mustn't use the pool.
+    void addWorkerObserver(WorkerObserver observer, void* context) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _observers.push_back({observer, context});
+        for(int id : _threadIds) observer(context, id);
+    }
+
+    void removeWorkerObserver(void* context) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _observers.erase(std::remove_if(_observers.begin(), _observers.end(),
+                                        [&](const Observer& o) { return o.context == context; }), _observers.end());
+    }
+
+private:
+    ThreadPool() {}
+
+    void work(Job& job) {
+        TRACE_SCOPE("ParallelFor worker");
+        try {
+            for(int c = job.next++; c < job.chunks; c = job.next++) job.run(job.fn, c);
+        }
+        catch(...) {
+            job.next = job.chunks;
+            std::lock_guard<std::mutex> lock(_lock);
+            if(!job.error) job.error = std::current_exception();
+        }
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock(_lock);
+        int id = OSThreadId();
+        _threadIds.push_back(id);
+        for(const Observer& o : _observers) o.observer(o.context, id);
+        while(true) {
+            _wake.wait(lock, [&]() { return _stopping || !_jobs.empty(); });
+            if(_stopping) return;
+
+            // Jobs leave the queue once they have all the help they asked for, or nothing left to hand out
+            Job& job = *_jobs.front();
+            if(job.next >= job.chunks) {
+                _jobs.pop_front();
+                continue;
+            }
+            ++job.active;
+            if(++job.helpers >= job.maxHelpers) _jobs.pop_front();
+            lock.unlock();
+
+            Trace::SetThreadName("worker");
+            work(job);
+
+            lock.lock();
+            if(--job.active == 0) _done.notify_all();
+        }
+    }
+
+    std::mutex _lock;
+    std::condition_variable _wake; // workers, for a new job or stopping
+    std::condition_variable _done; // callers, for a job's workers finishing
+    std::deque<Job*> _jobs;
+    std::vector<std::thread> _workers;
+    std::vector<int> _threadIds; // workers' OSThreadIds, in the order they started
+    struct Observer {
+        WorkerObserver observer;
+        void* context;
+    };
+    std::vector<Observer> _observers;
+    bool _stopping = false;
+};
+
+/// @brief Run fn(begin, end) over [begin, end) split into chunks of grain items, spread over threads, the
+/// calling one included, with the rest taken from ThreadPool::Shared(). Chunks are handed out dynamically
+/// so uneven work balances out. Runs inline if only one thread is used.
+template<typename F>
+void ParallelFor(int begin, int end, int grain, int threads, F&& fn) {
+    if(end <= begin) return;
+    grain = std::max(grain, 1);
+    int chunks = (end - begin + grain - 1) / grain;
+    threads = std::min(ResolveThreadCount(threads), chunks);
+
+    if(threads <= 1) {
+        fn(begin, end);
+        return;
+    }
+
+    auto chunk = [&](int c) {
+        int b = begin + c * grain;
+        fn(b, std::min(b + grain, end));
+    };
+    using Chunk = decltype(chunk);
+
+    ThreadPool::Job job;
+    job.run = [](void* f, int c) { (*static_cast<Chunk*>(f))(c); };
+    job.fn = &chunk;
+    job.chunks = chunks;
+    job.maxHelpers = threads - 1;
+    ThreadPool::Shared().run(job);
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef PerfCounters_DEFINED
+#define PerfCounters_DEFINED
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+
+/// @brief Hardware event counts over some span of execution
+struct PerfValues {
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t l1dMisses = 0; // L1 data cache read misses
+    uint64_t llcMisses = 0; // last level cache misses
+    uint64_t branchMisses = 0;
+
+    double ipc() const { return cycles > 0 ? double(instructions) / double(cycles) : 0.0; }
+
+    PerfValues& operator+=(const PerfValues& o) {
+        cycles += o.cycles;
+        instructions += o.instructions;
+        l1dMisses += o.l1dMisses;
+        llcMisses += o.llcMisses;
+        branchMisses += o.branchMisses;
+        return *this;
+    }
+
+    PerfValues operator-(const PerfValues& o) const {
+        PerfValues d;
+        d.cycles = cycles - o.cycles;
+        d.instructions = instructions - o.instructions;
+        d.l1dMisses = l1dMisses - o.l1dMisses;
+        d.llcMisses = llcMisses - o.llcMisses;
+        d.branchMisses = branchMisses - o.branchMisses;
+        return d;
+    }
+};
+
+/// @brief Hardware performance counters (Linux perf_event_open) for the thread that creates them and the workers
+/// of ThreadPool::Shared(), so ParallelFor work counts wherever it runs. Workers count whatever they run,
+/// including chunks of other threads' ParallelFor calls made at the same time. Other threads don't count.
+/// User space only.
+/// Events the CPU, kernel or container won't provide are left out, and if none open the counters
+/// report unavailable along with the reason instead of failing.
+class PerfCounters {
+public:
+    enum Event { Cycles, Instructions, L1DMisses, LLCMisses, BranchMisses, NumEvents };
+
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return _numOpen > 0; }
+    bool available(Event e) const { return _fds[e] >= 0; }
+    /// @brief Why no counters could be opened, empty if available
+    const std::string& error() const { return _error; }
+
+    /// @brief Running totals since construction, or since a worker started for its share, summed over the
+    /// threads and scaled up if the kernel had to multiplex counters. Unavailable events read as 0.
+    PerfValues read() const;
+
+private:
+    int _fds[NumEvents];
+    int _numOpen = 0;
+    std::string _error;
+
+    // The same events for each pool worker, opened as workers start
+    std::vector<std::array<int, NumEvents>> _workers;
+    mutable std::mutex _workersLock;
+    static void WorkerStarted(void* counters, int threadId);
+};
+
+#endif
@@ -0,0 +1,244 @@
+#ifndef SIMD_DEFINED
+#define SIMD_DEFINED
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+/*
+    8-wide float and int vectors for the shading kernels. Backed by one AVX2 register when compiled
+    with AVX2 (make NATIVE=1 on a CPU that has it), a pair of SSE2 registers on any other x86-64,
+    and plain arrays elsewhere or with CPPR_NO_SIMD. Every path gives bit identical results.
+
+    Comparisons return masks with all bits of a lane set where true, for Select and Any.
+    RsqrtEstimate is the exception to matching paths, its precision is only guaranteed to 12 bits.
+*/
+
+#if defined(CPPR_NO_SIMD)
+#define CPPR_SIMD_SCALAR
+#elif defined(__AVX2__)
+#define CPPR_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define CPPR_SIMD_SSE2
+#include <emmintrin.h>
+#else
+#define CPPR_SIMD_SCALAR
+#endif
+
+struct i8;
+
+struct f8 {
+#if defined(CPPR_SIMD_AVX2)
+    __m256 v;
+    f8() {}
+    f8(__m256 v) : v(v) {}
+    f8(float s) : v(_mm256_set1_ps(s)) {}
+
+    static f8 Load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    f8 operator+(f8 o) const { return _mm256_add_ps(v, o.v); }
+    f8 operator-(f8 o) const { return _mm256_sub_ps(v, o.v); }
+    f8 operator*(f8 o) const { return _mm256_mul_ps(v, o.v); }
+    f8 operator/(f8 o) const { return _mm256_div_ps(v, o.v); }
+
+    f8 operator<(f8 o) const { return _mm256_cmp_ps(v, o.v, _CMP_LT_OQ); }
+    f8 operator<=(f8 o) const { return _mm256_cmp_ps(v, o.v, _CMP_LE_OQ); }
+    f8 operator>(f8 o) const { return _mm256_cmp_ps(v, o.v, _CMP_GT_OQ); }
+    f8 operator&(f8 o) const { return _mm256_and_ps(v, o.v); }
+    f8 operator|(f8 o) const { return _mm256_or_ps(v, o.v); }
+
+    friend f8 Min(f8 a, f8 b) { return _mm256_min_ps(a.v, b.v); }
+    friend f8 Max(f8 a, f8 b) { return _mm256_max_ps(a.v, b.v); }
+    friend f8 Sqrt(f8 a) { return _mm256_sqrt_ps(a.v); }
+    friend f8 RsqrtEstimate(f8 a) { return _mm256_rsqrt_ps(a.v); }
+    /// @brief Lanes of a where mask is set, b elsewhere
+    friend f8 Select(f8 mask, f8 a, f8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+    friend bool Any(f8 mask) { return _mm256_movemask_ps(mask.v) != 0; }
+    friend bool All(f8 mask) { return _mm256_movemask_ps(mask.v) == 0xFF; }
+    /// @brief Bit i set where lane i of mask is
+    friend int MoveMask(f8 mask) { return _mm256_movemask_ps(mask.v); }
+#elif defined(CPPR_SIMD_SSE2)
+    __m128 lo, hi;
+    f8() {}
+    f8(__m128 lo, __m128 hi) : lo(lo), hi(hi) {}
+    f8(float s) : lo(_mm_set1_ps(s)), hi(_mm_set1_ps(s)) {}
+
+    static f8 Load(const float* p) { return {_mm_loadu_ps(p), _mm_loadu_ps(p + 4)}; }
+    void store(float* p) const { _mm_storeu_ps(p, lo); _mm_storeu_ps(p + 4, hi); }
+
+    f8 operator+(f8 o) const { return {_mm_add_ps(lo, o.lo), _mm_add_ps(hi, o.hi)}; }
+    f8 operator-(f8 o) const { return {_mm_sub_ps(lo, o.lo), _mm_sub_ps(hi, o.hi)}; }
+    f8 operator*(f8 o) const { return {_mm_mul_ps(lo, o.lo), _mm_mul_ps(hi, o.hi)}; }
+    f8 operator/(f8 o) const { return {_mm_div_ps(lo, o.lo), _mm_div_ps(hi, o.hi)}; }
+
+    f8 operator<(f8 o) const { return {_mm_cmplt_ps(lo, o.lo), _mm_cmplt_ps(hi, o.hi)}; }
+    f8 operator<=(f8 o) const { return {_mm_cmple_ps(lo, o.lo), _mm_cmple_ps(hi, o.hi)}; }
+    f8 operator>(f8 o) const { return {_mm_cmpgt_ps(lo, o.lo), _mm_cmpgt_ps(hi, o.hi)}; }
+    f8 operator&(f8 o) const { return {_mm_and_ps(lo, o.lo), _mm_and_ps(hi, o.hi)}; }
+    f8 operator|(f8 o) const { return {_mm_or_ps(lo, o.lo), _mm_or_ps(hi, o.hi)}; }
+
+    friend f8 Min(f8 a, f8 b) { return {_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)}; }
+    friend f8 Max(f8 a, f8 b) { return {_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)}; }
+    friend f8 Sqrt(f8 a) { return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)}; }
+    friend f8 RsqrtEstimate(f8 a) { return {_mm_rsqrt_ps(a.lo), _mm_rsqrt_ps(a.hi)}; }
+    /// @brief Lanes of a where mask is set, b elsewhere
+    friend f8 Select(f8 mask, f8 a, f8 b) {
+        return {_mm_or_ps(_mm_and_ps(mask.lo, a.lo), _mm_andnot_ps(mask.lo, b.lo)),
+                _mm_or_ps(_mm_and_ps(mask.hi, a.hi), _mm_andnot_ps(mask.hi, b.hi))};
+    }
+    friend bool Any(f8 mask) { return (_mm_movemask_ps(mask.lo) | _mm_movemask_ps(mask.hi)) != 0; }
+    friend bool All(f8 mask) { return (_mm_movemask_ps(mask.lo) & _mm_movemask_ps(mask.hi)) == 0xF; }
+    /// @brief Bit i set where lane i of mask is
+    friend int MoveMask(f8 mask) { return _mm_movemask_ps(mask.lo) | (_mm_movemask_ps(mask.hi) << 4); }
+#else
+    float v[8];
+    f8() {}
+    f8(float s) { for(float& x : v) x = s; }
+
+    static f8 Load(const float* p) { f8 r; std::memcpy(r.v, p, sizeof(r.v)); return r; }
+    void store(float* p) const { std::memcpy(p, v, sizeof(v)); }
+
+    template<typename Op>
+    f8 map(f8 o, Op op) const { f8 r; for(int i = 0; i < 8; ++i) r.v[i] = op(v[i], o.v[i]); return r; }
+    static float MaskLane(bool b) { uint32_t bits = b ? ~0u : 0u; float f; std::memcpy(&f, &bits, 4); return f; }
+    static bool LaneSet(float f) { uint32_t bits; std::memcpy(&bits, &f, 4); return bits >> 31; }
+    template<typename Op>
+    static float BitOp(float a, float b, Op op) {
+        uint32_t x, y;
+        std::memcpy(&x, &a, 4);
+        std::memcpy(&y, &b, 4);
+        x = op(x, y);
+        float r;
+        std::memcpy(&r, &x, 4);
+        return r;
+    }
+
+    f8 operator+(f8 o) const { return map(o, [](float a, float b) { return a + b; }); }
+    f8 operator-(f8 o) const { return map(o, [](float a, float b) { return a - b; }); }
+    f8 operator*(f8 o) const { return map(o, [](float a, float b) { return a * b; }); }
+    f8 operator/(f8 o) const { return map(o, [](float a, float b) { return a / b; }); }
+
+    f8 operator<(f8 o) const { return map(o, [](float a, float b) { return MaskLane(a < b); }); }
+    f8 operator<=(f8 o) const { return map(o, [](float a, float b) { return MaskLane(a <= b); }); }
+    f8 operator>(f8 o) const { return map(o, [](float a, float b) { return MaskLane(a > b); }); }
+    f8 operator&(f8 o) const { return map(o, [](float a, float b) { return BitOp(a, b, [](uint32_t x, uint32_t y) { return x & y; }); }); }
+    f8 operator|(f8 o) const { return map(o, [](float a, float b) { return BitOp(a, b, [](uint32_t x, uint32_t y) { return x | y; }); }); }
+
+    // Same NaN handling as minps/maxps, which return the second operand
+    friend f8 Min(f8 a, f8 b) { return a.map(b, [](float x, float y) { return x < y ? x : y; }); }
+    friend f8 Max(f8 a, f8 b) { return a.map(b, [](float x, float y) { return x > y ? x : y; }); }
+    friend f8 Sqrt(f8 a) { f8 r; for(int i = 0; i < 8; ++i) r.v[i] = std::sqrt(a.v[i]); return r; }
+    friend f8 RsqrtEstimate(f8 a) { f8 r; for(int i = 0; i < 8; ++i) r.v[i] = 1.f / std::sqrt(a.v[i]); return r; }
+    /// @brief Lanes of a where mask is set, b elsewhere
+    friend f8 Select(f8 mask, f8 a, f8 b) {
+        f8 r; for(int i = 0; i < 8; ++i) r.v[i] = LaneSet(mask.v[i]) ? a.v[i] : b.v[i]; return r;
+    }
+    friend bool Any(f8 mask) { for(float m : mask.v) if(LaneSet(m)) return true; return false; }
+    friend bool All(f8 mask) { for(float m : mask.v) if(!LaneSet(m)) return false; return true; }
+    /// @brief Bit i set where lane i of mask is
+    friend int MoveMask(f8 mask) { int r = 0; for(int i = 0; i < 8; ++i) r |= LaneSet(mask.v[i]) << i; return r; }
+#endif
+
+    /// @brief Load n <= 8 floats, zero filling the remaining lanes
+    static f8 LoadPartial(const float* p, int n) {
+        if(n >= 8) return Load(p);
+        float tmp[8] = {};
+        std::memcpy(tmp, p, n * sizeof(float));
+        return Load(tmp);
+    }
+
+    /// @brief Mask with lane i set where bit i of bits is, the inverse of MoveMask
+    static f8 FromMask(int bits) {
+        float lanes[8];
+        for(int i = 0; i < 8; ++i) {
+            uint32_t b = (bits >> i & 1) ? ~0u : 0u;
+            std::memcpy(&lanes[i], &b, 4);
+        }
+        return Load(lanes);
+    }
+
+    /// @brief Apply a scalar function lane by lane, for what has no vector instruction
+    template<typename F>
+    friend f8 PerLane(f8 a, f8 b, F f) {
+        alignas(32) float x[8], y[8];
+        a.store(x);
+        b.store(y);
+        for(int i = 0; i < 8; ++i) x[i] = f(x[i], y[i]);
+        return Load(x);
+    }
+
+    /// @brief Truncate toward zero like a (int) cast
+    i8 toInt() const;
+    /// @brief Reinterpret the lanes' bits as integers, and back
+    i8 bits() const;
+    static f8 FromBits(i8 b);
+};
+
+struct i8 {
+#if defined(CPPR_SIMD_AVX2)
+    __m256i v;
+    i8() {}
+    i8(__m256i v) : v(v) {}
+    i8(int32_t s) : v(_mm256_set1_epi32(s)) {}
+
+    void store(int32_t* p) const { _mm256_storeu_si256((__m256i*) p, v); }
+    i8 operator+(i8 o) const { return _mm256_add_epi32(v, o.v); }
+    i8 operator-(i8 o) const { return _mm256_sub_epi32(v, o.v); }
+    i8 operator&(i8 o) const { return _mm256_and_si256(v, o.v); }
+    i8 operator|(i8 o) const { return _mm256_or_si256(v, o.v); }
+    template<int N> i8 shl() const { return _mm256_slli_epi32(v, N); }
+    template<int N> i8 shr() const { return _mm256_srli_epi32(v, N); }
+    f8 toFloat() const { return _mm256_cvtepi32_ps(v); }
+#elif defined(CPPR_SIMD_SSE2)
+    __m128i lo, hi;
+    i8() {}
+    i8(__m128i lo, __m128i hi) : lo(lo), hi(hi) {}
+    i8(int32_t s) : lo(_mm_set1_epi32(s)), hi(_mm_set1_epi32(s)) {}
+
+    void store(int32_t* p) const { _mm_storeu_si128((__m128i*) p, lo); _mm_storeu_si128((__m128i*) (p + 4), hi); }
+    i8 operator+(i8 o) const { return {_mm_add_epi32(lo, o.lo), _mm_add_epi32(hi, o.hi)}; }
+    i8 operator-(i8 o) const { return {_mm_sub_epi32(lo, o.lo), _mm_sub_epi32(hi, o.hi)}; }
+    i8 operator&(i8 o) const { return {_mm_and_si128(lo, o.lo), _mm_and_si128(hi, o.hi)}; }
+    i8 operator|(i8 o) const { return {_mm_or_si128(lo, o.lo), _mm_or_si128(hi, o.hi)}; }
+    template<int N> i8 shl() const { return {_mm_slli_epi32(lo, N), _mm_slli_epi32(hi, N)}; }
+    template<int N> i8 shr() const { return {_mm_srli_epi32(lo, N), _mm_srli_epi32(hi, N)}; }
+    f8 toFloat() const { return {_mm_cvtepi32_ps(lo), _mm_cvtepi32_ps(hi)}; }
+#else
+    int32_t v[8];
+    i8() {}
+    i8(int32_t s) { for(int32_t& x : v) x = s; }
+
+    void store(int32_t* p) const { std::memcpy(p, v, sizeof(v)); }
+    template<typename Op>
+    i8 map(i8 o, Op op) const { i8 r; for(int i = 0; i < 8; ++i) r.v[i] = (int32_t) op((uint32_t) v[i], (uint32_t) o.v[i]); return r; }
+
+    i8 operator+(i8 o) const { return map(o, [](uint32_t a, uint32_t b) { return a + b; }); }
+    i8 operator-(i8 o) const { return map(o, [](uint32_t a, uint32_t b) { return a - b; }); }
+    i8 operator&(i8 o) const { return map(o, [](uint32_t a, uint32_t b) { return a & b; }); }
+    i8 operator|(i8 o) const { return map(o, [](uint32_t a, uint32_t b) { return a | b; }); }
+    template<int N> i8 shl() const { i8 r; for(int i = 0; i < 8; ++i) r.v[i] = (int32_t) ((uint32_t) v[i] << N); return r; }
+    template<int N> i8 shr() const { i8 r; for(int i = 0; i < 8; ++i) r.v[i] = (int32_t) ((uint32_t) v[i] >> N); return r; }
+    f8 toFloat() const { f8 r; for(int i = 0; i < 8; ++i) r.v[i] = (float) v[i]; return r; }
+#endif
+};
+
+#if defined(CPPR_SIMD_AVX2)
+inline i8 f8::toInt() const { return _mm256_cvttps_epi32(v); }
+inline i8 f8::bits() const { return _mm256_castps_si256(v); }
+inline f8 f8::FromBits(i8 b) { return _mm256_castsi256_ps(b.v); }
+#elif defined(CPPR_SIMD_SSE2)
+inline i8 f8::toInt() const { return {_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)}; }
+inline i8 f8::bits() const { return {_mm_castps_si128(lo), _mm_castps_si128(hi)}; }
+inline f8 f8::FromBits(i8 b) { return {_mm_castsi128_ps(b.lo), _mm_castsi128_ps(b.hi)}; }
+#else
+inline i8 f8::toInt() const { i8 r; for(int i = 0; i < 8; ++i) r.v[i] = (int32_t) v[i]; return r; }
+inline i8 f8::bits() const { i8 r; std::memcpy(r.v, v, sizeof(v)); return r; }
+inline f8 f8::FromBits(i8 b) { f8 r; std::memcpy(r.v, b.v, sizeof(r.v)); return r; }
+#endif
+
+/// @brief Absolute value, by clearing the sign bit
+inline f8 Abs(f8 a) { return f8::FromBits(a.bits() & i8(0x7FFFFFFF)); }
+
+#endif
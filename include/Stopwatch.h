@@ -0,0 +1,31 @@
+#ifndef Stopwatch_DEFINED
+#define Stopwatch_DEFINED
+
+#include <chrono>
+
+/// @brief Monotonic wall clock timer for measuring render phases
+class Stopwatch {
+public:
+    using clock = std::chrono::steady_clock;
+
+    Stopwatch() : _start(clock::now()), _lap(_start) {}
+
+    /// @brief Seconds since construction
+    double elapsed() const { return seconds(clock::now() - _start); }
+
+    /// @brief Seconds since the previous lap (or construction), and start the next lap
+    double lap() {
+        clock::time_point now = clock::now();
+        double s = seconds(now - _lap);
+        _lap = now;
+        return s;
+    }
+
+private:
+    clock::time_point _start;
+    clock::time_point _lap;
+
+    static double seconds(clock::duration d) { return std::chrono::duration<double>(d).count(); }
+};
+
+#endif
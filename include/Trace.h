@@ -0,0 +1,58 @@
+#ifndef Trace_DEFINED
+#define Trace_DEFINED
+
+#include <atomic>
+#include <cstdint>
+
+/// @brief Opt-in span tracing, written out as Chrome trace_event JSON (open in Perfetto or chrome://tracing).
+/// Spans are recorded into per-thread ring buffers without locking, and while tracing is disabled
+/// a span costs a single relaxed atomic load.
+class Trace {
+public:
+    static bool IsEnabled() { return _enabled.load(std::memory_order_relaxed); }
+    static void SetEnabled(bool enabled);
+
+    /// @brief Nanoseconds since tracing was first enabled
+    static uint64_t Now();
+
+    /// @brief Record a finished span on the calling thread. name must outlive the trace, e.g. a string literal.
+    static void Record(const char* name, uint64_t start, uint64_t end);
+
+    /// @brief Label the calling thread in the trace viewer, replacing any earlier label. No-op while disabled.
+    static void SetThreadName(const char* name);
+
+    /// @brief Write all recorded spans to path. Call while no spans are being recorded, e.g. after rendering.
+    /// Each thread keeps only its most recent spans if it recorded more than its ring holds.
+    static bool WriteJson(const char* path);
+
+    /// @brief Drop all recorded spans. Same restriction as WriteJson.
+    static void Clear();
+
+private:
+    static std::atomic<bool> _enabled;
+};
+
+/// @brief Records a span from construction to destruction, if tracing was enabled at construction
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : _name(Trace::IsEnabled() ? name : nullptr) {
+        if(_name) _start = Trace::Now();
+    }
+    ~TraceScope() {
+        if(_name) Trace::Record(_name, _start, Trace::Now());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* _name;
+    uint64_t _start = 0;
+};
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+/// @brief Trace the rest of the enclosing scope as a span called name
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(_traceScope, __LINE__)(name)
+
+#endif
@@ -46,8 +46,11 @@ public:
     }
     
     
+    /// @brief Make result a view of data, which must outlive it
     static Vector& fromArrMem(float data[D], Vector<D> &result) {
+        if(result.owned) delete[] result.vals;
         result.vals = data;
+        result.owned = false;
         return result;
     }
     
@@ -58,6 +61,10 @@ public:
         std::copy(v.vals, v.vals + D, vals);
     }
 
+    ~Vector() {
+        if(owned) delete[] vals;
+    }
+
     float x() const { return vals[0]; }
     float y() const { return vals[1]; }
     float z() const { typename std::enable_if<(D > 2)>::type(); return vals[2]; }
@@ -278,6 +285,7 @@ public:
 
 private:
     float* vals;
+    bool owned = true; // false for views made by fromArrMem
 };
 
 using vec4 = Vector<4>;
@@ -0,0 +1,318 @@
+#include "../include/AllocTracker.h"
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <malloc.h>
+#endif
+
+#if defined(CPPR_TRACK_ALLOCS) && defined(__linux__)
+
+namespace {
+
+constexpr int SiteSlots = 4096;
+
+std::atomic<uint64_t> gAllocs{0};
+std::atomic<uint64_t> gFrees{0};
+std::atomic<uint64_t> gBytes{0};
+std::atomic<int64_t> gLive{0};
+std::atomic<int64_t> gPeak{0};
+
+// Open addressed table keyed by a hash of the call stack. Fixed size and lock free, since it is updated
+// from inside operator new where allocating or locking could recurse or deadlock.
+struct SiteSlot {
+    std::atomic<uint64_t> key{0};
+    std::atomic<uintptr_t> stack[AllocSite::StackDepth] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> bytes{0};
+};
+SiteSlot gSites[SiteSlots];
+
+// backtrace loads libgcc the first time it runs, through malloc rather than operator new, but doing that
+// up front keeps it out of the first tracked allocation
+struct BacktraceWarmUp {
+    BacktraceWarmUp() {
+        void* frame[1];
+        backtrace(frame, 1);
+    }
+} gBacktraceWarmUp;
+
+uint64_t stackKey(void* const stack[], int depth) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for(int i = 0; i < depth; ++i) h = (h ^ (uint64_t) (uintptr_t) stack[i]) * 0x100000001B3ull;
+    return h ? h : 1;
+}
+
+void recordSite(void* const stack[], int depth, size_t size) {
+    uint64_t key = stackKey(stack, depth);
+    size_t h = (size_t) (key * 0x9E3779B97F4A7C15ull >> 52);
+    for(int probe = 0; probe < SiteSlots; ++probe) {
+        SiteSlot& slot = gSites[(h + probe) & (SiteSlots - 1)];
+        uint64_t cur = slot.key.load(std::memory_order_relaxed);
+        if(cur == 0 && slot.key.compare_exchange_strong(cur, key, std::memory_order_relaxed)) {
+            for(int i = 0; i < depth; ++i) slot.stack[i].store((uintptr_t) stack[i], std::memory_order_relaxed);
+            cur = key;
+        }
+        if(cur == key) {
+            slot.count.fetch_add(1, std::memory_order_relaxed);
+            slot.bytes.fetch_add(size, std::memory_order_relaxed);
+            return;
+        }
+    }
+    // Table full, the allocation still shows up in the totals
+}
+
+void* track(void* p, size_t size, void* const stack[], int depth) {
+    if(!p) return p;
+    int64_t usable = malloc_usable_size(p);
+    gAllocs.fetch_add(1, std::memory_order_relaxed);
+    gBytes.fetch_add(size, std::memory_order_relaxed);
+    int64_t live = gLive.fetch_add(usable, std::memory_order_relaxed) + usable;
+    int64_t peak = gPeak.load(std::memory_order_relaxed);
+    while(live > peak && !gPeak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+    recordSite(stack, depth, size);
+    return p;
+}
+
+void untrack(void* p) {
+    if(!p) return;
+    gFrees.fetch_add(1, std::memory_order_relaxed);
+    gLive.fetch_sub(malloc_usable_size(p), std::memory_order_relaxed);
+}
+
+void* allocate(size_t size, void* const stack[], int depth) {
+    return track(std::malloc(size ? size : 1), size, stack, depth);
+}
+
+void* allocateAligned(size_t size, std::align_val_t align, void* const stack[], int depth) {
+    size_t a = std::max((size_t) align, sizeof(void*));
+    size_t rounded = (std::max(size, (size_t) 1) + a - 1) / a * a;
+    return track(std::aligned_alloc(a, rounded), size, stack, depth);
+}
+
+void release(void* p) {
+    untrack(p);
+    std::free(p);
+}
+
+/// @brief Whether a mangled symbol belongs to operator new, the standard library or the vector and matrix
+/// types, whose frames sit between nearly every allocation and the renderer code that asked for it
+bool isLibrarySymbol(const char* name) {
+    static const char* const prefixes[] = {
+        "_Zn",                                                  // operator new and new[]
+        "_ZSt", "_ZNSt", "_ZNKSt",                              // std::
+        "_ZN9__gnu_cxx", "_ZNK9__gnu_cxx",                      // libstdc++ internals
+        "_ZN6VectorI", "_ZNK6VectorI",                          // Vector<D>, which allocates in every constructor
+        "_ZN4mat3", "_ZNK4mat3", "_ZN4mat4", "_ZNK4mat4",       // matrices, whose rows are Vectors
+        "_Zml", "_Zdv", "_Zpl", "_Zmi", "_Zng", "_Zeq", "_Zne", // free arithmetic operators on the above
+    };
+    for(const char* prefix : prefixes) {
+        if(std::strncmp(name, prefix, std::strlen(prefix)) == 0) return true;
+    }
+    return false;
+}
+
+/// @brief Innermost frame of stack in the executable itself and outside isLibrarySymbol, else the innermost
+uintptr_t rendererFrame(const uintptr_t stack[]) {
+    static Dl_info self;
+    static bool haveSelf = dladdr((void*) &AllocTracker::IsEnabled, &self) != 0;
+    for(int i = 0; i < AllocSite::StackDepth && stack[i]; ++i) {
+        Dl_info info;
+        if(!dladdr((void*) stack[i], &info)) continue;
+        if(haveSelf && info.dli_fname && std::strcmp(info.dli_fname, self.dli_fname) != 0) continue; // shared library
+        if(info.dli_sname && isLibrarySymbol(info.dli_sname)) continue;
+        return stack[i];
+    }
+    return stack[0];
+}
+
+std::string symbolize(uintptr_t address) {
+    Dl_info info;
+    if(!dladdr((void*) address, &info) || !info.dli_sname) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "0x%lx", (unsigned long) address);
+        return buf;
+    }
+
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+    free(demangled);
+
+    char offset[32];
+    snprintf(offset, sizeof(offset), "+0x%lx", (unsigned long) (address - (uintptr_t) info.dli_saddr));
+    return name + offset;
+}
+
+uint64_t siteKey(const AllocSite& site) {
+    void* stack[AllocSite::StackDepth];
+    int depth = 0;
+    while(depth < AllocSite::StackDepth && site.stack[depth]) {
+        stack[depth] = (void*) site.stack[depth];
+        ++depth;
+    }
+    return stackKey(stack, depth);
+}
+
+}
+
+// The first frame backtrace returns is operator new itself
+#define CAPTURE_STACK \
+    void* frames[AllocSite::StackDepth + 1]; \
+    int numFrames = backtrace(frames, AllocSite::StackDepth + 1) - 1
+#define STACK frames + 1, numFrames
+
+void* operator new(size_t size) {
+    CAPTURE_STACK;
+    void* p = allocate(size, STACK);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size) {
+    CAPTURE_STACK;
+    void* p = allocate(size, STACK);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    CAPTURE_STACK;
+    return allocate(size, STACK);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    CAPTURE_STACK;
+    return allocate(size, STACK);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    CAPTURE_STACK;
+    void* p = allocateAligned(size, align, STACK);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t size, std::align_val_t align) {
+    CAPTURE_STACK;
+    void* p = allocateAligned(size, align, STACK);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    CAPTURE_STACK;
+    return allocateAligned(size, align, STACK);
+}
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    CAPTURE_STACK;
+    return allocateAligned(size, align, STACK);
+}
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { release(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { release(p); }
+
+#undef STACK
+#undef CAPTURE_STACK
+
+bool AllocTracker::IsEnabled() { return true; }
+
+AllocCounts AllocTracker::Counts() {
+    AllocCounts c;
+    c.allocations = gAllocs.load(std::memory_order_relaxed);
+    c.frees = gFrees.load(std::memory_order_relaxed);
+    c.bytes = gBytes.load(std::memory_order_relaxed);
+    return c;
+}
+
+uint64_t AllocTracker::LiveBytes() { return std::max<int64_t>(gLive.load(std::memory_order_relaxed), 0); }
+uint64_t AllocTracker::PeakBytes() { return std::max<int64_t>(gPeak.load(std::memory_order_relaxed), 0); }
+void AllocTracker::ResetPeak() { gPeak.store(gLive.load(std::memory_order_relaxed), std::memory_order_relaxed); }
+
+void AllocTracker::Sites(std::vector<AllocSite>& out) {
+    if(out.capacity() < (size_t) SiteSlots) out.reserve(SiteSlots);
+    out.clear();
+    for(const SiteSlot& slot : gSites) {
+        if(slot.key.load(std::memory_order_relaxed) == 0) continue;
+        out.emplace_back();
+        AllocSite& site = out.back();
+        for(int i = 0; i < AllocSite::StackDepth; ++i) site.stack[i] = slot.stack[i].load(std::memory_order_relaxed);
+        site.count = slot.count.load(std::memory_order_relaxed);
+        site.bytes = slot.bytes.load(std::memory_order_relaxed);
+    }
+}
+
+std::vector<AllocSite> AllocTracker::TopSites(const std::vector<AllocSite>& before,
+                                              const std::vector<AllocSite>& after, int n) {
+    std::unordered_map<uint64_t, const AllocSite*> old;
+    for(const AllocSite& s : before) old[siteKey(s)] = &s;
+
+    // Allocations since before per call stack, merged by the renderer frame each stack leads to
+    std::unordered_map<uintptr_t, AllocSite> merged;
+    for(const AllocSite& s : after) {
+        uint64_t count = s.count, bytes = s.bytes;
+        auto it = old.find(siteKey(s));
+        if(it != old.end()) {
+            count -= it->second->count;
+            bytes -= it->second->bytes;
+        }
+        if(count == 0) continue;
+        uintptr_t frame = rendererFrame(s.stack);
+        AllocSite& m = merged[frame];
+        if(m.count == 0) {
+            std::copy(s.stack, s.stack + AllocSite::StackDepth, m.stack);
+            m.address = frame;
+        }
+        m.count += count;
+        m.bytes += bytes;
+    }
+
+    std::vector<AllocSite> diff;
+    for(auto& entry : merged) diff.push_back(std::move(entry.second));
+    std::sort(diff.begin(), diff.end(), [](const AllocSite& a, const AllocSite& b) { return a.count > b.count; });
+    if((int) diff.size() > n) diff.resize(n);
+    for(AllocSite& s : diff) s.symbol = symbolize(s.address);
+    return diff;
+}
+
+#else
+
+bool AllocTracker::IsEnabled() { return false; }
+AllocCounts AllocTracker::Counts() { return {}; }
+uint64_t AllocTracker::LiveBytes() { return 0; }
+uint64_t AllocTracker::PeakBytes() { return 0; }
+void AllocTracker::ResetPeak() {}
+void AllocTracker::Sites(std::vector<AllocSite>& out) { out.clear(); }
+std::vector<AllocSite> AllocTracker::TopSites(const std::vector<AllocSite>&, const std::vector<AllocSite>&, int) {
+    return {};
+}
+
+#endif
+
+#ifdef __linux__
+
+uint64_t AllocTracker::PeakResidentBytes() {
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (uint64_t) usage.ru_maxrss * 1024; // reported in kilobytes on Linux
+}
+
+#else
+
+uint64_t AllocTracker::PeakResidentBytes() { return 0; }
+
+#endif
@@ -4,29 +4,11 @@
 
 #include "../include/GBitmap.h"
 #include "lodepng.h"
-
-static void convertToPNG(const GPixel src[], int width, uint8_t dst[]) {
-    for (int i = 0; i < width; i++) {
-        GPixel c = *src++;
-        int a = GPixel_GetA(c);
-        int r = GPixel_GetR(c);
-        int g = GPixel_GetG(c);
-        int b = GPixel_GetB(c);
-        
-        // PNG requires unpremultiplied, but GPixel is premultiplied
-        if (0 != a && 255 != a) {
-            r = (r * 255 + a/2) / a;
-            g = (g * 255 + a/2) / a;
-            b = (b * 255 + a/2) / a;
-        }
-        *dst++ = r;
-        *dst++ = g;
-        *dst++ = b;
-        *dst++ = a;
-    }
-}
+#include "../include/Trace.h"
+#include "../include/PNGStream.h"
 
 bool GBitmap::writeToFile(const char path[]) const {
+    TRACE_SCOPE("GBitmap::writeToFile");
     size_t rb = this->width() * 4;
     uint8_t* pix = (uint8_t*)malloc(this->height() * rb);
     if (!pix) {
@@ -36,7 +18,7 @@ bool GBitmap::writeToFile(const char path[]) const {
     const GPixel* src = this->pixels();
     uint8_t* dst = pix;
     for (int y = 0; y < this->height(); ++y) {
-        convertToPNG(src, this->width(), dst);
+        PNGStream::ToRGBA(src, this->width(), dst);
         src += this->rowBytes() / 4;
         dst += rb;
     }
@@ -0,0 +1,562 @@
+#include "../include/PNGStream.h"
+#include "../include/Trace.h"
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+// Deflate (RFC 1951) in a zlib wrapper (RFC 1950). Matches are gathered into blocks, each coded with
+// Huffman codes built for its own symbol counts.
+struct PNGStream::Deflate {
+    static constexpr int WindowSize = 1 << 15; // farthest a match may reach back
+    static constexpr int WindowMask = WindowSize - 1;
+    static constexpr int HashBits = 15;
+    static constexpr int MinMatch = 3, MaxMatch = 258;
+    static constexpr int MaxChain = 8;         // candidates tried per position
+    static constexpr int NiceLength = 64;      // a match this long ends the search
+    static constexpr int MaxInsertLength = 16; // positions inside longer matches aren't hashed, as zlib's fast levels do
+    static constexpr int BlockTokens = 1 << 16;
+    static constexpr int NumLiterals = 286, NumDistances = 30, NumLengthCodes = 19;
+
+    // The window holds the last WindowSize bytes already compressed followed by those still to come
+    uint8_t window[2 * WindowSize];
+    int start = 0, end = 0; // next byte to compress, and end of what was written
+    std::vector<int> head, prev; // newest position per hash, and the one before it per position, -1 for none
+    uint32_t adlerA = 1, adlerB = 0;
+
+    // Current block, a literal has distance 0
+    struct Token {
+        uint16_t value; // literal byte or match length
+        uint16_t distance;
+    };
+    std::vector<Token> tokens;
+    uint32_t literalCounts[NumLiterals], distanceCounts[NumDistances];
+
+    std::vector<uint8_t> out; // compressed bytes not yet written to a chunk
+    uint64_t bits = 0;
+    int bitCount = 0;
+
+    Deflate() : head(1 << HashBits, -1), prev(WindowSize, -1) {
+        out.push_back(0x78); // 32K window deflate
+        out.push_back(0x01); // no dictionary, header checksum
+        tokens.reserve(BlockTokens);
+        resetCounts();
+    }
+
+    void resetCounts() {
+        std::fill(literalCounts, literalCounts + NumLiterals, 0);
+        std::fill(distanceCounts, distanceCounts + NumDistances, 0);
+        literalCounts[256] = 1; // end of block
+    }
+
+    void put(uint32_t value, int count) {
+        bits |= (uint64_t) value << bitCount;
+        bitCount += count;
+        while(bitCount >= 8) {
+            out.push_back((uint8_t) bits);
+            bits >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    /// @brief Length and distance codes step through powers of two with 2 or 4 codes per power,
+    /// the low bits of the value past the leading one going out as extra bits
+    static int LengthCode(int length, int& extra, int& extraBits) {
+        int x = length - MinMatch;
+        extra = extraBits = 0;
+        if(length == MaxMatch) return 285;
+        if(x < 8) return 257 + x;
+        int n = 31 - __builtin_clz(x);
+        extraBits = n - 2;
+        int step = x >> extraBits & 3;
+        extra = x - ((4 | step) << extraBits);
+        return 257 + 4 * (n - 1) + step;
+    }
+
+    static int DistanceCode(int distance, int& extra, int& extraBits) {
+        int x = distance - 1;
+        extra = extraBits = 0;
+        if(x < 4) return x;
+        int n = 31 - __builtin_clz(x);
+        extraBits = n - 1;
+        int step = x >> extraBits & 1;
+        extra = x - ((2 | step) << extraBits);
+        return 2 * n + step;
+    }
+
+    void literal(uint8_t byte) {
+        tokens.push_back({byte, 0});
+        ++literalCounts[byte];
+    }
+
+    void match(int length, int distance) {
+        tokens.push_back({(uint16_t) length, (uint16_t) distance});
+        int extra, extraBits;
+        ++literalCounts[LengthCode(length, extra, extraBits)];
+        ++distanceCounts[DistanceCode(distance, extra, extraBits)];
+    }
+
+    /// @brief Huffman code lengths for counts, none longer than maxBits. Counts are halved until the
+    /// tree is shallow enough, which costs little as only rare symbols are affected.
+    static void CodeLengths(const uint32_t counts[], int n, int maxBits, uint8_t lengths[]) {
+        std::vector<uint32_t> weights(counts, counts + n);
+        std::vector<uint64_t> nodes;   // weight << 32 | node, leaves first
+        std::vector<int> parent;
+        while(true) {
+            nodes.clear();
+            for(int i = 0; i < n; ++i) {
+                if(weights[i] > 0) nodes.push_back((uint64_t) weights[i] << 32 | (uint64_t) i);
+            }
+            std::fill(lengths, lengths + n, 0);
+            if(nodes.size() == 1) lengths[nodes[0] & 0xFFFFFFFF] = 1;
+            if(nodes.size() < 2) return;
+
+            // Leaves are numbered 0..n-1, internal nodes n and up
+            parent.assign(n + nodes.size(), -1);
+            std::make_heap(nodes.begin(), nodes.end(), std::greater<uint64_t>());
+            int next = n;
+            while(nodes.size() > 1) {
+                std::pop_heap(nodes.begin(), nodes.end(), std::greater<uint64_t>());
+                uint64_t a = nodes.back();
+                nodes.pop_back();
+                std::pop_heap(nodes.begin(), nodes.end(), std::greater<uint64_t>());
+                uint64_t b = nodes.back();
+                nodes.pop_back();
+                parent[a & 0xFFFFFFFF] = parent[b & 0xFFFFFFFF] = next;
+                nodes.push_back(((a >> 32) + (b >> 32)) << 32 | (uint64_t) next++);
+                std::push_heap(nodes.begin(), nodes.end(), std::greater<uint64_t>());
+            }
+
+            // Parents are numbered after their children, so depths resolve from the root down
+            std::vector<int> depth(next, 0);
+            for(int i = next - 2; i >= 0; --i) {
+                if(parent[i] >= 0) depth[i] = depth[parent[i]] + 1;
+            }
+            int longest = 0;
+            for(int i = 0; i < n; ++i) {
+                if(weights[i] > 0) lengths[i] = (uint8_t) depth[i];
+                longest = std::max<int>(longest, lengths[i]);
+            }
+            if(longest <= maxBits) return;
+            for(uint32_t& w : weights) {
+                if(w > 0) w = (w + 1) / 2;
+            }
+        }
+    }
+
+    /// @brief Canonical codes for lengths, bit reversed since Huffman codes are packed from their first bit
+    static void Codes(const uint8_t lengths[], int n, uint16_t codes[]) {
+        int count[16] = {0}, next[16] = {0};
+        for(int i = 0; i < n; ++i) ++count[lengths[i]];
+        count[0] = 0;
+        for(int bits = 1, code = 0; bits < 16; ++bits) {
+            code = (code + count[bits - 1]) << 1;
+            next[bits] = code;
+        }
+        for(int i = 0; i < n; ++i) {
+            int len = lengths[i];
+            if(len == 0) continue;
+            uint32_t code = next[len]++, reversed = 0;
+            for(int b = 0; b < len; ++b) reversed |= (code >> b & 1) << (len - 1 - b);
+            codes[i] = (uint16_t) reversed;
+        }
+    }
+
+    /// @brief Write the current block with its own codes
+    void flushBlock(bool last) {
+        // A lone distance code would leave its tree incomplete, which decoders may reject
+        int used = 0;
+        for(uint32_t c : distanceCounts) used += c > 0;
+        for(int i = 0; used < 2; ++i) {
+            if(distanceCounts[i] == 0) {
+                distanceCounts[i] = 1;
+                ++used;
+            }
+        }
+
+        uint8_t lengths[NumLiterals + NumDistances];
+        uint8_t* literalLengths = lengths;
+        uint8_t* distanceLengths = lengths + NumLiterals;
+        CodeLengths(literalCounts, NumLiterals, 15, literalLengths);
+        CodeLengths(distanceCounts, NumDistances, 15, distanceLengths);
+        int numLiterals = NumLiterals, numDistances = NumDistances;
+        while(literalLengths[numLiterals - 1] == 0) --numLiterals;
+        while(distanceLengths[numDistances - 1] == 0) --numDistances;
+
+        // Both code length lists back to back, runs coded by 16 (repeat the previous 3-6 times),
+        // 17 (3-10 zeros) and 18 (11-138 zeros)
+        uint8_t all[NumLiterals + NumDistances];
+        std::copy(literalLengths, literalLengths + numLiterals, all);
+        std::copy(distanceLengths, distanceLengths + numDistances, all + numLiterals);
+        int total = numLiterals + numDistances;
+        struct Run { uint8_t code, extra; };
+        std::vector<Run> runs;
+        uint32_t lengthCounts[NumLengthCodes] = {0};
+        for(int i = 0; i < total;) {
+            int len = all[i], run = 1;
+            while(i + run < total && all[i + run] == len) ++run;
+            i += run;
+            if(len == 0) {
+                while(run >= 11) {
+                    int r = std::min(run, 138);
+                    runs.push_back({18, (uint8_t) (r - 11)});
+                    run -= r;
+                }
+                if(run >= 3) {
+                    runs.push_back({17, (uint8_t) (run - 3)});
+                    run = 0;
+                }
+            }
+            else {
+                runs.push_back({(uint8_t) len, 0});
+                --run;
+                while(run >= 3) {
+                    int r = std::min(run, 6);
+                    runs.push_back({16, (uint8_t) (r - 3)});
+                    run -= r;
+                }
+            }
+            for(; run > 0; --run) runs.push_back({(uint8_t) len, 0});
+        }
+        for(const Run& r : runs) ++lengthCounts[r.code];
+
+        uint8_t lengthLengths[NumLengthCodes];
+        uint16_t lengthCodes[NumLengthCodes];
+        CodeLengths(lengthCounts, NumLengthCodes, 7, lengthLengths);
+        Codes(lengthLengths, NumLengthCodes, lengthCodes);
+        static const int Order[NumLengthCodes] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        int numLengthCodes = NumLengthCodes;
+        while(numLengthCodes > 4 && lengthLengths[Order[numLengthCodes - 1]] == 0) --numLengthCodes;
+
+        put(last ? 1 : 0, 1);
+        put(2, 2); // dynamic Huffman codes
+        put(numLiterals - 257, 5);
+        put(numDistances - 1, 5);
+        put(numLengthCodes - 4, 4);
+        for(int i = 0; i < numLengthCodes; ++i) put(lengthLengths[Order[i]], 3);
+        for(const Run& r : runs) {
+            put(lengthCodes[r.code], lengthLengths[r.code]);
+            if(r.code == 16) put(r.extra, 2);
+            else if(r.code == 17) put(r.extra, 3);
+            else if(r.code == 18) put(r.extra, 7);
+        }
+
+        uint16_t literalCodes[NumLiterals], distanceCodes[NumDistances];
+        Codes(literalLengths, NumLiterals, literalCodes);
+        Codes(distanceLengths, NumDistances, distanceCodes);
+        for(const Token& t : tokens) {
+            if(t.distance == 0) {
+                put(literalCodes[t.value], literalLengths[t.value]);
+                continue;
+            }
+            int extra, extraBits;
+            int code = LengthCode(t.value, extra, extraBits);
+            put(literalCodes[code], literalLengths[code]);
+            put(extra, extraBits);
+            code = DistanceCode(t.distance, extra, extraBits);
+            put(distanceCodes[code], distanceLengths[code]);
+            put(extra, extraBits);
+        }
+        put(literalCodes[256], literalLengths[256]);
+
+        tokens.clear();
+        resetCounts();
+    }
+
+    int hash(int p) const {
+        return ((window[p] << 10) ^ (window[p + 1] << 5) ^ window[p + 2]) & ((1 << HashBits) - 1);
+    }
+
+    void insert(int p) {
+        int h = hash(p);
+        prev[p & WindowMask] = head[h];
+        head[h] = p;
+    }
+
+    /// @brief Longest earlier match for the bytes at p, 0 if none is MinMatch long
+    int longest(int p, int& distance) const {
+        int limit = std::min(MaxMatch, end - p);
+        int best = 0;
+        int candidate = head[hash(p)];
+        for(int chain = MaxChain; candidate >= 0 && p - candidate <= WindowSize && chain > 0; --chain) {
+            const uint8_t* a = window + p;
+            const uint8_t* b = window + candidate;
+            if(b[best] == a[best]) {
+                int len = 0;
+                while(len < limit && a[len] == b[len]) ++len;
+                if(len > best) {
+                    best = len;
+                    distance = p - candidate;
+                    if(len >= NiceLength || len == limit) break;
+                }
+            }
+            int next = prev[candidate & WindowMask];
+            if(next >= candidate) break; // the slot was reused by a newer position
+            candidate = next;
+        }
+        return best >= MinMatch ? best : 0;
+    }
+
+    /// @brief Compress what's in the window, all of it when finishing, otherwise leaving the last
+    /// MaxMatch bytes for matches that may run on into what's written next
+    void compress(bool finish) {
+        int limit = finish ? end : end - MaxMatch;
+        while(start < limit) {
+            if((int) tokens.size() >= BlockTokens) flushBlock(false);
+            int distance = 0;
+            int length = start + MinMatch <= end ? longest(start, distance) : 0;
+            if(length == 0) {
+                literal(window[start]);
+                if(start + MinMatch <= end) insert(start);
+                ++start;
+                continue;
+            }
+            match(length, distance);
+            if(length <= MaxInsertLength) {
+                for(int i = 0; i < length; ++i, ++start) {
+                    if(start + MinMatch <= end) insert(start);
+                }
+            }
+            else {
+                insert(start);
+                start += length;
+            }
+        }
+    }
+
+    /// @brief Drop the older half of the window
+    void slide() {
+        std::memmove(window, window + WindowSize, WindowSize);
+        start -= WindowSize;
+        end -= WindowSize;
+        for(int& p : head) p = p >= WindowSize ? p - WindowSize : -1;
+        for(int& p : prev) p = p >= WindowSize ? p - WindowSize : -1;
+    }
+
+    void write(const uint8_t* data, size_t size) {
+        // Adler-32, summed in runs short enough not to overflow before taking the modulo
+        for(size_t i = 0; i < size;) {
+            size_t n = std::min<size_t>(size - i, 5552);
+            for(size_t j = 0; j < n; ++j) {
+                adlerA += data[i + j];
+                adlerB += adlerA;
+            }
+            adlerA %= 65521;
+            adlerB %= 65521;
+            i += n;
+        }
+
+        while(size > 0) {
+            if(end == 2 * WindowSize) slide();
+            size_t n = std::min<size_t>(size, 2 * WindowSize - end);
+            std::memcpy(window + end, data, n);
+            end += (int) n;
+            data += n;
+            size -= n;
+            compress(false);
+        }
+    }
+
+    void finish() {
+        compress(true);
+        flushBlock(true);
+        put(0, (8 - bitCount) & 7);
+        uint32_t adler = adlerB << 16 | adlerA;
+        for(int shift = 24; shift >= 0; shift -= 8) out.push_back((uint8_t) (adler >> shift));
+    }
+};
+
+static uint32_t Crc32(uint32_t crc, const uint8_t data[], size_t size) {
+    static const struct Table {
+        uint32_t t[256];
+        Table() {
+            for(uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for(int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+        }
+    } table;
+    crc = ~crc;
+    for(size_t i = 0; i < size; ++i) crc = table.t[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void PutBigEndian(uint8_t dst[4], uint32_t v) {
+    dst[0] = (uint8_t) (v >> 24);
+    dst[1] = (uint8_t) (v >> 16);
+    dst[2] = (uint8_t) (v >> 8);
+    dst[3] = (uint8_t) v;
+}
+
+void PNGStream::ToRGBA(const GPixel src[], int width, uint8_t dst[]) {
+    for (int i = 0; i < width; i++) {
+        GPixel c = *src++;
+        int a = GPixel_GetA(c);
+        int r = GPixel_GetR(c);
+        int g = GPixel_GetG(c);
+        int b = GPixel_GetB(c);
+
+        // PNG requires unpremultiplied, but GPixel is premultiplied
+        if (0 != a && 255 != a) {
+            r = (r * 255 + a/2) / a;
+            g = (g * 255 + a/2) / a;
+            b = (b * 255 + a/2) / a;
+        }
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+        *dst++ = a;
+    }
+}
+
+PNGStream::PNGStream() {}
+
+PNGStream::~PNGStream() {
+    if(_file) fclose(_file);
+}
+
+bool PNGStream::open(const char path[], int width, int height, Format format) {
+    if(_file) fclose(_file);
+    _file = fopen(path, "wb");
+    _ok = _file != nullptr && width > 0 && height > 0;
+    if(!_ok) return false;
+
+    _format = format;
+    _width = width;
+    _height = height;
+    _rowsWritten = 0;
+    size_t rowBytes = (size_t) width * (format == Format::RGBA8 ? 4 : 2);
+    _row.assign(rowBytes, 0);
+    _prior.assign(rowBytes, 0);
+    for(std::vector<uint8_t>& f : _filtered) f.assign(rowBytes + 1, 0);
+    _deflate = std::make_unique<Deflate>();
+
+    static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    _ok = fwrite(signature, 1, 8, _file) == 8;
+
+    uint8_t header[13];
+    PutBigEndian(header, width);
+    PutBigEndian(header + 4, height);
+    header[8] = format == Format::RGBA8 ? 8 : 16; // bits per channel
+    header[9] = format == Format::RGBA8 ? 6 : 0;  // RGBA or grayscale
+    header[10] = 0; // deflate
+    header[11] = 0; // adaptive filtering
+    header[12] = 0; // not interlaced
+    writeChunk("IHDR", header, sizeof(header));
+    return _ok;
+}
+
+bool PNGStream::write(const GBitmap& rows) {
+    TRACE_SCOPE("PNGStream::write");
+    if(!_file || _format != Format::RGBA8 || rows.width() != _width || _rowsWritten + rows.height() > _height) {
+        return _ok = false;
+    }
+    for(int y = 0; y < rows.height(); ++y) {
+        ToRGBA(rows.getAddr(0, y), _width, _row.data());
+        writeRow();
+    }
+    flushIDAT(false);
+    return _ok;
+}
+
+bool PNGStream::write(const uint16_t samples[], int count) {
+    TRACE_SCOPE("PNGStream::write");
+    if(!_file || _format != Format::Gray16 || count < 0 || _rowsWritten + count > _height) return _ok = false;
+    for(int y = 0; y < count; ++y) {
+        // PNG samples are big endian
+        const uint16_t* row = samples + (size_t) y * _width;
+        for(int x = 0; x < _width; ++x) {
+            _row[2 * x] = (uint8_t) (row[x] >> 8);
+            _row[2 * x + 1] = (uint8_t) row[x];
+        }
+        writeRow();
+    }
+    flushIDAT(false);
+    return _ok;
+}
+
+void PNGStream::writeRow() {
+    // Each row takes whichever filter leaves the smallest sum of signed residuals, as lodepng does by default.
+    // Pixels before the first are zero, as is the row above the first.
+    const int bpp = _format == Format::RGBA8 ? 4 : 2;
+    int n = (int) _row.size();
+    const uint8_t* cur = _row.data();
+    const uint8_t* up = _prior.data();
+    uint64_t bestSum = UINT64_MAX;
+    int best = 0;
+    for(int type = 0; type < 5; ++type) {
+        uint8_t* f = _filtered[type].data();
+        f[0] = (uint8_t) type;
+        ++f;
+        for(int i = 0; i < bpp; ++i) {
+            int predicted = type == 2 || type == 4 ? up[i] : type == 3 ? up[i] / 2 : 0;
+            f[i] = (uint8_t) (cur[i] - predicted);
+        }
+        // One loop per filter, so each vectorizes
+        switch(type) {
+            case 0:
+                std::memcpy(f, cur, n);
+                break;
+            case 1:
+                for(int i = bpp; i < n; ++i) f[i] = (uint8_t) (cur[i] - cur[i - bpp]);
+                break;
+            case 2:
+                for(int i = bpp; i < n; ++i) f[i] = (uint8_t) (cur[i] - up[i]);
+                break;
+            case 3:
+                for(int i = bpp; i < n; ++i) f[i] = (uint8_t) (cur[i] - ((cur[i - bpp] + up[i]) >> 1));
+                break;
+            case 4:
+                for(int i = bpp; i < n; ++i) {
+                    int a = cur[i - bpp], b = up[i], c = up[i - bpp];
+                    int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+                    f[i] = (uint8_t) (cur[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c));
+                }
+                break;
+        }
+        uint32_t sum = 0;
+        for(int i = 0; i < n; ++i) sum += (uint32_t) std::abs((int) (int8_t) f[i]);
+        if(sum < bestSum) {
+            bestSum = sum;
+            best = type;
+        }
+    }
+
+    _deflate->write(_filtered[best].data(), n + 1);
+    std::swap(_row, _prior);
+    ++_rowsWritten;
+}
+
+void PNGStream::writeChunk(const char type[4], const uint8_t data[], size_t size) {
+    uint8_t length[4];
+    PutBigEndian(length, (uint32_t) size);
+    uint32_t crc = Crc32(0, (const uint8_t*) type, 4);
+    crc = Crc32(crc, data, size);
+    uint8_t check[4];
+    PutBigEndian(check, crc);
+
+    _ok = _ok && fwrite(length, 1, 4, _file) == 4 && fwrite(type, 1, 4, _file) == 4
+        && (size == 0 || fwrite(data, 1, size, _file) == size) && fwrite(check, 1, 4, _file) == 4;
+}
+
+void PNGStream::flushIDAT(bool finish) {
+    static const size_t ChunkSize = 1 << 16;
+    std::vector<uint8_t>& out = _deflate->out;
+    if(out.size() < ChunkSize && !finish) return;
+    if(!out.empty()) writeChunk("IDAT", out.data(), out.size());
+    out.clear();
+}
+
+bool PNGStream::close() {
+    if(!_file) return false;
+    if(_rowsWritten != _height) _ok = false;
+    if(_ok) {
+        _deflate->finish();
+        flushIDAT(true);
+        writeChunk("IEND", nullptr, 0);
+    }
+    _ok = fclose(_file) == 0 && _ok;
+    _file = nullptr;
+    _deflate.reset();
+    return _ok;
+}
@@ -0,0 +1,112 @@
+#include "../include/PerfCounters.h"
+#include "../include/Parallel.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+
+static const struct { uint32_t type; uint64_t config; } Events[PerfCounters::NumEvents] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/// @param tid thread to count, 0 for the calling one
+static int openEvent(uint32_t type, uint64_t config, int tid) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // Not inherited: the pool's workers get counters of their own, which inheriting would count twice
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+}
+
+/// @brief Counts of the open events in fds, scaled up for multiplexing
+static PerfValues readEvents(const int* fds) {
+    uint64_t counts[PerfCounters::NumEvents] = {};
+    for(int e = 0; e < PerfCounters::NumEvents; ++e) {
+        if(fds[e] < 0) continue;
+        uint64_t data[3]; // value, time enabled, time running
+        if(::read(fds[e], data, sizeof(data)) != (ssize_t) sizeof(data)) continue;
+        counts[e] = data[2] > 0 && data[2] < data[1] ? (uint64_t) (double(data[0]) * data[1] / data[2]) : data[0];
+    }
+
+    PerfValues v;
+    v.cycles = counts[PerfCounters::Cycles];
+    v.instructions = counts[PerfCounters::Instructions];
+    v.l1dMisses = counts[PerfCounters::L1DMisses];
+    v.llcMisses = counts[PerfCounters::LLCMisses];
+    v.branchMisses = counts[PerfCounters::BranchMisses];
+    return v;
+}
+
+PerfCounters::PerfCounters() {
+    int firstError = 0;
+    for(int e = 0; e < NumEvents; ++e) {
+        _fds[e] = openEvent(Events[e].type, Events[e].config, 0);
+        if(_fds[e] >= 0) ++_numOpen;
+        else if(!firstError) firstError = errno;
+    }
+
+    if(_numOpen == 0) {
+        switch(firstError) {
+            case ENOENT:
+            case EOPNOTSUPP: _error = "hardware events not supported by this CPU or VM"; break;
+            case EACCES:
+            case EPERM: _error = "not permitted, see /proc/sys/kernel/perf_event_paranoid"; break;
+            case ENOSYS: _error = "perf_event_open not available in this kernel or container"; break;
+            default: _error = std::strerror(firstError); break;
+        }
+    }
+    else ThreadPool::Shared().addWorkerObserver(WorkerStarted, this);
+}
+
+PerfCounters::~PerfCounters() {
+    if(_numOpen > 0) ThreadPool::Shared().removeWorkerObserver(this);
+    for(int fd : _fds) {
+        if(fd >= 0) close(fd);
+    }
+    for(const auto& fds : _workers) {
+        for(int fd : fds) {
+            if(fd >= 0) close(fd);
+        }
+    }
+}
+
+void PerfCounters::WorkerStarted(void* counters, int threadId) {
+    PerfCounters& self = *static_cast<PerfCounters*>(counters);
+    std::array<int, NumEvents> fds;
+    for(int e = 0; e < NumEvents; ++e) {
+        fds[e] = self._fds[e] >= 0 ? openEvent(Events[e].type, Events[e].config, threadId) : -1;
+    }
+    std::lock_guard<std::mutex> lock(self._workersLock);
+    self._workers.push_back(fds);
+}
+
+PerfValues PerfCounters::read() const {
+    PerfValues v = readEvents(_fds);
+    std::lock_guard<std::mutex> lock(_workersLock);
+    for(const auto& fds : _workers) v += readEvents(fds.data());
+    return v;
+}
+
+#else
+
+PerfCounters::PerfCounters() : _error("only supported on Linux") {
+    for(int& fd : _fds) fd = -1;
+}
+
+PerfCounters::~PerfCounters() {}
+
+PerfValues PerfCounters::read() const { return {}; }
+
+#endif
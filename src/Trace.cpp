@@ -0,0 +1,159 @@
+#include "../include/Trace.h"
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdio>
+
+std::atomic<bool> Trace::_enabled{false};
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    int tid;
+};
+
+constexpr uint64_t RingSize = 1 << 14;
+
+/// Written only by the thread that owns it, head is published with release so a reader sees whole events
+struct ThreadBuffer {
+    Event events[RingSize];
+    std::atomic<uint64_t> head{0};
+};
+
+/// Owns every ring buffer. Buffers of exited threads are handed to new threads instead of being freed,
+/// which keeps short-lived workers from growing memory while their spans stay available for writing.
+struct Registry {
+    std::mutex lock;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::vector<ThreadBuffer*> retired;
+    std::vector<std::pair<int, std::string>> threadNames;
+    std::atomic<int> nextTid{1};
+
+    ThreadBuffer* acquire() {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!retired.empty()) {
+            ThreadBuffer* b = retired.back();
+            retired.pop_back();
+            return b;
+        }
+        buffers.push_back(std::make_unique<ThreadBuffer>());
+        return buffers.back().get();
+    }
+
+    void retire(ThreadBuffer* b) {
+        std::lock_guard<std::mutex> guard(lock);
+        retired.push_back(b);
+    }
+};
+
+// Never destroyed, thread exit hooks may still need it during static destruction
+Registry& registry() {
+    static Registry* r = new Registry();
+    return *r;
+}
+
+struct ThreadSlot {
+    ThreadBuffer* buffer = nullptr;
+    int tid = 0;
+
+    ~ThreadSlot() {
+        if(buffer) registry().retire(buffer);
+    }
+};
+thread_local ThreadSlot tSlot;
+
+int threadId() {
+    if(tSlot.tid == 0) tSlot.tid = registry().nextTid++;
+    return tSlot.tid;
+}
+
+std::chrono::steady_clock::time_point epoch() {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return start;
+}
+
+void writeEscaped(FILE* f, const char* s) {
+    for(; *s; ++s) {
+        if(*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+}
+
+}
+
+void Trace::SetEnabled(bool enabled) {
+    epoch();
+    _enabled.store(enabled, std::memory_order_relaxed);
+}
+
+uint64_t Trace::Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch()).count();
+}
+
+void Trace::Record(const char* name, uint64_t start, uint64_t end) {
+    if(!tSlot.buffer) tSlot.buffer = registry().acquire();
+    ThreadBuffer& b = *tSlot.buffer;
+
+    uint64_t h = b.head.load(std::memory_order_relaxed);
+    b.events[h % RingSize] = {name, start, end - start, threadId()};
+    b.head.store(h + 1, std::memory_order_release);
+}
+
+void Trace::SetThreadName(const char* name) {
+    if(!IsEnabled()) return;
+    Registry& r = registry();
+    int tid = threadId();
+    std::lock_guard<std::mutex> guard(r.lock);
+    for(auto& named : r.threadNames) {
+        if(named.first != tid) continue;
+        named.second = name;
+        return;
+    }
+    r.threadNames.push_back({tid, name});
+}
+
+bool Trace::WriteJson(const char* path) {
+    FILE* f = fopen(path, "w");
+    if(!f) return false;
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+    bool first = true;
+    for(const auto& buffer : r.buffers) {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t begin = head > RingSize ? head - RingSize : 0;
+        for(uint64_t i = begin; i < head; ++i) {
+            const Event& e = buffer->events[i % RingSize];
+            fputs(first ? "" : ",\n", f);
+            first = false;
+            fputs("{\"name\":\"", f);
+            writeEscaped(f, e.name);
+            fprintf(f, "\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    e.tid, e.start / 1000.0, e.duration / 1000.0);
+        }
+    }
+    for(const auto& named : r.threadNames) {
+        fputs(first ? "" : ",\n", f);
+        first = false;
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"", named.first);
+        writeEscaped(f, named.second.c_str());
+        fputs("\"}}", f);
+    }
+    fputs("\n]}\n", f);
+
+    return fclose(f) == 0;
+}
+
+void Trace::Clear() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    for(const auto& buffer : r.buffers) buffer->head.store(0, std::memory_order_relaxed);
+    r.threadNames.clear();
+}